@@ -0,0 +1,1117 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * vhci_bench -- end-to-end benchmark for libusb_vhci (and vhci-hcd)
+ *
+ * A controller with one port is created, and a purpose-built device is
+ * plugged into it. The device is served by one or more device threads, which
+ * use the plain usb_vhci_fetch_work/fetch_data/giveback interface. It has
+ *
+ *   ep0        vendor request 0x01 (OUT, data is discarded) and
+ *              vendor request 0x02 (IN, returns wLength bytes)
+ *   ep1 OUT    bulk sink
+ *   ep1 IN     bulk source
+ *   ep2 IN     interrupt source
+ *   ep3 IN     isochronous source
+ *   ep4 OUT/IN bulk echo (IN returns the data of the last OUT transfer)
+ *
+ * The host side keeps a number of transfers in flight and resubmits each of
+ * them as soon as it completes. By default, the controller is the simulated
+ * one of libusb_vhci (usb_vhci_sim_open), so the numbers show the overhead of
+ * the library itself and the benchmark runs without the kernel modules. With
+ * -k, the kernel module is used, and the device is driven through usbcore by
+ * libusb-1.0 (only if libusb-1.0 was found by configure).
+ *
+ * For every workload and transfer size, one line with URBs/s, MB/s, CPU time
+ * per URB and the 50th, 99th and 99.9th percentile of the latency (from
+ * submission until completion) is written as JSON. "make bench" runs the
+ * default set and compares it with baseline.json (see -b).
+ */
+
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef HAVE_LIBUSB
+#include <libusb-1.0/libusb.h>
+#endif
+#include "../src/libusb_vhci.h"
+
+#define BENCH_VENDOR_ID  0xdead
+#define BENCH_PRODUCT_ID 0xbe7c
+
+#define RQ_SINK     0x01
+#define RQ_SOURCE   0x02
+
+#define EP_SINK     0x01
+#define EP_SOURCE   0x81
+#define EP_INT      0x82
+#define EP_ISO      0x83
+#define EP_ECHO_OUT 0x04
+#define EP_ECHO_IN  0x84
+
+// usbfs refuses control transfers with more than a page of data
+#define MAX_CONTROL_SIZE 4096
+#define MAX_SIZE         (1 << 24)
+
+enum workload
+{
+	W_CONTROL,
+	W_BULK_OUT,
+	W_BULK_IN,
+	W_ECHO,
+	W_INTERRUPT,
+	W_ISO,
+	W_COUNT
+};
+
+static const char *const workload_names[W_COUNT] = {
+	"control", "bulk-out", "bulk-in", "echo", "interrupt", "iso"
+};
+
+static const uint8_t dev_desc[] = {
+	18,     // descriptor length
+	1,      // type: device descriptor
+	0x00,   // bcd usb release number
+	0x02,   //  "
+	0xff,   // device class: vendor specific
+	0,      // device sub class
+	0,      // device protocol
+	64,     // max packet size
+	BENCH_VENDOR_ID & 0xff,  // vendor id
+	BENCH_VENDOR_ID >> 8,    //  "
+	BENCH_PRODUCT_ID & 0xff, // product id
+	BENCH_PRODUCT_ID >> 8,   //  "
+	0x00,   // bcd device release number
+	0x01,   //  "
+	0,      // manufacturer string
+	0,      // product string
+	0,      // serial number string
+	1       // number of configurations
+};
+
+static const uint8_t conf_desc[] = {
+	9,      // descriptor length
+	2,      // type: configuration descriptor
+	60,     // total descriptor length (configuration+interface+endpoints)
+	0,      //  "
+	1,      // number of interfaces
+	1,      // configuration index
+	0,      // configuration string
+	0x80,   // attributes: none
+	0,      // max power
+
+	9,      // descriptor length
+	4,      // type: interface
+	0,      // interface number
+	0,      // alternate setting
+	6,      // number of endpoints
+	0xff,   // interface class: vendor specific
+	0,      // interface sub class
+	0,      // interface protocol
+	0,      // interface string
+
+	// length, type, address, attributes, max packet size, interval
+	7, 5, EP_SINK,     0x02, 0x00, 0x02, 0,
+	7, 5, EP_SOURCE,   0x02, 0x00, 0x02, 0,
+	7, 5, EP_INT,      0x03, 0x00, 0x04, 1,
+	7, 5, EP_ISO,      0x01, 0x00, 0x04, 1,
+	7, 5, EP_ECHO_OUT, 0x02, 0x00, 0x02, 0,
+	7, 5, EP_ECHO_IN,  0x02, 0x00, 0x02, 0
+};
+
+static const uint8_t str0_desc[] = {
+	4,      // descriptor length
+	3,      // type: string
+	0x09,   // lang id: english (us)
+	0x04    //  "
+};
+
+struct options
+{
+	bool kernel;
+	int host_threads, device_threads, depth, iso_packets;
+	long count, warmup;
+	bool workloads[W_COUNT];
+	int32_t sizes[16];
+	int size_count;
+	const char *output, *baseline, *capture;
+};
+
+static struct options opt;
+
+// state of the device
+static struct
+{
+	int fd;
+	pthread_mutex_t lock; // protects stat and the echo buffer
+	struct usb_vhci_port_stat stat;
+	uint8_t *echo;
+	int32_t echo_length;
+	int32_t max_size;
+	volatile bool stop;
+} dev;
+
+struct run;
+
+struct slot
+{
+	struct run *run;
+	uint8_t *buffer;
+	struct usb_vhci_iso_packet *iso;
+	bool echo_in; // the next echo transfer of this slot is the IN half
+	uint64_t submitted;
+#ifdef HAVE_LIBUSB
+	struct libusb_transfer *xfer;
+#endif
+};
+
+// one measurement (one workload with one transfer size)
+struct run
+{
+	enum workload w;
+	int32_t size, packet_length;
+	long count;
+	struct slot *slots;
+	int slot_count;
+	uint64_t *latency; // in ns, one entry per completed urb
+	volatile long submitted, completed, errors;
+	volatile int64_t bytes;
+	volatile uint64_t end;
+#ifdef HAVE_LIBUSB
+	libusb_device_handle *handle;
+#endif
+};
+
+struct result
+{
+	enum workload w;
+	int32_t size;
+	long urbs, errors;
+	double seconds, urbs_per_sec, mb_per_sec, cpu_us_per_urb;
+	double p50, p99, p999; // latency in us
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 +
+	       ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+/*
+ * device side
+ */
+
+static void dev_port_stat(const struct usb_vhci_port_stat *stat)
+{
+	pthread_mutex_lock(&dev.lock);
+	struct usb_vhci_port_stat prev = dev.stat;
+	dev.stat = *stat;
+	pthread_mutex_unlock(&dev.lock);
+
+	if(stat->index != 1)
+		return;
+	uint8_t triggers = usb_vhci_port_stat_triggers(stat, &prev);
+	int res = 0;
+	if(triggers & USB_VHCI_PORT_STAT_TRIGGER_POWER_ON)
+		res = usb_vhci_port_connect(dev.fd, 1, USB_VHCI_DATA_RATE_HIGH);
+	else if(triggers & USB_VHCI_PORT_STAT_TRIGGER_RESET && stat->status & USB_VHCI_PORT_STAT_CONNECTION)
+		res = usb_vhci_port_reset_done(dev.fd, 1, 1);
+	else if(triggers & USB_VHCI_PORT_STAT_TRIGGER_RESUMING && stat->status & USB_VHCI_PORT_STAT_CONNECTION)
+		res = usb_vhci_port_resumed(dev.fd, 1);
+	if(res == -1)
+		fprintf(stderr, "vhci_bench: port operation failed with errno %d\n", errno);
+}
+
+static void dev_reply(struct usb_vhci_urb *urb, const uint8_t *data, int32_t length)
+{
+	if(length > urb->wLength)
+		length = urb->wLength;
+	memcpy(urb->buffer, data, length);
+	urb->buffer_actual = length;
+	urb->status = USB_VHCI_STATUS_SUCCESS;
+}
+
+static void dev_control(struct usb_vhci_urb *urb)
+{
+	static const uint8_t zero[2];
+	uint8_t rt = urb->bmRequestType;
+	uint8_t r = urb->bRequest;
+
+	urb->status = USB_VHCI_STATUS_STALL;
+	if(rt == 0xc0 && r == RQ_SOURCE)
+	{
+		urb->buffer_actual = urb->wLength;
+		urb->status = USB_VHCI_STATUS_SUCCESS;
+	}
+	else if(rt == 0x40 && r == RQ_SINK)
+		urb->status = USB_VHCI_STATUS_SUCCESS;
+	else if(rt == 0x80 && r == URB_RQ_GET_DESCRIPTOR)
+	{
+		switch(urb->wValue >> 8)
+		{
+		case 1:
+			dev_reply(urb, dev_desc, sizeof dev_desc);
+			break;
+		case 2:
+			dev_reply(urb, conf_desc, sizeof conf_desc);
+			break;
+		case 3:
+			if(!(urb->wValue & 0xff))
+				dev_reply(urb, str0_desc, sizeof str0_desc);
+			break;
+		}
+	}
+	else if((rt & 0x80) && (rt & 0x60) == 0 && r == URB_RQ_GET_STATUS)
+		dev_reply(urb, zero, sizeof zero);
+	else if(rt == 0x00 && (r == URB_RQ_SET_ADDRESS || r == URB_RQ_SET_CONFIGURATION))
+		urb->status = USB_VHCI_STATUS_SUCCESS;
+	else if(rt == 0x01 && r == URB_RQ_SET_INTERFACE)
+		urb->status = USB_VHCI_STATUS_SUCCESS;
+	else if(rt == 0x02 && r == URB_RQ_CLEAR_FEATURE)
+		urb->status = USB_VHCI_STATUS_SUCCESS;
+}
+
+static void dev_process(struct usb_vhci_urb *urb)
+{
+	urb->status = USB_VHCI_STATUS_SUCCESS;
+	switch(urb->epadr)
+	{
+	case 0x00:
+	case 0x80:
+		dev_control(urb);
+		break;
+	case EP_SINK:
+	case EP_SOURCE:
+	case EP_INT:
+		urb->buffer_actual = urb->buffer_length;
+		break;
+	case EP_ISO:
+		for(int i = 0; i < urb->packet_count; i++)
+		{
+			urb->iso_packets[i].packet_actual = urb->iso_packets[i].packet_length;
+			urb->iso_packets[i].status = USB_VHCI_STATUS_SUCCESS;
+		}
+		urb->buffer_actual = urb->buffer_length;
+		urb->error_count = 0;
+		break;
+	case EP_ECHO_OUT:
+		pthread_mutex_lock(&dev.lock);
+		memcpy(dev.echo, urb->buffer, urb->buffer_length);
+		dev.echo_length = urb->buffer_length;
+		pthread_mutex_unlock(&dev.lock);
+		urb->buffer_actual = urb->buffer_length;
+		break;
+	case EP_ECHO_IN:
+		pthread_mutex_lock(&dev.lock);
+		urb->buffer_actual = (dev.echo_length < urb->buffer_length) ? dev.echo_length : urb->buffer_length;
+		memcpy(urb->buffer, dev.echo, urb->buffer_actual);
+		pthread_mutex_unlock(&dev.lock);
+		break;
+	default:
+		urb->status = USB_VHCI_STATUS_STALL;
+		break;
+	}
+}
+
+static void *dev_thread(void *arg)
+{
+	(void)arg;
+	uint8_t *buffer = malloc(dev.max_size);
+	struct usb_vhci_iso_packet *iso = malloc(opt.iso_packets * sizeof *iso);
+	if(!buffer || !iso)
+	{
+		fprintf(stderr, "vhci_bench: out of memory\n");
+		dev.stop = true;
+	}
+
+	while(!dev.stop)
+	{
+		struct usb_vhci_work w;
+		int res = usb_vhci_fetch_work_timeout(dev.fd, &w, 100);
+		if(res == -1)
+		{
+			if(errno != ETIMEDOUT && errno != EINTR && errno != ENODATA)
+			{
+				fprintf(stderr, "vhci_bench: usb_vhci_fetch_work failed with errno %d\n", errno);
+				break;
+			}
+			continue;
+		}
+		switch(w.type)
+		{
+		case USB_VHCI_WORK_TYPE_PORT_STAT:
+			dev_port_stat(&w.work.port_stat);
+			break;
+		case USB_VHCI_WORK_TYPE_PROCESS_URB:
+			w.work.urb.buffer = buffer;
+			w.work.urb.iso_packets = iso;
+			if(w.work.urb.buffer_length > dev.max_size || w.work.urb.packet_count > opt.iso_packets)
+			{
+				// never sent by the host side of this benchmark
+				w.work.urb.buffer_actual = 0;
+				w.work.urb.packet_count = 0;
+				w.work.urb.status = USB_VHCI_STATUS_STALL;
+			}
+			else
+			{
+				if(res && usb_vhci_fetch_data(dev.fd, &w.work.urb) == -1)
+				{
+					if(errno != ECANCELED)
+						fprintf(stderr, "vhci_bench: usb_vhci_fetch_data failed with errno %d\n", errno);
+					break;
+				}
+				dev_process(&w.work.urb);
+			}
+			if(usb_vhci_giveback(dev.fd, &w.work.urb) == -1)
+				fprintf(stderr, "vhci_bench: usb_vhci_giveback failed with errno %d\n", errno);
+			break;
+		case USB_VHCI_WORK_TYPE_CANCEL_URB:
+			break;
+		}
+	}
+
+	free(buffer);
+	free(iso);
+	return NULL;
+}
+
+/*
+ * host side (common)
+ */
+
+static bool run_take(struct run *r)
+{
+	return __sync_fetch_and_add(&r->submitted, 1) < r->count;
+}
+
+static void run_complete(struct run *r, struct slot *s, uint64_t now, bool ok, int32_t actual)
+{
+	long i = __sync_fetch_and_add(&r->completed, 1);
+	if(i >= r->count)
+		return;
+	r->latency[i] = now - s->submitted;
+	if(!ok)
+		__sync_fetch_and_add(&r->errors, 1);
+	__sync_fetch_and_add(&r->bytes, actual);
+	if(r->w == W_ECHO)
+		s->echo_in = !s->echo_in;
+	if(i + 1 == r->count)
+		r->end = now;
+}
+
+static bool run_done(const struct run *r)
+{
+	return r->completed >= r->count;
+}
+
+/*
+ * host side (simulated controller)
+ */
+
+static void sim_fill(const struct run *r, const struct slot *s, struct usb_vhci_urb *urb)
+{
+	memset(urb, 0, sizeof *urb);
+	urb->handle = s - r->slots + 1;
+	urb->buffer = s->buffer;
+	urb->buffer_length = r->size;
+	urb->type = USB_VHCI_URB_TYPE_BULK;
+	switch(r->w)
+	{
+	case W_CONTROL:
+		urb->type = USB_VHCI_URB_TYPE_CONTROL;
+		urb->bmRequestType = 0xc0;
+		urb->bRequest = RQ_SOURCE;
+		urb->wLength = r->size;
+		break;
+	case W_BULK_OUT:
+		urb->epadr = EP_SINK;
+		break;
+	case W_BULK_IN:
+		urb->epadr = EP_SOURCE;
+		break;
+	case W_ECHO:
+		urb->epadr = s->echo_in ? EP_ECHO_IN : EP_ECHO_OUT;
+		break;
+	case W_INTERRUPT:
+		urb->type = USB_VHCI_URB_TYPE_INT;
+		urb->epadr = EP_INT;
+		urb->interval = 1;
+		break;
+	case W_ISO:
+		urb->type = USB_VHCI_URB_TYPE_ISO;
+		urb->epadr = EP_ISO;
+		urb->interval = 1;
+		urb->flags = USB_VHCI_URB_FLAGS_ISO_ASAP;
+		urb->packet_count = opt.iso_packets;
+		urb->iso_packets = s->iso;
+		for(int i = 0; i < opt.iso_packets; i++)
+		{
+			s->iso[i].offset = i * r->packet_length;
+			s->iso[i].packet_length = r->packet_length;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static bool sim_submit(struct run *r, struct slot *s)
+{
+	struct usb_vhci_urb urb;
+	sim_fill(r, s, &urb);
+	s->submitted = now_ns();
+	if(usb_vhci_sim_submit(dev.fd, &urb) == -1)
+	{
+		fprintf(stderr, "vhci_bench: usb_vhci_sim_submit failed with errno %d\n", errno);
+		run_complete(r, s, s->submitted, false, 0);
+		return false;
+	}
+	return true;
+}
+
+struct host_arg
+{
+	struct run *run;
+	int first, count;
+};
+
+static void *sim_host_thread(void *arg)
+{
+	const struct host_arg *a = arg;
+	struct run *r = a->run;
+
+	for(int i = a->first; i < a->first + a->count && run_take(r); i++)
+		sim_submit(r, &r->slots[i]);
+
+	while(!run_done(r))
+	{
+		struct usb_vhci_urb urb;
+		if(usb_vhci_sim_reap(dev.fd, &urb, 100) == -1)
+		{
+			if(errno == ETIMEDOUT)
+				continue;
+			fprintf(stderr, "vhci_bench: usb_vhci_sim_reap failed with errno %d\n", errno);
+			break;
+		}
+		uint64_t now = now_ns();
+		struct slot *s = &r->slots[urb.handle - 1];
+		int32_t actual = urb.buffer_actual;
+		bool ok = urb.status == USB_VHCI_STATUS_SUCCESS;
+		if(r->w == W_ISO)
+		{
+			actual = 0;
+			for(int i = 0; i < urb.packet_count; i++)
+			{
+				actual += urb.iso_packets[i].packet_actual;
+				ok = ok && urb.iso_packets[i].status == USB_VHCI_STATUS_SUCCESS;
+			}
+		}
+		run_complete(r, s, now, ok, actual);
+		if(run_take(r))
+			sim_submit(r, s);
+	}
+	return NULL;
+}
+
+static int sim_wait_enabled(void)
+{
+	for(int i = 0; i < 500; i++)
+	{
+		struct usb_vhci_port_stat stat;
+		if(usb_vhci_sim_get_port_stat(dev.fd, 1, &stat) == -1)
+			return -1;
+		if(stat.status & USB_VHCI_PORT_STAT_ENABLE)
+			return 0;
+		usleep(10000);
+	}
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+/*
+ * host side (kernel module and libusb-1.0)
+ */
+
+#ifdef HAVE_LIBUSB
+static libusb_context *lu_ctx;
+static libusb_device_handle *lu_handle;
+
+static void LIBUSB_CALL lu_callback(struct libusb_transfer *xfer);
+
+static void lu_fill(struct run *r, struct slot *s)
+{
+	struct libusb_transfer *xfer = s->xfer;
+	switch(r->w)
+	{
+	case W_CONTROL:
+		libusb_fill_control_setup(s->buffer, 0xc0, RQ_SOURCE, 0, 0, r->size);
+		libusb_fill_control_transfer(xfer, r->handle, s->buffer, lu_callback, s, 5000);
+		break;
+	case W_BULK_OUT:
+	case W_BULK_IN:
+	case W_ECHO:
+		libusb_fill_bulk_transfer(xfer, r->handle,
+		                          (r->w == W_BULK_OUT) ? EP_SINK :
+		                          (r->w == W_BULK_IN) ? EP_SOURCE :
+		                          s->echo_in ? EP_ECHO_IN : EP_ECHO_OUT,
+		                          s->buffer, r->size, lu_callback, s, 5000);
+		break;
+	case W_INTERRUPT:
+		libusb_fill_interrupt_transfer(xfer, r->handle, EP_INT, s->buffer, r->size, lu_callback, s, 5000);
+		break;
+	case W_ISO:
+		libusb_fill_iso_transfer(xfer, r->handle, EP_ISO, s->buffer, r->size, opt.iso_packets, lu_callback, s, 5000);
+		libusb_set_iso_packet_lengths(xfer, r->packet_length);
+		break;
+	default:
+		break;
+	}
+}
+
+static void lu_submit(struct run *r, struct slot *s)
+{
+	lu_fill(r, s);
+	s->submitted = now_ns();
+	int res = libusb_submit_transfer(s->xfer);
+	if(res < 0)
+	{
+		fprintf(stderr, "vhci_bench: libusb_submit_transfer failed: %s\n", libusb_error_name(res));
+		run_complete(r, s, s->submitted, false, 0);
+	}
+}
+
+static void LIBUSB_CALL lu_callback(struct libusb_transfer *xfer)
+{
+	uint64_t now = now_ns();
+	struct slot *s = xfer->user_data;
+	struct run *r = s->run;
+	int32_t actual = xfer->actual_length;
+	bool ok = xfer->status == LIBUSB_TRANSFER_COMPLETED;
+	if(r->w == W_ISO)
+	{
+		actual = 0;
+		for(int i = 0; i < xfer->num_iso_packets; i++)
+		{
+			actual += xfer->iso_packet_desc[i].actual_length;
+			ok = ok && xfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED;
+		}
+	}
+	run_complete(r, s, now, ok, actual);
+	if(run_take(r))
+		lu_submit(r, s);
+}
+
+static void *lu_host_thread(void *arg)
+{
+	const struct host_arg *a = arg;
+	struct run *r = a->run;
+
+	for(int i = a->first; i < a->first + a->count && run_take(r); i++)
+		lu_submit(r, &r->slots[i]);
+
+	// all threads handle events; libusb lets one of them at a time do it
+	while(!run_done(r))
+	{
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(lu_ctx, &tv, NULL);
+	}
+	return NULL;
+}
+
+static int lu_open(void)
+{
+	int res = libusb_init(&lu_ctx);
+	if(res < 0)
+	{
+		fprintf(stderr, "vhci_bench: libusb_init failed: %s\n", libusb_error_name(res));
+		return -1;
+	}
+	// wait until usbcore has enumerated the device
+	for(int i = 0; i < 100 && !lu_handle; i++)
+	{
+		lu_handle = libusb_open_device_with_vid_pid(lu_ctx, BENCH_VENDOR_ID, BENCH_PRODUCT_ID);
+		if(!lu_handle)
+			usleep(100000);
+	}
+	if(!lu_handle)
+	{
+		fprintf(stderr, "vhci_bench: device did not show up (no access to /dev/bus/usb?)\n");
+		return -1;
+	}
+	if((res = libusb_claim_interface(lu_handle, 0)) < 0)
+	{
+		fprintf(stderr, "vhci_bench: libusb_claim_interface failed: %s\n", libusb_error_name(res));
+		return -1;
+	}
+	return 0;
+}
+
+static void lu_close(void)
+{
+	if(lu_handle)
+	{
+		libusb_release_interface(lu_handle, 0);
+		libusb_close(lu_handle);
+	}
+	if(lu_ctx)
+		libusb_exit(lu_ctx);
+}
+#endif
+
+/*
+ * measurement
+ */
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, long n, double q)
+{
+	if(n <= 0)
+		return 0.0;
+	long i = (long)(q * n + 0.999999) - 1;
+	if(i < 0)
+		i = 0;
+	if(i >= n)
+		i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+static int run_measure(enum workload w, int32_t size, long count, struct result *res)
+{
+	struct run r;
+	memset(&r, 0, sizeof r);
+	r.w = w;
+	r.size = size;
+	r.count = count;
+	r.slot_count = opt.host_threads * opt.depth;
+	if(w == W_ISO)
+	{
+		r.packet_length = size / opt.iso_packets;
+		r.size = r.packet_length * opt.iso_packets;
+	}
+#ifdef HAVE_LIBUSB
+	r.handle = lu_handle;
+#endif
+
+	int ret = -1;
+	pthread_t *threads = calloc(opt.host_threads, sizeof *threads);
+	struct host_arg *args = calloc(opt.host_threads, sizeof *args);
+	r.slots = calloc(r.slot_count, sizeof *r.slots);
+	r.latency = malloc(count * sizeof *r.latency);
+	if(!threads || !args || !r.slots || !r.latency)
+		goto out;
+	for(int i = 0; i < r.slot_count; i++)
+	{
+		struct slot *s = &r.slots[i];
+		s->run = &r;
+		// room for the setup packet of libusb control transfers
+		if(!(s->buffer = calloc(1, r.size + 8)) ||
+		   !(s->iso = calloc(opt.iso_packets, sizeof *s->iso)))
+			goto out;
+#ifdef HAVE_LIBUSB
+		if(opt.kernel && !(s->xfer = libusb_alloc_transfer(opt.iso_packets)))
+			goto out;
+#endif
+	}
+
+	uint64_t cpu = cpu_ns();
+	uint64_t start = now_ns();
+	int started = 0;
+	for(; started < opt.host_threads; started++)
+	{
+		args[started].run = &r;
+		args[started].first = started * opt.depth;
+		args[started].count = opt.depth;
+#ifdef HAVE_LIBUSB
+		if(opt.kernel)
+		{
+			if(pthread_create(&threads[started], NULL, lu_host_thread, &args[started]))
+				break;
+			continue;
+		}
+#endif
+		if(pthread_create(&threads[started], NULL, sim_host_thread, &args[started]))
+			break;
+	}
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	cpu = cpu_ns() - cpu;
+	if(started < opt.host_threads || !run_done(&r))
+		goto out;
+
+	double seconds = (r.end - start) / 1e9;
+	qsort(r.latency, count, sizeof *r.latency, cmp_u64);
+	res->w = w;
+	res->size = r.size;
+	res->urbs = count;
+	res->errors = r.errors;
+	res->seconds = seconds;
+	res->urbs_per_sec = count / seconds;
+	res->mb_per_sec = r.bytes / seconds / 1e6;
+	res->cpu_us_per_urb = cpu / 1000.0 / count;
+	res->p50 = percentile(r.latency, count, 0.5);
+	res->p99 = percentile(r.latency, count, 0.99);
+	res->p999 = percentile(r.latency, count, 0.999);
+	ret = 0;
+
+out:
+	for(int i = 0; r.slots && i < r.slot_count; i++)
+	{
+		free(r.slots[i].buffer);
+		free(r.slots[i].iso);
+#ifdef HAVE_LIBUSB
+		if(r.slots[i].xfer)
+			libusb_free_transfer(r.slots[i].xfer);
+#endif
+	}
+	free(r.slots);
+	free(r.latency);
+	free(threads);
+	free(args);
+	return ret;
+}
+
+/*
+ * output
+ */
+
+static void write_json(FILE *f, const struct result *res, int n)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"tool\": \"vhci_bench\",\n");
+	fprintf(f, "  \"backend\": \"%s\",\n", opt.kernel ? "kernel" : "sim");
+	fprintf(f, "  \"host_threads\": %d,\n", opt.host_threads);
+	fprintf(f, "  \"device_threads\": %d,\n", opt.device_threads);
+	fprintf(f, "  \"queue_depth\": %d,\n", opt.depth);
+	fprintf(f, "  \"iso_packets\": %d,\n", opt.iso_packets);
+	fprintf(f, "  \"results\": [\n");
+	for(int i = 0; i < n; i++)
+	{
+		const struct result *r = &res[i];
+		fprintf(f, "    {\"workload\": \"%s\", \"size\": %d, \"urbs\": %ld, \"errors\": %ld, "
+		           "\"seconds\": %.6f, \"urbs_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+		           "\"cpu_us_per_urb\": %.3f, \"lat_p50_us\": %.2f, \"lat_p99_us\": %.2f, "
+		           "\"lat_p999_us\": %.2f}%s\n",
+		        workload_names[r->w], (int)r->size, r->urbs, r->errors,
+		        r->seconds, r->urbs_per_sec, r->mb_per_sec,
+		        r->cpu_us_per_urb, r->p50, r->p99, r->p999,
+		        (i + 1 < n) ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+// reads a number from a result line written by write_json
+static bool json_number(const char *line, const char *key, double *value)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof pattern, "\"%s\": ", key);
+	const char *p = strstr(line, pattern);
+	if(!p)
+		return false;
+	*value = strtod(p + strlen(pattern), NULL);
+	return true;
+}
+
+static double change(double now, double base)
+{
+	return base ? (now - base) * 100.0 / base : 0.0;
+}
+
+static int compare_baseline(const char *path, const struct result *res, int n)
+{
+	FILE *f = fopen(path, "r");
+	if(!f)
+	{
+		fprintf(stderr, "vhci_bench: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(stderr, "\n%-10s %7s  %12s %9s  %10s %9s  %10s %9s\n",
+	        "workload", "size", "urbs/s", "change", "p99 us", "change", "cpu/urb us", "change");
+	char line[512];
+	while(fgets(line, sizeof line, f))
+	{
+		const char *p = strstr(line, "\"workload\": \"");
+		if(!p)
+			continue;
+		p += strlen("\"workload\": \"");
+		double size, rate, p99, cpu;
+		if(!json_number(line, "size", &size) || !json_number(line, "urbs_per_sec", &rate) ||
+		   !json_number(line, "lat_p99_us", &p99) || !json_number(line, "cpu_us_per_urb", &cpu))
+			continue;
+		for(int i = 0; i < n; i++)
+		{
+			const struct result *r = &res[i];
+			const char *name = workload_names[r->w];
+			if(strncmp(p, name, strlen(name)) || p[strlen(name)] != '"' || r->size != (int32_t)size)
+				continue;
+			fprintf(stderr, "%-10s %7d  %12.0f %+8.1f%%  %10.2f %+8.1f%%  %10.3f %+8.1f%%\n",
+			        name, (int)r->size,
+			        r->urbs_per_sec, change(r->urbs_per_sec, rate),
+			        r->p99, change(r->p99, p99),
+			        r->cpu_us_per_urb, change(r->cpu_us_per_urb, cpu));
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * main
+ */
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -w LIST  workloads (control,bulk-out,bulk-in,echo,interrupt,iso or all)\n"
+	        "  -s LIST  transfer sizes in bytes (default: 64,512,16384; control transfers\n"
+	        "           are limited to %d bytes)\n"
+	        "  -n N     urbs per workload and size (default: 100000)\n"
+	        "  -W N     warm-up urbs before each measurement (default: 1000)\n"
+	        "  -q N     transfers in flight per host thread (default: 8)\n"
+	        "  -t N     host threads (default: 1)\n"
+	        "  -d N     device threads (default: 1)\n"
+	        "  -p N     packets per iso urb (default: 8)\n"
+	        "  -o FILE  write results to FILE instead of stdout\n"
+	        "  -b FILE  compare results with FILE (written by -o) on stderr\n"
+	        "  -c FILE  capture the urbs of the device into FILE (pcap; see vhci_replay)\n"
+#ifdef HAVE_LIBUSB
+	        "  -k       use the kernel module and libusb-1.0 instead of the simulated\n"
+	        "           controller\n"
+#endif
+	        , name, MAX_CONTROL_SIZE);
+}
+
+static bool parse_workloads(char *list)
+{
+	memset(opt.workloads, 0, sizeof opt.workloads);
+	for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+	{
+		bool found = false;
+		for(int i = 0; i < W_COUNT; i++)
+			if(!strcmp(tok, "all") || !strcmp(tok, workload_names[i]))
+				opt.workloads[i] = found = true;
+		if(!found)
+			return false;
+	}
+	return true;
+}
+
+static bool parse_sizes(char *list)
+{
+	opt.size_count = 0;
+	for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+	{
+		long size = strtol(tok, NULL, 0);
+		if(size <= 0 || size > MAX_SIZE ||
+		   opt.size_count == sizeof opt.sizes / sizeof *opt.sizes)
+			return false;
+		opt.sizes[opt.size_count++] = size;
+	}
+	return opt.size_count > 0;
+}
+
+int main(int argc, char **argv)
+{
+	char default_sizes[] = "64,512,16384";
+	opt.host_threads = 1;
+	opt.device_threads = 1;
+	opt.depth = 8;
+	opt.iso_packets = 8;
+	opt.count = 100000;
+	opt.warmup = 1000;
+	for(int i = 0; i < W_COUNT; i++)
+		opt.workloads[i] = true;
+	parse_sizes(default_sizes);
+
+	int c;
+	while((c = getopt(argc, argv, "w:s:n:W:q:t:d:p:o:b:c:kh")) != -1)
+	{
+		bool ok = true;
+		switch(c)
+		{
+		case 'w': ok = parse_workloads(optarg); break;
+		case 's': ok = parse_sizes(optarg); break;
+		case 'n': ok = (opt.count = atol(optarg)) > 0; break;
+		case 'W': ok = (opt.warmup = atol(optarg)) >= 0; break;
+		case 'q': ok = (opt.depth = atoi(optarg)) > 0; break;
+		case 't': ok = (opt.host_threads = atoi(optarg)) > 0; break;
+		case 'd': ok = (opt.device_threads = atoi(optarg)) > 0; break;
+		case 'p': ok = (opt.iso_packets = atoi(optarg)) > 0; break;
+		case 'o': opt.output = optarg; break;
+		case 'b': opt.baseline = optarg; break;
+		case 'c': opt.capture = optarg; break;
+#ifdef HAVE_LIBUSB
+		case 'k': opt.kernel = true; break;
+#endif
+		default: ok = false; break;
+		}
+		if(!ok)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	int32_t max_size = MAX_CONTROL_SIZE;
+	for(int i = 0; i < opt.size_count; i++)
+		if(opt.sizes[i] > max_size)
+			max_size = opt.sizes[i];
+	dev.max_size = max_size;
+	dev.echo = malloc(max_size);
+	pthread_mutex_init(&dev.lock, NULL);
+
+	int32_t id;
+	char *bus_id = NULL;
+	dev.fd = opt.kernel ? usb_vhci_open(1, &id, NULL, &bus_id) :
+	                      usb_vhci_sim_open(1, 0, &id, NULL, &bus_id);
+	if(dev.fd == -1 || !dev.echo)
+	{
+		fprintf(stderr, "vhci_bench: cannot create controller: %s\n", strerror(errno));
+		return 1;
+	}
+	fprintf(stderr, "vhci_bench: created %s\n", bus_id);
+	free(bus_id);
+
+	int ret = 1;
+	pthread_t *dev_threads = calloc(opt.device_threads, sizeof *dev_threads);
+	struct result *results = calloc(W_COUNT * opt.size_count, sizeof *results);
+	int started = 0, n = 0;
+	if(!dev_threads || !results)
+		goto out;
+	for(; started < opt.device_threads; started++)
+		if(pthread_create(&dev_threads[started], NULL, dev_thread, NULL))
+			goto out;
+
+#ifdef HAVE_LIBUSB
+	if(opt.kernel ? lu_open() == -1 : sim_wait_enabled() == -1)
+#else
+	if(sim_wait_enabled() == -1)
+#endif
+	{
+		fprintf(stderr, "vhci_bench: device did not get enabled\n");
+		goto out;
+	}
+
+	if(opt.capture && usb_vhci_capture_start(opt.capture, 0) == -1)
+	{
+		fprintf(stderr, "vhci_bench: cannot capture into %s: %s\n", opt.capture, strerror(errno));
+		goto out;
+	}
+	for(int w = 0; w < W_COUNT; w++)
+	{
+		if(!opt.workloads[w])
+			continue;
+		for(int i = 0; i < opt.size_count; i++)
+		{
+			int32_t size = opt.sizes[i];
+			if(w == W_CONTROL && size > MAX_CONTROL_SIZE)
+				size = MAX_CONTROL_SIZE;
+			if(w == W_ISO && size < opt.iso_packets)
+				size = opt.iso_packets;
+			if(opt.warmup && run_measure(w, size, opt.warmup, &results[n]) == -1)
+				goto failed;
+			if(run_measure(w, size, opt.count, &results[n]) == -1)
+				goto failed;
+			fprintf(stderr, "vhci_bench: %-9s %7d bytes: %10.0f urbs/s, p99 %.2f us\n",
+			        workload_names[w], (int)results[n].size,
+			        results[n].urbs_per_sec, results[n].p99);
+			n++;
+			continue;
+failed:
+			fprintf(stderr, "vhci_bench: %s with %d bytes failed\n", workload_names[w], (int)size);
+			goto out;
+		}
+	}
+
+	if(opt.capture)
+	{
+		struct usb_vhci_capture_stats cs;
+		if(usb_vhci_capture_stop(&cs) == -1)
+			fprintf(stderr, "vhci_bench: capture failed: %s\n", strerror(errno));
+		else
+			fprintf(stderr, "vhci_bench: captured %llu records (%llu bytes), dropped %llu\n",
+			        (unsigned long long)cs.records, (unsigned long long)cs.bytes,
+			        (unsigned long long)cs.dropped);
+	}
+
+	FILE *f = opt.output ? fopen(opt.output, "w") : stdout;
+	if(!f)
+	{
+		fprintf(stderr, "vhci_bench: cannot open %s: %s\n", opt.output, strerror(errno));
+		goto out;
+	}
+	write_json(f, results, n);
+	if(f != stdout)
+		fclose(f);
+	ret = 0;
+	if(opt.baseline && compare_baseline(opt.baseline, results, n) == -1)
+		ret = 1;
+
+out:
+#ifdef HAVE_LIBUSB
+	if(opt.kernel)
+		lu_close();
+#endif
+	dev.stop = true;
+	for(int i = 0; i < started; i++)
+		pthread_join(dev_threads[i], NULL);
+	// fails if the capture was stopped already
+	if(opt.capture)
+		usb_vhci_capture_stop(NULL);
+	usb_vhci_close(dev.fd);
+	free(dev_threads);
+	free(results);
+	free(dev.echo);
+	return ret;
+}
@@ -0,0 +1,837 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * vhci_replay -- replays a recorded urb trace against a simulated device
+ *
+ * The trace is a pcap file in the usbmon format (link type 220, as written by
+ * usb_vhci_capture_start, by tcpdump/Wireshark on a usbmon interface, or link
+ * type 189 for traces without iso descriptors). Every submission ('S' record)
+ * with a matching completion ('C' record) becomes one urb of the workload.
+ *
+ * The host side submits the urbs through the simulated controller in the
+ * order of the trace, with their recorded setup packet, flags and OUT data,
+ * either at their recorded time (scaled by -s) or as fast as possible (-s 0).
+ * The device answers every urb with the status, IN data and iso results of its
+ * recorded completion, so the workload is the same on every run. An urb whose
+ * completion differs from the recorded one (status or length) is counted as a
+ * mismatch.
+ *
+ * The result is written as JSON like the one of vhci_bench: URBs/s, MB/s and
+ * the 50th, 99th and 99.9th percentile of the latency (from submission until
+ * completion).
+ */
+
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "../src/libusb_vhci.h"
+
+#define PCAP_MAGIC           0xa1b2c3d4
+#define PCAP_MAGIC_NS        0xa1b23c4d
+#define LINKTYPE_USB_LINUX   189 // 48 byte header
+#define LINKTYPE_USB_MMAPPED 220 // 64 byte header, followed by iso descriptors
+
+#define MAX_PACKETS          1024
+
+struct pcap_file_header
+{
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+	uint32_t ts_sec, ts_usec;
+	uint32_t incl_len, orig_len;
+};
+
+// the header of the binary interface of usbmon; the fields after setup are only
+// there with LINKTYPE_USB_MMAPPED
+struct usbmon_packet
+{
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	union
+	{
+		uint8_t setup[8];
+		struct
+		{
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+struct usbmon_iso_desc
+{
+	int32_t status;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t pad;
+};
+
+// one recorded urb
+struct xfer
+{
+	uint64_t time; // of the submission, in ns since the first one
+	uint64_t id;   // of usbmon (only while loading)
+	uint16_t busnum;
+	uint8_t type, epadr, devadr;
+	uint8_t setup[8];
+	bool complete;
+	uint16_t flags;
+	int32_t interval;
+	int32_t length;
+	uint8_t *out;  // OUT data (length bytes)
+	int32_t packet_count;
+	struct usb_vhci_iso_packet *packets; // offset and packet_length of the submission,
+	                                     // packet_actual and status of the completion
+	// completion
+	int32_t status; // USB_VHCI_STATUS_*
+	int32_t actual;
+	int32_t error_count;
+	uint8_t *in;    // IN data (actual bytes)
+	// the device takes the expected answers from a queue per endpoint
+	struct xfer *next_pending;
+};
+
+struct options
+{
+	double speed;
+	long loops;
+	int depth;
+	int devadr, busnum;
+	const char *trace, *output;
+};
+
+static struct options opt;
+
+static struct
+{
+	struct xfer *xfers;
+	long count;
+	int32_t max_length, max_packets;
+} trace;
+
+// state of the device
+static struct
+{
+	int fd;
+	pthread_mutex_t lock; // protects the queues
+	struct usb_vhci_port_stat stat;
+	// expected urbs per endpoint (control endpoints without direction bit)
+	struct xfer *head[256], *tail[256];
+	volatile long mismatches;
+	volatile bool stop;
+} dev;
+
+// urbs in flight
+struct slot
+{
+	const struct xfer *x;
+	uint8_t *buffer;
+	struct usb_vhci_iso_packet *iso;
+	uint64_t submitted;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint8_t endpoint_key(uint8_t type, uint8_t epadr)
+{
+	return usb_vhci_is_control(type) ? (epadr & 0x0f) : epadr;
+}
+
+/*
+ * trace
+ */
+
+static int read_exact(FILE *f, void *buf, size_t size)
+{
+	return (size && fread(buf, size, 1, f) != 1) ? -1 : 0;
+}
+
+static struct xfer *trace_add(void)
+{
+	static long room;
+	if(trace.count == room)
+	{
+		long n = room ? room * 2 : 1024;
+		struct xfer *x = realloc(trace.xfers, n * sizeof *x);
+		if(!x)
+			return NULL;
+		trace.xfers = x;
+		room = n;
+	}
+	struct xfer *x = &trace.xfers[trace.count++];
+	memset(x, 0, sizeof *x);
+	return x;
+}
+
+static void trace_submission(struct xfer *x, const struct usbmon_packet *mp, int hdr_len,
+                             const uint8_t *data, uint32_t len_cap)
+{
+	x->id = mp->id;
+	x->busnum = mp->busnum;
+	x->type = mp->xfer_type;
+	x->epadr = mp->epnum;
+	x->devadr = mp->devnum;
+	x->length = mp->length;
+	if(!mp->flag_setup)
+		memcpy(x->setup, mp->s.setup, sizeof x->setup);
+	if(hdr_len == sizeof *mp)
+	{
+		x->flags = mp->xfer_flags & (USB_VHCI_URB_FLAGS_SHORT_NOT_OK |
+		                             USB_VHCI_URB_FLAGS_ISO_ASAP |
+		                             USB_VHCI_URB_FLAGS_ZERO_PACKET);
+		x->interval = mp->interval;
+	}
+	// OUT data which wasn't captured completely is padded with zeros
+	if(usb_vhci_is_out(x->epadr) && x->length > 0 && (x->out = calloc(1, x->length)))
+		memcpy(x->out, data, (len_cap < (uint32_t)x->length) ? len_cap : (uint32_t)x->length);
+	if(x->length > trace.max_length)
+		trace.max_length = x->length;
+}
+
+static void trace_iso(struct xfer *x, const struct usbmon_packet *mp, const struct usbmon_iso_desc *desc, bool completion)
+{
+	if(!completion)
+	{
+		x->packet_count = (mp->ndesc < MAX_PACKETS) ? mp->ndesc : MAX_PACKETS;
+		if(!(x->packets = calloc(x->packet_count ? x->packet_count : 1, sizeof *x->packets)))
+			return;
+		for(int i = 0; i < x->packet_count; i++)
+		{
+			x->packets[i].offset = desc[i].offset;
+			x->packets[i].packet_length = desc[i].length;
+		}
+		if(x->packet_count > trace.max_packets)
+			trace.max_packets = x->packet_count;
+		return;
+	}
+	x->error_count = mp->s.iso.error_count;
+	for(int i = 0; x->packets && i < x->packet_count && i < (int)mp->ndesc; i++)
+	{
+		x->packets[i].packet_actual = desc[i].length;
+		x->packets[i].status = usb_vhci_from_iso_packets_errno(desc[i].status);
+	}
+}
+
+static void trace_completion(struct xfer *x, const struct usbmon_packet *mp, const uint8_t *data, uint32_t len_cap)
+{
+	x->complete = true;
+	x->status = usb_vhci_from_errno(mp->status, usb_vhci_is_iso(x->type));
+	x->actual = ((int32_t)mp->length < x->length) ? (int32_t)mp->length : x->length;
+	if(usb_vhci_is_in(x->epadr) && x->actual > 0 && (x->in = calloc(1, x->actual)))
+		memcpy(x->in, data, (len_cap < (uint32_t)x->actual) ? len_cap : (uint32_t)x->actual);
+}
+
+static bool trace_wanted(const struct usbmon_packet *mp)
+{
+	return (opt.devadr < 0 || mp->devnum == opt.devadr) &&
+	       (opt.busnum < 0 || mp->busnum == opt.busnum) &&
+	       mp->xfer_type <= USB_VHCI_URB_TYPE_BULK;
+}
+
+static int trace_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if(!f)
+	{
+		fprintf(stderr, "vhci_replay: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct pcap_file_header fh;
+	int ret = -1;
+	uint8_t *rec = NULL;
+	if(read_exact(f, &fh, sizeof fh) == -1 || (fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NS) ||
+	   (fh.linktype != LINKTYPE_USB_LINUX && fh.linktype != LINKTYPE_USB_MMAPPED))
+	{
+		fprintf(stderr, "vhci_replay: %s is no usbmon capture (in the byte order of this machine)\n", path);
+		goto out;
+	}
+	const int hdr_len = (fh.linktype == LINKTYPE_USB_MMAPPED) ? 64 : 48;
+	const uint32_t ts_div = (fh.magic == PCAP_MAGIC_NS) ? 1 : 1000;
+	if(!(rec = malloc((fh.snaplen > (uint32_t)hdr_len) ? fh.snaplen : sizeof(struct usbmon_packet))))
+		goto out;
+
+	// submissions which are still waiting for their completion
+	long *pending = NULL, pending_count = 0, pending_room = 0;
+	uint64_t first = 0;
+	struct pcap_record_header ph;
+	while(read_exact(f, &ph, sizeof ph) == 0)
+	{
+		if(ph.incl_len > fh.snaplen || read_exact(f, rec, ph.incl_len) == -1)
+		{
+			fprintf(stderr, "vhci_replay: %s is truncated\n", path);
+			break;
+		}
+		if(ph.incl_len < (uint32_t)hdr_len)
+			continue;
+		struct usbmon_packet mp;
+		memset(&mp, 0, sizeof mp);
+		memcpy(&mp, rec, hdr_len);
+		if(!trace_wanted(&mp) || (mp.type != 'S' && mp.type != 'C'))
+			continue;
+		const struct usbmon_iso_desc *desc = (const struct usbmon_iso_desc *)(rec + hdr_len);
+		if(hdr_len == 48 || !usb_vhci_is_iso(mp.xfer_type))
+			mp.ndesc = 0;
+		else if((uint64_t)mp.ndesc * sizeof *desc > ph.incl_len - hdr_len)
+			continue;
+		const uint8_t *data = (const uint8_t *)(desc + mp.ndesc);
+		uint32_t len_cap = ph.incl_len - hdr_len - mp.ndesc * sizeof *desc;
+		if(mp.len_cap < len_cap)
+			len_cap = mp.len_cap;
+		// iso urbs can't be replayed without their descriptors
+		if(usb_vhci_is_iso(mp.xfer_type) && hdr_len == 48)
+			continue;
+
+		if(mp.type == 'S')
+		{
+			if(pending_count == pending_room)
+			{
+				long n = pending_room ? pending_room * 2 : 64;
+				long *p = realloc(pending, n * sizeof *p);
+				if(!p)
+					break;
+				pending = p;
+				pending_room = n;
+			}
+			struct xfer *x = trace_add();
+			if(!x)
+				break;
+			uint64_t t = (uint64_t)ph.ts_sec * 1000000000 + (uint64_t)ph.ts_usec * ts_div;
+			if(trace.count == 1)
+				first = t;
+			x->time = (t > first) ? t - first : 0;
+			trace_submission(x, &mp, hdr_len, data, len_cap);
+			if(usb_vhci_is_iso(x->type))
+				trace_iso(x, &mp, desc, false);
+			pending[pending_count++] = trace.count - 1;
+			continue;
+		}
+		// a completion without submission was in flight when the capture started
+		for(long i = pending_count - 1; i >= 0; i--)
+		{
+			struct xfer *x = &trace.xfers[pending[i]];
+			if(x->id != mp.id || x->busnum != mp.busnum)
+				continue;
+			trace_completion(x, &mp, data, len_cap);
+			if(usb_vhci_is_iso(x->type))
+				trace_iso(x, &mp, desc, true);
+			pending[i] = pending[--pending_count];
+			break;
+		}
+	}
+	free(pending);
+
+	// urbs which never completed in the trace are left out
+	long n = 0;
+	for(long i = 0; i < trace.count; i++)
+	{
+		struct xfer *x = &trace.xfers[i];
+		if(x->complete && (!usb_vhci_is_iso(x->type) || (x->packets && x->packet_count)))
+			trace.xfers[n++] = *x;
+		else
+		{
+			free(x->out);
+			free(x->in);
+			free(x->packets);
+		}
+	}
+	trace.count = n;
+	if(!n)
+		fprintf(stderr, "vhci_replay: %s has no complete urbs\n", path);
+	else
+		ret = 0;
+
+out:
+	free(rec);
+	fclose(f);
+	return ret;
+}
+
+static void trace_free(void)
+{
+	for(long i = 0; i < trace.count; i++)
+	{
+		free(trace.xfers[i].out);
+		free(trace.xfers[i].in);
+		free(trace.xfers[i].packets);
+	}
+	free(trace.xfers);
+}
+
+/*
+ * device side
+ */
+
+static void dev_port_stat(const struct usb_vhci_port_stat *stat)
+{
+	struct usb_vhci_port_stat prev = dev.stat;
+	dev.stat = *stat;
+
+	if(stat->index != 1)
+		return;
+	uint8_t triggers = usb_vhci_port_stat_triggers(stat, &prev);
+	int res = 0;
+	if(triggers & USB_VHCI_PORT_STAT_TRIGGER_POWER_ON)
+		res = usb_vhci_port_connect(dev.fd, 1, USB_VHCI_DATA_RATE_HIGH);
+	else if(triggers & USB_VHCI_PORT_STAT_TRIGGER_RESET && stat->status & USB_VHCI_PORT_STAT_CONNECTION)
+		res = usb_vhci_port_reset_done(dev.fd, 1, 1);
+	else if(triggers & USB_VHCI_PORT_STAT_TRIGGER_RESUMING && stat->status & USB_VHCI_PORT_STAT_CONNECTION)
+		res = usb_vhci_port_resumed(dev.fd, 1);
+	if(res == -1)
+		fprintf(stderr, "vhci_replay: port operation failed with errno %d\n", errno);
+}
+
+static void dev_push(struct xfer *x)
+{
+	uint8_t key = endpoint_key(x->type, x->epadr);
+	pthread_mutex_lock(&dev.lock);
+	x->next_pending = NULL;
+	if(dev.tail[key])
+		dev.tail[key]->next_pending = x;
+	else
+		dev.head[key] = x;
+	dev.tail[key] = x;
+	pthread_mutex_unlock(&dev.lock);
+}
+
+static const struct xfer *dev_pop(const struct usb_vhci_urb *urb)
+{
+	uint8_t key = endpoint_key(urb->type, urb->epadr);
+	pthread_mutex_lock(&dev.lock);
+	struct xfer *x = dev.head[key];
+	if(x && !(dev.head[key] = x->next_pending))
+		dev.tail[key] = NULL;
+	pthread_mutex_unlock(&dev.lock);
+	return x;
+}
+
+// answers like the recorded completion
+static void dev_process(struct usb_vhci_urb *urb, const struct xfer *x)
+{
+	urb->status = x->status;
+	if(usb_vhci_is_iso(urb->type))
+	{
+		urb->error_count = x->error_count;
+		for(int i = 0; i < urb->packet_count; i++)
+		{
+			struct usb_vhci_iso_packet *p = &urb->iso_packets[i];
+			if(i < x->packet_count)
+			{
+				p->packet_actual = (x->packets[i].packet_actual < p->packet_length) ?
+				                   x->packets[i].packet_actual : p->packet_length;
+				p->status = x->packets[i].status;
+			}
+			else
+			{
+				p->packet_actual = 0;
+				p->status = USB_VHCI_STATUS_SUCCESS;
+			}
+		}
+	}
+	urb->buffer_actual = (x->actual < urb->buffer_length) ? x->actual : urb->buffer_length;
+	if(usb_vhci_is_in(urb->epadr) && x->in)
+		memcpy(urb->buffer, x->in, urb->buffer_actual);
+}
+
+static void *dev_thread(void *arg)
+{
+	(void)arg;
+	uint8_t *buffer = malloc(trace.max_length ? trace.max_length : 1);
+	struct usb_vhci_iso_packet *iso = malloc((trace.max_packets ? trace.max_packets : 1) * sizeof *iso);
+	if(!buffer || !iso)
+	{
+		fprintf(stderr, "vhci_replay: out of memory\n");
+		dev.stop = true;
+	}
+
+	while(!dev.stop)
+	{
+		struct usb_vhci_work w;
+		int res = usb_vhci_fetch_work_timeout(dev.fd, &w, 100);
+		if(res == -1)
+		{
+			if(errno != ETIMEDOUT && errno != EINTR && errno != ENODATA)
+			{
+				fprintf(stderr, "vhci_replay: usb_vhci_fetch_work failed with errno %d\n", errno);
+				break;
+			}
+			continue;
+		}
+		switch(w.type)
+		{
+		case USB_VHCI_WORK_TYPE_PORT_STAT:
+			dev_port_stat(&w.work.port_stat);
+			break;
+		case USB_VHCI_WORK_TYPE_PROCESS_URB:
+		{
+			const struct xfer *x = dev_pop(&w.work.urb);
+			w.work.urb.buffer = buffer;
+			w.work.urb.iso_packets = iso;
+			if(!x || w.work.urb.buffer_length > trace.max_length || w.work.urb.packet_count > trace.max_packets)
+			{
+				// never sent by the host side
+				w.work.urb.buffer_actual = 0;
+				w.work.urb.packet_count = 0;
+				w.work.urb.status = USB_VHCI_STATUS_STALL;
+			}
+			else
+			{
+				if(res && usb_vhci_fetch_data(dev.fd, &w.work.urb) == -1)
+				{
+					if(errno != ECANCELED)
+						fprintf(stderr, "vhci_replay: usb_vhci_fetch_data failed with errno %d\n", errno);
+					break;
+				}
+				dev_process(&w.work.urb, x);
+			}
+			if(usb_vhci_giveback(dev.fd, &w.work.urb) == -1)
+				fprintf(stderr, "vhci_replay: usb_vhci_giveback failed with errno %d\n", errno);
+			break;
+		}
+		case USB_VHCI_WORK_TYPE_CANCEL_URB:
+			break;
+		}
+	}
+
+	free(buffer);
+	free(iso);
+	return NULL;
+}
+
+/*
+ * host side
+ */
+
+static int sim_wait_enabled(void)
+{
+	for(int i = 0; i < 500; i++)
+	{
+		struct usb_vhci_port_stat stat;
+		if(usb_vhci_sim_get_port_stat(dev.fd, 1, &stat) == -1)
+			return -1;
+		if(stat.status & USB_VHCI_PORT_STAT_ENABLE)
+			return 0;
+		usleep(10000);
+	}
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+static int host_submit(struct slot *slots, int index, struct xfer *x)
+{
+	struct slot *s = &slots[index];
+	struct usb_vhci_urb urb;
+	memset(&urb, 0, sizeof urb);
+	urb.handle = index + 1;
+	urb.type = x->type;
+	urb.devadr = x->devadr;
+	urb.epadr = x->epadr;
+	urb.flags = x->flags;
+	urb.interval = x->interval;
+	urb.buffer_length = x->length;
+	urb.buffer = s->buffer;
+	if(x->out)
+		memcpy(s->buffer, x->out, x->length);
+	if(usb_vhci_is_control(x->type))
+	{
+		urb.bmRequestType = x->setup[0];
+		urb.bRequest = x->setup[1];
+		urb.wValue = x->setup[2] | x->setup[3] << 8;
+		urb.wIndex = x->setup[4] | x->setup[5] << 8;
+		urb.wLength = x->setup[6] | x->setup[7] << 8;
+	}
+	if(usb_vhci_is_iso(x->type))
+	{
+		urb.packet_count = x->packet_count;
+		urb.iso_packets = s->iso;
+		memcpy(s->iso, x->packets, x->packet_count * sizeof *s->iso);
+	}
+	s->x = x;
+	dev_push(x);
+	s->submitted = now_ns();
+	if(usb_vhci_sim_submit(dev.fd, &urb) == -1)
+	{
+		fprintf(stderr, "vhci_replay: usb_vhci_sim_submit failed with errno %d\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, long n, double q)
+{
+	if(n <= 0)
+		return 0.0;
+	long i = (long)(q * n + 0.999999) - 1;
+	if(i < 0)
+		i = 0;
+	if(i >= n)
+		i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+static int replay(FILE *out)
+{
+	const long total = trace.count * opt.loops;
+	uint64_t *latency = malloc(total * sizeof *latency);
+	struct slot *slots = calloc(opt.depth, sizeof *slots);
+	int *free_slots = malloc(opt.depth * sizeof *free_slots);
+	int ret = -1, free_count = 0;
+	if(!latency || !slots || !free_slots)
+		goto out;
+	for(int i = 0; i < opt.depth; i++)
+	{
+		if(!(slots[i].buffer = malloc(trace.max_length ? trace.max_length : 1)) ||
+		   !(slots[i].iso = malloc((trace.max_packets ? trace.max_packets : 1) * sizeof *slots[i].iso)))
+			goto out;
+		free_slots[free_count++] = i;
+	}
+
+	long submitted = 0, completed = 0, errors = 0;
+	int64_t bytes = 0;
+	const uint64_t start = now_ns();
+	uint64_t loop_start = start, end = start;
+	while(completed < total)
+	{
+		// submits everything that is due
+		while(submitted < total && free_count)
+		{
+			const long i = submitted % trace.count;
+			struct xfer *x = &trace.xfers[i];
+			if(i == 0 && submitted)
+				loop_start = now_ns();
+			if(opt.speed > 0 && now_ns() < loop_start + (uint64_t)(x->time / opt.speed))
+				break;
+			if(host_submit(slots, free_slots[--free_count], x) == -1)
+				goto out;
+			submitted++;
+		}
+
+		int16_t timeout = 100;
+		if(submitted < total && free_count && opt.speed > 0)
+		{
+			const struct xfer *x = &trace.xfers[submitted % trace.count];
+			const uint64_t due = loop_start + (uint64_t)(x->time / opt.speed), now = now_ns();
+			timeout = (due > now) ? (int16_t)((due - now) / 1000000) : 0;
+			if(timeout > 100)
+				timeout = 100;
+		}
+		struct usb_vhci_urb urb;
+		if(usb_vhci_sim_reap(dev.fd, &urb, timeout) == -1)
+		{
+			if(errno == ETIMEDOUT)
+				continue;
+			fprintf(stderr, "vhci_replay: usb_vhci_sim_reap failed with errno %d\n", errno);
+			goto out;
+		}
+		const uint64_t now = now_ns();
+		struct slot *s = &slots[urb.handle - 1];
+		latency[completed++] = now - s->submitted;
+		if(urb.status != s->x->status || urb.buffer_actual != s->x->actual)
+			__sync_fetch_and_add(&dev.mismatches, 1);
+		if(urb.status != USB_VHCI_STATUS_SUCCESS)
+			errors++;
+		bytes += urb.buffer_actual;
+		free_slots[free_count++] = urb.handle - 1;
+		end = now;
+	}
+
+	double seconds = (end - start) / 1e9;
+	qsort(latency, total, sizeof *latency, cmp_u64);
+	fprintf(out, "{\n");
+	fprintf(out, "  \"tool\": \"vhci_replay\",\n");
+	fprintf(out, "  \"backend\": \"sim\",\n");
+	fprintf(out, "  \"trace\": \"%s\",\n", opt.trace);
+	fprintf(out, "  \"speed\": %g,\n", opt.speed);
+	fprintf(out, "  \"loops\": %ld,\n", opt.loops);
+	fprintf(out, "  \"queue_depth\": %d,\n", opt.depth);
+	fprintf(out, "  \"results\": [\n");
+	fprintf(out, "    {\"urbs\": %ld, \"errors\": %ld, \"mismatches\": %ld, \"seconds\": %.6f, "
+	             "\"urbs_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"lat_p50_us\": %.2f, "
+	             "\"lat_p99_us\": %.2f, \"lat_p999_us\": %.2f}\n",
+	        total, errors, dev.mismatches, seconds, total / seconds, bytes / seconds / 1e6,
+	        percentile(latency, total, 0.5), percentile(latency, total, 0.99),
+	        percentile(latency, total, 0.999));
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+	fprintf(stderr, "vhci_replay: %ld urbs in %.3f s: %.0f urbs/s, %.2f MB/s, p99 %.2f us, %ld mismatches\n",
+	        total, seconds, total / seconds, bytes / seconds / 1e6, percentile(latency, total, 0.99),
+	        dev.mismatches);
+	ret = 0;
+
+out:
+	for(int i = 0; slots && i < opt.depth; i++)
+	{
+		free(slots[i].buffer);
+		free(slots[i].iso);
+	}
+	free(slots);
+	free(free_slots);
+	free(latency);
+	return ret;
+}
+
+/*
+ * main
+ */
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options] TRACE\n"
+	        "  -s F     speed factor for the recorded timing (default: 1; 0 submits\n"
+	        "           the urbs as fast as possible)\n"
+	        "  -l N     replay the trace N times (default: 1)\n"
+	        "  -q N     maximum of urbs in flight (default: 64)\n"
+	        "  -D N     replay only the urbs of device address N\n"
+	        "  -B N     replay only the urbs of bus N\n"
+	        "  -o FILE  write results to FILE instead of stdout\n"
+	        , name);
+}
+
+int main(int argc, char **argv)
+{
+	opt.speed = 1.0;
+	opt.loops = 1;
+	opt.depth = 64;
+	opt.devadr = -1;
+	opt.busnum = -1;
+
+	int c;
+	while((c = getopt(argc, argv, "s:l:q:D:B:o:h")) != -1)
+	{
+		bool ok = true;
+		switch(c)
+		{
+		case 's': ok = (opt.speed = atof(optarg)) >= 0; break;
+		case 'l': ok = (opt.loops = atol(optarg)) > 0; break;
+		case 'q': ok = (opt.depth = atoi(optarg)) > 0; break;
+		case 'D': ok = (opt.devadr = atoi(optarg)) >= 0 && opt.devadr < 128; break;
+		case 'B': ok = (opt.busnum = atoi(optarg)) >= 0; break;
+		case 'o': opt.output = optarg; break;
+		default: ok = false; break;
+		}
+		if(!ok)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(optind + 1 != argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	opt.trace = argv[optind];
+	if(trace_load(opt.trace) == -1)
+		return 1;
+	fprintf(stderr, "vhci_replay: %ld urbs, %.3f s\n", trace.count, trace.xfers[trace.count - 1].time / 1e9);
+	pthread_mutex_init(&dev.lock, NULL);
+
+	int32_t id;
+	char *bus_id = NULL;
+	dev.fd = usb_vhci_sim_open(1, 0, &id, NULL, &bus_id);
+	if(dev.fd == -1)
+	{
+		fprintf(stderr, "vhci_replay: cannot create controller: %s\n", strerror(errno));
+		trace_free();
+		return 1;
+	}
+	free(bus_id);
+
+	int ret = 1;
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, dev_thread, NULL))
+	{
+		usb_vhci_close(dev.fd);
+		trace_free();
+		return 1;
+	}
+	if(sim_wait_enabled() == -1)
+		fprintf(stderr, "vhci_replay: device did not get enabled\n");
+	else
+	{
+		FILE *f = opt.output ? fopen(opt.output, "w") : stdout;
+		if(!f)
+			fprintf(stderr, "vhci_replay: cannot open %s: %s\n", opt.output, strerror(errno));
+		else
+		{
+			if(replay(f) == 0)
+				ret = 0;
+			if(f != stdout)
+				fclose(f);
+		}
+	}
+
+	dev.stop = true;
+	pthread_join(thread, NULL);
+	usb_vhci_close(dev.fd);
+	trace_free();
+	return ret;
+}
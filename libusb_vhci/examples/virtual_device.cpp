@@ -47,16 +47,11 @@
  * nothing else than answering a few control requests from the usb core.
  */
 
-#include <pthread.h>
 #include <unistd.h>
 #include <iostream>
 #include <iomanip>
 #include "../src/libusb_vhci.h"
 
-bool has_work(true), waiting_for_work(false);
-pthread_mutex_t has_work_mutex;
-pthread_cond_t has_work_cv;
-
 const uint8_t dev_desc[] = {
 	18,     // descriptor length
 	1,      // type: device descriptor
@@ -110,18 +105,6 @@ const uint8_t str0_desc[] = {
 const uint8_t* str1_desc =
 	reinterpret_cast<const uint8_t*>("\x1a\x03H\0e\0l\0l\0o\0 \0W\0o\0r\0l\0d\0!");
 
-void signal_work_enqueued(void* arg, usb::vhci::hcd& from) throw()
-{
-	pthread_mutex_lock(&has_work_mutex);
-	has_work = true;
-	if(waiting_for_work)
-	{
-		waiting_for_work = false;
-		pthread_cond_signal(&has_work_cv);
-	}
-	pthread_mutex_unlock(&has_work_mutex);
-}
-
 void process_urb(usb::urb* urb)
 {
 	if(!urb->is_control())
@@ -205,31 +188,21 @@ void process_urb(usb::urb* urb)
 
 int main()
 {
-	pthread_mutex_init(&has_work_mutex, NULL);
-	pthread_cond_init(&has_work_cv, NULL);
-
 	usb::vhci::local_hcd hcd(1);
 	std::cout << "created " << hcd.get_bus_id() << " (bus# " << hcd.get_usb_bus_num() << ")" << std::endl;
-	hcd.add_work_enqueued_callback(usb::vhci::hcd::callback(&signal_work_enqueued, NULL));
 
-	bool cont(false);
 	while(true)
 	{
-		if(!cont)
+		usb::vhci::work* works[16];
+		size_t count(hcd.next_work_batch(works, 16));
+		if(!count)
 		{
-			pthread_mutex_lock(&has_work_mutex);
-			if(!has_work)
-			{
-				waiting_for_work = true;
-				pthread_cond_wait(&has_work_cv, &has_work_mutex);
-			}
-			else has_work = false;
-			pthread_mutex_unlock(&has_work_mutex);
+			hcd.wait_for_work();
+			continue;
 		}
-		usb::vhci::work* work;
-		cont = hcd.next_work(&work);
-		if(work)
+		for(size_t i(0); i < count; i++)
 		{
+			usb::vhci::work* work(works[i]);
 			if(usb::vhci::port_stat_work* psw = dynamic_cast<usb::vhci::port_stat_work*>(work))
 			{
 				std::cout << "got port stat work" << std::endl;
@@ -294,8 +267,6 @@ int main()
 		}
 	}
 
-	pthread_mutex_destroy(&has_work_mutex);
-	pthread_cond_destroy(&has_work_cv);
 	return 0;
 }
 
@@ -186,10 +186,16 @@ void process_urb(struct usb_vhci_urb *urb)
 int main()
 {
 	int32_t id, usb_bus_num;
-	char *bus_id = NULL; // will be allocated by usb_vhci_open; use free(bus_id) to free it, if you want
+	char *bus_id = NULL; // will be allocated by usb_vhci_ctx_open; use free(bus_id) to free it, if you want
 
-	// create a host controller with only one port
-	int fd = usb_vhci_open(1, &id, &usb_bus_num, &bus_id);
+	// create a host controller with only one port; the context owns the buffers of the
+	// urbs, so that they don't need to be allocated for every urb
+	struct usb_vhci_ctx *ctx = usb_vhci_ctx_open(1, NULL, &id, &usb_bus_num, &bus_id);
+	if(!ctx)
+	{
+		fprintf(stderr, "usb_vhci_ctx_open failed with errno %d\n", errno);
+		return 1;
+	}
 	printf("created %s (bus# %d)\n", bus_id, usb_bus_num);
 
 	// contains the status of the port
@@ -203,11 +209,11 @@ int main()
 	while(true)
 	{
 		struct usb_vhci_work w;
-		int res = usb_vhci_fetch_work(fd, &w);
+		int res = usb_vhci_ctx_fetch_work(ctx, &w, 100);
 		if(res == -1)
 		{
-			if(errno != ETIMEDOUT && errno != EINTR && errno != ENODATA)
-				fprintf(stderr, "usb_vhci_fetch_work failed with errno %d", errno);
+			if(errno != ETIMEDOUT && errno != EINTR && errno != ENODATA && errno != ECANCELED)
+				fprintf(stderr, "usb_vhci_ctx_fetch_work failed with errno %d", errno);
 		}
 		else
 		{
@@ -248,9 +254,9 @@ int main()
 				if(~prev.status & USB_VHCI_PORT_STAT_POWER && status & USB_VHCI_PORT_STAT_POWER)
 				{
 					printf("port is powered on -> connecting device\n");
-					if(usb_vhci_port_connect(fd, 1, USB_VHCI_DATA_RATE_FULL) == -1)
+					if(usb_vhci_ctx_port_connect(ctx, 1, USB_VHCI_DATA_RATE_FULL) == -1)
 					{
-						fprintf(stderr, "usb_vhci_port_connect failed with errno %d\n", errno);
+						fprintf(stderr, "usb_vhci_ctx_port_connect failed with errno %d\n", errno);
 						return 1;
 					}
 				}
@@ -260,9 +266,9 @@ int main()
 					if(status & USB_VHCI_PORT_STAT_CONNECTION)
 					{
 						printf("-> completing reset\n");
-						if(usb_vhci_port_reset_done(fd, 1, 1) == -1)
+						if(usb_vhci_ctx_port_reset_done(ctx, 1, 1) == -1)
 						{
-							fprintf(stderr, "usb_vhci_port_reset_done failed with errno %d\n", errno);
+							fprintf(stderr, "usb_vhci_ctx_port_reset_done failed with errno %d\n", errno);
 							return 1;
 						}
 					}
@@ -273,9 +279,9 @@ int main()
 					if(status & USB_VHCI_PORT_STAT_CONNECTION)
 					{
 						printf("-> completing resume\n");
-						if(usb_vhci_port_resumed(fd, 1) == -1)
+						if(usb_vhci_ctx_port_resumed(ctx, 1) == -1)
 						{
-							fprintf(stderr, "usb_vhci_port_resumed failed with errno %d\n", errno);
+							fprintf(stderr, "usb_vhci_ctx_port_resumed failed with errno %d\n", errno);
 							return 1;
 						}
 					}
@@ -287,28 +293,13 @@ int main()
 				break;
 			case USB_VHCI_WORK_TYPE_PROCESS_URB:
 				printf("got process urb work\n");
-				w.work.urb.buffer = NULL;
-				w.work.urb.iso_packets = NULL;
+				// buffer and iso_packets were filled in by usb_vhci_ctx_fetch_work already
 				if(w.work.urb.devadr != adr)
 				{
 					// not for me
+					usb_vhci_ctx_release(ctx, &w.work.urb);
 					break;
 				}
-				if(w.work.urb.buffer_length)
-					w.work.urb.buffer = (uint8_t *)malloc(w.work.urb.buffer_length);
-				if(w.work.urb.packet_count)
-					w.work.urb.iso_packets = (struct usb_vhci_iso_packet *)malloc(w.work.urb.packet_count * sizeof(struct usb_vhci_iso_packet));
-				if(res) // usb_vhci_fetch_work has returned a value != 0
-				{
-					res = usb_vhci_fetch_data(fd, &w.work.urb);
-					if(res == -1)
-					{
-						if(errno != ECANCELED)
-							fprintf(stderr, "usb_vhci_fetch_data failed with errno %d", errno);
-						free(w.work.urb.buffer);
-						free(w.work.urb.iso_packets);
-					}
-				}
 				// SET_ADDRESS?
 				if(usb_vhci_is_control(w.work.urb.type) && !(w.work.urb.epadr & 0x7f) && !w.work.urb.bmRequestType && w.work.urb.bRequest == 5)
 				{
@@ -326,10 +317,9 @@ int main()
 				{
 					process_urb(&w.work.urb);
 				}
-				if(usb_vhci_giveback(fd, &w.work.urb) == -1)
-					fprintf(stderr, "usb_vhci_giveback failed with errno %d", errno);
-				free(w.work.urb.buffer);
-				free(w.work.urb.iso_packets);
+				// returns the buffers to the context
+				if(usb_vhci_ctx_giveback(ctx, &w.work.urb) == -1)
+					fprintf(stderr, "usb_vhci_ctx_giveback failed with errno %d", errno);
 				break;
 			case USB_VHCI_WORK_TYPE_CANCEL_URB:
 				printf("got cancel urb work\n");
@@ -0,0 +1,826 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <deque>
+#include <new>
+#include "libusb_vhci_remote.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+namespace
+{
+	// how long an accepted connection may take to send its hello, in nanoseconds, and
+	// how many may do so at the same time
+	const uint64_t hello_timeout(1000000000u);
+	const size_t max_pending_hellos(16);
+
+	// anonymous shared memory which can be passed to the client
+	int create_shm(size_t size) _LIB_USB_VHCI_NOEXCEPT
+	{
+		int fd(-1);
+#ifdef SYS_memfd_create
+		fd = static_cast<int>(syscall(SYS_memfd_create, "vhci-broker", MFD_CLOEXEC));
+#endif
+		if(fd == -1)
+		{
+			// kernels before 3.17
+			char name[] = "/dev/shm/vhci-broker-XXXXXX";
+			fd = mkostemp(name, O_CLOEXEC);
+			if(fd != -1) unlink(name);
+		}
+		if(fd != -1 && ftruncate(fd, static_cast<off_t>(size)) == -1)
+		{
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	// like remote_ring::reserve; if the ring is full, the client gets asked to ring
+	// the doorbell of the broker after its next pop
+	usb::vhci::remote_msg* reserve(usb::vhci::remote_ring& r, uint32_t msg_size) _LIB_USB_VHCI_NOEXCEPT
+	{
+		usb::vhci::remote_msg* m(r.reserve(msg_size));
+		if(m) return m;
+		r.set_producer_waiting();
+		// the client may have made room meanwhile
+		return r.reserve(msg_size);
+	}
+
+	void commit(usb::vhci::remote_ring& r, int doorbell, usb::vhci::remote_msg* m) _LIB_USB_VHCI_NOEXCEPT
+	{
+		if(r.commit(m)) usb::vhci::remote_ring_doorbell(doorbell);
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		struct broker::client
+		{
+			int sock;
+			int doorbell;      // of to_broker; the broker waits for it
+			int peer_doorbell; // of to_client; the client waits for it
+			void* shm;
+			size_t shm_size;
+			remote_ring to_client;
+			remote_ring to_broker;
+			uint8_t port_count;
+			uint8_t ports[REMOTE_MAX_PORTS]; // port of the client - 1 -> port of dev
+			// urbs which the client has; tag = generation << 32 | index; free_slots has
+			// room for all slots, so that freeing a slot doesn't allocate
+			std::vector<process_urb_work*> slots;
+			std::vector<uint32_t> generations;
+			std::vector<uint32_t> free_slots;
+			// works which didn't fit into to_client (in order)
+			std::deque<work*> backlog;
+			watch sock_watch;
+			watch doorbell_watch;
+			bool dead;
+
+			client() _LIB_USB_VHCI_NOEXCEPT :
+				sock(-1),
+				doorbell(-1),
+				peer_doorbell(-1),
+				shm(NULL),
+				shm_size(0),
+				to_client(),
+				to_broker(),
+				port_count(0),
+				slots(),
+				generations(),
+				free_slots(),
+				backlog(),
+				sock_watch(),
+				doorbell_watch(),
+				dead(false)
+			{
+				memset(ports, 0, sizeof(ports));
+			}
+
+			~client() _LIB_USB_VHCI_NOEXCEPT
+			{
+				if(shm) munmap(shm, shm_size);
+				if(sock != -1) close(sock);
+				if(doorbell != -1) close(doorbell);
+				if(peer_doorbell != -1) close(peer_doorbell);
+			}
+
+			// port of the client for a port of dev
+			uint8_t local_port(uint8_t port) const _LIB_USB_VHCI_NOEXCEPT
+			{
+				for(uint8_t i(0); i < port_count; i++)
+					if(ports[i] == port)
+						return i + 1;
+				return 0;
+			}
+
+		private:
+			client(const client&) _LIB_USB_VHCI_NOEXCEPT;
+			client& operator=(const client&) _LIB_USB_VHCI_NOEXCEPT;
+		};
+
+		broker::broker(hcd& dev, const std::string& path, uint32_t ring_size) _LIB_USB_VHCI_THROW((std::exception)) :
+			dev(dev),
+			path(path),
+			ring_size(ring_size),
+			listen_fd(-1),
+			epoll_fd(-1),
+			wake_fd(-1),
+			listen_watch(),
+			work_watch(),
+			wake_watch(),
+			clients(),
+			pending_hellos(),
+			port_clients(NULL),
+			thread(),
+			shutdown(false),
+			client_count(0)
+		{
+			if(ring_size < 4096 || ring_size > (1u << 30) || (ring_size & (ring_size - 1)))
+				throw std::invalid_argument("ring_size");
+			sockaddr_un a;
+			memset(&a, 0, sizeof(a));
+			a.sun_family = AF_UNIX;
+			if(path.empty() || path.size() >= sizeof(a.sun_path)) throw std::invalid_argument("path");
+			path.copy(a.sun_path, path.size());
+			bool bound(false);
+			try
+			{
+				port_clients = new client*[dev.get_port_count()]();
+				// accept_client doesn't allocate
+				pending_hellos.reserve(max_pending_hellos);
+				listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+				if(listen_fd == -1) throw std::exception();
+				// left behind by a broker which crashed
+				struct stat st;
+				if(lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+				if(bind(listen_fd, reinterpret_cast<sockaddr*>(&a), sizeof(a)) == -1) throw std::exception();
+				bound = true;
+				if(listen(listen_fd, 16) == -1) throw std::exception();
+				epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+				if(epoll_fd == -1) throw std::exception();
+				wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if(wake_fd == -1) throw std::exception();
+				listen_watch.fd = listen_fd;
+				work_watch.fd = dev.get_work_fd();
+				wake_watch.fd = wake_fd;
+				watch* ws[3] = { &listen_watch, &work_watch, &wake_watch };
+				for(int i(0); i < 3; i++)
+				{
+					epoll_event ev;
+					memset(&ev, 0, sizeof(ev));
+					ev.events = EPOLLIN;
+					ev.data.ptr = ws[i];
+					if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ws[i]->fd, &ev) == -1) throw std::exception();
+				}
+				if(pthread_create(&thread, NULL, thread_start, this)) throw std::exception();
+			}
+			catch(...)
+			{
+				if(wake_fd != -1) close(wake_fd);
+				if(epoll_fd != -1) close(epoll_fd);
+				if(listen_fd != -1) close(listen_fd);
+				if(bound) unlink(path.c_str());
+				delete[] port_clients;
+				throw;
+			}
+		}
+
+		broker::~broker() _LIB_USB_VHCI_NOEXCEPT
+		{
+			shutdown = true;
+			remote_ring_doorbell(wake_fd);
+			pthread_join(thread, NULL);
+			drop_pending_hellos(true);
+			while(!clients.empty()) remove_client(clients.back());
+			close(wake_fd);
+			close(epoll_fd);
+			close(listen_fd);
+			unlink(path.c_str());
+			delete[] port_clients;
+		}
+
+		void* broker::thread_start(void* _this) _LIB_USB_VHCI_NOEXCEPT
+		{
+			static_cast<broker*>(_this)->run();
+			return NULL;
+		}
+
+		void broker::run() _LIB_USB_VHCI_NOEXCEPT
+		{
+			epoll_event evs[16];
+			work* ws[32];
+			while(!shutdown)
+			{
+				bool busy(false);
+				remote_clear_doorbell(dev.get_work_fd());
+				size_t n;
+				while((n = dev.next_work_batch(ws, 32)))
+				{
+					for(size_t i(0); i < n; i++) route_work(ws[i]);
+					busy = true;
+					if(n < 32) break;
+				}
+				for(size_t i(0); i < clients.size(); i++)
+				{
+					client* cl(clients[i]);
+					if(cl->dead) continue;
+					if(receive(cl)) busy = true;
+					if(!cl->backlog.empty() && flush_backlog(cl)) busy = true;
+				}
+
+				// the clients usually answer right away
+				const uint64_t spin(busy ? 0 : remote_spin_time());
+				if(spin && !clients.empty())
+				{
+					const uint64_t end(latency_histogram::now() + spin);
+					do
+					{
+						for(size_t i(0); i < clients.size(); i++)
+							if(!clients[i]->dead && !clients[i]->to_broker.empty())
+								busy = true;
+						remote_cpu_relax();
+					} while(!busy && latency_histogram::now() < end);
+				}
+
+				// sleep only if no client has sent something meanwhile (and not beyond the
+				// timeout of a pending hello)
+				const int hello_wait(drop_pending_hellos(false));
+				int timeout(busy ? 0 : hello_wait);
+				if(!busy)
+					for(size_t i(0); i < clients.size(); i++)
+						if(!clients[i]->to_broker.prepare_wait())
+							timeout = 0;
+				const int nev(epoll_wait(epoll_fd, evs, sizeof(evs) / sizeof(*evs), timeout));
+				if(!busy)
+					for(size_t i(0); i < clients.size(); i++)
+						clients[i]->to_broker.end_wait();
+				for(int i(0); i < nev; i++)
+				{
+					watch* w(static_cast<watch*>(evs[i].data.ptr));
+					if(w == &listen_watch) accept_client();
+					else if(w->hello_deadline) receive_hello(w);
+					else if(!w->cl) continue; // work fd and wake_fd are checked by the loop
+					else if(w->fd == w->cl->doorbell) remote_clear_doorbell(w->fd);
+					else
+					{
+						// nothing is sent over the socket after the welcome; so this is EOF
+						char c;
+						const ssize_t r(recv(w->fd, &c, sizeof(c), MSG_DONTWAIT));
+						if(r != -1 || (errno != EAGAIN && errno != EINTR)) w->cl->dead = true;
+					}
+				}
+				for(size_t i(clients.size()); i-- > 0; )
+					if(clients[i]->dead)
+						remove_client(clients[i]);
+			}
+		}
+
+		void broker::accept_client() _LIB_USB_VHCI_NOEXCEPT
+		{
+			const int fd(accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC));
+			if(fd == -1) return;
+			// the hello follows the connect right away, but the other clients must not
+			// wait for it: the connection waits in epoll_fd like the clients do
+			watch* w((pending_hellos.size() < max_pending_hellos) ? new(std::nothrow) watch : NULL);
+			if(w)
+			{
+				w->cl = NULL;
+				w->fd = fd;
+				w->hello_deadline = latency_histogram::now() + hello_timeout;
+				epoll_event ev;
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN | EPOLLRDHUP;
+				ev.data.ptr = w;
+				if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+				{
+					pending_hellos.push_back(w);
+					return;
+				}
+				delete w;
+			}
+			close(fd);
+		}
+
+		void broker::receive_hello(watch* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_hello h;
+			memset(&h, 0, sizeof(h));
+			const ssize_t r(recv(w->fd, &h, sizeof(h), MSG_DONTWAIT));
+			if(r == -1 && (errno == EAGAIN || errno == EINTR)) return;
+			const int fd(w->fd);
+			// the client gets other watches
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			pending_hellos.erase(std::find(pending_hellos.begin(), pending_hellos.end(), w));
+			delete w;
+			if(r != static_cast<ssize_t>(sizeof(h)) || h.magic != REMOTE_MAGIC)
+			{
+				close(fd);
+				return;
+			}
+			welcome_client(fd, h);
+		}
+
+		int broker::drop_pending_hellos(bool all) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(pending_hellos.empty()) return -1;
+			const uint64_t now(latency_histogram::now());
+			uint64_t next(~static_cast<uint64_t>(0));
+			for(size_t i(pending_hellos.size()); i-- > 0; )
+			{
+				watch* w(pending_hellos[i]);
+				if(all || w->hello_deadline <= now)
+				{
+					// closing the fd removes it from epoll_fd
+					close(w->fd);
+					delete w;
+					pending_hellos.erase(pending_hellos.begin() + i);
+				}
+				else if(w->hello_deadline < next)
+					next = w->hello_deadline;
+			}
+			if(pending_hellos.empty()) return -1;
+			return static_cast<int>((next - now) / 1000000u) + 1;
+		}
+
+		void broker::welcome_client(int fd, const remote_hello& h) _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_welcome wl;
+			memset(&wl, 0, sizeof(wl));
+			wl.magic = REMOTE_MAGIC;
+			wl.version = REMOTE_VERSION;
+			client* cl(NULL);
+			int shm_fd(-1);
+			if(h.version != REMOTE_VERSION) wl.error = EPROTONOSUPPORT;
+			else if(!h.port_count || h.port_count > REMOTE_MAX_PORTS) wl.error = EINVAL;
+			else if(!(cl = new(std::nothrow) client)) wl.error = ENOMEM;
+			else
+			{
+				// all or nothing
+				for(uint8_t i(0); i < dev.get_port_count() && cl->port_count < h.port_count; i++)
+					if(!port_clients[i])
+						cl->ports[cl->port_count++] = i + 1;
+				if(cl->port_count < h.port_count) wl.error = EBUSY;
+			}
+			if(!wl.error)
+			{
+				cl->sock = fd;
+				cl->shm_size = remote_shm_data_offset + 2 * static_cast<size_t>(ring_size);
+				shm_fd = create_shm(cl->shm_size);
+				if(shm_fd != -1)
+				{
+					cl->shm = mmap(NULL, cl->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+					if(cl->shm == MAP_FAILED) cl->shm = NULL;
+				}
+				cl->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				cl->peer_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if(!cl->shm || cl->doorbell == -1 || cl->peer_doorbell == -1) wl.error = errno ? errno : ENOMEM;
+			}
+			if(!wl.error)
+			{
+				remote_shm* hdr(static_cast<remote_shm*>(cl->shm));
+				hdr->magic = REMOTE_MAGIC;
+				hdr->ring_size = ring_size;
+				char* data(static_cast<char*>(cl->shm) + remote_shm_data_offset);
+				cl->to_client = remote_ring(&hdr->to_client, data, ring_size);
+				cl->to_broker = remote_ring(&hdr->to_broker, data + ring_size, ring_size);
+				cl->sock_watch.cl = cl->doorbell_watch.cl = cl;
+				cl->sock_watch.fd = fd;
+				cl->doorbell_watch.fd = cl->doorbell;
+				epoll_event ev;
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN | EPOLLRDHUP;
+				ev.data.ptr = &cl->sock_watch;
+				if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) wl.error = errno;
+				ev.events = EPOLLIN;
+				ev.data.ptr = &cl->doorbell_watch;
+				if(!wl.error && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cl->doorbell, &ev) == -1) wl.error = errno;
+				try
+				{
+					if(!wl.error) clients.push_back(cl);
+				}
+				catch(std::bad_alloc&)
+				{
+					wl.error = ENOMEM;
+				}
+			}
+
+			if(!wl.error)
+			{
+				wl.shm_size = static_cast<uint32_t>(cl->shm_size);
+				wl.port_count = cl->port_count;
+				memcpy(wl.ports, cl->ports, sizeof(wl.ports));
+				std::string bus_id;
+				if(local_hcd* lh = dynamic_cast<local_hcd*>(&dev))
+				{
+					wl.id = lh->get_vhci_id();
+					wl.usb_bus_num = lh->get_usb_bus_num();
+					bus_id = lh->get_bus_id();
+				}
+				else if(remote_hcd* rh = dynamic_cast<remote_hcd*>(&dev))
+				{
+					wl.id = rh->get_vhci_id();
+					wl.usb_bus_num = rh->get_usb_bus_num();
+					bus_id = rh->get_bus_id();
+				}
+				bus_id.copy(wl.bus_id, sizeof(wl.bus_id) - 1);
+			}
+			iovec iov = { &wl, sizeof(wl) };
+			union
+			{
+				cmsghdr align;
+				char buf[CMSG_SPACE(3 * sizeof(int))];
+			} cbuf;
+			msghdr mh;
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = &iov;
+			mh.msg_iovlen = 1;
+			if(!wl.error)
+			{
+				// memfd, doorbell of to_client, doorbell of to_broker
+				const int fds[3] = { shm_fd, cl->peer_doorbell, cl->doorbell };
+				mh.msg_control = cbuf.buf;
+				mh.msg_controllen = sizeof(cbuf.buf);
+				cmsghdr* c(CMSG_FIRSTHDR(&mh));
+				c->cmsg_level = SOL_SOCKET;
+				c->cmsg_type = SCM_RIGHTS;
+				c->cmsg_len = CMSG_LEN(sizeof(fds));
+				memcpy(CMSG_DATA(c), fds, sizeof(fds));
+			}
+			const bool sent(sendmsg(fd, &mh, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(wl)));
+			if(shm_fd != -1) close(shm_fd);
+			if(wl.error)
+			{
+				if(cl) cl->sock = -1;
+				delete cl;
+				close(fd);
+				return;
+			}
+			for(uint8_t i(0); i < cl->port_count; i++)
+				port_clients[cl->ports[i] - 1] = cl;
+			__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED);
+			if(!sent)
+			{
+				cl->dead = true;
+				return;
+			}
+			// the client starts with the current state of its ports
+			for(uint8_t i(0); i < cl->port_count; i++)
+			{
+				try
+				{
+					const port_stat stat(dev.get_port_stat(cl->ports[i]));
+					send_port_stat(cl, i + 1, stat);
+				}
+				catch(...)
+				{
+				}
+			}
+		}
+
+		void broker::remove_client(client* cl) _LIB_USB_VHCI_NOEXCEPT
+		{
+			// the urbs first; the host may reuse them as soon as the port is gone
+			for(size_t i(0); i < cl->slots.size(); i++)
+				if(cl->slots[i])
+					fail_work(cl->slots[i], USB_VHCI_STATUS_NO_RESPONSE);
+			for(size_t i(0); i < cl->backlog.size(); i++)
+				fail_work(cl->backlog[i], USB_VHCI_STATUS_NO_RESPONSE);
+			for(uint8_t i(0); i < cl->port_count; i++)
+			{
+				port_clients[cl->ports[i] - 1] = NULL;
+				try
+				{
+					if(dev.get_port_stat(cl->ports[i]).get_connection())
+						dev.port_disconnect(cl->ports[i]);
+				}
+				catch(...)
+				{
+				}
+			}
+			clients.erase(std::find(clients.begin(), clients.end(), cl));
+			// closing the fds removes them from epoll_fd
+			delete cl;
+			__atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+		}
+
+		void broker::route_work(work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const uint8_t port(w->get_port());
+			client* cl((port <= dev.get_port_count()) ? port_clients[port - 1] : NULL);
+			if(!cl || cl->dead)
+			{
+				fail_work(w, USB_VHCI_STATUS_NO_RESPONSE);
+				return;
+			}
+			if(w->get_type() == work_type_cancel_urb)
+			{
+				// an urb which waits in the backlog is given back right here
+				const uint64_t handle(static_cast<cancel_urb_work*>(w)->get_handle());
+				for(std::deque<work*>::iterator it(cl->backlog.begin()); it != cl->backlog.end(); ++it)
+				{
+					if((*it)->get_type() == work_type_process_urb &&
+					   static_cast<process_urb_work*>(*it)->get_urb()->get_handle() == handle)
+					{
+						work* uw(*it);
+						cl->backlog.erase(it);
+						fail_work(uw, USB_VHCI_STATUS_CANCELED);
+						finish(w);
+						return;
+					}
+				}
+			}
+			if(cl->backlog.empty() && deliver(cl, w)) return;
+			try
+			{
+				cl->backlog.push_back(w);
+			}
+			catch(std::bad_alloc&)
+			{
+				fail_work(w, USB_VHCI_STATUS_NO_RESPONSE);
+			}
+		}
+
+		bool broker::deliver(client* cl, work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const uint8_t port(cl->local_port(w->get_port()));
+			switch(w->get_type())
+			{
+			case work_type_process_urb:
+			{
+				process_urb_work* uw(static_cast<process_urb_work*>(w));
+				const usb::urb* u(uw->get_urb());
+				const uint32_t size(remote_urb_msg_size(*u->get_internal()));
+				if(size > cl->to_client.get_max_msg_size())
+				{
+					fail_work(w, USB_VHCI_STATUS_BUFFER_OVERRUN);
+					return true;
+				}
+				if(cl->free_slots.empty())
+				{
+					try
+					{
+						cl->slots.reserve(cl->slots.size() + 1);
+						cl->generations.reserve(cl->slots.size() + 1);
+						cl->free_slots.reserve(cl->slots.size() + 1);
+					}
+					catch(std::bad_alloc&)
+					{
+						fail_work(w, USB_VHCI_STATUS_NO_RESPONSE);
+						return true;
+					}
+					cl->free_slots.push_back(static_cast<uint32_t>(cl->slots.size()));
+					cl->slots.push_back(NULL);
+					cl->generations.push_back(0);
+				}
+				remote_msg* m(reserve(cl->to_client, size));
+				if(!m) return false;
+				const uint32_t index(cl->free_slots.back());
+				cl->free_slots.pop_back();
+				cl->slots[index] = uw;
+				m->type = REMOTE_MSG_PROCESS_URB;
+				m->port = port;
+				m->op = 0;
+				m->tag = static_cast<uint64_t>(cl->generations[index]) << 32 | index;
+				remote_put_urb(m, *u);
+				commit(cl->to_client, cl->peer_doorbell, m);
+				return true;
+			}
+			case work_type_cancel_urb:
+			{
+				// nothing to do, if the client has given the urb back already
+				const uint64_t handle(static_cast<cancel_urb_work*>(w)->get_handle());
+				for(uint32_t i(0); i < cl->slots.size(); i++)
+				{
+					if(!cl->slots[i] || cl->slots[i]->get_urb()->get_handle() != handle) continue;
+					remote_msg* m(reserve(cl->to_client, remote_msg_size(0)));
+					if(!m) return false;
+					m->type = REMOTE_MSG_CANCEL_URB;
+					m->port = port;
+					m->op = 0;
+					m->tag = static_cast<uint64_t>(cl->generations[i]) << 32 | i;
+					commit(cl->to_client, cl->peer_doorbell, m);
+					break;
+				}
+				break;
+			}
+			case work_type_port_stat:
+				if(!send_port_stat(cl, port, static_cast<port_stat_work*>(w)->get_port_stat())) return false;
+				break;
+			}
+			finish(w);
+			return true;
+		}
+
+		bool broker::send_port_stat(client* cl, uint8_t port, const port_stat& stat) _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_msg* m(reserve(cl->to_client, remote_msg_size(sizeof(usb_vhci_port_stat))));
+			if(!m) return false;
+			m->type = REMOTE_MSG_PORT_STAT;
+			m->port = port;
+			m->op = 0;
+			m->tag = 0;
+			usb_vhci_port_stat* ps(static_cast<usb_vhci_port_stat*>(remote_msg_body(m)));
+			memset(ps, 0, sizeof(*ps));
+			ps->status = stat.get_status();
+			ps->change = stat.get_change();
+			ps->index = port;
+			ps->flags = stat.get_flags();
+			commit(cl->to_client, cl->peer_doorbell, m);
+			return true;
+		}
+
+		bool broker::flush_backlog(client* cl) _LIB_USB_VHCI_NOEXCEPT
+		{
+			bool progress(false);
+			while(!cl->backlog.empty() && deliver(cl, cl->backlog.front()))
+			{
+				cl->backlog.pop_front();
+				progress = true;
+			}
+			return progress;
+		}
+
+		bool broker::receive(client* cl) _LIB_USB_VHCI_NOEXCEPT
+		{
+			int n(0);
+			remote_msg hdr;
+			for(const remote_msg* m; n < 256 && (m = cl->to_broker.peek(hdr)); n++)
+			{
+				if(!hdr.size)
+				{
+					cl->dead = true;
+					break;
+				}
+				switch(hdr.type)
+				{
+				case REMOTE_MSG_GIVEBACK:
+					giveback(cl, hdr, m);
+					break;
+				case REMOTE_MSG_PORT_OP:
+					port_op(cl, hdr);
+					break;
+				default:
+					cl->dead = true;
+					break;
+				}
+				if(cl->dead) break;
+				if(cl->to_broker.pop(hdr.size)) remote_ring_doorbell(cl->peer_doorbell);
+			}
+			return n > 0;
+		}
+
+		void broker::giveback(client* cl, const remote_msg& hdr, const remote_msg* m) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const uint32_t index(static_cast<uint32_t>(hdr.tag));
+			// stale tags belong to urbs which were failed already
+			if(index >= cl->slots.size() || !cl->slots[index] || cl->generations[index] != hdr.tag >> 32) return;
+			usb_vhci_urb mu;
+			const usb_vhci_iso_packet* iso;
+			const uint8_t* data;
+			int32_t data_length;
+			if(!remote_get_urb(m, hdr.size, mu, &iso, &data, &data_length))
+			{
+				cl->dead = true;
+				return;
+			}
+			process_urb_work* uw(cl->slots[index]);
+			cl->slots[index] = NULL;
+			cl->generations[index]++;
+			cl->free_slots.push_back(index);
+
+			usb::urb* u(uw->get_urb());
+			const int32_t length(u->get_buffer_length());
+			if(data_length > length) data_length = length;
+			u->set_status(mu.status);
+			if(u->is_isochronous())
+			{
+				const int32_t count((u->get_iso_packet_count() < mu.packet_count) ? u->get_iso_packet_count() : mu.packet_count);
+				for(int32_t i(0); iso && i < count; i++)
+				{
+					// the client may still change it
+					usb_vhci_iso_packet p;
+					memcpy(&p, &iso[i], sizeof(p));
+					const int32_t length(u->get_iso_packet_length(i));
+					u->set_iso_packet_actual(i, (p.packet_actual < 0) ? 0 : (p.packet_actual > length) ? length : p.packet_actual);
+					u->set_iso_status(i, p.status);
+				}
+				u->set_iso_error_count(mu.error_count);
+				// the buffer of iso urbs is given back as a whole
+				if(u->is_in() && data) memcpy(u->get_buffer(), data, data_length);
+				u->set_buffer_actual(length);
+			}
+			else if(u->is_in())
+			{
+				// straight from the shared memory; finish_work is done with it on return
+				u->set_buffer_actual(data ? data_length : 0);
+				if(data) u->set_in_data(data);
+			}
+			else
+				u->set_buffer_actual((mu.buffer_actual < 0) ? 0 : (mu.buffer_actual > length) ? length : mu.buffer_actual);
+			finish(uw);
+		}
+
+		void broker::port_op(client* cl, const remote_msg& hdr) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(!hdr.port || hdr.port > cl->port_count) return;
+			const uint8_t port(cl->ports[hdr.port - 1]);
+			// the client doesn't wait for the result
+			try
+			{
+				switch(hdr.op)
+				{
+				case REMOTE_PORT_CONNECT:     dev.port_connect(port, static_cast<usb::data_rate>(hdr.tag)); break;
+				case REMOTE_PORT_DISCONNECT:  dev.port_disconnect(port); break;
+				case REMOTE_PORT_DISABLE:     dev.port_disable(port); break;
+				case REMOTE_PORT_RESUMED:     dev.port_resumed(port); break;
+				case REMOTE_PORT_OVERCURRENT: dev.port_overcurrent(port, hdr.tag); break;
+				case REMOTE_PORT_RESET_DONE:  dev.port_reset_done(port, hdr.tag); break;
+				}
+			}
+			catch(...)
+			{
+			}
+		}
+
+		void broker::finish(work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			try
+			{
+				dev.finish_work(w);
+			}
+			catch(...)
+			{
+			}
+		}
+
+		void broker::fail_work(work* w, int32_t status) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(w->get_type() == work_type_process_urb)
+			{
+				usb::urb* u(static_cast<process_urb_work*>(w)->get_urb());
+				u->set_status(status);
+				if(u->is_isochronous())
+				{
+					for(int32_t i(0); i < u->get_iso_packet_count(); i++)
+					{
+						u->set_iso_packet_actual(i, 0);
+						u->set_iso_status(i, status);
+					}
+					u->set_iso_error_count(u->get_iso_packet_count());
+					u->set_buffer_actual(u->get_buffer_length());
+				}
+				else
+					u->set_buffer_actual(0);
+			}
+			finish(w);
+		}
+	}
+}
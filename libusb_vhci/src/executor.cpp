@@ -0,0 +1,325 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		executor::executor(hcd& dev,
+		                   void (*func)(void*, hcd&, work*),
+		                   void* arg,
+		                   unsigned int threads) _LIB_USB_VHCI_THROW((std::exception)) :
+			dev(dev),
+			func(func),
+			arg(arg),
+			mutex(),
+			strands(NULL),
+			workers(NULL),
+			worker_count(0),
+			dispatcher(),
+			wake_fd(-1),
+			shutdown(false),
+			stopping(false),
+			prefault_size(0)
+		{
+			if(!func) throw std::invalid_argument("func");
+			if(!threads)
+			{
+				long n(sysconf(_SC_NPROCESSORS_ONLN));
+				threads = (n > 0) ? static_cast<unsigned int>(n) : 1;
+			}
+			if((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) throw std::exception();
+			try
+			{
+				strands = new strand[dev.get_port_count() * 32];
+				workers = new worker[threads];
+			}
+			catch(...)
+			{
+				delete[] strands;
+				close(wake_fd);
+				throw;
+			}
+			pthread_mutex_init(&mutex, NULL);
+			for(unsigned int i(0); i < threads; i++)
+			{
+				worker& w(workers[i]);
+				w.owner = this;
+				w.index = i;
+				w.thread = pthread_t();
+				w.head = NULL;
+				w.tail = NULL;
+				w.waiting = false;
+				pthread_cond_init(&w.wake, NULL);
+			}
+			worker_count = threads;
+			const usb_vhci_thread_policy policy(dev.get_thread_policy());
+			prefault_size = policy.prefault_size;
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			bool ok(!usb_vhci_thread_policy_init_attr(&policy, &attr));
+			unsigned int started(0);
+			if(ok)
+			{
+				// the workers must not look at the others before all of them exist
+				lock _(mutex);
+				while(started < threads &&
+				      !pthread_create(&workers[started].thread, &attr, worker_start, &workers[started]))
+					started++;
+			}
+			ok = ok && started == threads && !pthread_create(&dispatcher, &attr, dispatcher_start, this);
+			pthread_attr_destroy(&attr);
+			if(!ok)
+			{
+				stop(started);
+				throw std::exception();
+			}
+		}
+
+		executor::~executor() _LIB_USB_VHCI_NOEXCEPT
+		{
+			shutdown = true;
+			uint64_t val(1);
+			while(write(wake_fd, &val, sizeof(val)) == -1 && errno == EINTR);
+			pthread_join(dispatcher, NULL);
+			stop(worker_count);
+		}
+
+		// lets the workers handle what is left and waits for them
+		void executor::stop(unsigned int running) _LIB_USB_VHCI_NOEXCEPT
+		{
+			{
+				lock _(mutex);
+				stopping = true;
+				for(unsigned int i(0); i < running; i++)
+					pthread_cond_signal(&workers[i].wake);
+			}
+			for(unsigned int i(0); i < running; i++)
+				pthread_join(workers[i].thread, NULL);
+			for(unsigned int i(0); i < worker_count; i++)
+				pthread_cond_destroy(&workers[i].wake);
+			pthread_mutex_destroy(&mutex);
+			delete[] workers;
+			delete[] strands;
+			while(close(wake_fd) == -1 && errno == EINTR);
+		}
+
+		void* executor::dispatcher_start(void* _this) _LIB_USB_VHCI_NOEXCEPT
+		{
+			executor& e(*reinterpret_cast<executor*>(_this));
+			usb_vhci_thread_prefault(e.prefault_size);
+			e.dispatch();
+			return NULL;
+		}
+
+		void* executor::worker_start(void* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			worker& self(*reinterpret_cast<worker*>(w));
+			usb_vhci_thread_prefault(self.owner->prefault_size);
+			self.owner->run(self);
+			return NULL;
+		}
+
+		// same layout as the endpoints of usb::vhci::scheduler (libusb_vhci.hpp)
+		size_t executor::strand_index(const usb::urb* urb) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const uint8_t ep(urb->get_endpoint_address() & 0x0f);
+			// both directions of endpoint 0 share a strand
+			return ep ? ep + (urb->is_in() ? 16 : 0) : 0;
+		}
+
+		// caller has mutex
+		executor::strand& executor::strand_of(const work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			strand* const port(strands + (w->get_port() - 1) * 32);
+			if(w->get_type() == work_type_process_urb)
+				return port[strand_index(static_cast<const process_urb_work*>(w)->get_urb())];
+			if(w->get_type() == work_type_cancel_urb)
+			{
+				// behind the process urb work (if it is still queued or being handled)
+				const uint64_t handle(static_cast<const cancel_urb_work*>(w)->get_handle());
+				for(size_t i(0); i < 32; i++)
+				{
+					strand& s(port[i]);
+					if(s.current == handle) return s;
+					for(std::deque<work*>::const_iterator j(s.works.begin()); j != s.works.end(); j++)
+					{
+						const process_urb_work* pw(static_cast<const process_urb_work*>(*j));
+						if(pw->get_type() == work_type_process_urb && pw->get_urb()->get_handle() == handle)
+							return s;
+					}
+				}
+			}
+			return port[0];
+		}
+
+		// caller has mutex
+		void executor::enqueue(worker& k, strand* s) _LIB_USB_VHCI_NOEXCEPT
+		{
+			s->next = NULL;
+			if(k.tail) k.tail->next = s;
+			else k.head = s;
+			k.tail = s;
+		}
+
+		// caller has mutex
+		void executor::schedule(worker& k, strand* s) _LIB_USB_VHCI_NOEXCEPT
+		{
+			enqueue(k, s);
+			if(k.waiting)
+				pthread_cond_signal(&k.wake);
+			else
+			{
+				// k is handling another strand right now: wake up someone who can steal
+				for(unsigned int i(0); i < worker_count; i++)
+				{
+					if(workers[i].waiting)
+					{
+						pthread_cond_signal(&workers[i].wake);
+						break;
+					}
+				}
+			}
+		}
+
+		// caller has mutex
+		executor::strand* executor::take_strand(worker& self) _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(unsigned int i(0); i < worker_count; i++)
+			{
+				// own queue first, then steal from the others
+				worker& k(workers[(self.index + i) % worker_count]);
+				if(strand* s = k.head)
+				{
+					k.head = s->next;
+					if(!k.head) k.tail = NULL;
+					s->next = NULL;
+					return s;
+				}
+			}
+			return NULL;
+		}
+
+		void executor::dispatch() _LIB_USB_VHCI_NOEXCEPT
+		{
+			while(!shutdown)
+			{
+				work* w[32];
+				size_t n(dev.next_work_batch(w, 32));
+				if(!n)
+				{
+					// wait_for_work(0) resets the work fd before it looks for works, so
+					// that an enqueue after the look wakes us up
+					if(!dev.wait_for_work(0) && !shutdown)
+					{
+						pollfd p[2];
+						p[0].fd = dev.get_work_fd();
+						p[1].fd = wake_fd;
+						p[0].events = p[1].events = POLLIN;
+						p[0].revents = p[1].revents = 0;
+						poll(p, 2, -1);
+					}
+					continue;
+				}
+				for(size_t i(0); i < n; i++)
+				{
+					bool queued(false);
+					while(!queued)
+					{
+						{
+							lock _(mutex);
+							strand& s(strand_of(w[i]));
+							try
+							{
+								s.works.push_back(w[i]);
+								queued = true;
+							}
+							catch(...) { }
+							if(queued && !s.scheduled)
+							{
+								s.scheduled = true;
+								schedule(workers[(&s - strands) % worker_count], &s);
+							}
+						}
+						// wait for others to free mem
+						if(!queued) usleep(100000);
+					}
+				}
+			}
+		}
+
+		void executor::run(worker& self) _LIB_USB_VHCI_NOEXCEPT
+		{
+			pthread_mutex_lock(&mutex);
+			while(true)
+			{
+				strand* s(take_strand(self));
+				if(!s)
+				{
+					if(stopping) break;
+					self.waiting = true;
+					pthread_cond_wait(&self.wake, &mutex);
+					self.waiting = false;
+					continue;
+				}
+				// s stays scheduled while we handle its front, so that nobody else takes it
+				work* w(s->works.front());
+				s->works.pop_front();
+				s->current = (w->get_type() == work_type_process_urb) ?
+				             static_cast<process_urb_work*>(w)->get_urb()->get_handle() : 0;
+				pthread_mutex_unlock(&mutex);
+				func(arg, dev, w);
+				try { dev.finish_work(w); }
+				catch(...)
+				{
+					// counted in the giveback_errors of the port
+				}
+				pthread_mutex_lock(&mutex);
+				s->current = 0;
+				// round robin between the strands in the queue of this worker; the others
+				// are woken up only if there is more than this one
+				if(s->works.empty()) s->scheduled = false;
+				else if(!self.head) enqueue(self, s);
+				else schedule(self, s);
+			}
+			pthread_mutex_unlock(&mutex);
+		}
+	}
+}
@@ -32,40 +32,87 @@
 #include <config.h>
 #endif
 
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
 #include "libusb_vhci.h"
+#include "libusb_vhci_trace.h"
+
+// trace point for a work (handle, epadr and length are only set for urbs)
+#define HCD_TRACE(name, point, w, status) \
+	do \
+	{ \
+		const usb::urb* _u(((w)->get_type() == work_type_process_urb) ? \
+		                   static_cast<const process_urb_work*>(w)->get_urb() : NULL); \
+		USB_VHCI_TRACE(name, point, -1, _u ? _u->get_handle() : 0, (w)->get_port(), \
+		               _u ? _u->get_endpoint_address() : 0, _u ? _u->get_buffer_length() : 0, (status)); \
+	} while(0)
 
 namespace usb
 {
 	namespace vhci
 	{
-		hcd::hcd(uint8_t ports) throw(std::invalid_argument, std::bad_alloc) :
+		hcd::hcd(uint8_t ports) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc)) :
 			work_enqueued_callbacks(),
 			bg_thread(),
 			thread_shutdown(false),
 			thread_sync(),
+			thread_policy(),
+			thread_cpu_set(),
 			port_count(ports),
 			_lock(),
 			inbox(),
-			processing()
+			processing(),
+			draining(false),
+			handles(64),
+			handle_count(0),
+			incoming(NULL),
+			work_fd(-1),
+			port_stats(NULL),
+			fetch_errors(0),
+			fetch_data_errors(0),
+			dropped_works(0)
 		{
 			if(ports == 0) throw std::invalid_argument("ports");
+			port_stats = new port_statistics[ports];
+			// only fails if we are out of file descriptors or kernel memory
+			work_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(work_fd == -1)
+			{
+				delete[] port_stats;
+				throw std::bad_alloc();
+			}
 			pthread_mutex_init(&thread_sync, NULL);
 			pthread_mutex_init(&_lock, NULL);
 		}
 
-		hcd::~hcd() throw()
+		hcd::~hcd() _LIB_USB_VHCI_NOEXCEPT
 		{
 			join_bg_thread();
-			for(std::deque<work*>::iterator w(inbox.begin()); w < inbox.end(); w++)
-				delete *w;
-			for(std::list<work*>::iterator w(processing.begin()); w != processing.end(); w++)
-				delete *w;
+			collect_works();
+			for(work_list* l(&inbox); l; l = (l == &inbox) ? &processing : NULL)
+			{
+				while(work* w = l->head)
+				{
+					l->head = w->next;
+					delete w;
+				}
+			}
+			close(work_fd);
+			delete[] port_stats;
 			pthread_mutex_destroy(&_lock);
 			pthread_mutex_destroy(&thread_sync);
 		}
 
-		// caller has _lock
-		void hcd::on_work_enqueued() throw()
+		// caller has thread_sync (not _lock)
+		void hcd::kick_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+		}
+
+		void hcd::on_work_enqueued() _LIB_USB_VHCI_NOEXCEPT
 		{
 			for(std::vector<callback>::const_iterator i(work_enqueued_callbacks.begin());
 			    i < work_enqueued_callbacks.end();
@@ -75,25 +122,169 @@ namespace usb
 			}
 		}
 
+		void hcd::append_work(work_list& list, work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			w->next = NULL;
+			w->prev = list.tail;
+			if(list.tail) list.tail->next = w;
+			else list.head = w;
+			list.tail = w;
+			if(++list.count > list.max_count) list.max_count = list.count;
+		}
+
+		void hcd::unlink_work(work_list& list, work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(w->prev) w->prev->next = w->next;
+			else list.head = w->next;
+			if(w->next) w->next->prev = w->prev;
+			else list.tail = w->prev;
+			w->prev = NULL;
+			w->next = NULL;
+			list.count--;
+		}
+
+		size_t hcd::handle_bucket(uint64_t handle) const _LIB_USB_VHCI_NOEXCEPT
+		{
+			// handles are kernel pointers, so the low bits are mostly zero
+			return static_cast<size_t>((handle * 0x9e3779b97f4a7c15ull) >> 32) & (handles.size() - 1);
+		}
+
+		// caller has _lock
+		void hcd::index_work(process_urb_work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(handle_count >= handles.size())
+			{
+				std::vector<process_urb_work*> old;
+				// without memory for more buckets, the chains just get longer
+				try { old.resize(handles.size() * 2); }
+				catch(...) { }
+				if(!old.empty()) old.swap(handles);
+				for(std::vector<process_urb_work*>::iterator b(old.begin()); b < old.end(); b++)
+				{
+					while(process_urb_work* uw = *b)
+					{
+						*b = uw->next_handle;
+						size_t i(handle_bucket(uw->get_urb()->get_handle()));
+						uw->next_handle = handles[i];
+						handles[i] = uw;
+					}
+				}
+			}
+			size_t i(handle_bucket(w->get_urb()->get_handle()));
+			w->next_handle = handles[i];
+			handles[i] = w;
+			handle_count++;
+		}
+
+		// caller has _lock
+		void hcd::unindex_work(process_urb_work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(process_urb_work** p(&handles[handle_bucket(w->get_urb()->get_handle())]); *p; p = &(*p)->next_handle)
+			{
+				if(*p == w)
+				{
+					*p = w->next_handle;
+					w->next_handle = NULL;
+					handle_count--;
+					return;
+				}
+			}
+		}
+
+		// caller has _lock
+		process_urb_work* hcd::find_work(uint64_t handle) const _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(process_urb_work* uw(handles[handle_bucket(handle)]); uw; uw = uw->next_handle)
+				if(uw->get_urb()->get_handle() == handle)
+					return uw;
+			return NULL;
+		}
+
+		void hcd::enqueue_work(work* w) _LIB_USB_VHCI_THROW((std::bad_alloc))
+		{
+			w->enqueued = latency_histogram::now();
+			HCD_TRACE(hcd_enqueue, USB_VHCI_TRACE_HCD_ENQUEUE, w, w->get_type());
+			work* head(__atomic_load_n(&incoming, __ATOMIC_RELAXED));
+			do
+			{
+				w->next = head;
+			} while(!__atomic_compare_exchange_n(&incoming, &head, w, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+			// the consumers only need to be woken up, if incoming was empty
+			if(!head)
+			{
+				const uint64_t one(1);
+				ssize_t res(write(work_fd, &one, sizeof(one)));
+				static_cast<void>(res); // EAGAIN: counter is non-zero anyway
+			}
+		}
+
 		// caller has _lock
-		void hcd::enqueue_work(work* w) throw(std::bad_alloc)
+		void hcd::collect_works() _LIB_USB_VHCI_NOEXCEPT
+		{
+			work* w(__atomic_exchange_n(&incoming, static_cast<work*>(NULL), __ATOMIC_ACQUIRE));
+			// incoming is LIFO
+			work* fifo(NULL);
+			while(w)
+			{
+				work* n(w->next);
+				w->next = fifo;
+				fifo = w;
+				w = n;
+			}
+			while(fifo)
+			{
+				work* n(fifo->next);
+				if(fifo->get_type() == work_type_process_urb)
+					index_work(static_cast<process_urb_work*>(fifo));
+				append_work(inbox, fifo);
+				fifo = n;
+			}
+		}
+
+		void hcd::take_works(std::vector<work*>& w) volatile _LIB_USB_VHCI_THROW((std::bad_alloc))
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			_this.collect_works();
+			// all or nothing
+			w.reserve(w.size() + _this.inbox.count);
+			while(work* _w = _this.inbox.head)
+			{
+				_this.unlink_work(_this.inbox, _w);
+				if(_w->get_type() == work_type_process_urb)
+					_this.unindex_work(static_cast<process_urb_work*>(_w));
+				if(_w->is_canceled()) delete _w;
+				else w.push_back(_w);
+			}
+		}
+
+		bool hcd::has_work() volatile _LIB_USB_VHCI_NOEXCEPT
 		{
-			inbox.push_back(w);
+			hcd& _this(const_cast<hcd&>(*this));
+			if(!__atomic_load_n(&_this.draining, __ATOMIC_RELAXED) && __atomic_load_n(&incoming, __ATOMIC_RELAXED))
+				return true;
+			lock _(_lock);
+			return _this.can_pop_work();
 		}
 
-		void hcd::init_bg_thread() volatile throw(std::exception)
+		void hcd::init_bg_thread() volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
+			hcd& _this(const_cast<hcd&>(*this));
 			pthread_attr_t attr;
 			pthread_attr_init(&attr);
 			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-			// TODO: set priority
 			int res;
 			pthread_t t;
 			{
 				lock _(thread_sync);
 				if(bg_thread != pthread_t())
+				{
+					pthread_attr_destroy(&attr);
 					throw std::exception();
-				res = pthread_create(&t, NULL, bg_thread_start, const_cast<hcd*>(this));
+				}
+				res = usb_vhci_thread_policy_init_attr(&_this.thread_policy, &attr);
+				if(res) goto cleanup;
+				res = pthread_create(&t, &attr, bg_thread_start, &_this);
 				if(res) goto cleanup;
 				bg_thread = t;
 			}
@@ -102,116 +293,332 @@ namespace usb
 			if(res) throw std::exception();
 		}
 
-		void hcd::join_bg_thread() volatile throw()
+		void hcd::set_thread_policy(const usb_vhci_thread_policy& policy) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			hcd& _this(const_cast<hcd&>(*this));
+			{
+				pthread_attr_t attr;
+				pthread_attr_init(&attr);
+				int res(usb_vhci_thread_policy_init_attr(&policy, &attr));
+				pthread_attr_destroy(&attr);
+				if(res) throw std::invalid_argument("policy");
+			}
+			usb_vhci_thread_policy p(policy);
+			std::vector<uint8_t> cpu_set;
+			if(policy.cpu_set)
+			{
+				const uint8_t* c(reinterpret_cast<const uint8_t*>(policy.cpu_set));
+				cpu_set.assign(c, c + policy.cpu_set_size);
+			}
+			if((policy.flags & USB_VHCI_THREAD_MLOCKALL) && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+				throw std::exception();
+			bool running;
+			{
+				lock _(thread_sync);
+				running = bg_thread != pthread_t();
+			}
+			if(running) join_bg_thread();
+			{
+				lock _(thread_sync);
+				std::swap(_this.thread_policy, p);
+				_this.thread_cpu_set.swap(cpu_set);
+				_this.thread_policy.cpu_set = _this.thread_cpu_set.empty() ? NULL : &_this.thread_cpu_set[0];
+			}
+			if(!running) return;
+			try { init_bg_thread(); }
+			catch(std::exception&)
+			{
+				// back to the old policy, with which the thread was running before
+				{
+					lock _(thread_sync);
+					std::swap(_this.thread_policy, p);
+					_this.thread_cpu_set.swap(cpu_set);
+				}
+				init_bg_thread();
+				throw;
+			}
+		}
+
+		usb_vhci_thread_policy hcd::get_thread_policy() const volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			const hcd& _this(const_cast<const hcd&>(*this));
+			lock _(const_cast<pthread_mutex_t&>(thread_sync));
+			return _this.thread_policy;
+		}
+
+		void hcd::join_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT
 		{
 			lock _(thread_sync);
 			if(bg_thread == pthread_t()) return;
 			thread_shutdown = true;
+			kick_bg_thread();
 			pthread_join(bg_thread, NULL);
 			thread_shutdown = false;
 			bg_thread = pthread_t();
 		}
 
-		void* hcd::bg_thread_start(void* _this) throw()
+		void* hcd::bg_thread_start(void* _this) _LIB_USB_VHCI_NOEXCEPT
 		{
 			hcd& dev = *reinterpret_cast<hcd*>(_this);
+			// set_thread_policy changes the policy only while this thread doesn't run
+			usb_vhci_thread_prefault(dev.thread_policy.prefault_size);
 			while(!dev.thread_shutdown)
 				dev.bg_work();
 			return NULL;
 		}
 
-		bool hcd::next_work(work** w) volatile throw(std::bad_alloc)
+		// caller has _lock
+		size_t hcd::pop_works(work** w, size_t count) _LIB_USB_VHCI_NOEXCEPT
 		{
-			*w = NULL;
-			lock _(_lock);
-			hcd& _this(const_cast<hcd&>(*this));
-			std::deque<work*>::size_type len(_this.inbox.size());
-			while(len)
+			size_t n(0);
+			if(count) w[0] = NULL;
+			collect_works();
+			work* _w(inbox.head);
+			while(n < count && _w)
 			{
-				work* _w(_this.inbox.front());
-				_this.inbox.pop_front();
-				if(!_w->is_canceled())
+				work* next(_w->next);
+				if(_w->is_canceled())
+				{
+					unlink_work(inbox, _w);
+					if(_w->get_type() == work_type_process_urb)
+						unindex_work(static_cast<process_urb_work*>(_w));
+					delete _w;
+				}
+				else if(!draining || _w->get_type() == work_type_cancel_urb)
 				{
-					_this.processing.push_back(_w);
-					*w = _w;
-					return len != 1;
+					unlink_work(inbox, _w);
+					append_work(processing, _w);
+					_w->in_progress = true;
+					w[n++] = _w;
+					HCD_TRACE(hcd_next, USB_VHCI_TRACE_HCD_NEXT, _w, _w->get_type());
 				}
-				delete _w;
-				len = _this.inbox.size();
+				_w = next;
 			}
+			return n;
+		}
+
+		// caller has _lock
+		bool hcd::can_pop_work() _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(!draining) return inbox.head || __atomic_load_n(&incoming, __ATOMIC_RELAXED);
+			collect_works();
+			for(work* w(inbox.head); w; w = w->next)
+				if(w->get_type() == work_type_cancel_urb) return true;
 			return false;
 		}
 
-		void hcd::finish_work(work* w) volatile throw(std::exception)
+		// caller has _lock
+		void hcd::set_draining(bool value) _LIB_USB_VHCI_NOEXCEPT
 		{
+			__atomic_store_n(&draining, value, __ATOMIC_RELAXED);
+			if(!value && inbox.head)
 			{
-				lock _(_lock);
-				hcd& _this(const_cast<hcd&>(*this));
-				_this.finishing_work(w);
-				_this.processing.remove(w);
+				// the consumers may wait for works which were held back
+				const uint64_t one(1);
+				ssize_t res(write(work_fd, &one, sizeof(one)));
+				static_cast<void>(res);
 			}
-			delete w;
 		}
 
-		bool hcd::cancel_process_urb_work(uint64_t handle) volatile throw(std::exception)
+		bool hcd::next_work(work** w) volatile _LIB_USB_VHCI_THROW((std::bad_alloc))
 		{
 			lock _(_lock);
 			hcd& _this(const_cast<hcd&>(*this));
-			process_urb_work* wrk(NULL);
-			for(std::deque<work*>::iterator w(_this.inbox.begin()); w < _this.inbox.end(); w++)
+			_this.pop_works(w, 1);
+			return _this.can_pop_work();
+		}
+
+		size_t hcd::next_work_batch(work** w, size_t count) volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			lock _(_lock);
+			return const_cast<hcd&>(*this).pop_works(w, count);
+		}
+
+		bool hcd::wait_for_work(int timeout) volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			timespec end;
+			if(timeout > 0)
 			{
-				process_urb_work* uw = dynamic_cast<process_urb_work*>(*w);
-				if(uw)
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				end.tv_sec += timeout / 1000;
+				end.tv_nsec += (timeout % 1000) * 1000000L;
+				if(end.tv_nsec >= 1000000000L)
 				{
-					if(uw->get_urb()->get_handle() == handle)
-					{
-						wrk = uw;
-						break;
-					}
+					end.tv_sec++;
+					end.tv_nsec -= 1000000000L;
 				}
 			}
-			if(!wrk)
+			while(true)
 			{
-				for(std::list<work*>::iterator w(_this.processing.begin()); w != _this.processing.end(); w++)
+				uint64_t val;
+				// reset the counter before checking, so that an enqueue after the check
+				// wakes us up
+				if(read(work_fd, &val, sizeof(val)) == -1 && errno != EAGAIN) return has_work();
+				if(has_work()) return true;
+				int ms(timeout);
+				if(timeout > 0)
 				{
-					process_urb_work* uw = dynamic_cast<process_urb_work*>(*w);
-					if(uw)
-					{
-						if(uw->get_urb()->get_handle() == handle)
-						{
-							wrk = uw;
-							break;
-						}
-					}
+					timespec now;
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					int64_t left((end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000);
+					if(left <= 0) return false;
+					ms = static_cast<int>(left);
 				}
-				if(wrk)
+				else if(timeout == 0) return false;
+				pollfd p;
+				p.fd = work_fd;
+				p.events = POLLIN;
+				p.revents = 0;
+				if(poll(&p, 1, ms) == -1 && errno != EINTR) return has_work();
+			}
+		}
+
+		void hcd::finish_work(work* w) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			hcd& _this(const_cast<hcd&>(*this));
+			{
+				lock _(_lock);
+				if(w->in_progress)
 				{
-					_this.canceling_work(wrk, true);
-					return true;
+					unlink_work(_this.processing, w);
+					w->in_progress = false;
 				}
+				if(w->get_type() == work_type_process_urb)
+					_this.unindex_work(static_cast<process_urb_work*>(w));
+			}
+			// w is not reachable by anyone else now, so that finishing_work (the giveback of
+			// local_hcd) doesn't need to serialize the threads which call finish_work
+			try { _this.finishing_work(w); }
+			catch(...)
+			{
+				_this.count_giveback_error(w->get_port());
+				delete w;
+				throw;
 			}
-			else
+			HCD_TRACE(hcd_finish, USB_VHCI_TRACE_HCD_FINISH, w,
+			          (w->get_type() == work_type_process_urb) ? static_cast<process_urb_work*>(w)->get_urb()->get_status() : 0);
+			_this.count_finished_work(w);
+			delete w;
+		}
+
+		bool hcd::cancel_process_urb_work(uint64_t handle) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			lock _(_lock);
+			hcd& _this(const_cast<hcd&>(*this));
+			_this.collect_works();
+			process_urb_work* wrk(_this.find_work(handle));
+			if(!wrk) return false;
+			__atomic_fetch_add(&_this.port_stats[wrk->get_port() - 1].cancels, 1, __ATOMIC_RELAXED);
+			HCD_TRACE(hcd_cancel, USB_VHCI_TRACE_HCD_CANCEL, wrk, wrk->in_progress ? 1 : 0);
+			if(wrk->in_progress)
 			{
-				wrk->cancel();
-				_this.canceling_work(wrk, false);
-				_this.finishing_work(wrk);
+				_this.canceling_work(wrk, true);
+				return true;
 			}
+			// not fetched yet: finish it right here (if finishing_work throws, next_work
+			// drops the canceled work later)
+			_this.unindex_work(wrk);
+			wrk->cancel();
+			_this.canceling_work(wrk, false);
+			_this.finishing_work(wrk);
+			unlink_work(_this.inbox, wrk);
+			delete wrk;
 			return false;
 		}
 
+		// lock-free
+		void hcd::count_finished_work(const work* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(w->get_type() != work_type_process_urb) return;
+			const usb::urb* urb(static_cast<const process_urb_work*>(w)->get_urb());
+			port_statistics& s(port_stats[w->get_port() - 1]);
+			const bool in(urb->is_in());
+			__atomic_fetch_add(&s.urbs[urb->get_type() & 3][in], 1, __ATOMIC_RELAXED);
+			if(in)
+			{
+				if(urb->get_buffer_actual() > 0)
+					__atomic_fetch_add(&s.bytes_in, static_cast<uint64_t>(urb->get_buffer_actual()), __ATOMIC_RELAXED);
+			}
+			else if(urb->get_buffer_length() > 0)
+				__atomic_fetch_add(&s.bytes_out, static_cast<uint64_t>(urb->get_buffer_length()), __ATOMIC_RELAXED);
+			const uint64_t now(latency_histogram::now());
+			s.latency.record((now > w->enqueued) ? now - w->enqueued : 0);
+		}
+
+		void hcd::count_fetch_error() _LIB_USB_VHCI_NOEXCEPT
+		{
+			__atomic_fetch_add(&fetch_errors, 1, __ATOMIC_RELAXED);
+		}
+
+		void hcd::count_fetch_data_error() _LIB_USB_VHCI_NOEXCEPT
+		{
+			__atomic_fetch_add(&fetch_data_errors, 1, __ATOMIC_RELAXED);
+		}
+
+		void hcd::count_dropped_work() _LIB_USB_VHCI_NOEXCEPT
+		{
+			__atomic_fetch_add(&dropped_works, 1, __ATOMIC_RELAXED);
+		}
+
+		void hcd::count_giveback_error(uint8_t port) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(port && port <= port_count)
+				__atomic_fetch_add(&port_stats[port - 1].giveback_errors, 1, __ATOMIC_RELAXED);
+		}
+
+		port_statistics hcd::get_port_statistics(uint8_t port) const volatile _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			// the copy constructor loads the counters atomically
+			return const_cast<const hcd&>(*this).port_stats[port - 1];
+		}
+
+		hcd_statistics hcd::get_statistics() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			hcd& _this(const_cast<hcd&>(*this));
+			hcd_statistics s;
+			s.fetch_errors = __atomic_load_n(&_this.fetch_errors, __ATOMIC_RELAXED);
+			s.fetch_data_errors = __atomic_load_n(&_this.fetch_data_errors, __ATOMIC_RELAXED);
+			s.dropped_works = __atomic_load_n(&_this.dropped_works, __ATOMIC_RELAXED);
+			s.giveback_errors = 0;
+			for(uint8_t i(0); i < _this.port_count; i++)
+				s.giveback_errors += __atomic_load_n(&_this.port_stats[i].giveback_errors, __ATOMIC_RELAXED);
+			lock _(_lock);
+			_this.collect_works();
+			s.inbox = _this.inbox.count;
+			s.processing = _this.processing.count;
+			s.inbox_max = _this.inbox.max_count;
+			s.processing_max = _this.processing.max_count;
+			return s;
+		}
+
+		void hcd::reset_statistics() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			hcd& _this(const_cast<hcd&>(*this));
+			__atomic_store_n(&_this.fetch_errors, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&_this.fetch_data_errors, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&_this.dropped_works, 0, __ATOMIC_RELAXED);
+			for(uint8_t i(0); i < _this.port_count; i++)
+				_this.port_stats[i].reset();
+			lock _(_lock);
+			_this.inbox.max_count = _this.inbox.count;
+			_this.processing.max_count = _this.processing.count;
+		}
+
 		// caller has _lock
-		void hcd::canceling_work(work* w, bool in_progress) throw(std::exception) { }
-		// caller has _lock
-		void hcd::finishing_work(work* w) throw(std::exception) { }
+		void hcd::canceling_work(work* w, bool in_progress) _LIB_USB_VHCI_THROW((std::exception)) { }
+		// caller may have _lock
+		void hcd::finishing_work(work* w) _LIB_USB_VHCI_THROW((std::exception)) { }
 
-		void hcd::add_work_enqueued_callback(callback c) volatile throw(std::bad_alloc)
+		void hcd::add_work_enqueued_callback(callback c) volatile _LIB_USB_VHCI_THROW((std::bad_alloc))
 		{
 			lock _(_lock);
 			hcd& _this(const_cast<hcd&>(*this));
 			_this.work_enqueued_callbacks.push_back(c);
 		}
 
-		void hcd::remove_work_enqueued_callback(callback c) volatile throw()
+		void hcd::remove_work_enqueued_callback(callback c) volatile _LIB_USB_VHCI_NOEXCEPT
 		{
 			lock _(_lock);
 			hcd& _this(const_cast<hcd&>(*this));
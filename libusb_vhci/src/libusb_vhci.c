@@ -34,13 +34,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include "libusb_vhci.h"
+#include "libusb_vhci_sim.h"
+#include "libusb_vhci_trace.h"
+
+// same as ioctl, but dispatches to the simulated controller, if fd belongs to one
+static inline int vhci_ioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+	if(usb_vhci_sim_active() && usb_vhci_sim_ioctl(fd, request, arg, &ret))
+		return ret;
+	return ioctl(fd, request, arg);
+}
 
 int usb_vhci_open(uint8_t port_count,  // [IN]  number of ports
                   int32_t *id,         // [OUT] controller id
@@ -53,7 +67,7 @@ int usb_vhci_open(uint8_t port_count,  // [IN]  number of ports
 
 	struct usb_vhci_ioc_register r;
 	r.port_count = port_count;
-	if(ioctl(fd, USB_VHCI_HCD_IOCREGISTER, &r) == -1)
+	if(vhci_ioctl(fd, USB_VHCI_HCD_IOCREGISTER, &r) == -1)
 	{
 		int err = errno;
 		usb_vhci_close(fd);
@@ -63,6 +77,7 @@ int usb_vhci_open(uint8_t port_count,  // [IN]  number of ports
 
 	if(id) *id = r.id;
 	if(usb_busnum) *usb_busnum = r.usb_busnum;
+	usb_vhci_capture_set_busnum(fd, r.usb_busnum);
 	if(bus_id)
 	{
 		size_t s = sizeof r.bus_id / sizeof *r.bus_id - 1;
@@ -78,50 +93,226 @@ int usb_vhci_open(uint8_t port_count,  // [IN]  number of ports
 int usb_vhci_close(int fd)
 {
 	int result;
+	usb_vhci_capture_set_busnum(fd, 0);
+	if(usb_vhci_sim_active() && usb_vhci_sim_close(fd, &result))
+		return result;
 	while((result = close(fd)) == -1 && errno == EINTR);
 	return result;
 }
 
+// sent (together with the file descriptor) in front of the state
+struct handoff_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t length;
+};
+
+#define HANDOFF_MAGIC   0x46484856 // "VHHF"
+#define HANDOFF_VERSION 1
+
+static int send_all(int sock, const void *buf, size_t length)
+{
+	while(length)
+	{
+		ssize_t r = send(sock, buf, length, MSG_NOSIGNAL);
+		if(r == -1)
+		{
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		buf = (const char *)buf + r;
+		length -= r;
+	}
+	return 0;
+}
+
+static int recv_all(int sock, void *buf, size_t length)
+{
+	while(length)
+	{
+		ssize_t r = recv(sock, buf, length, 0);
+		if(r == -1)
+		{
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(!r)
+		{
+			errno = ECONNRESET;
+			return -1;
+		}
+		buf = (char *)buf + r;
+		length -= r;
+	}
+	return 0;
+}
+
+int usb_vhci_handoff_send(int sock, int fd, const void *state, size_t length)
+{
+	struct handoff_header h;
+	struct iovec iov;
+	struct msghdr mh;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct cmsghdr *c;
+	ssize_t r;
+	if(fd == -1 || (length && !state))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&h, 0, sizeof h);
+	h.magic = HANDOFF_MAGIC;
+	h.version = HANDOFF_VERSION;
+	h.length = length;
+	iov.iov_base = &h;
+	iov.iov_len = sizeof h;
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf.buf;
+	mh.msg_controllen = sizeof cbuf.buf;
+	c = CMSG_FIRSTHDR(&mh);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	while((r = sendmsg(sock, &mh, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	if(r == -1) return -1;
+	// a stream socket may have taken only a part of the header
+	if(send_all(sock, (const char *)&h + r, sizeof h - r) == -1 ||
+	   send_all(sock, state, length) == -1)
+		return -1;
+	return 0;
+}
+
+int usb_vhci_handoff_recv(int sock, int *fd, void **state, size_t *length)
+{
+	struct handoff_header h;
+	struct iovec iov;
+	struct msghdr mh;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(4 * sizeof(int))];
+	} cbuf;
+	struct cmsghdr *c;
+	ssize_t r;
+	int rfd = -1, err;
+	void *s = NULL;
+	iov.iov_base = &h;
+	iov.iov_len = sizeof h;
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf.buf;
+	mh.msg_controllen = sizeof cbuf.buf;
+	while((r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+	if(r == -1) return -1;
+	for(c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c))
+	{
+		if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+		// only one is expected; close the others
+		size_t n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(size_t i = 0; i < n; i++)
+		{
+			int f;
+			memcpy(&f, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+			if(rfd == -1) rfd = f;
+			else close(f);
+		}
+	}
+	if(!r)
+	{
+		errno = ECONNRESET;
+		goto fail;
+	}
+	if(recv_all(sock, (char *)&h + r, sizeof h - r) == -1)
+		goto fail;
+	if(rfd == -1 || h.magic != HANDOFF_MAGIC || h.version != HANDOFF_VERSION)
+	{
+		errno = EPROTO;
+		goto fail;
+	}
+	if(h.length)
+	{
+		if(h.length > SIZE_MAX || !(s = malloc(h.length)))
+		{
+			errno = ENOMEM;
+			goto fail;
+		}
+		if(recv_all(sock, s, h.length) == -1)
+			goto fail;
+	}
+	*fd = rfd;
+	*state = s;
+	*length = h.length;
+	return 0;
+
+fail:
+	err = errno;
+	free(s);
+	if(rfd != -1) close(rfd);
+	errno = err;
+	return -1;
+}
+
 int usb_vhci_fetch_work(int fd, struct usb_vhci_work *work)
 {
 	return usb_vhci_fetch_work_timeout(fd, work, 100);
 }
 
-int usb_vhci_fetch_work_timeout(int fd, struct usb_vhci_work *work, int16_t timeout)
+// set, if the kernel doesn't know USB_VHCI_HCD_IOCFETCHWORKTS
+static volatile int fetch_work_no_ts = 0;
+
+static int fetch_work(int fd, struct usb_vhci_work *work, int16_t timeout)
 {
-	struct usb_vhci_ioc_work w;
-	w.timeout = timeout;
-	if(ioctl(fd, USB_VHCI_HCD_IOCFETCHWORK, &w) == -1)
-		return -1;
+	struct usb_vhci_ioc_work_ts wt;
+	wt.work.timeout = timeout;
+	wt.enqueue_time = 0;
+	wt.seq = 0;
+	if(fetch_work_no_ts || vhci_ioctl(fd, USB_VHCI_HCD_IOCFETCHWORKTS, &wt) == -1)
+	{
+		if(!fetch_work_no_ts && errno != ENOTTY)
+			return -1;
+		// older kernel module
+		fetch_work_no_ts = 1;
+		if(vhci_ioctl(fd, USB_VHCI_HCD_IOCFETCHWORK, &wt.work) == -1)
+			return -1;
+	}
 
-	switch(w.type)
+	switch(wt.work.type)
 	{
 	case USB_VHCI_WORK_TYPE_PORT_STAT:
 		work->type = USB_VHCI_WORK_TYPE_PORT_STAT;
-		work->work.port_stat.status = w.work.port.status;
-		work->work.port_stat.change = w.work.port.change;
-		work->work.port_stat.index  = w.work.port.index;
-		work->work.port_stat.flags  = w.work.port.flags;
+		work->work.port_stat.status = wt.work.work.port.status;
+		work->work.port_stat.change = wt.work.work.port.change;
+		work->work.port_stat.index  = wt.work.work.port.index;
+		work->work.port_stat.flags  = wt.work.work.port.flags;
 		return 0;
 
 	case USB_VHCI_WORK_TYPE_PROCESS_URB:
 		memset(&work->work.urb, 0, sizeof work->work.urb);
-		switch(w.work.urb.type)
+		switch(wt.work.work.urb.type)
 		{
 		case USB_VHCI_URB_TYPE_ISO:
-			work->work.urb.packet_count  = w.work.urb.packet_count;
+			work->work.urb.packet_count  = wt.work.work.urb.packet_count;
 		case USB_VHCI_URB_TYPE_INT:
-			work->work.urb.interval      = w.work.urb.interval;
+			work->work.urb.interval      = wt.work.work.urb.interval;
 			break;
 		case USB_VHCI_URB_TYPE_CONTROL:
-			work->work.urb.wValue        = w.work.urb.setup_packet.wValue;
-			work->work.urb.wIndex        = w.work.urb.setup_packet.wIndex;
-			work->work.urb.wLength       = w.work.urb.setup_packet.wLength;
-			work->work.urb.bmRequestType = w.work.urb.setup_packet.bmRequestType;
-			work->work.urb.bRequest      = w.work.urb.setup_packet.bRequest;
+			work->work.urb.wValue        = wt.work.work.urb.setup_packet.wValue;
+			work->work.urb.wIndex        = wt.work.work.urb.setup_packet.wIndex;
+			work->work.urb.wLength       = wt.work.work.urb.setup_packet.wLength;
+			work->work.urb.bmRequestType = wt.work.work.urb.setup_packet.bmRequestType;
+			work->work.urb.bRequest      = wt.work.work.urb.setup_packet.bRequest;
 			break;
 		case USB_VHCI_URB_TYPE_BULK:
-			work->work.urb.flags         = w.work.urb.flags &
+			work->work.urb.flags         = wt.work.work.urb.flags &
 			                               (USB_VHCI_URB_FLAGS_SHORT_NOT_OK |
 			                                USB_VHCI_URB_FLAGS_ZERO_PACKET);
 			break;
@@ -130,20 +321,22 @@ int usb_vhci_fetch_work_timeout(int fd, struct usb_vhci_work *work, int16_t time
 			return -1;
 		}
 		work->type = USB_VHCI_WORK_TYPE_PROCESS_URB;
-		work->work.urb.type          = w.work.urb.type;
+		work->work.urb.type          = wt.work.work.urb.type;
 		work->work.urb.status        = USB_VHCI_STATUS_PENDING;
-		work->work.urb.handle        = w.handle;
-		work->work.urb.buffer_length = w.work.urb.buffer_length;
-		if(usb_vhci_is_out(w.work.urb.endpoint) || usb_vhci_is_iso(work->work.urb.type))
-			work->work.urb.buffer_actual = w.work.urb.buffer_length;
-		work->work.urb.devadr        = w.work.urb.address;
-		work->work.urb.epadr         = w.work.urb.endpoint;
+		work->work.urb.handle        = wt.work.handle;
+		work->work.urb.buffer_length = wt.work.work.urb.buffer_length;
+		if(usb_vhci_is_out(wt.work.work.urb.endpoint) || usb_vhci_is_iso(work->work.urb.type))
+			work->work.urb.buffer_actual = wt.work.work.urb.buffer_length;
+		work->work.urb.devadr        = wt.work.work.urb.address;
+		work->work.urb.epadr         = wt.work.work.urb.endpoint;
+		work->work.urb.enqueue_time  = wt.enqueue_time;
+		work->work.urb.seq           = wt.seq;
 		// return 1 if usb_vhci_fetch_data should be called
 		return work->work.urb.buffer_actual || work->work.urb.packet_count;
 
 	case USB_VHCI_WORK_TYPE_CANCEL_URB:
 		work->type = USB_VHCI_WORK_TYPE_CANCEL_URB;
-		work->work.handle = w.handle;
+		work->work.handle = wt.work.handle;
 		return 0;
 
 	default:
@@ -152,6 +345,37 @@ int usb_vhci_fetch_work_timeout(int fd, struct usb_vhci_work *work, int16_t time
 	}
 }
 
+int usb_vhci_fetch_work_timeout(int fd, struct usb_vhci_work *work, int16_t timeout)
+{
+	int ret = fetch_work(fd, work, timeout);
+	if(ret == -1)
+		return -1;
+	switch(work->type)
+	{
+	case USB_VHCI_WORK_TYPE_PORT_STAT:
+		USB_VHCI_TRACE(fetch_work, USB_VHCI_TRACE_FETCH_WORK, fd, 0, work->work.port_stat.index, 0, 0,
+		               USB_VHCI_WORK_TYPE_PORT_STAT);
+		break;
+	case USB_VHCI_WORK_TYPE_PROCESS_URB:
+		USB_VHCI_TRACE(fetch_work, USB_VHCI_TRACE_FETCH_WORK, fd, work->work.urb.handle, 0, work->work.urb.epadr,
+		               work->work.urb.buffer_length, USB_VHCI_WORK_TYPE_PROCESS_URB);
+		// otherwise usb_vhci_fetch_data captures it (with the data)
+		if(!ret && USB_VHCI_CAPTURING())
+			usb_vhci_capture_submit(fd, &work->work.urb);
+		break;
+	case USB_VHCI_WORK_TYPE_CANCEL_URB:
+		USB_VHCI_TRACE(fetch_work, USB_VHCI_TRACE_FETCH_WORK, fd, work->work.handle, 0, 0, 0,
+		               USB_VHCI_WORK_TYPE_CANCEL_URB);
+		break;
+	}
+	return ret;
+}
+
+int usb_vhci_kick(int fd)
+{
+	return (vhci_ioctl(fd, USB_VHCI_HCD_IOCKICK, NULL) == -1) ? -1 : 0;
+}
+
 int usb_vhci_fetch_data(int fd, const struct usb_vhci_urb *urb)
 {
 	struct usb_vhci_ioc_urb_data u;
@@ -160,30 +384,38 @@ int usb_vhci_fetch_data(int fd, const struct usb_vhci_urb *urb)
 	const int pc    = urb->packet_count;
 	u.packet_count  = pc;
 	u.buffer        = urb->buffer;
-	u.iso_packets   = NULL;
-	if(pc > 0)
-		u.iso_packets = malloc(sizeof *u.iso_packets * pc);
+	// the descriptors of the ioctl are half as big as usb_vhci_iso_packet, so they are
+	// fetched into urb->iso_packets and converted in place (from back to front)
+	u.iso_packets   = (pc > 0) ? (struct usb_vhci_ioc_iso_packet_data *)urb->iso_packets : NULL;
 
-	int ret = ioctl(fd, USB_VHCI_HCD_IOCFETCHDATA, &u);
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCFETCHDATA, &u);
+	USB_VHCI_TRACE(fetch_data, USB_VHCI_TRACE_FETCH_DATA, fd, urb->handle, 0, urb->epadr, urb->buffer_length,
+	               (ret == -1) ? -errno : 0);
 	if(ret == -1)
-		goto err;
-	ret = 0;
-	for(int i = 0; i < pc; i++)
+		return -1;
+	for(int i = pc - 1; i >= 0; i--)
 	{
-		urb->iso_packets[i].offset = u.iso_packets[i].offset;
-		urb->iso_packets[i].packet_length = (int32_t)u.iso_packets[i].packet_length;
+		// (memcpy, because both layouts share the memory)
+		struct usb_vhci_ioc_iso_packet_data d;
+		memcpy(&d, (const char *)urb->iso_packets + i * sizeof d, sizeof d);
+		urb->iso_packets[i].offset = d.offset;
+		urb->iso_packets[i].packet_length = (int32_t)d.packet_length;
 		urb->iso_packets[i].packet_actual = 0;
 		urb->iso_packets[i].status = USB_VHCI_STATUS_PENDING;
 	}
-
-err:
-	if(u.iso_packets)
-		free(u.iso_packets);
-	return ret;
+	if(USB_VHCI_CAPTURING())
+		usb_vhci_capture_submit(fd, urb);
+	return 0;
 }
 
-int usb_vhci_giveback(int fd, const struct usb_vhci_urb *urb)
+// number of iso packets, up to which usb_vhci_giveback converts them on the stack
+#define ISO_STACK_PACKETS 128
+
+// iov is the IN data for the capture (the data has been transfered already, if
+// urb->buffer is NULL)
+static int giveback(int fd, const struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt)
 {
+	struct usb_vhci_ioc_iso_packet_giveback iso_stack[ISO_STACK_PACKETS];
 	struct usb_vhci_ioc_giveback gb;
 	gb.handle = urb->handle;
 	gb.status = usb_vhci_to_errno(urb->status, usb_vhci_is_iso(urb->type));
@@ -198,7 +430,10 @@ int usb_vhci_giveback(int fd, const struct usb_vhci_urb *urb)
 	if(usb_vhci_is_iso(urb->type))
 	{
 		const int pc = urb->packet_count;
-		gb.iso_packets = malloc(sizeof *gb.iso_packets * pc);
+		if(pc <= ISO_STACK_PACKETS)
+			gb.iso_packets = iso_stack;
+		else if(!(gb.iso_packets = malloc(sizeof *gb.iso_packets * pc)))
+			return -1;
 		gb.packet_count = pc;
 		gb.error_count = urb->error_count;
 		for(int i = 0; i < pc; i++)
@@ -208,16 +443,130 @@ int usb_vhci_giveback(int fd, const struct usb_vhci_urb *urb)
 		}
 	}
 
-	int ret = ioctl(fd, USB_VHCI_HCD_IOCGIVEBACK, &gb);
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCGIVEBACK, &gb);
+	USB_VHCI_TRACE(giveback, USB_VHCI_TRACE_GIVEBACK, fd, urb->handle, 0, urb->epadr, urb->buffer_actual, urb->status);
 
-	if(gb.iso_packets)
+	if(gb.iso_packets != iso_stack)
 		free(gb.iso_packets);
-	if(ret == -1)
-		return (errno == ECANCELED) ? 0 : -1;
-	errno = 0;
+	if(ret == -1 && errno != ECANCELED)
+		return -1;
+	if(USB_VHCI_CAPTURING())
+		usb_vhci_capture_giveback(fd, urb, iov, iovcnt);
 	return 0;
 }
 
+int usb_vhci_giveback(int fd, const struct usb_vhci_urb *urb)
+{
+	struct iovec iov;
+	iov.iov_base = urb->buffer;
+	iov.iov_len = (urb->buffer && urb->buffer_actual > 0) ? (size_t)urb->buffer_actual : 0;
+	return giveback(fd, urb, &iov, 1);
+}
+
+int usb_vhci_giveback_iov(int fd, const struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt)
+{
+	struct usb_vhci_urb u = *urb;
+	int32_t offset = 0;
+
+	if(!usb_vhci_is_in(urb->epadr) || iovcnt < 0 || (iovcnt && !iov))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	u.buffer = NULL;
+	u.buffer_actual = 0;
+	if(iovcnt == 1)
+	{
+		// single chunk: no extra ioctl
+		u.buffer = iov[0].iov_base;
+		u.buffer_actual = (int32_t)iov[0].iov_len;
+		return giveback(fd, &u, iov, 1);
+	}
+
+	// the chunks are copied into the transfer buffer one by one; usb_vhci_giveback
+	// completes the urb without copying them again
+	for(int i = 0; i < iovcnt; i++)
+	{
+		if(!iov[i].iov_len)
+			continue;
+		if(usb_vhci_giveback_part(fd, urb->handle, iov[i].iov_base, offset, (int32_t)iov[i].iov_len) == -1)
+		{
+			// the urb still has to be given back
+			if(errno == ECANCELED)
+				break;
+			// the chunk did not fit (or was refused): complete the urb with what was
+			// copied so far, so that it does not hang
+			const int err = errno;
+			u.status = USB_VHCI_STATUS_ERROR;
+			u.buffer_actual = offset;
+			giveback(fd, &u, iov, i);
+			errno = err;
+			return -1;
+		}
+		offset += (int32_t)iov[i].iov_len;
+	}
+	u.buffer_actual = offset;
+	return giveback(fd, &u, iov, iovcnt);
+}
+
+int usb_vhci_fetch_data_part(int fd, uint64_t handle, void *buffer, int32_t offset, int32_t length)
+{
+	struct usb_vhci_ioc_data_part p;
+	p.handle   = handle;
+	p.buffer   = buffer;
+	p.offset   = offset;
+	p.length   = length;
+	p.reserved = 0;
+	return (vhci_ioctl(fd, USB_VHCI_HCD_IOCFETCHDATAPART, &p) == -1) ? -1 : 0;
+}
+
+int usb_vhci_giveback_part(int fd, uint64_t handle, const void *buffer, int32_t offset, int32_t length)
+{
+	struct usb_vhci_ioc_data_part p;
+	p.handle   = handle;
+	p.buffer   = (void *)buffer;
+	p.offset   = offset;
+	p.length   = length;
+	p.reserved = 0;
+	return (vhci_ioctl(fd, USB_VHCI_HCD_IOCGIVEBACKPART, &p) == -1) ? -1 : 0;
+}
+
+int usb_vhci_responder_add(int fd, uint8_t port, const struct usb_vhci_responder *rule)
+{
+	if(!port || !rule ||
+	   (rule->status != USB_VHCI_STATUS_SUCCESS && rule->status != USB_VHCI_STATUS_STALL) ||
+	   rule->data_length > USB_VHCI_RESPONDER_MAX_DATA ||
+	   (rule->data_length && !rule->data))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	struct usb_vhci_ioc_responder r;
+	r.setup_packet.bmRequestType = rule->bmRequestType;
+	r.setup_packet.bRequest      = rule->bRequest;
+	r.setup_packet.wValue        = rule->wValue;
+	r.setup_packet.wIndex        = rule->wIndex;
+	r.setup_packet.wLength       = 0;
+	r.status      = usb_vhci_to_errno(rule->status, 0);
+	r.count       = rule->count;
+	r.data_length = rule->data_length;
+	r.index       = port;
+	r.op          = USB_VHCI_RESPONDER_OP_ADD;
+	if(rule->data_length)
+		memcpy(r.data, rule->data, rule->data_length);
+	return (vhci_ioctl(fd, USB_VHCI_HCD_IOCRESPONDER, &r) == -1) ? -1 : 0;
+}
+
+int usb_vhci_responder_clear(int fd, uint8_t port)
+{
+	struct usb_vhci_ioc_responder r;
+	memset(&r, 0, offsetof(struct usb_vhci_ioc_responder, data));
+	r.index = port;
+	r.op    = USB_VHCI_RESPONDER_OP_CLEAR;
+	return (vhci_ioctl(fd, USB_VHCI_HCD_IOCRESPONDER, &r) == -1) ? -1 : 0;
+}
+
 int usb_vhci_port_connect(int fd, uint8_t port, uint8_t data_rate)
 {
 	if(!port ||
@@ -237,9 +586,9 @@ int usb_vhci_port_connect(int fd, uint8_t port, uint8_t data_rate)
 	ps.change = USB_PORT_STAT_C_CONNECTION;
 	ps.index = port;
 	ps.flags = 0;
-	if(ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
-		return -1;
-	return 0;
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps);
+	USB_VHCI_TRACE(port_connect, USB_VHCI_TRACE_PORT_CONNECT, fd, 0, port, 0, 0, (ret == -1) ? -errno : data_rate);
+	return (ret == -1) ? -1 : 0;
 }
 
 int usb_vhci_port_disconnect(int fd, uint8_t port)
@@ -254,9 +603,9 @@ int usb_vhci_port_disconnect(int fd, uint8_t port)
 	ps.change = USB_PORT_STAT_C_CONNECTION;
 	ps.index = port;
 	ps.flags = 0;
-	if(ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
-		return -1;
-	return 0;
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps);
+	USB_VHCI_TRACE(port_disconnect, USB_VHCI_TRACE_PORT_DISCONNECT, fd, 0, port, 0, 0, (ret == -1) ? -errno : 0);
+	return (ret == -1) ? -1 : 0;
 }
 
 int usb_vhci_port_disable(int fd, uint8_t port)
@@ -271,9 +620,9 @@ int usb_vhci_port_disable(int fd, uint8_t port)
 	ps.change = USB_PORT_STAT_C_ENABLE;
 	ps.index = port;
 	ps.flags = 0;
-	if(ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
-		return -1;
-	return 0;
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps);
+	USB_VHCI_TRACE(port_disable, USB_VHCI_TRACE_PORT_DISABLE, fd, 0, port, 0, 0, (ret == -1) ? -errno : 0);
+	return (ret == -1) ? -1 : 0;
 }
 
 int usb_vhci_port_resumed(int fd, uint8_t port)
@@ -288,9 +637,9 @@ int usb_vhci_port_resumed(int fd, uint8_t port)
 	ps.change = USB_PORT_STAT_C_SUSPEND;
 	ps.index = port;
 	ps.flags = 0;
-	if(ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
-		return -1;
-	return 0;
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps);
+	USB_VHCI_TRACE(port_resumed, USB_VHCI_TRACE_PORT_RESUMED, fd, 0, port, 0, 0, (ret == -1) ? -errno : 0);
+	return (ret == -1) ? -1 : 0;
 }
 
 int usb_vhci_port_overcurrent(int fd, uint8_t port, uint8_t set)
@@ -305,9 +654,9 @@ int usb_vhci_port_overcurrent(int fd, uint8_t port, uint8_t set)
 	ps.change = USB_PORT_STAT_C_OVERCURRENT;
 	ps.index = port;
 	ps.flags = 0;
-	if(ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
-		return -1;
-	return 0;
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps);
+	USB_VHCI_TRACE(port_overcurrent, USB_VHCI_TRACE_PORT_OVERCURRENT, fd, 0, port, 0, 0, (ret == -1) ? -errno : set);
+	return (ret == -1) ? -1 : 0;
 }
 
 int usb_vhci_port_reset_done(int fd, uint8_t port, uint8_t enable)
@@ -323,9 +672,40 @@ int usb_vhci_port_reset_done(int fd, uint8_t port, uint8_t enable)
 	ps.change |= enable ? 0 : USB_PORT_STAT_C_ENABLE;
 	ps.index = port;
 	ps.flags = 0;
-	if(ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
-		return -1;
-	return 0;
+	int ret = vhci_ioctl(fd, USB_VHCI_HCD_IOCPORTSTAT, &ps);
+	USB_VHCI_TRACE(port_reset_done, USB_VHCI_TRACE_PORT_RESET_DONE, fd, 0, port, 0, 0, (ret == -1) ? -errno : enable);
+	return (ret == -1) ? -1 : 0;
+}
+
+usb_vhci_trace_func usb_vhci_trace_callback = NULL;
+static void *trace_arg = NULL;
+
+void usb_vhci_set_trace(usb_vhci_trace_func func, void *arg)
+{
+	__atomic_store_n(&trace_arg, arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&usb_vhci_trace_callback, func, __ATOMIC_RELEASE);
+}
+
+void usb_vhci_trace_emit(int point, int fd, uint64_t handle, uint8_t port, uint8_t epadr, int32_t length, int32_t status)
+{
+	usb_vhci_trace_func func = __atomic_load_n(&usb_vhci_trace_callback, __ATOMIC_ACQUIRE);
+	if(!func)
+		return;
+	// the trace point may be between a failing call and the check of errno
+	int err = errno;
+	struct timespec ts;
+	struct usb_vhci_trace_event ev;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev.point  = point;
+	ev.fd     = fd;
+	ev.handle = handle;
+	ev.port   = port;
+	ev.epadr  = epadr;
+	ev.length = length;
+	ev.status = status;
+	ev.time   = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+	func(__atomic_load_n(&trace_arg, __ATOMIC_RELAXED), &ev);
+	errno = err;
 }
 
 uint8_t usb_vhci_port_stat_triggers(const struct usb_vhci_port_stat *stat,
@@ -371,9 +751,9 @@ int usb_vhci_to_errno(int32_t status, uint8_t iso_urb)
 	}
 }
 
-int32_t usb_vhci_from_errno(int errno, uint8_t iso_urb)
+int32_t usb_vhci_from_errno(int err, uint8_t iso_urb)
 {
-	switch(errno)
+	switch(err)
 	{
 	case 0:            return USB_VHCI_STATUS_SUCCESS;
 	case -EINPROGRESS: return USB_VHCI_STATUS_PENDING;
@@ -401,8 +781,8 @@ int usb_vhci_to_iso_packets_errno(int32_t status)
 	return usb_vhci_to_errno(status, 0);
 }
 
-int32_t usb_vhci_from_iso_packets_errno(int errno)
+int32_t usb_vhci_from_iso_packets_errno(int err)
 {
-	return usb_vhci_from_errno(errno, 0);
+	return usb_vhci_from_errno(err, 0);
 }
 
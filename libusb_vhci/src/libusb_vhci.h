@@ -32,16 +32,32 @@
 #define _LIBUSB_VHCI_H 1
 
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 #include <errno.h>
+#include <stdio.h>
 #include <string>
 #include <exception>
 #include <stdexcept>
 #include <vector>
 #include <list>
+#include <deque>
 #include <queue>
+
+// Dynamic exception specifications are ill-formed since C++17. For older standards
+// they are kept as they were; since C++11 only "throws nothing" (noexcept) or
+// "may throw" (noexcept(false)) is left of them. The parameter of
+// _LIB_USB_VHCI_THROW is a parenthesized list of exception types.
+#if __cplusplus >= 201103L
+#define _LIB_USB_VHCI_NOEXCEPT noexcept
+#define _LIB_USB_VHCI_THROW(x) noexcept(false)
+#else
+#define _LIB_USB_VHCI_NOEXCEPT throw()
+#define _LIB_USB_VHCI_THROW(x) throw x
+#endif
 #endif
 
 #include <linux/usb-vhci.h>
@@ -53,7 +69,7 @@
 #endif
 #ifdef __cplusplus
 extern "C" {
-#define _LIB_USB_VHCI_NOTHROW throw()
+#define _LIB_USB_VHCI_NOTHROW _LIB_USB_VHCI_NOEXCEPT
 #else
 #define _LIB_USB_VHCI_NOTHROW
 #endif
@@ -95,6 +111,10 @@ struct usb_vhci_urb
 	uint8_t bmRequestType, bRequest;
 	uint8_t devadr, epadr;
 	uint8_t type;
+	uint64_t enqueue_time; // time (CLOCK_MONOTONIC, in ns) at which the kernel
+	                       // received the urb (0, if the kernel doesn't tell)
+	uint64_t seq;          // sequence number which was assigned by the kernel
+	                       // (0, if the kernel doesn't tell)
 };
 
 struct usb_vhci_port_stat
@@ -115,10 +135,39 @@ struct usb_vhci_port_stat
 #define USB_VHCI_PORT_STAT_C_RESET       0x0010
 	uint8_t index, flags;
 };
+// features for usb_vhci_sim_port_feature (same as wValue of the Set/ClearPortFeature
+// hub class requests)
+#define USB_VHCI_PORT_FEAT_CONNECTION     0
+#define USB_VHCI_PORT_FEAT_ENABLE         1
+#define USB_VHCI_PORT_FEAT_SUSPEND        2
+#define USB_VHCI_PORT_FEAT_OVER_CURRENT   3
+#define USB_VHCI_PORT_FEAT_RESET          4
+#define USB_VHCI_PORT_FEAT_POWER          8
+#define USB_VHCI_PORT_FEAT_LOWSPEED       9
+#define USB_VHCI_PORT_FEAT_HIGHSPEED      10
+#define USB_VHCI_PORT_FEAT_C_CONNECTION   16
+#define USB_VHCI_PORT_FEAT_C_ENABLE       17
+#define USB_VHCI_PORT_FEAT_C_SUSPEND      18
+#define USB_VHCI_PORT_FEAT_C_OVER_CURRENT 19
+#define USB_VHCI_PORT_FEAT_C_RESET        20
+#define USB_VHCI_PORT_FEAT_INDICATOR      22
 #define USB_VHCI_DATA_RATE_FULL 0
 #define USB_VHCI_DATA_RATE_LOW  1
 #define USB_VHCI_DATA_RATE_HIGH 2
 
+// rule for the in-kernel responder: control urbs for the device on the given port which
+// match bmRequestType, bRequest, wValue and wIndex are completed by the kernel without
+// passing them to user space
+struct usb_vhci_responder
+{
+	const uint8_t *data;   // data stage (only for IN requests with status SUCCESS)
+	uint32_t count;        // number of times the rule applies (0 means unlimited)
+	int32_t status;        // USB_VHCI_STATUS_SUCCESS or USB_VHCI_STATUS_STALL
+	uint16_t wValue, wIndex;
+	uint16_t data_length;  // max. USB_VHCI_RESPONDER_MAX_DATA bytes
+	uint8_t bmRequestType, bRequest;
+};
+
 struct usb_vhci_work
 {
 	union
@@ -138,8 +187,27 @@ int usb_vhci_open(uint8_t port_count,
 int usb_vhci_close(int fd) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_fetch_work(int fd, struct usb_vhci_work *work) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_fetch_work_timeout(int fd, struct usb_vhci_work *work, int16_t timeout) _LIB_USB_VHCI_NOTHROW;
+// wakes up a thread which waits in usb_vhci_fetch_work_timeout (which fails with EINTR
+// then); if no thread waits, the next fetch which would wait returns immediately
+// (fails with ENOTTY if the kernel module is too old)
+int usb_vhci_kick(int fd) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_fetch_data(int fd, const struct usb_vhci_urb *urb) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_giveback(int fd, const struct usb_vhci_urb *urb) _LIB_USB_VHCI_NOTHROW;
+// gives back an IN urb, whose data is taken from iov instead of urb->buffer: the kernel
+// copies it straight from there into the transfer buffer; buffer_actual is the sum of
+// the lengths of iov (urb->buffer_actual is ignored); if a chunk can not be copied (e.g.
+// ENOBUFS, if iov holds more than buffer_length bytes), then the urb is completed with
+// USB_VHCI_STATUS_ERROR and the bytes copied before, and -1 is returned anyway
+int usb_vhci_giveback_iov(int fd, const struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt) _LIB_USB_VHCI_NOTHROW;
+
+// for streaming the data stage of large urbs in chunks: usb_vhci_fetch_data_part copies
+// length bytes (starting at offset) of the data of an OUT urb into buffer;
+// usb_vhci_giveback_part copies length bytes of IN data into the urb without completing
+// it; the chunks have to follow each other without holes (EINVAL otherwise). If all IN
+// data was transfered this way, then urb->buffer may be NULL when calling
+// usb_vhci_giveback.
+int usb_vhci_fetch_data_part(int fd, uint64_t handle, void *buffer, int32_t offset, int32_t length) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_giveback_part(int fd, uint64_t handle, const void *buffer, int32_t offset, int32_t length) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_port_connect(int fd, uint8_t port, uint8_t data_rate) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_port_disconnect(int fd, uint8_t port) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_port_disable(int fd, uint8_t port) _LIB_USB_VHCI_NOTHROW;
@@ -147,15 +215,218 @@ int usb_vhci_port_resumed(int fd, uint8_t port) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_port_overcurrent(int fd, uint8_t port, uint8_t set) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_port_reset_done(int fd, uint8_t port, uint8_t enable) _LIB_USB_VHCI_NOTHROW;
 
+// for answering simple control requests within the kernel; rules are tried in the order
+// in which they were added, and all rules of a port are removed when a device gets
+// connected to or disconnected from it (port 0 clears the rules of all ports)
+int usb_vhci_responder_add(int fd, uint8_t port, const struct usb_vhci_responder *rule) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_responder_clear(int fd, uint8_t port) _LIB_USB_VHCI_NOTHROW;
+
+// for restarting a device server without disconnecting its devices: closing the file
+// descriptor removes the controller, so the old process passes it on to the new one
+// (as SCM_RIGHTS over a connected unix stream socket) together with state, which is
+// opaque to these functions (e.g. from usb::vhci::local_hcd::detach). The controller
+// stays as long as either process has the file descriptor open. usb_vhci_handoff_recv
+// allocates *state (free it with free; NULL if length is 0). Simulated controllers can't
+// leave their process.
+int usb_vhci_handoff_send(int sock, int fd, const void *state, size_t length) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_handoff_recv(int sock, int *fd, void **state, size_t *length) _LIB_USB_VHCI_NOTHROW;
+
+// Simulated controller, which doesn't need the kernel modules: usb_vhci_sim_open returns
+// a file descriptor which works with all functions above (except usb_vhci_responder_*).
+// The host side (usbcore and the hub driver) is played by the usb_vhci_sim_* functions.
+// Unless USB_VHCI_SIM_FLAG_NO_HUB is given, all ports are powered on, and status changes
+// are acknowledged (and newly connected devices get reset) like the hub driver does.
+// The file descriptor is readable as long as there is work to fetch. (If the library was
+// built without the simulated controller, then usb_vhci_sim_open fails with ENOSYS.)
+#define USB_VHCI_SIM_FLAG_NO_HUB 0x00000001
+int usb_vhci_sim_open(uint8_t port_count,
+                      uint32_t flags,
+                      int32_t *id,
+                      int32_t *usb_busnum,
+                      char    **bus_id) _LIB_USB_VHCI_NOTHROW;
+// submits an urb like a device driver does: handle, type, devadr, epadr, flags, interval,
+// buffer_length, packet_count and the setup packet are taken from urb; buffer (OUT data or
+// room for IN data) and iso_packets have to stay valid until the urb is reaped
+int usb_vhci_sim_submit(int fd, const struct usb_vhci_urb *urb) _LIB_USB_VHCI_NOTHROW;
+// returns 0 if the urb was canceled immediately, or 1 if the device has to acknowledge the
+// cancelation first; the urb has to be reaped in both cases
+int usb_vhci_sim_unlink(int fd, uint64_t handle) _LIB_USB_VHCI_NOTHROW;
+// returns the next completed urb (the submitted urb with status, buffer_actual, error_count
+// and the results of the iso packets); timeout in milliseconds (-1 waits forever)
+int usb_vhci_sim_reap(int fd, struct usb_vhci_urb *urb, int16_t timeout) _LIB_USB_VHCI_NOTHROW;
+// SetPortFeature (set != 0) or ClearPortFeature request of the hub driver
+int usb_vhci_sim_port_feature(int fd, uint8_t port, uint8_t set, uint16_t feature) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_sim_get_port_stat(int fd, uint8_t port, struct usb_vhci_port_stat *stat) _LIB_USB_VHCI_NOTHROW;
+
+// Context for device servers written in C: owns the file descriptor and the buffers of
+// the urbs which are fetched through it. The buffers are cached per size class and reused,
+// so that a context which is busy doesn't allocate per urb. Fetching and giving back may
+// happen in different threads.
+struct usb_vhci_ctx;
+
+// memory hooks of a context (e.g. for arenas); free gets the size which was passed to
+// alloc; a NULL allocator means malloc and free
+struct usb_vhci_allocator
+{
+	void *(*alloc)(void *arg, size_t size); // returns NULL if out of memory
+	void (*free)(void *arg, void *ptr, size_t size);
+	void *arg;
+};
+
+struct usb_vhci_ctx_stats
+{
+	uint64_t urbs;          // fetched urbs
+	uint64_t bytes_out;     // data fetched from OUT urbs
+	uint64_t bytes_in;      // data given back with IN urbs
+	uint64_t buffer_allocs; // buffers which had to be allocated
+	uint64_t buffer_reuses; // buffers which were taken from the cache
+};
+
+struct usb_vhci_ctx *usb_vhci_ctx_open(uint8_t port_count,
+                                       const struct usb_vhci_allocator *allocator,
+                                       int32_t *id,
+                                       int32_t *usb_busnum,
+                                       char    **bus_id) _LIB_USB_VHCI_NOTHROW;
+// takes over fd (from usb_vhci_open or usb_vhci_sim_open); it is closed by
+// usb_vhci_ctx_close
+struct usb_vhci_ctx *usb_vhci_ctx_attach(int fd, const struct usb_vhci_allocator *allocator) _LIB_USB_VHCI_NOTHROW;
+// urbs which were not given back or released must not be used anymore
+int usb_vhci_ctx_close(struct usb_vhci_ctx *ctx) _LIB_USB_VHCI_NOTHROW;
+// like usb_vhci_ctx_close, but returns the file descriptor instead of closing it (for
+// usb_vhci_handoff_send); give back all urbs first
+int usb_vhci_ctx_detach(struct usb_vhci_ctx *ctx) _LIB_USB_VHCI_NOTHROW;
+// for poll and for the functions above which take a file descriptor
+int usb_vhci_ctx_get_fd(const struct usb_vhci_ctx *ctx) _LIB_USB_VHCI_NOTHROW;
+// like usb_vhci_fetch_work_timeout, but the data of an urb is fetched, too: buffer has
+// room for buffer_length bytes (OUT data is filled in) and iso_packets for packet_count
+// packets. Both belong to the context (don't change the pointers) until the urb is given
+// back with usb_vhci_ctx_giveback or dropped with usb_vhci_ctx_release. Returns 0 or -1;
+// errno is ECANCELED if an urb was canceled while its data was fetched (nothing to do)
+// and ENOMEM if there was no memory for the urb (it has been given back with
+// USB_VHCI_STATUS_ERROR already)
+int usb_vhci_ctx_fetch_work(struct usb_vhci_ctx *ctx, struct usb_vhci_work *work, int16_t timeout) _LIB_USB_VHCI_NOTHROW;
+// gives back and releases the urb
+int usb_vhci_ctx_giveback(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb) _LIB_USB_VHCI_NOTHROW;
+// like usb_vhci_ctx_giveback, but the IN data is taken from iov (see usb_vhci_giveback_iov)
+int usb_vhci_ctx_giveback_iov(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt) _LIB_USB_VHCI_NOTHROW;
+// returns the buffers of an urb which will not be given back (sets them to NULL)
+void usb_vhci_ctx_release(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_ctx_port_connect(struct usb_vhci_ctx *ctx, uint8_t port, uint8_t data_rate) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_ctx_port_disconnect(struct usb_vhci_ctx *ctx, uint8_t port) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_ctx_port_disable(struct usb_vhci_ctx *ctx, uint8_t port) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_ctx_port_resumed(struct usb_vhci_ctx *ctx, uint8_t port) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_ctx_port_overcurrent(struct usb_vhci_ctx *ctx, uint8_t port, uint8_t set) _LIB_USB_VHCI_NOTHROW;
+int usb_vhci_ctx_port_reset_done(struct usb_vhci_ctx *ctx, uint8_t port, uint8_t enable) _LIB_USB_VHCI_NOTHROW;
+void usb_vhci_ctx_get_stats(struct usb_vhci_ctx *ctx, struct usb_vhci_ctx_stats *stats) _LIB_USB_VHCI_NOTHROW;
+
+// Trace points of the fetch -> process -> giveback pipeline. Each one is also a USDT
+// probe of provider libusb_vhci (named like the constant in lower case, e.g.
+// usdt:libusb_vhci.so:libusb_vhci:giveback) with the fields of usb_vhci_trace_event
+// from fd to status as arguments, if the library was built with sys/sdt.h.
+//   FETCH_WORK    a work was fetched; status is its USB_VHCI_WORK_TYPE_*, port is set
+//                 for port stat works, handle, epadr and length (buffer_length) for urbs
+//   FETCH_DATA    status is 0 or -errno; length is buffer_length
+//   GIVEBACK      status is the USB_VHCI_STATUS_* of the urb; length is buffer_actual
+//   PORT_*        a port operation; status is its argument (data rate, set, enable)
+//                 or -errno, if it failed
+//   HCD_ENQUEUE   hcd got a work (from the controller); status is its work type
+//   HCD_NEXT      next_work/next_work_batch handed out a work; status is its work type
+//   HCD_FINISH    finish_work; status is the USB_VHCI_STATUS_* of urbs
+//   HCD_CANCEL    an urb of an hcd gets canceled; status is 1, if it is in progress
+// The HCD_* points belong to the C++ classes (fd is -1 there).
+#define USB_VHCI_TRACE_FETCH_WORK       0
+#define USB_VHCI_TRACE_FETCH_DATA       1
+#define USB_VHCI_TRACE_GIVEBACK         2
+#define USB_VHCI_TRACE_PORT_CONNECT     3
+#define USB_VHCI_TRACE_PORT_DISCONNECT  4
+#define USB_VHCI_TRACE_PORT_DISABLE     5
+#define USB_VHCI_TRACE_PORT_RESUMED     6
+#define USB_VHCI_TRACE_PORT_OVERCURRENT 7
+#define USB_VHCI_TRACE_PORT_RESET_DONE  8
+#define USB_VHCI_TRACE_HCD_ENQUEUE      9
+#define USB_VHCI_TRACE_HCD_NEXT         10
+#define USB_VHCI_TRACE_HCD_FINISH       11
+#define USB_VHCI_TRACE_HCD_CANCEL       12
+
+struct usb_vhci_trace_event
+{
+	int point;       // USB_VHCI_TRACE_*
+	int fd;
+	uint64_t handle; // of the urb (0 for port stat works and port operations)
+	uint8_t port;    // 0 if unknown
+	uint8_t epadr;
+	int32_t length;
+	int32_t status;
+	uint64_t time;   // CLOCK_MONOTONIC in nanoseconds
+};
+
+typedef void (*usb_vhci_trace_func)(void *arg, const struct usb_vhci_trace_event *event);
+
+// registers the callback for the trace points of all controllers (NULL removes it); it is
+// called on the thread which passes the trace point and should return quickly. Changing
+// the callback isn't synchronized with threads which pass trace points right then, so
+// arg should stay valid for a while after it was replaced.
+void usb_vhci_set_trace(usb_vhci_trace_func func, void *arg) _LIB_USB_VHCI_NOTHROW;
+
+// Captures the urbs of all controllers of the process into a pcap file with the link
+// type of usbmon (LINKTYPE_USB_LINUX_MMAPPED), which Wireshark and tcpdump can read: a
+// submission record when an urb was fetched (with its OUT data, so for urbs with data
+// after usb_vhci_fetch_data) and a completion record when it is given back (with its IN
+// data). busnum of the records is the usb bus number of the controller (0 for simulated
+// controllers and for file descriptors which were not opened by usb_vhci_open). The
+// fetching and giving back threads only copy the records into rings of their own, from
+// which a writer thread writes them; a thread whose ring is full waits for the writer
+// (100 ms at most), and drops the record only then. snaplen limits the data per record
+// (0: 256 KiB, which is also the maximum).
+struct usb_vhci_capture_stats
+{
+	uint64_t records; // written
+	uint64_t dropped; // because a ring was full
+	uint64_t bytes;   // written (without the file header)
+};
+
+// fails with EBUSY if a capture is running already
+int usb_vhci_capture_start(const char *path, uint32_t snaplen) _LIB_USB_VHCI_NOTHROW;
+// writes what is left and closes the file; stats may be NULL
+int usb_vhci_capture_stop(struct usb_vhci_capture_stats *stats) _LIB_USB_VHCI_NOTHROW;
+
+// Execution policy for the threads which fetch and process works (against the jitter of
+// being scheduled behind other work). Real-time priorities need CAP_SYS_NICE (or
+// RLIMIT_RTPRIO), mlockall needs CAP_IPC_LOCK (or RLIMIT_MEMLOCK); without them the
+// functions fail with EPERM and leave the thread as it was.
+#define USB_VHCI_THREAD_MLOCKALL 0x00000001 // mlockall(MCL_CURRENT | MCL_FUTURE) for the process
+
+struct usb_vhci_thread_policy
+{
+	int sched_policy;      // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+	int sched_priority;    // for SCHED_FIFO and SCHED_RR (0 for SCHED_OTHER)
+	const void *cpu_set;   // cpu_set_t of the CPUs to run on; NULL: no affinity
+	size_t cpu_set_size;   // in bytes (sizeof(cpu_set_t) or CPU_ALLOC_SIZE)
+	size_t stack_size;     // of created threads; 0: default
+	size_t prefault_size;  // of the stack which gets touched when a thread starts
+	uint32_t flags;        // USB_VHCI_THREAD_*
+};
+
+// for threads which are created with attr (which has to be initialized); the new thread
+// should call usb_vhci_thread_prefault(policy->prefault_size) first
+int usb_vhci_thread_policy_init_attr(const struct usb_vhci_thread_policy *policy, pthread_attr_t *attr) _LIB_USB_VHCI_NOTHROW;
+// applies the policy to the calling thread (and mlockall to the process)
+int usb_vhci_thread_policy_apply(const struct usb_vhci_thread_policy *policy) _LIB_USB_VHCI_NOTHROW;
+// touches size bytes of the stack below the caller (at most what the stack has left), so
+// that they don't fault later
+void usb_vhci_thread_prefault(size_t size) _LIB_USB_VHCI_NOTHROW;
+// like usb_vhci_thread_policy_apply; for the thread which fetches the works of ctx
+int usb_vhci_ctx_set_thread_policy(struct usb_vhci_ctx *ctx, const struct usb_vhci_thread_policy *policy) _LIB_USB_VHCI_NOTHROW;
+
 // helper function for detecting relevant port stat changes issued by the kernel
 uint8_t usb_vhci_port_stat_triggers(const struct usb_vhci_port_stat *stat,
                                     const struct usb_vhci_port_stat *prev) _LIB_USB_VHCI_NOTHROW;
 
 // for converting status codes
 int usb_vhci_to_errno(int32_t status, uint8_t iso_urb) _LIB_USB_VHCI_NOTHROW;
-int32_t usb_vhci_from_errno(int errno, uint8_t iso_urb) _LIB_USB_VHCI_NOTHROW;
+int32_t usb_vhci_from_errno(int err, uint8_t iso_urb) _LIB_USB_VHCI_NOTHROW;
 int usb_vhci_to_iso_packets_errno(int32_t status) _LIB_USB_VHCI_NOTHROW;
-int32_t usb_vhci_from_iso_packets_errno(int errno) _LIB_USB_VHCI_NOTHROW;
+int32_t usb_vhci_from_iso_packets_errno(int err) _LIB_USB_VHCI_NOTHROW;
 
 #ifdef __cplusplus
 } // extern "C"
@@ -205,16 +476,28 @@ namespace usb
 		data_rate_high = USB_VHCI_DATA_RATE_HIGH
 	};
 
+	namespace vhci
+	{
+		class urb_pool;
+	}
+
 	class urb
 	{
 	private:
 		usb_vhci_urb _urb;
+		bool _own; // false, if buffer and iso_packets belong to a block of a vhci::urb_pool
+		// IN data which is given back instead of the buffer (see set_in_data)
+		const iovec* _in_iov; // NULL: _in_one
+		int _in_iovcnt;
+		mutable iovec _in_one; // iov_len is taken from buffer_actual by get_in_data
 
-		void _cpy(const usb_vhci_urb& u) throw(std::bad_alloc);
-		void _chk() throw(std::invalid_argument);
+		void _cpy(const usb_vhci_urb& u) _LIB_USB_VHCI_THROW((std::bad_alloc));
+		void _chk() _LIB_USB_VHCI_THROW((std::invalid_argument));
+
+		friend class vhci::urb_pool;
 
 	public:
-		urb(const urb&) throw(std::bad_alloc);
+		urb(const urb&) _LIB_USB_VHCI_THROW((std::bad_alloc));
 		urb(uint64_t handle,
 		    urb_type type,
 		    int32_t buffer_length,
@@ -234,54 +517,107 @@ namespace usb
 		    uint8_t bRequest,
 		    uint16_t wValue,
 		    uint16_t wIndex,
-		    uint16_t wLength) throw(std::invalid_argument, std::bad_alloc);
-		urb(const usb_vhci_urb& urb) throw(std::invalid_argument, std::bad_alloc);
-		urb(const usb_vhci_urb& urb, bool own) throw(std::invalid_argument, std::bad_alloc);
-		virtual ~urb() throw();
-		urb& operator=(const urb&) throw(std::bad_alloc);
-
-		const usb_vhci_urb* get_internal() const throw() { return &_urb; }
-		uint64_t get_handle() const throw() { return _urb.handle; }
-		uint8_t* get_buffer() const throw() { return _urb.buffer; }
-		uint32_t get_iso_packet_offset(int32_t index) const throw() { return _urb.iso_packets[index].offset; }
-		int32_t get_iso_packet_length(int32_t index) const throw() { return _urb.iso_packets[index].packet_length; }
-		int32_t get_iso_packet_actual(int32_t index) const throw() { return _urb.iso_packets[index].packet_actual; }
-		int32_t get_iso_packet_status(int32_t index) const throw() { return _urb.iso_packets[index].status; }
-		uint8_t* get_iso_packet_buffer(int32_t index) const throw() { return _urb.buffer + _urb.iso_packets[index].offset; }
-		int32_t get_buffer_length() const throw() { return _urb.buffer_length; }
-		int32_t get_buffer_actual() const throw() { return _urb.buffer_actual; }
-		int32_t get_iso_packet_count() const throw() { return _urb.packet_count; }
-		int32_t get_iso_error_count() const throw() { return _urb.error_count; }
-		int32_t get_status() const throw() { return _urb.status; }
-		int32_t get_interval() const throw() { return _urb.interval; }
-		uint16_t get_flags() const throw() { return _urb.flags; }
-		uint16_t get_wValue() const throw() { return _urb.wValue; }
-		uint16_t get_wIndex() const throw() { return _urb.wIndex; }
-		uint16_t get_wLength() const throw() { return _urb.wLength; }
-		uint8_t get_bmRequestType() const throw() { return _urb.bmRequestType; }
-		uint8_t get_bRequest() const throw() { return _urb.bRequest; }
-		uint8_t get_device_address() const throw() { return _urb.devadr; }
-		uint8_t get_endpoint_address() const throw() { return _urb.epadr; }
-		uint8_t get_endpoint_number() const throw() { return _urb.epadr & 0x07; }
-		urb_type get_type() const throw() { return static_cast<urb_type>(_urb.type); }
-		bool is_in() const throw() { return _urb.epadr & 0x80; }
-		bool is_out() const throw() { return !is_in(); }
-		bool is_isochronous() const throw() { return get_type() == urb_type_isochronous; }
-		bool is_interrupt() const throw() { return get_type() == urb_type_interrupt; }
-		bool is_control() const throw() { return get_type() == urb_type_control; }
-		bool is_bulk() const throw() { return get_type() == urb_type_bulk; }
-		void set_status(int32_t value) throw() { _urb.status = value; }
-		void ack() throw() { set_status(USB_VHCI_STATUS_SUCCESS); }
-		void stall() throw() { set_status(USB_VHCI_STATUS_STALL); }
-		void set_buffer_actual(int32_t value) throw() { _urb.buffer_actual = value; }
-		void set_iso_error_count(int32_t value) throw() { _urb.error_count = value; }
-		void set_iso_status(int32_t index, int32_t value) throw() { _urb.iso_packets[index].status = value; }
-		void ack_iso(int32_t index) throw() { set_iso_status(index, USB_VHCI_STATUS_SUCCESS); }
-		void stall_iso(int32_t index) throw() { set_iso_status(index, USB_VHCI_STATUS_STALL); }
-		void set_iso_packet_actual(int32_t index, int32_t value) throw() { _urb.iso_packets[index].packet_actual = value; }
-		bool is_short_not_ok() const throw() { return _urb.flags & USB_VHCI_URB_FLAGS_SHORT_NOT_OK; }
-		bool is_zero_packet() const throw() { return _urb.flags & USB_VHCI_URB_FLAGS_ZERO_PACKET; }
-		void set_iso_results() throw(std::logic_error);
+		    uint16_t wLength) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc));
+		urb(const usb_vhci_urb& urb) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc));
+		urb(const usb_vhci_urb& urb, bool own) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc));
+		virtual ~urb() _LIB_USB_VHCI_NOEXCEPT;
+		urb& operator=(const urb&) _LIB_USB_VHCI_THROW((std::bad_alloc));
+#if __cplusplus >= 201103L
+		// takes the buffers over instead of copying them (an urb from an urb_pool keeps
+		// referring to the memory of its block); inline, so that it doesn't depend on the
+		// standard the library was built with
+		urb(urb&& other) noexcept :
+			_urb(other._urb),
+			_own(other._own),
+			_in_iov(other._in_iov),
+			_in_iovcnt(other._in_iovcnt),
+			_in_one(other._in_one)
+		{
+			other._urb.buffer = nullptr;
+			other._urb.iso_packets = nullptr;
+			other._urb.buffer_length = 0;
+			other._urb.packet_count = 0;
+			other._in_iovcnt = 0;
+		}
+
+		urb& operator=(urb&& other) noexcept
+		{
+			if(this != &other)
+			{
+				if(_own)
+				{
+					delete[] _urb.buffer;
+					delete[] _urb.iso_packets;
+				}
+				_urb = other._urb;
+				_own = other._own;
+				_in_iov = other._in_iov;
+				_in_iovcnt = other._in_iovcnt;
+				_in_one = other._in_one;
+				other._urb.buffer = nullptr;
+				other._urb.iso_packets = nullptr;
+				other._urb.buffer_length = 0;
+				other._urb.packet_count = 0;
+				other._in_iovcnt = 0;
+			}
+			return *this;
+		}
+#endif
+
+		const usb_vhci_urb* get_internal() const _LIB_USB_VHCI_NOEXCEPT { return &_urb; }
+		uint64_t get_handle() const _LIB_USB_VHCI_NOEXCEPT { return _urb.handle; }
+		uint8_t* get_buffer() const _LIB_USB_VHCI_NOEXCEPT { return _urb.buffer; }
+		uint32_t get_iso_packet_offset(int32_t index) const _LIB_USB_VHCI_NOEXCEPT { return _urb.iso_packets[index].offset; }
+		int32_t get_iso_packet_length(int32_t index) const _LIB_USB_VHCI_NOEXCEPT { return _urb.iso_packets[index].packet_length; }
+		int32_t get_iso_packet_actual(int32_t index) const _LIB_USB_VHCI_NOEXCEPT { return _urb.iso_packets[index].packet_actual; }
+		int32_t get_iso_packet_status(int32_t index) const _LIB_USB_VHCI_NOEXCEPT { return _urb.iso_packets[index].status; }
+		uint8_t* get_iso_packet_buffer(int32_t index) const _LIB_USB_VHCI_NOEXCEPT { return _urb.buffer + _urb.iso_packets[index].offset; }
+		int32_t get_buffer_length() const _LIB_USB_VHCI_NOEXCEPT { return _urb.buffer_length; }
+		int32_t get_buffer_actual() const _LIB_USB_VHCI_NOEXCEPT { return _urb.buffer_actual; }
+		int32_t get_iso_packet_count() const _LIB_USB_VHCI_NOEXCEPT { return _urb.packet_count; }
+		int32_t get_iso_error_count() const _LIB_USB_VHCI_NOEXCEPT { return _urb.error_count; }
+		int32_t get_status() const _LIB_USB_VHCI_NOEXCEPT { return _urb.status; }
+		int32_t get_interval() const _LIB_USB_VHCI_NOEXCEPT { return _urb.interval; }
+		uint16_t get_flags() const _LIB_USB_VHCI_NOEXCEPT { return _urb.flags; }
+		uint16_t get_wValue() const _LIB_USB_VHCI_NOEXCEPT { return _urb.wValue; }
+		uint16_t get_wIndex() const _LIB_USB_VHCI_NOEXCEPT { return _urb.wIndex; }
+		uint16_t get_wLength() const _LIB_USB_VHCI_NOEXCEPT { return _urb.wLength; }
+		uint8_t get_bmRequestType() const _LIB_USB_VHCI_NOEXCEPT { return _urb.bmRequestType; }
+		uint8_t get_bRequest() const _LIB_USB_VHCI_NOEXCEPT { return _urb.bRequest; }
+		uint8_t get_device_address() const _LIB_USB_VHCI_NOEXCEPT { return _urb.devadr; }
+		uint8_t get_endpoint_address() const _LIB_USB_VHCI_NOEXCEPT { return _urb.epadr; }
+		uint8_t get_endpoint_number() const _LIB_USB_VHCI_NOEXCEPT { return _urb.epadr & 0x07; }
+		uint64_t get_enqueue_time() const _LIB_USB_VHCI_NOEXCEPT { return _urb.enqueue_time; }
+		uint64_t get_seq() const _LIB_USB_VHCI_NOEXCEPT { return _urb.seq; }
+		urb_type get_type() const _LIB_USB_VHCI_NOEXCEPT { return static_cast<urb_type>(_urb.type); }
+		bool is_in() const _LIB_USB_VHCI_NOEXCEPT { return _urb.epadr & 0x80; }
+		bool is_out() const _LIB_USB_VHCI_NOEXCEPT { return !is_in(); }
+		bool is_isochronous() const _LIB_USB_VHCI_NOEXCEPT { return get_type() == urb_type_isochronous; }
+		bool is_interrupt() const _LIB_USB_VHCI_NOEXCEPT { return get_type() == urb_type_interrupt; }
+		bool is_control() const _LIB_USB_VHCI_NOEXCEPT { return get_type() == urb_type_control; }
+		bool is_bulk() const _LIB_USB_VHCI_NOEXCEPT { return get_type() == urb_type_bulk; }
+		void set_status(int32_t value) _LIB_USB_VHCI_NOEXCEPT { _urb.status = value; }
+		void ack() _LIB_USB_VHCI_NOEXCEPT { set_status(USB_VHCI_STATUS_SUCCESS); }
+		void stall() _LIB_USB_VHCI_NOEXCEPT { set_status(USB_VHCI_STATUS_STALL); }
+		void set_buffer_actual(int32_t value) _LIB_USB_VHCI_NOEXCEPT { _urb.buffer_actual = value; }
+		void set_iso_error_count(int32_t value) _LIB_USB_VHCI_NOEXCEPT { _urb.error_count = value; }
+		void set_iso_status(int32_t index, int32_t value) _LIB_USB_VHCI_NOEXCEPT { _urb.iso_packets[index].status = value; }
+		void ack_iso(int32_t index) _LIB_USB_VHCI_NOEXCEPT { set_iso_status(index, USB_VHCI_STATUS_SUCCESS); }
+		void stall_iso(int32_t index) _LIB_USB_VHCI_NOEXCEPT { set_iso_status(index, USB_VHCI_STATUS_STALL); }
+		void set_iso_packet_actual(int32_t index, int32_t value) _LIB_USB_VHCI_NOEXCEPT { _urb.iso_packets[index].packet_actual = value; }
+		bool is_short_not_ok() const _LIB_USB_VHCI_NOEXCEPT { return _urb.flags & USB_VHCI_URB_FLAGS_SHORT_NOT_OK; }
+		bool is_zero_packet() const _LIB_USB_VHCI_NOEXCEPT { return _urb.flags & USB_VHCI_URB_FLAGS_ZERO_PACKET; }
+		void set_iso_results() _LIB_USB_VHCI_THROW((std::logic_error));
+		// Gives back the data of an IN urb from memory of the caller instead of the buffer
+		// (no copy into the buffer). The memory (and iov) has to stay valid until the urb
+		// is given back. The pointer variant takes get_buffer_actual bytes at the time the
+		// urb is given back; the iovec variant sets buffer_actual to the sum of the
+		// lengths. set_in_data(NULL) switches back to the buffer.
+		void set_in_data(const void* data) _LIB_USB_VHCI_NOEXCEPT;
+		void set_in_data(const iovec* iov, int iovcnt) _LIB_USB_VHCI_NOEXCEPT;
+		// number of elements of the iovec which is given back instead of the buffer (0
+		// if the buffer is given back)
+		int get_in_data(const iovec** iov) const _LIB_USB_VHCI_NOEXCEPT;
 	};
 
 	namespace vhci
@@ -291,16 +627,16 @@ namespace usb
 		private:
 			pthread_mutex_t& mutex;
 
-			lock& operator=(const lock&) throw();
-			lock(const lock&) throw();
+			lock& operator=(const lock&) _LIB_USB_VHCI_NOEXCEPT;
+			lock(const lock&) _LIB_USB_VHCI_NOEXCEPT;
 
 		public:
-			explicit lock(volatile pthread_mutex_t& m) throw() : mutex(const_cast<pthread_mutex_t&>(m))
+			explicit lock(volatile pthread_mutex_t& m) _LIB_USB_VHCI_NOEXCEPT : mutex(const_cast<pthread_mutex_t&>(m))
 			{
 				pthread_mutex_lock(&mutex);
 			}
 
-			~lock() throw()
+			~lock() _LIB_USB_VHCI_NOEXCEPT
 			{
 				pthread_mutex_unlock(&mutex);
 			}
@@ -314,89 +650,124 @@ namespace usb
 			uint8_t flags;
 
 		public:
-			port_stat() throw() : status(0), change(0), flags(0) { }
-			port_stat(uint16_t status, uint16_t change, uint8_t flags) throw() :
+			port_stat() _LIB_USB_VHCI_NOEXCEPT : status(0), change(0), flags(0) { }
+			port_stat(uint16_t status, uint16_t change, uint8_t flags) _LIB_USB_VHCI_NOEXCEPT :
 				status(status),
 				change(change),
 				flags(flags) { }
-			virtual ~port_stat() throw();
-			uint16_t get_status() const throw() { return status; }
-			uint16_t get_change() const throw() { return change; }
-			uint8_t get_flags()   const throw() { return flags; }
-			void set_status(uint16_t value) throw() { status = value; }
-			void set_change(uint16_t value) throw() { change = value; }
-			void set_flags(uint8_t value)   throw() { flags = value; }
-			bool get_resuming() const throw() { return flags & USB_VHCI_PORT_STAT_FLAG_RESUMING; }
-			void set_resuming(bool value) throw()
+			virtual ~port_stat() _LIB_USB_VHCI_NOEXCEPT;
+			uint16_t get_status() const _LIB_USB_VHCI_NOEXCEPT { return status; }
+			uint16_t get_change() const _LIB_USB_VHCI_NOEXCEPT { return change; }
+			uint8_t get_flags()   const _LIB_USB_VHCI_NOEXCEPT { return flags; }
+			void set_status(uint16_t value) _LIB_USB_VHCI_NOEXCEPT { status = value; }
+			void set_change(uint16_t value) _LIB_USB_VHCI_NOEXCEPT { change = value; }
+			void set_flags(uint8_t value)   _LIB_USB_VHCI_NOEXCEPT { flags = value; }
+			bool get_resuming() const _LIB_USB_VHCI_NOEXCEPT { return flags & USB_VHCI_PORT_STAT_FLAG_RESUMING; }
+			void set_resuming(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ flags = (flags & ~USB_VHCI_PORT_STAT_FLAG_RESUMING) | (value ? USB_VHCI_PORT_STAT_FLAG_RESUMING : 0); }
-			bool get_connection()  const throw() { return status & USB_VHCI_PORT_STAT_CONNECTION; }
-			bool get_enable()      const throw() { return status & USB_VHCI_PORT_STAT_ENABLE; }
-			bool get_suspend()     const throw() { return status & USB_VHCI_PORT_STAT_SUSPEND; }
-			bool get_overcurrent() const throw() { return status & USB_VHCI_PORT_STAT_OVERCURRENT; }
-			bool get_reset()       const throw() { return status & USB_VHCI_PORT_STAT_RESET; }
-			bool get_power()       const throw() { return status & USB_VHCI_PORT_STAT_POWER; }
-			bool get_low_speed()   const throw() { return status & USB_VHCI_PORT_STAT_LOW_SPEED; }
-			bool get_high_speed()  const throw() { return status & USB_VHCI_PORT_STAT_HIGH_SPEED; }
-			void set_connection(bool value) throw()
+			bool get_connection()  const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_CONNECTION; }
+			bool get_enable()      const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_ENABLE; }
+			bool get_suspend()     const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_SUSPEND; }
+			bool get_overcurrent() const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_OVERCURRENT; }
+			bool get_reset()       const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_RESET; }
+			bool get_power()       const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_POWER; }
+			bool get_low_speed()   const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_LOW_SPEED; }
+			bool get_high_speed()  const _LIB_USB_VHCI_NOEXCEPT { return status & USB_VHCI_PORT_STAT_HIGH_SPEED; }
+			void set_connection(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_CONNECTION) |  (value ? USB_VHCI_PORT_STAT_CONNECTION : 0); }
-			void set_enable(bool value) throw()
+			void set_enable(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_ENABLE) |      (value ? USB_VHCI_PORT_STAT_ENABLE : 0); }
-			void set_suspend(bool value) throw()
+			void set_suspend(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_SUSPEND) |     (value ? USB_VHCI_PORT_STAT_SUSPEND : 0); }
-			void set_overcurrent(bool value) throw()
+			void set_overcurrent(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_OVERCURRENT) | (value ? USB_VHCI_PORT_STAT_OVERCURRENT : 0); }
-			void set_reset(bool value) throw()
+			void set_reset(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_RESET) |       (value ? USB_VHCI_PORT_STAT_RESET : 0); }
-			void set_power(bool value) throw()
+			void set_power(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_POWER) |       (value ? USB_VHCI_PORT_STAT_POWER: 0); }
-			void set_low_speed(bool value) throw()
+			void set_low_speed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_LOW_SPEED) |   (value ? USB_VHCI_PORT_STAT_LOW_SPEED : 0); }
-			void set_high_speed(bool value) throw()
+			void set_high_speed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ status = (status & ~USB_VHCI_PORT_STAT_HIGH_SPEED) |  (value ? USB_VHCI_PORT_STAT_HIGH_SPEED : 0); }
-			bool get_connection_changed()  const throw() { return change & USB_VHCI_PORT_STAT_C_CONNECTION; }
-			bool get_enable_changed()      const throw() { return change & USB_VHCI_PORT_STAT_C_ENABLE; }
-			bool get_suspend_changed()     const throw() { return change & USB_VHCI_PORT_STAT_C_SUSPEND; }
-			bool get_overcurrent_changed() const throw() { return change & USB_VHCI_PORT_STAT_C_OVERCURRENT; }
-			bool get_reset_changed()       const throw() { return change & USB_VHCI_PORT_STAT_C_RESET; }
-			void set_connection_changed(bool value) throw()
+			bool get_connection_changed()  const _LIB_USB_VHCI_NOEXCEPT { return change & USB_VHCI_PORT_STAT_C_CONNECTION; }
+			bool get_enable_changed()      const _LIB_USB_VHCI_NOEXCEPT { return change & USB_VHCI_PORT_STAT_C_ENABLE; }
+			bool get_suspend_changed()     const _LIB_USB_VHCI_NOEXCEPT { return change & USB_VHCI_PORT_STAT_C_SUSPEND; }
+			bool get_overcurrent_changed() const _LIB_USB_VHCI_NOEXCEPT { return change & USB_VHCI_PORT_STAT_C_OVERCURRENT; }
+			bool get_reset_changed()       const _LIB_USB_VHCI_NOEXCEPT { return change & USB_VHCI_PORT_STAT_C_RESET; }
+			void set_connection_changed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_CONNECTION) |  (value ? USB_VHCI_PORT_STAT_C_CONNECTION : 0); }
-			void set_enable_changed(bool value) throw()
+			void set_enable_changed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_ENABLE) |      (value ? USB_VHCI_PORT_STAT_C_ENABLE : 0); }
-			void set_suspend_changed(bool value) throw()
+			void set_suspend_changed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_SUSPEND) |     (value ? USB_VHCI_PORT_STAT_C_SUSPEND : 0); }
-			void set_overcurrent_changed(bool value) throw()
+			void set_overcurrent_changed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_OVERCURRENT) | (value ? USB_VHCI_PORT_STAT_C_OVERCURRENT : 0); }
-			void set_reset_changed(bool value) throw()
+			void set_reset_changed(bool value) _LIB_USB_VHCI_NOEXCEPT
 			{ change = (change & ~USB_VHCI_PORT_STAT_C_RESET) |       (value ? USB_VHCI_PORT_STAT_C_RESET : 0); }
 		};
 
+		enum work_type
+		{
+			work_type_port_stat   = USB_VHCI_WORK_TYPE_PORT_STAT,
+			work_type_process_urb = USB_VHCI_WORK_TYPE_PROCESS_URB,
+			work_type_cancel_urb  = USB_VHCI_WORK_TYPE_CANCEL_URB
+		};
+
+		class process_urb_work;
+
 		class work
 		{
 		private:
 			uint8_t port;
 			bool canceled;
+			work_type type;
+
+			// bookkeeping of hcd
+			work* prev;                    // inbox or processing list
+			work* next;
+			process_urb_work* next_handle; // bucket of the handle index
+			bool in_progress;              // true, if in the processing list
+			uint64_t enqueued;             // CLOCK_MONOTONIC in nanoseconds (for latency_histogram)
+
+			friend class hcd;
 
 		protected:
-			work(uint8_t port) throw(std::invalid_argument);
+			work(uint8_t port, work_type type) _LIB_USB_VHCI_THROW((std::invalid_argument));
 
 		public:
-			virtual ~work() throw();
-			uint8_t get_port() const throw() { return port; }
-			bool is_canceled() const throw() { return canceled; }
-			void cancel() throw();
+			work(const work& w) _LIB_USB_VHCI_NOEXCEPT;
+			work& operator=(const work& w) _LIB_USB_VHCI_NOEXCEPT;
+			virtual ~work() _LIB_USB_VHCI_NOEXCEPT;
+			uint8_t get_port() const _LIB_USB_VHCI_NOEXCEPT { return port; }
+			// use this instead of dynamic_cast for finding out the derived class
+			work_type get_type() const _LIB_USB_VHCI_NOEXCEPT { return type; }
+			bool is_canceled() const _LIB_USB_VHCI_NOEXCEPT { return canceled; }
+			void cancel() _LIB_USB_VHCI_NOEXCEPT;
 		};
 
 		class process_urb_work : public work
 		{
 		private:
 			usb::urb* urb;
+			bool pooled; // urb lives in the same urb_pool block as this work
+
+			process_urb_work(uint8_t port, usb::urb* urb, bool pooled) _LIB_USB_VHCI_THROW((std::invalid_argument));
+
+			friend class urb_pool;
 
 		public:
-			process_urb_work(uint8_t port, usb::urb* urb) throw(std::invalid_argument);
-			process_urb_work(const process_urb_work&) throw(std::bad_alloc);
-			process_urb_work& operator=(const process_urb_work&) throw(std::bad_alloc);
-			virtual ~process_urb_work() throw();
-			usb::urb* get_urb() const throw() { return urb; }
+			process_urb_work(uint8_t port, usb::urb* urb) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			process_urb_work(const process_urb_work&) _LIB_USB_VHCI_THROW((std::bad_alloc));
+			process_urb_work& operator=(const process_urb_work&) _LIB_USB_VHCI_THROW((std::bad_alloc));
+			virtual ~process_urb_work() _LIB_USB_VHCI_NOEXCEPT;
+			usb::urb* get_urb() const _LIB_USB_VHCI_NOEXCEPT { return urb; }
+
+			// instances share their memory layout with urb_pool blocks, so that deleting
+			// a work returns pooled memory to its pool
+			static void* operator new(size_t size) _LIB_USB_VHCI_THROW((std::bad_alloc));
+			static void* operator new(size_t, void* p) _LIB_USB_VHCI_NOEXCEPT { return p; }
+			static void operator delete(void* p) _LIB_USB_VHCI_NOEXCEPT;
+			static void operator delete(void*, void*) _LIB_USB_VHCI_NOEXCEPT { }
 		};
 
 		class cancel_urb_work : public work
@@ -405,8 +776,8 @@ namespace usb
 			uint64_t handle;
 
 		public:
-			cancel_urb_work(uint8_t port, uint64_t handle) throw(std::invalid_argument);
-			uint64_t get_handle() const throw() { return handle; }
+			cancel_urb_work(uint8_t port, uint64_t handle) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			uint64_t get_handle() const _LIB_USB_VHCI_NOEXCEPT { return handle; }
 		};
 
 		class port_stat_work : public work
@@ -416,16 +787,125 @@ namespace usb
 			uint8_t trigger_flags;
 
 		public:
-			port_stat_work(uint8_t port, const port_stat& stat) throw(std::invalid_argument);
-			port_stat_work(uint8_t port, const port_stat& stat, const port_stat& prev) throw(std::invalid_argument);
-			const port_stat& get_port_stat() const throw() { return stat; }
-			uint8_t get_trigger_flags()     const throw() { return trigger_flags; }
-			bool triggers_disable()  const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_DISABLE; }
-			bool triggers_suspend()  const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_SUSPEND; }
-			bool triggers_resuming() const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESUMING; }
-			bool triggers_reset()    const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESET; }
-			bool triggers_power_on()  const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_ON; }
-			bool triggers_power_off() const throw() { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_OFF; }
+			port_stat_work(uint8_t port, const port_stat& stat) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			port_stat_work(uint8_t port, const port_stat& stat, const port_stat& prev) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			// restores a work with the trigger flags it had (see local_hcd::detach)
+			port_stat_work(uint8_t port, const port_stat& stat, uint8_t trigger_flags) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			const port_stat& get_port_stat() const _LIB_USB_VHCI_NOEXCEPT { return stat; }
+			uint8_t get_trigger_flags()     const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags; }
+			bool triggers_disable()  const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_DISABLE; }
+			bool triggers_suspend()  const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_SUSPEND; }
+			bool triggers_resuming() const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESUMING; }
+			bool triggers_reset()    const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_RESET; }
+			bool triggers_power_on()  const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_ON; }
+			bool triggers_power_off() const _LIB_USB_VHCI_NOEXCEPT { return trigger_flags & USB_VHCI_PORT_STAT_TRIGGER_POWER_OFF; }
+		};
+
+		// Recycles the memory of urbs which are fetched by local_hcd. A process_urb_work,
+		// its urb, the iso packets and the data buffer share one block; blocks are taken from
+		// per size class free lists and go back there when the work gets deleted, so that
+		// the steady state doesn't allocate. Thread-safe.
+		class urb_pool
+		{
+		private:
+			struct block;
+
+			static const int class_count = 12; // 512 bytes .. 1 MiB
+
+			pthread_mutex_t mutex;
+			block* free_blocks[class_count];
+			uint32_t cached[class_count];
+			uint32_t outstanding;
+			bool orphaned;
+
+			urb_pool(const urb_pool&) _LIB_USB_VHCI_NOEXCEPT;
+			urb_pool& operator=(const urb_pool&) _LIB_USB_VHCI_NOEXCEPT;
+			~urb_pool() _LIB_USB_VHCI_NOEXCEPT;
+
+			static block* get_block(const void* p) _LIB_USB_VHCI_NOEXCEPT;
+			void put_block(block* b) _LIB_USB_VHCI_NOEXCEPT;
+
+			friend class process_urb_work;
+
+		public:
+			urb_pool() _LIB_USB_VHCI_NOEXCEPT;
+			// frees the cached blocks; the pool deletes itself as soon as all outstanding
+			// blocks are returned
+			void destroy() _LIB_USB_VHCI_NOEXCEPT;
+
+			// copies urb (without data) into a new block; returns NULL if out of memory
+			usb::urb* alloc_urb(const usb_vhci_urb& urb) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			// constructs the work in the block of an urb from alloc_urb; deleting the work
+			// returns the block
+			process_urb_work* make_work(uint8_t port, usb::urb* urb) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			// returns the block of an urb, for which no work was made
+			void free_urb(usb::urb* urb) _LIB_USB_VHCI_NOEXCEPT;
+		};
+
+		// Histogram of latencies in nanoseconds with logarithmic buckets (like HdrHistogram):
+		// 8 sub-buckets per power of two, so that a value is at most 12.5% off from the
+		// bounds of its bucket. record is lock-free and may be called from many threads;
+		// a copy is a snapshot.
+		class latency_histogram
+		{
+		public:
+			static const int bucket_count = 496;
+
+		private:
+			uint64_t buckets[bucket_count];
+			uint64_t count;
+			uint64_t sum;
+			uint64_t max;
+
+			static int bucket_of(uint64_t ns) _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			latency_histogram() _LIB_USB_VHCI_NOEXCEPT;
+			latency_histogram(const latency_histogram& h) _LIB_USB_VHCI_NOEXCEPT;
+			latency_histogram& operator=(const latency_histogram& h) _LIB_USB_VHCI_NOEXCEPT;
+			void record(uint64_t ns) _LIB_USB_VHCI_NOEXCEPT;
+			void reset() _LIB_USB_VHCI_NOEXCEPT;
+			uint64_t get_count() const _LIB_USB_VHCI_NOEXCEPT { return count; }
+			uint64_t get_sum()   const _LIB_USB_VHCI_NOEXCEPT { return sum; }
+			uint64_t get_max()   const _LIB_USB_VHCI_NOEXCEPT { return max; }
+			uint64_t get_mean()  const _LIB_USB_VHCI_NOEXCEPT { return count ? sum / count : 0; }
+			uint64_t get_bucket(int i) const _LIB_USB_VHCI_NOEXCEPT { return buckets[i]; }
+			// smallest value of bucket i
+			static uint64_t get_bucket_start(int i) _LIB_USB_VHCI_NOEXCEPT;
+			// upper bound of the bucket, which contains the given percentile (0..100)
+			uint64_t get_percentile(double percentile) const _LIB_USB_VHCI_NOEXCEPT;
+			// CLOCK_MONOTONIC in nanoseconds
+			static uint64_t now() _LIB_USB_VHCI_NOEXCEPT;
+		};
+
+		// counters of a port of an hcd (see hcd::get_port_statistics)
+		struct port_statistics
+		{
+			uint64_t urbs[4][2];       // finished urbs by urb_type and direction (0: OUT, 1: IN)
+			uint64_t bytes_out;        // buffer_length of finished OUT urbs
+			uint64_t bytes_in;         // buffer_actual of finished IN urbs
+			uint64_t cancels;          // urbs which got canceled
+			uint64_t giveback_errors;  // finish_work failed to give back an urb
+			latency_histogram latency; // from enqueueing to finishing an urb
+
+			port_statistics() _LIB_USB_VHCI_NOEXCEPT;
+			port_statistics(const port_statistics& s) _LIB_USB_VHCI_NOEXCEPT;
+			port_statistics& operator=(const port_statistics& s) _LIB_USB_VHCI_NOEXCEPT;
+			void reset() _LIB_USB_VHCI_NOEXCEPT;
+			uint64_t get_urb_count() const _LIB_USB_VHCI_NOEXCEPT;
+		};
+
+		// counters of an hcd, which don't belong to a port (see hcd::get_statistics)
+		struct hcd_statistics
+		{
+			uint64_t fetch_errors;      // fetching a work from the controller failed (no timeouts)
+			uint64_t fetch_data_errors; // fetching the data of an urb failed (not canceled ones)
+			uint64_t dropped_works;     // works for unknown ports or device addresses
+			uint64_t giveback_errors;   // sum of all ports
+			size_t inbox;               // works which wait for next_work
+			size_t processing;          // works which were fetched but are not finished yet
+			size_t inbox_max;           // high-water marks of inbox and processing
+			size_t processing_max;
 		};
 
 		class hcd
@@ -434,24 +914,24 @@ namespace usb
 			class callback
 			{
 			private:
-				void (*func)(void*, hcd&) throw();
+				void (*func)(void*, hcd&); // must not throw
 				void* arg;
 
 			public:
-				callback(void (*func)(void*, hcd&) throw(), void* arg) throw(std::invalid_argument) : func(func), arg(arg)
+				callback(void (*func)(void*, hcd&), void* arg) _LIB_USB_VHCI_THROW((std::invalid_argument)) : func(func), arg(arg)
 				{
 					if(!func) throw std::invalid_argument("func");
 				}
 
-				bool operator==(const callback& other) const throw()
+				bool operator==(const callback& other) const _LIB_USB_VHCI_NOEXCEPT
 				{
 					return func == other.func && arg == other.arg;
 				}
 
-				bool operator!=(const callback& other) const throw() { return !(*this == other); }
-				void (*get_func() const throw())(void*, hcd&) throw() { return func; }
-				void* get_arg() const throw() { return arg; }
-				void call(hcd& from) const throw() { (*func)(arg, from); }
+				bool operator!=(const callback& other) const _LIB_USB_VHCI_NOEXCEPT { return !(*this == other); }
+				void (*get_func() const _LIB_USB_VHCI_NOEXCEPT)(void*, hcd&) { return func; }
+				void* get_arg() const _LIB_USB_VHCI_NOEXCEPT { return arg; }
+				void call(hcd& from) const _LIB_USB_VHCI_NOEXCEPT { (*func)(arg, from); }
 			};
 
 		private:
@@ -460,47 +940,129 @@ namespace usb
 			pthread_t bg_thread;
 			volatile bool thread_shutdown;
 			pthread_mutex_t thread_sync;
+			// protected by thread_sync; cpu_set points into thread_cpu_set
+			usb_vhci_thread_policy thread_policy;
+			std::vector<uint8_t> thread_cpu_set;
+
+			// intrusive list (linked by work::prev and work::next)
+			struct work_list
+			{
+				work* head;
+				work* tail;
+				size_t count;
+				size_t max_count;
+			};
 
 			uint8_t port_count;
 			pthread_mutex_t _lock;
-			std::deque<work*> inbox;
-			std::list<work*> processing;
+			work_list inbox;
+			work_list processing;
+			// only cancel works are handed out (see set_draining)
+			bool draining;
+			// handle -> process_urb_work for all works in inbox and processing (chained
+			// by work::next_handle); the bucket count is a power of two
+			std::vector<process_urb_work*> handles;
+			size_t handle_count;
+			// works from enqueue_work, which are not in inbox yet: lock-free LIFO (linked by
+			// work::next) which gets moved to inbox as a whole by the consumers
+			work* volatile incoming;
+			// eventfd which becomes readable, when incoming gets non-empty
+			int work_fd;
+			// statistics; the counters are updated with atomic operations
+			port_statistics* port_stats;
+			uint64_t fetch_errors;
+			uint64_t fetch_data_errors;
+			uint64_t dropped_works;
 
-			hcd(const hcd&) throw();
-			hcd& operator=(const hcd&) throw();
+			hcd(const hcd&) _LIB_USB_VHCI_NOEXCEPT;
+			hcd& operator=(const hcd&) _LIB_USB_VHCI_NOEXCEPT;
 
-			static void* bg_thread_start(void* _this) throw();
+			static void* bg_thread_start(void* _this) _LIB_USB_VHCI_NOEXCEPT;
+			static void append_work(work_list& list, work* w) _LIB_USB_VHCI_NOEXCEPT;
+			static void unlink_work(work_list& list, work* w) _LIB_USB_VHCI_NOEXCEPT;
+			size_t handle_bucket(uint64_t handle) const _LIB_USB_VHCI_NOEXCEPT;
+			void index_work(process_urb_work* w) _LIB_USB_VHCI_NOEXCEPT;
+			void collect_works() _LIB_USB_VHCI_NOEXCEPT;
+			size_t pop_works(work** w, size_t count) _LIB_USB_VHCI_NOEXCEPT;
+			bool can_pop_work() _LIB_USB_VHCI_NOEXCEPT;
+			bool has_work() volatile _LIB_USB_VHCI_NOEXCEPT;
+			void unindex_work(process_urb_work* w) _LIB_USB_VHCI_NOEXCEPT;
+			process_urb_work* find_work(uint64_t handle) const _LIB_USB_VHCI_NOEXCEPT;
+			void count_finished_work(const work* w) _LIB_USB_VHCI_NOEXCEPT;
 
 		protected:
-			explicit hcd(uint8_t ports) throw(std::invalid_argument, std::bad_alloc);
-			virtual void bg_work() volatile throw() = 0;
-			virtual uint8_t address_from_port(uint8_t port) const throw(std::exception) = 0;
-			virtual uint8_t port_from_address(uint8_t address) const throw(std::exception) = 0;
-			virtual void canceling_work(work* w, bool in_progress) throw(std::exception);
-			virtual void finishing_work(work* w) throw(std::exception);
-			virtual void on_work_enqueued() throw();
-			void enqueue_work(work* w) throw(std::bad_alloc);
-			void init_bg_thread() volatile throw(std::exception);
-			void join_bg_thread() volatile throw();
-			pthread_mutex_t& get_lock() volatile throw() { return const_cast<pthread_mutex_t&>(_lock); }
-			bool is_thread_shutdown() const volatile throw() { return thread_shutdown; }
+			explicit hcd(uint8_t ports) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc));
+			virtual void bg_work() volatile _LIB_USB_VHCI_NOEXCEPT = 0;
+			virtual uint8_t address_from_port(uint8_t port) const _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual uint8_t port_from_address(uint8_t address) const _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void canceling_work(work* w, bool in_progress) _LIB_USB_VHCI_THROW((std::exception));
+			// called with _lock held for canceled works which were not fetched yet, and
+			// without _lock from finish_work (w is not in any list of the hcd then)
+			virtual void finishing_work(work* w) _LIB_USB_VHCI_THROW((std::exception));
+			virtual void on_work_enqueued() _LIB_USB_VHCI_NOEXCEPT;
+			// wakes up bg_work, if it waits (join_bg_thread calls it after setting the
+			// shutdown flag, with thread_sync held; so it must not take _lock)
+			virtual void kick_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT;
+			// lock-free; doesn't need _lock (and doesn't throw anymore)
+			void enqueue_work(work* w) _LIB_USB_VHCI_THROW((std::bad_alloc));
+			void init_bg_thread() volatile _LIB_USB_VHCI_THROW((std::exception));
+			void join_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT;
+			// moves the works which were not fetched yet out of the hcd (in order); the caller
+			// owns them then and has to make sure that no works get enqueued meanwhile
+			void take_works(std::vector<work*>& w) volatile _LIB_USB_VHCI_THROW((std::bad_alloc));
+			// while draining, next_work and next_work_batch hand out cancel works only, so
+			// that the works which were handed out before can be finished (or canceled)
+			// without new ones being started; caller has _lock
+			void set_draining(bool value) _LIB_USB_VHCI_NOEXCEPT;
+			// works which were handed out and are not finished yet; caller has _lock
+			size_t get_processing_count() const _LIB_USB_VHCI_NOEXCEPT { return processing.count; }
+			pthread_mutex_t& get_lock() volatile _LIB_USB_VHCI_NOEXCEPT { return const_cast<pthread_mutex_t&>(_lock); }
+			bool is_thread_shutdown() const volatile _LIB_USB_VHCI_NOEXCEPT { return thread_shutdown; }
+			// for the errors which the derived classes run into (lock-free)
+			void count_fetch_error() _LIB_USB_VHCI_NOEXCEPT;
+			void count_fetch_data_error() _LIB_USB_VHCI_NOEXCEPT;
+			void count_dropped_work() _LIB_USB_VHCI_NOEXCEPT;
+			void count_giveback_error(uint8_t port) _LIB_USB_VHCI_NOEXCEPT;
 
 		public:
-			virtual ~hcd() throw();
-
-			void add_work_enqueued_callback(callback c) volatile throw(std::bad_alloc);
-			void remove_work_enqueued_callback(callback c) volatile throw();
-			virtual const port_stat& get_port_stat(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception) = 0;
-			virtual void port_disconnect(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_disable(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_resumed(uint8_t port) volatile throw(std::exception) = 0;
-			virtual void port_overcurrent(uint8_t port, bool set) volatile throw(std::exception) = 0;
-			virtual void port_reset_done(uint8_t port, bool enable = true) volatile throw(std::exception) = 0;
-			uint8_t get_port_count() const volatile throw() { return port_count; }
-			bool next_work(work** w) volatile throw(std::bad_alloc);
-			void finish_work(work* w) volatile throw(std::exception);
-			bool cancel_process_urb_work(uint64_t handle) volatile throw(std::exception);
+			virtual ~hcd() _LIB_USB_VHCI_NOEXCEPT;
+
+			// callbacks are called with the lock of the hcd held; prefer wait_for_work
+			void add_work_enqueued_callback(callback c) volatile _LIB_USB_VHCI_THROW((std::bad_alloc));
+			void remove_work_enqueued_callback(callback c) volatile _LIB_USB_VHCI_NOEXCEPT;
+			virtual const port_stat& get_port_stat(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void port_disconnect(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void port_disable(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void port_resumed(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void port_overcurrent(uint8_t port, bool set) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile _LIB_USB_VHCI_THROW((std::exception)) = 0;
+			uint8_t get_port_count() const volatile _LIB_USB_VHCI_NOEXCEPT { return port_count; }
+			// execution policy of the background thread (which gets restarted, if it runs)
+			// and of the threads of executors which are created afterwards; throws
+			// std::invalid_argument if the policy is invalid and std::exception if it can't
+			// be applied (e.g. EPERM), in which case the old policy stays
+			void set_thread_policy(const usb_vhci_thread_policy& policy) volatile _LIB_USB_VHCI_THROW((std::exception));
+			// cpu_set stays valid until the next set_thread_policy
+			usb_vhci_thread_policy get_thread_policy() const volatile _LIB_USB_VHCI_NOEXCEPT;
+			bool next_work(work** w) volatile _LIB_USB_VHCI_THROW((std::bad_alloc));
+			// fetches up to count works at once (like calling next_work count times);
+			// returns the number of works stored in w
+			size_t next_work_batch(work** w, size_t count) volatile _LIB_USB_VHCI_NOEXCEPT;
+			// blocks until there is work to fetch; timeout in milliseconds (-1 waits forever);
+			// returns false on timeout
+			bool wait_for_work(int timeout = -1) volatile _LIB_USB_VHCI_NOEXCEPT;
+			// eventfd for poll/epoll, which becomes readable when works get enqueued;
+			// wait_for_work resets it
+			int get_work_fd() const volatile _LIB_USB_VHCI_NOEXCEPT { return work_fd; }
+			void finish_work(work* w) volatile _LIB_USB_VHCI_THROW((std::exception));
+			bool cancel_process_urb_work(uint64_t handle) volatile _LIB_USB_VHCI_THROW((std::exception));
+			port_statistics get_port_statistics(uint8_t port) const volatile _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range));
+			hcd_statistics get_statistics() volatile _LIB_USB_VHCI_NOEXCEPT;
+			void reset_statistics() volatile _LIB_USB_VHCI_NOEXCEPT;
+			// writes the statistics in a human readable form (one line per port which
+			// had any urbs)
+			void dump_statistics(FILE* f) volatile _LIB_USB_VHCI_NOEXCEPT;
 		};
 
 		class local_hcd : public hcd
@@ -510,39 +1072,418 @@ namespace usb
 			{
 				uint8_t adr;
 				port_stat stat;
-				_port_info() throw() : adr(0xff), stat() { }
-				_port_info(uint8_t adr, const port_stat& stat) throw() : adr(adr), stat(stat) { }
+				_port_info() _LIB_USB_VHCI_NOEXCEPT : adr(0xff), stat() { }
+				_port_info(uint8_t adr, const port_stat& stat) _LIB_USB_VHCI_NOEXCEPT : adr(adr), stat(stat) { }
 			};
 
 			int fd;
 			int32_t id, usb_bus_num;
 			std::string bus_id;
 			_port_info* port_info;
+			urb_pool* pool;
+			bool kick_supported; // bg_work may wait without timeout
+			bool detached;       // fd belongs to another process (see detach)
+
+			local_hcd(const local_hcd&) _LIB_USB_VHCI_NOEXCEPT;
+			local_hcd& operator=(const local_hcd&) _LIB_USB_VHCI_NOEXCEPT;
+			void init(char* _bus_id, const std::vector<uint8_t>* state = NULL) _LIB_USB_VHCI_THROW((std::exception));
+			void restore(const std::vector<uint8_t>& state) _LIB_USB_VHCI_THROW((std::exception));
+			static uint8_t state_port_count(const std::vector<uint8_t>& state) _LIB_USB_VHCI_THROW((std::invalid_argument));
+			// fetches one work from the vhci-hcd and enqueues it; timeout in milliseconds;
+			// returns false, if there was none
+			bool fetch_vhci_work(int16_t timeout) volatile _LIB_USB_VHCI_NOEXCEPT;
+
+			friend class reactor;
+
+		protected:
+			// opens a simulated controller (see sim_hcd)
+			local_hcd(uint8_t ports, uint32_t sim_flags) _LIB_USB_VHCI_THROW((std::exception));
+			int get_fd() const volatile _LIB_USB_VHCI_NOEXCEPT { return fd; }
+			virtual uint8_t address_from_port(uint8_t port) const _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range));
+			virtual uint8_t port_from_address(uint8_t address) const _LIB_USB_VHCI_THROW((std::invalid_argument));
+			virtual void canceling_work(work* w, bool in_progress) _LIB_USB_VHCI_THROW((std::exception));
+			virtual void finishing_work(work* w) _LIB_USB_VHCI_THROW((std::exception));
+			virtual void kick_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			explicit local_hcd(uint8_t ports) _LIB_USB_VHCI_THROW((std::exception));
+			// takes over a controller which was handed over with detach: fd refers to it
+			// (e.g. from usb_vhci_handoff_recv), and state is what detach returned; the
+			// devices stay connected, and the works which were not fetched from the old
+			// hcd are fetched from this one. state contains the raw usb_vhci_urbs, so it
+			// is only accepted from the same version of the library with the same
+			// layout of the structures. fd is not closed, if this throws
+			// (std::invalid_argument for a broken or foreign state).
+			local_hcd(int fd, const std::vector<uint8_t>& state) _LIB_USB_VHCI_THROW((std::exception));
+			virtual ~local_hcd() _LIB_USB_VHCI_NOEXCEPT;
+
+			// Hands the controller over to another process (or hcd) without a
+			// disconnect: stops fetching from the vhci-hcd and moves the port states
+			// (addresses and stats) and the works which were not fetched from this hcd
+			// yet into state. Returns the file descriptor, which has to be passed on
+			// together with state (see usb_vhci_handoff_send); it is not closed by this
+			// hcd anymore. The works which were fetched before have to be finished
+			// first: detach blocks until they are, while next_work hands out cancel works
+			// only. So it must not be called from a thread which has works of this hcd
+			// to finish. If timeout (in milliseconds, -1 waits forever) expires first,
+			// nothing is handed over and it throws std::exception. Must not be called
+			// while a reactor drives this hcd.
+			int detach(std::vector<uint8_t>& state, int timeout = -1) volatile _LIB_USB_VHCI_THROW((std::exception));
+
+			int32_t get_vhci_id() volatile _LIB_USB_VHCI_NOEXCEPT { return id; }
+			const std::string& get_bus_id() volatile _LIB_USB_VHCI_NOEXCEPT { return const_cast<const std::string&>(bus_id); }
+			int32_t get_usb_bus_num() volatile _LIB_USB_VHCI_NOEXCEPT { return usb_bus_num; }
+			virtual void bg_work() volatile _LIB_USB_VHCI_NOEXCEPT;
+			virtual const port_stat& get_port_stat(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range));
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_disconnect(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_disable(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_resumed(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_overcurrent(uint8_t port, bool set) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile _LIB_USB_VHCI_THROW((std::exception));
+			void add_responder(uint8_t port, const usb_vhci_responder& rule) volatile _LIB_USB_VHCI_THROW((std::exception));
+			void clear_responders(uint8_t port = 0) volatile _LIB_USB_VHCI_THROW((std::exception));
+		};
+
+		// runs without the kernel modules: the host side is driven by the methods below
+		// (see usb_vhci_sim_open)
+		class sim_hcd : public local_hcd
+		{
+		private:
+			sim_hcd(const sim_hcd&) _LIB_USB_VHCI_NOEXCEPT;
+			sim_hcd& operator=(const sim_hcd&) _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			explicit sim_hcd(uint8_t ports, uint32_t flags = 0) _LIB_USB_VHCI_THROW((std::exception));
+			virtual ~sim_hcd() _LIB_USB_VHCI_NOEXCEPT;
+
+			void submit(const usb_vhci_urb& urb) volatile _LIB_USB_VHCI_THROW((std::exception));
+			bool unlink(uint64_t handle) volatile _LIB_USB_VHCI_THROW((std::exception));
+			bool reap(usb_vhci_urb& urb, int16_t timeout = 0) volatile _LIB_USB_VHCI_THROW((std::exception));
+			void set_port_feature(uint8_t port, uint16_t feature) volatile _LIB_USB_VHCI_THROW((std::exception));
+			void clear_port_feature(uint8_t port, uint16_t feature) volatile _LIB_USB_VHCI_THROW((std::exception));
+		};
+
+		class remote_ring;
+		struct remote_msg;
+		struct remote_hello;
+
+		// Device side of an hcd whose controller is owned by a broker in another process
+		// (see broker): the ports of this hcd are ports of the hcd of the broker, and its
+		// works come from there. Works are handled like the ones of a local_hcd. The port
+		// methods are sent to the broker and don't wait for it; they throw, if the broker
+		// is gone (finish_work counts a giveback error then).
+		class remote_hcd : public hcd
+		{
+		private:
+			struct _port_info
+			{
+				uint8_t adr;
+				port_stat stat;
+				_port_info() _LIB_USB_VHCI_NOEXCEPT : adr(0xff), stat() { }
+			};
+
+			int sock;
+			int in_fd;   // doorbell of the ring from the broker
+			int out_fd;  // doorbell of the ring to the broker
+			int kick_fd;
+			void* shm;
+			size_t shm_size;
+			remote_ring* in;
+			remote_ring* out;
+			pthread_mutex_t out_lock; // serializes the producers of out
+			// producers which wait for room in out wait here (with out_lock); bg_work
+			// signals it, when the broker has rung in_fd after making room
+			pthread_cond_t out_room;
+			uint32_t out_waiting; // protected by out_lock
+			int32_t id, usb_bus_num;
+			std::string bus_id;
+			_port_info* port_info;
+			urb_pool* pool;
+			volatile bool connected;
 
-			local_hcd(const local_hcd&) throw();
-			local_hcd& operator=(const local_hcd&) throw();
+			remote_hcd(const remote_hcd&) _LIB_USB_VHCI_NOEXCEPT;
+			remote_hcd& operator=(const remote_hcd&) _LIB_USB_VHCI_NOEXCEPT;
+			void connect(const std::string& path) _LIB_USB_VHCI_THROW((std::exception));
+			void cleanup() _LIB_USB_VHCI_NOEXCEPT;
+			// hdr is the copy of the header of m (see remote_ring::peek)
+			void handle_msg(const remote_msg& hdr, const remote_msg* m) _LIB_USB_VHCI_NOEXCEPT;
+			// the broker is gone (or broken): disconnects the ports; caller has _lock
+			void lost_broker() _LIB_USB_VHCI_NOEXCEPT;
+			// reserves a message of msg_size bytes in out and keeps out_lock until
+			// end_send; waits for room (without out_lock); NULL if the broker is gone
+			remote_msg* begin_send(uint32_t msg_size) volatile _LIB_USB_VHCI_NOEXCEPT;
+			// wakes up the producers which wait for room in out
+			void wake_producers() volatile _LIB_USB_VHCI_NOEXCEPT;
+			void end_send(remote_msg* m) volatile _LIB_USB_VHCI_NOEXCEPT;
+			void port_op(uint8_t port, uint8_t op, uint32_t arg) volatile _LIB_USB_VHCI_THROW((std::exception));
 
 		protected:
-			virtual uint8_t address_from_port(uint8_t port) const throw(std::invalid_argument, std::out_of_range);
-			virtual uint8_t port_from_address(uint8_t address) const throw(std::invalid_argument);
-			virtual void canceling_work(work* w, bool in_progress) throw(std::exception);
-			virtual void finishing_work(work* w) throw(std::exception);
+			virtual uint8_t address_from_port(uint8_t port) const _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range));
+			virtual uint8_t port_from_address(uint8_t address) const _LIB_USB_VHCI_THROW((std::invalid_argument));
+			virtual void canceling_work(work* w, bool in_progress) _LIB_USB_VHCI_THROW((std::exception));
+			virtual void finishing_work(work* w) _LIB_USB_VHCI_THROW((std::exception));
+			virtual void kick_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			// connects to the broker which listens on path and takes ports of it (all
+			// or nothing)
+			remote_hcd(const std::string& path, uint8_t ports = 1) _LIB_USB_VHCI_THROW((std::exception));
+			virtual ~remote_hcd() _LIB_USB_VHCI_NOEXCEPT;
+
+			// of the controller of the broker (0 and "" if the broker doesn't serve a
+			// local_hcd)
+			int32_t get_vhci_id() volatile _LIB_USB_VHCI_NOEXCEPT { return id; }
+			const std::string& get_bus_id() volatile _LIB_USB_VHCI_NOEXCEPT { return const_cast<const std::string&>(bus_id); }
+			int32_t get_usb_bus_num() volatile _LIB_USB_VHCI_NOEXCEPT { return usb_bus_num; }
+			// false, as soon as the broker is gone
+			bool is_connected() const volatile _LIB_USB_VHCI_NOEXCEPT { return connected; }
+			virtual void bg_work() volatile _LIB_USB_VHCI_NOEXCEPT;
+			virtual const port_stat& get_port_stat(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range));
+			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_disconnect(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_disable(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_resumed(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_overcurrent(uint8_t port, bool set) volatile _LIB_USB_VHCI_THROW((std::exception));
+			virtual void port_reset_done(uint8_t port, bool enable = true) volatile _LIB_USB_VHCI_THROW((std::exception));
+		};
+
+		// Serves the ports of an hcd (usually a local_hcd) to remote_hcds in other
+		// processes, so that every device can run in a process of its own: a remote_hcd
+		// connects to the unix socket at path and gets ports of dev which no other client
+		// has. Urbs, cancelations and port stat changes of those ports go to the client,
+		// and its givebacks and port operations come back, through rings in shared memory.
+		// If a client goes away (or crashes), its devices get disconnected, and its urbs
+		// are given back with USB_VHCI_STATUS_NO_RESPONSE.
+		// The broker fetches all works of dev on a thread of its own, so nothing else may
+		// fetch them; it has to be destroyed before dev.
+		class broker
+		{
+		private:
+			struct client;
+
+			struct watch
+			{
+				client* cl; // NULL: listening socket, work fd of dev, wake_fd or pending hello
+				int fd;
+				uint64_t hello_deadline; // connection which hasn't sent its hello yet: when it
+				                         // gets dropped (see latency_histogram::now), else 0
+			};
+
+			hcd& dev;
+			std::string path;
+			uint32_t ring_size;
+			int listen_fd;
+			int epoll_fd;
+			int wake_fd; // eventfd for the destructor
+			watch listen_watch;
+			watch work_watch;
+			watch wake_watch;
+			std::vector<client*> clients;
+			std::vector<watch*> pending_hellos; // accepted connections without a hello
+			client** port_clients; // by port of dev
+			pthread_t thread;
+			volatile bool shutdown;
+			size_t client_count;
+
+			broker(const broker&) _LIB_USB_VHCI_NOEXCEPT;
+			broker& operator=(const broker&) _LIB_USB_VHCI_NOEXCEPT;
+
+			static void* thread_start(void* _this) _LIB_USB_VHCI_NOEXCEPT;
+			void run() _LIB_USB_VHCI_NOEXCEPT;
+			void accept_client() _LIB_USB_VHCI_NOEXCEPT;
+			void receive_hello(watch* w) _LIB_USB_VHCI_NOEXCEPT;
+			void welcome_client(int fd, const remote_hello& h) _LIB_USB_VHCI_NOEXCEPT;
+			// drops the pending hellos which timed out (or all of them); returns the
+			// epoll timeout for the others in milliseconds (-1 if there are none)
+			int drop_pending_hellos(bool all) _LIB_USB_VHCI_NOEXCEPT;
+			void remove_client(client* cl) _LIB_USB_VHCI_NOEXCEPT;
+			void route_work(work* w) _LIB_USB_VHCI_NOEXCEPT;
+			// false, if the ring to the client is full
+			bool deliver(client* cl, work* w) _LIB_USB_VHCI_NOEXCEPT;
+			bool send_port_stat(client* cl, uint8_t port, const port_stat& stat) _LIB_USB_VHCI_NOEXCEPT;
+			bool flush_backlog(client* cl) _LIB_USB_VHCI_NOEXCEPT;
+			bool receive(client* cl) _LIB_USB_VHCI_NOEXCEPT;
+			// hdr is the copy of the header of m (see remote_ring::peek)
+			void giveback(client* cl, const remote_msg& hdr, const remote_msg* m) _LIB_USB_VHCI_NOEXCEPT;
+			void port_op(client* cl, const remote_msg& hdr) _LIB_USB_VHCI_NOEXCEPT;
+			void finish(work* w) _LIB_USB_VHCI_NOEXCEPT;
+			void fail_work(work* w, int32_t status) _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			// ring_size: bytes per direction and client (a power of two); urbs with more
+			// than half of it are answered with USB_VHCI_STATUS_BUFFER_OVERRUN
+			broker(hcd& dev, const std::string& path, uint32_t ring_size = 4u << 20) _LIB_USB_VHCI_THROW((std::exception));
+			// disconnects all clients and removes the socket
+			~broker() _LIB_USB_VHCI_NOEXCEPT;
+
+			size_t get_client_count() const volatile _LIB_USB_VHCI_NOEXCEPT { return __atomic_load_n(&client_count, __ATOMIC_RELAXED); }
+		};
+
+		// Runs the works of an hcd on a pool of worker threads. Works are sorted into
+		// strands by port and endpoint (port stat works go to the strand of endpoint 0 of
+		// their port, cancel urb works to the strand of their urb); the works of a strand are handled one after another
+		// in the order in which the hcd delivered them, different strands run in parallel.
+		// Every worker has its own queue of ready strands and steals from the others when
+		// it is idle. After the handler returns, the executor calls finish_work for the
+		// work (which may be done from any thread).
+		class executor
+		{
+		private:
+			struct strand
+			{
+				std::deque<work*> works;
+				uint64_t current; // handle of the urb which is being handled by a worker (or 0)
+				bool scheduled;   // in a ready queue or being handled by a worker
+				strand* next;     // link in the ready queue
+				strand() _LIB_USB_VHCI_NOEXCEPT : works(), current(0), scheduled(false), next(NULL) { }
+			private:
+				strand(const strand&) _LIB_USB_VHCI_NOEXCEPT;
+				strand& operator=(const strand&) _LIB_USB_VHCI_NOEXCEPT;
+			};
+
+			struct worker
+			{
+				executor* owner;
+				unsigned int index;
+				pthread_t thread;
+				pthread_cond_t wake;
+				strand* head;   // ready queue
+				strand* tail;
+				bool waiting;
+			};
+
+			hcd& dev;
+			void (*func)(void*, hcd&, work*); // must not throw
+			void* arg;
+			pthread_mutex_t mutex;
+			strand* strands; // 32 per port (16 endpoint numbers, 2 directions)
+			worker* workers;
+			unsigned int worker_count;
+			pthread_t dispatcher;
+			int wake_fd; // eventfd; wakes up the dispatcher on shutdown
+			volatile bool shutdown;
+			bool stopping;
+			size_t prefault_size; // of the thread policy of dev
+
+			executor(const executor&) _LIB_USB_VHCI_NOEXCEPT;
+			executor& operator=(const executor&) _LIB_USB_VHCI_NOEXCEPT;
+
+			static void* dispatcher_start(void* _this) _LIB_USB_VHCI_NOEXCEPT;
+			static void* worker_start(void* w) _LIB_USB_VHCI_NOEXCEPT;
+			void dispatch() _LIB_USB_VHCI_NOEXCEPT;
+			void run(worker& self) _LIB_USB_VHCI_NOEXCEPT;
+			void enqueue(worker& k, strand* s) _LIB_USB_VHCI_NOEXCEPT;
+			void schedule(worker& k, strand* s) _LIB_USB_VHCI_NOEXCEPT;
+			strand* take_strand(worker& self) _LIB_USB_VHCI_NOEXCEPT;
+			static size_t strand_index(const usb::urb* urb) _LIB_USB_VHCI_NOEXCEPT;
+			strand& strand_of(const work* w) _LIB_USB_VHCI_NOEXCEPT;
+			void stop(unsigned int running) _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			// threads == 0: one per online cpu; the threads get the thread policy of dev
+			// (see hcd::set_thread_policy)
+			executor(hcd& dev,
+			         void (*func)(void* arg, hcd& from, work* w),
+			         void* arg,
+			         unsigned int threads = 0) _LIB_USB_VHCI_THROW((std::exception));
+			// handles all works which were fetched already, before it returns
+			~executor() _LIB_USB_VHCI_NOEXCEPT;
+
+			unsigned int get_thread_count() const _LIB_USB_VHCI_NOEXCEPT { return worker_count; }
+		};
+
+		// Waits for many local_hcds on one thread (with one epoll), instead of one
+		// background thread per local_hcd. An added local_hcd stops its background
+		// thread; run and run_once fetch its works from the vhci-hcd instead and call
+		// its handler, when it has works which can be fetched with next_work or
+		// next_work_batch. The handler has to fetch all of them, because it gets called
+		// again only for works which are enqueued afterwards.
+		// Except for stop, the methods must be called from the thread which runs the
+		// reactor (e.g. from a handler) or while no thread runs it.
+		class reactor
+		{
+		private:
+			struct source;
+
+			struct watch
+			{
+				source* src;
+				bool vhci; // vhci-hcd fd or work fd of the hcd
+			};
+
+			struct source
+			{
+				local_hcd* dev;
+				hcd::callback handler;
+				watch vhci_watch;
+				watch work_watch;
+				source(local_hcd& dev, const hcd::callback& handler) _LIB_USB_VHCI_NOEXCEPT;
+			private:
+				source(const source&) _LIB_USB_VHCI_NOEXCEPT;
+				source& operator=(const source&) _LIB_USB_VHCI_NOEXCEPT;
+			};
+
+			int epoll_fd;
+			int wake_fd; // eventfd for stop
+			std::vector<source*> sources;
+			std::vector<source*> removed; // deleted when no events refer to them anymore
+			bool dispatching;
+			volatile bool stopped;
+
+			reactor(const reactor&) _LIB_USB_VHCI_NOEXCEPT;
+			reactor& operator=(const reactor&) _LIB_USB_VHCI_NOEXCEPT;
+
+			void dispatch(watch* w) _LIB_USB_VHCI_NOEXCEPT;
+
+		public:
+			reactor() _LIB_USB_VHCI_THROW((std::exception));
+			// removes the local_hcds which are still added (they get their background
+			// threads back)
+			~reactor() _LIB_USB_VHCI_NOEXCEPT;
+
+			// handler is called with the hcd which has works to fetch
+			void add(local_hcd& dev, hcd::callback handler) _LIB_USB_VHCI_THROW((std::exception));
+			// restarts the background thread of dev; returns false, if dev was not added
+			bool remove(local_hcd& dev) _LIB_USB_VHCI_THROW((std::exception));
+			size_t get_controller_count() const _LIB_USB_VHCI_NOEXCEPT { return sources.size(); }
+			// handles the events which arrive within timeout (in milliseconds, -1 waits
+			// forever); returns false on timeout
+			bool run_once(int timeout = -1) _LIB_USB_VHCI_NOEXCEPT;
+			// loops until stop is called
+			void run() _LIB_USB_VHCI_NOEXCEPT;
+			// may be called from any thread (and from handlers)
+			void stop() _LIB_USB_VHCI_NOEXCEPT;
+		};
+
+		// Reports the statistics of an hcd periodically on a thread of its own: calls a
+		// callback (which may use get_statistics and get_port_statistics) or writes
+		// dump_statistics into a stream every interval milliseconds.
+		class statistics_dump
+		{
+		private:
+			hcd& dev;
+			hcd::callback cb;
+			FILE* file;
+			int interval;
+			pthread_t thread;
+			pthread_mutex_t mutex;
+			pthread_cond_t wake;
+			bool shutdown;
+
+			statistics_dump(const statistics_dump&) _LIB_USB_VHCI_NOEXCEPT;
+			statistics_dump& operator=(const statistics_dump&) _LIB_USB_VHCI_NOEXCEPT;
+
+			static void* thread_start(void* _this) _LIB_USB_VHCI_NOEXCEPT;
+			static void dump_to_file(void* _this, hcd& from) _LIB_USB_VHCI_NOEXCEPT;
+			void start() _LIB_USB_VHCI_THROW((std::exception));
+			void run() _LIB_USB_VHCI_NOEXCEPT;
 
 		public:
-			explicit local_hcd(uint8_t ports) throw(std::exception);
-			virtual ~local_hcd() throw();
-
-			int32_t get_vhci_id() volatile throw() { return id; }
-			const std::string& get_bus_id() volatile throw() { return const_cast<const std::string&>(bus_id); }
-			int32_t get_usb_bus_num() volatile throw() { return usb_bus_num; }
-			virtual void bg_work() volatile throw();
-			virtual const port_stat& get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range);
-			virtual void port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception);
-			virtual void port_disconnect(uint8_t port) volatile throw(std::exception);
-			virtual void port_disable(uint8_t port) volatile throw(std::exception);
-			virtual void port_resumed(uint8_t port) volatile throw(std::exception);
-			virtual void port_overcurrent(uint8_t port, bool set) volatile throw(std::exception);
-			virtual void port_reset_done(uint8_t port, bool enable = true) volatile throw(std::exception);
+			statistics_dump(hcd& dev, hcd::callback cb, int interval) _LIB_USB_VHCI_THROW((std::exception));
+			statistics_dump(hcd& dev, FILE* f, int interval) _LIB_USB_VHCI_THROW((std::exception));
+			// stops the thread (without a last report)
+			~statistics_dump() _LIB_USB_VHCI_NOEXCEPT;
 		};
 	}
 }
@@ -0,0 +1,610 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Header-only C++17 interface on top of the C functions of libusb_vhci.h. In contrast
+// to the classes of libusb_vhci.h, urbs are move-only values (no vtable, no deep
+// copies), accessors are noexcept and errors are reported as std::system_error. It
+// doesn't depend on the standard which the library was built with.
+// With C++20 coroutines, scheduler and task allow writing a device as coroutines which
+// wait for the urbs of their endpoints.
+
+#ifndef _LIBUSB_VHCI_HPP
+#define _LIBUSB_VHCI_HPP 1
+
+#if __cplusplus < 201703L
+#error "libusb_vhci.hpp needs C++17"
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <variant>
+#include <vector>
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+#if __cplusplus > 201703L && __has_include(<coroutine>)
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#endif
+
+#include "libusb_vhci.h"
+
+namespace usb::vhci::v2
+{
+#if defined(__cpp_lib_span)
+	template<typename T> using span = std::span<T>;
+#else
+	// what we need of std::span (C++20)
+	template<typename T>
+	class span final
+	{
+	private:
+		T* ptr;
+		size_t len;
+
+	public:
+		constexpr span() noexcept : ptr(nullptr), len(0) { }
+		constexpr span(T* data, size_t size) noexcept : ptr(data), len(size) { }
+		constexpr T* data() const noexcept { return ptr; }
+		constexpr size_t size() const noexcept { return len; }
+		constexpr bool empty() const noexcept { return !len; }
+		constexpr T* begin() const noexcept { return ptr; }
+		constexpr T* end() const noexcept { return ptr + len; }
+		constexpr T& operator[](size_t i) const noexcept { return ptr[i]; }
+	};
+#endif
+
+	class urb final
+	{
+	private:
+		usb_vhci_urb u{};
+		std::unique_ptr<uint8_t[]> buffer_;
+		std::unique_ptr<usb_vhci_iso_packet[]> iso_packets_;
+
+	public:
+		urb() noexcept = default;
+
+		// allocates the buffer and the iso packets for an urb which was fetched by
+		// usb_vhci_fetch_work (the data still has to be fetched)
+		explicit urb(const usb_vhci_urb& fetched) : u(fetched)
+		{
+			if(u.buffer_length > 0) buffer_.reset(new uint8_t[u.buffer_length]);
+			else u.buffer_length = 0;
+			if(usb_vhci_is_iso(u.type) && u.packet_count > 0)
+				iso_packets_.reset(new usb_vhci_iso_packet[u.packet_count]());
+			else u.packet_count = 0;
+			u.buffer = buffer_.get();
+			u.iso_packets = iso_packets_.get();
+		}
+
+		urb(urb&&) noexcept = default;
+		urb& operator=(urb&&) noexcept = default;
+		urb(const urb&) = delete;
+		urb& operator=(const urb&) = delete;
+
+		// for the C functions; buffer and iso_packets must not be changed
+		const usb_vhci_urb& c_urb() const noexcept { return u; }
+		usb_vhci_urb& c_urb() noexcept { return u; }
+
+		uint64_t handle() const noexcept { return u.handle; }
+		urb_type type() const noexcept { return static_cast<urb_type>(u.type); }
+		uint8_t devadr() const noexcept { return u.devadr; }
+		uint8_t epadr() const noexcept { return u.epadr; }
+		uint8_t endpoint_number() const noexcept { return u.epadr & 0x0f; }
+		bool is_in() const noexcept { return u.epadr & 0x80; }
+		bool is_out() const noexcept { return !is_in(); }
+		bool is_control() const noexcept { return u.type == USB_VHCI_URB_TYPE_CONTROL; }
+		bool is_bulk() const noexcept { return u.type == USB_VHCI_URB_TYPE_BULK; }
+		bool is_interrupt() const noexcept { return u.type == USB_VHCI_URB_TYPE_INT; }
+		bool is_isochronous() const noexcept { return u.type == USB_VHCI_URB_TYPE_ISO; }
+		uint16_t flags() const noexcept { return u.flags; }
+		int32_t interval() const noexcept { return u.interval; }
+		uint8_t bmRequestType() const noexcept { return u.bmRequestType; }
+		uint8_t bRequest() const noexcept { return u.bRequest; }
+		uint16_t wValue() const noexcept { return u.wValue; }
+		uint16_t wIndex() const noexcept { return u.wIndex; }
+		uint16_t wLength() const noexcept { return u.wLength; }
+
+		// the whole buffer (OUT data, or room for IN data)
+		span<uint8_t> buffer() const noexcept { return span<uint8_t>(u.buffer, u.buffer_length); }
+		span<usb_vhci_iso_packet> iso_packets() const noexcept
+		{ return span<usb_vhci_iso_packet>(u.iso_packets, u.packet_count); }
+		int32_t buffer_actual() const noexcept { return u.buffer_actual; }
+		void set_buffer_actual(int32_t value) noexcept { u.buffer_actual = value; }
+		int32_t status() const noexcept { return u.status; }
+		void set_status(int32_t value) noexcept { u.status = value; }
+		int32_t error_count() const noexcept { return u.error_count; }
+		void set_error_count(int32_t value) noexcept { u.error_count = value; }
+		void ack() noexcept { u.status = USB_VHCI_STATUS_SUCCESS; }
+		void stall() noexcept { u.status = USB_VHCI_STATUS_STALL; }
+	};
+
+	struct port_stat_work
+	{
+		uint8_t port;
+		usb_vhci_port_stat stat;
+		uint8_t triggers; // USB_VHCI_PORT_STAT_TRIGGER_* (compared to the previous stat)
+	};
+
+	struct cancel_urb_work
+	{
+		uint64_t handle;
+	};
+
+	using work = std::variant<port_stat_work, urb, cancel_urb_work>;
+
+	class controller final
+	{
+	private:
+		int fd_ = -1;
+		int32_t id_ = 0;
+		int32_t usb_bus_num_ = 0;
+		std::string bus_id_;
+		std::vector<usb_vhci_port_stat> prev_; // last stat of every port
+
+		controller() = default;
+
+		static void check(int res, const char* what)
+		{
+			if(res == -1) throw std::system_error(errno, std::generic_category(), what);
+		}
+
+		void init(int fd, char* bus_id, uint8_t ports)
+		{
+			check(fd, "usb_vhci_open");
+			fd_ = fd;
+			if(bus_id)
+			{
+				bus_id_.assign(bus_id);
+				std::free(bus_id);
+			}
+			prev_.resize(ports);
+		}
+
+	public:
+		explicit controller(uint8_t ports)
+		{
+			char* bus_id(nullptr);
+			int fd(usb_vhci_open(ports, &id_, &usb_bus_num_, &bus_id));
+			init(fd, bus_id, ports);
+		}
+
+		// see usb_vhci_sim_open; the host side is driven by the usb_vhci_sim_* functions
+		static controller simulated(uint8_t ports, uint32_t flags = 0)
+		{
+			controller c;
+			char* bus_id(nullptr);
+			int fd(usb_vhci_sim_open(ports, flags, &c.id_, &c.usb_bus_num_, &bus_id));
+			c.init(fd, bus_id, ports);
+			return c;
+		}
+
+		controller(controller&& other) noexcept :
+			fd_(std::exchange(other.fd_, -1)),
+			id_(other.id_),
+			usb_bus_num_(other.usb_bus_num_),
+			bus_id_(std::move(other.bus_id_)),
+			prev_(std::move(other.prev_))
+		{
+		}
+
+		controller& operator=(controller&& other) noexcept
+		{
+			if(this != &other)
+			{
+				if(fd_ != -1) usb_vhci_close(fd_);
+				fd_ = std::exchange(other.fd_, -1);
+				id_ = other.id_;
+				usb_bus_num_ = other.usb_bus_num_;
+				bus_id_ = std::move(other.bus_id_);
+				prev_ = std::move(other.prev_);
+			}
+			return *this;
+		}
+
+		controller(const controller&) = delete;
+		controller& operator=(const controller&) = delete;
+
+		~controller()
+		{
+			if(fd_ != -1) usb_vhci_close(fd_);
+		}
+
+		int fd() const noexcept { return fd_; }
+		int32_t id() const noexcept { return id_; }
+		int32_t usb_bus_num() const noexcept { return usb_bus_num_; }
+		const std::string& bus_id() const noexcept { return bus_id_; }
+		uint8_t port_count() const noexcept { return static_cast<uint8_t>(prev_.size()); }
+
+		// returns the next work (with the data of OUT urbs), or nothing if the timeout
+		// (in milliseconds, -1 waits forever) expired or a signal was caught
+		std::optional<work> fetch_work(int16_t timeout = -1)
+		{
+			usb_vhci_work w;
+			int res(usb_vhci_fetch_work_timeout(fd_, &w, timeout));
+			if(res == -1)
+			{
+				if(errno == ETIMEDOUT || errno == EINTR || errno == ENODATA) return std::nullopt;
+				check(res, "usb_vhci_fetch_work");
+			}
+			switch(w.type)
+			{
+			case USB_VHCI_WORK_TYPE_PORT_STAT:
+			{
+				port_stat_work psw{w.work.port_stat.index, w.work.port_stat, 0};
+				if(psw.port && psw.port <= prev_.size())
+				{
+					usb_vhci_port_stat& prev(prev_[psw.port - 1]);
+					psw.triggers = usb_vhci_port_stat_triggers(&psw.stat, &prev);
+					prev = psw.stat;
+				}
+				return work(std::in_place_type<port_stat_work>, psw);
+			}
+			case USB_VHCI_WORK_TYPE_PROCESS_URB:
+			{
+				urb u(w.work.urb);
+				if(res && usb_vhci_fetch_data(fd_, &u.c_urb()) == -1)
+				{
+					// canceled in the meantime
+					if(errno == ECANCELED) return std::nullopt;
+					check(-1, "usb_vhci_fetch_data");
+				}
+				return work(std::in_place_type<urb>, std::move(u));
+			}
+			case USB_VHCI_WORK_TYPE_CANCEL_URB:
+				return work(std::in_place_type<cancel_urb_work>, cancel_urb_work{w.work.handle});
+			default:
+				return std::nullopt;
+			}
+		}
+
+		void giveback(const urb& u) { check(usb_vhci_giveback(fd_, &u.c_urb()), "usb_vhci_giveback"); }
+		// gives back an IN urb with data from memory of the caller (no copy into u's buffer)
+		void giveback(const urb& u, span<const uint8_t> data)
+		{
+			iovec iov;
+			iov.iov_base = const_cast<uint8_t*>(data.data());
+			iov.iov_len = data.size();
+			check(usb_vhci_giveback_iov(fd_, &u.c_urb(), &iov, 1), "usb_vhci_giveback_iov");
+		}
+		void giveback(const urb& u, span<const iovec> iov)
+		{
+			check(usb_vhci_giveback_iov(fd_, &u.c_urb(), iov.data(), static_cast<int>(iov.size())),
+			      "usb_vhci_giveback_iov");
+		}
+		void port_connect(uint8_t port, data_rate rate)
+		{ check(usb_vhci_port_connect(fd_, port, rate), "usb_vhci_port_connect"); }
+		void port_disconnect(uint8_t port) { check(usb_vhci_port_disconnect(fd_, port), "usb_vhci_port_disconnect"); }
+		void port_disable(uint8_t port) { check(usb_vhci_port_disable(fd_, port), "usb_vhci_port_disable"); }
+		void port_resumed(uint8_t port) { check(usb_vhci_port_resumed(fd_, port), "usb_vhci_port_resumed"); }
+		void port_overcurrent(uint8_t port, bool set)
+		{ check(usb_vhci_port_overcurrent(fd_, port, set), "usb_vhci_port_overcurrent"); }
+		void port_reset_done(uint8_t port, bool enable = true)
+		{ check(usb_vhci_port_reset_done(fd_, port, enable), "usb_vhci_port_reset_done"); }
+		// makes a fetch_work, which waits in another thread, return std::nullopt
+		void kick() { check(usb_vhci_kick(fd_), "usb_vhci_kick"); }
+	};
+
+#if defined(__cpp_impl_coroutine) && defined(__cpp_lib_coroutine)
+	class scheduler;
+
+	// coroutine which is started by scheduler::spawn
+	class task final
+	{
+	public:
+		struct promise_type
+		{
+			std::exception_ptr exception;
+
+			task get_return_object() noexcept
+			{ return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() noexcept { }
+			void unhandled_exception() noexcept { exception = std::current_exception(); }
+		};
+
+	private:
+		std::coroutine_handle<promise_type> h;
+
+		explicit task(std::coroutine_handle<promise_type> h) noexcept : h(h) { }
+
+		friend class scheduler;
+
+	public:
+		task(task&& other) noexcept : h(std::exchange(other.h, nullptr)) { }
+		task& operator=(task&& other) noexcept
+		{
+			if(this != &other)
+			{
+				if(h) h.destroy();
+				h = std::exchange(other.h, nullptr);
+			}
+			return *this;
+		}
+		task(const task&) = delete;
+		task& operator=(const task&) = delete;
+		~task() { if(h) h.destroy(); }
+	};
+
+	// Runs tasks on the thread which calls run or run_once. The tasks are resumed when
+	// the urbs they wait for arrive on the file descriptor of the controller.
+	// Like local_hcd, the scheduler keeps track of the addresses of the ports, answers
+	// SET_ADDRESS requests and completes port resets and resumes by itself. Urbs
+	// which are canceled before a task took them are given back as canceled. Urbs
+	// which a task already took are up to the task.
+	class scheduler final
+	{
+	private:
+		struct endpoint
+		{
+			std::deque<urb> pending;
+			std::coroutine_handle<> waiter;
+		};
+
+		struct port_info
+		{
+			uint8_t adr = 0xff;
+			bool connected = false;
+			std::deque<port_stat_work> pending;
+			std::coroutine_handle<> waiter;
+		};
+
+		controller& ctl;
+		std::vector<port_info> ports;
+		std::vector<endpoint> endpoints; // 32 per port (16 endpoint numbers, 2 directions)
+		std::deque<std::coroutine_handle<>> ready;
+		std::vector<std::coroutine_handle<task::promise_type>> tasks;
+		bool stopped = false;
+
+		endpoint& endpoint_of(uint8_t port, uint8_t epadr)
+		{
+			if(!port || port > ports.size()) throw std::out_of_range("port");
+			// both directions of endpoint 0 share one queue
+			size_t i(epadr & 0x0f);
+			if(i && (epadr & 0x80)) i |= 0x10;
+			return endpoints[(port - 1) * 32 + i];
+		}
+
+		void resume_later(std::coroutine_handle<>& waiter)
+		{
+			if(waiter) ready.push_back(std::exchange(waiter, nullptr));
+		}
+
+		void handle_port_stat(const port_stat_work& psw)
+		{
+			if(!psw.port || psw.port > ports.size()) return;
+			port_info& p(ports[psw.port - 1]);
+			const usb_vhci_port_stat& s(psw.stat);
+			// invalidate address on CONNECTION state change, set it to 0 after a reset
+			if(s.change & USB_VHCI_PORT_STAT_C_CONNECTION) p.adr = 0xff;
+			if((s.change & USB_VHCI_PORT_STAT_C_RESET) && !(s.status & USB_VHCI_PORT_STAT_RESET) &&
+			   (s.status & USB_VHCI_PORT_STAT_ENABLE))
+				p.adr = 0x00;
+			p.connected = s.status & USB_VHCI_PORT_STAT_CONNECTION;
+			if(p.connected && (psw.triggers & USB_VHCI_PORT_STAT_TRIGGER_RESET))
+				ctl.port_reset_done(psw.port);
+			if(p.connected && (psw.triggers & USB_VHCI_PORT_STAT_TRIGGER_RESUMING))
+				ctl.port_resumed(psw.port);
+			p.pending.push_back(psw);
+			resume_later(p.waiter);
+		}
+
+		void handle_urb(urb&& u)
+		{
+			uint8_t port(0);
+			for(size_t i(0); i < ports.size(); i++)
+				if(ports[i].adr == u.devadr()) port = static_cast<uint8_t>(i + 1);
+			if(!port)
+			{
+				// no device with this address
+				u.set_status(USB_VHCI_STATUS_TIMEDOUT);
+				ctl.giveback(u);
+				return;
+			}
+			if(u.is_control() && !u.endpoint_number() && !u.bmRequestType() && u.bRequest() == 5)
+			{
+				// SET_ADDRESS
+				if(u.wValue() > 0x7f) u.stall();
+				else
+				{
+					u.ack();
+					ports[port - 1].adr = static_cast<uint8_t>(u.wValue());
+				}
+				ctl.giveback(u);
+				return;
+			}
+			endpoint& ep(endpoint_of(port, u.epadr()));
+			ep.pending.push_back(std::move(u));
+			resume_later(ep.waiter);
+		}
+
+		void handle_cancel(uint64_t handle)
+		{
+			for(endpoint& ep : endpoints)
+			{
+				for(auto i(ep.pending.begin()); i != ep.pending.end(); i++)
+				{
+					if(i->handle() == handle)
+					{
+						i->set_status(USB_VHCI_STATUS_CANCELED);
+						ctl.giveback(*i);
+						ep.pending.erase(i);
+						return;
+					}
+				}
+			}
+		}
+
+		// resumes everything which is ready; rethrows the exceptions of the tasks
+		void resume_ready()
+		{
+			while(!ready.empty())
+			{
+				std::coroutine_handle<> h(ready.front());
+				ready.pop_front();
+				h.resume();
+			}
+			for(auto i(tasks.begin()); i != tasks.end();)
+			{
+				if(!i->done())
+				{
+					i++;
+					continue;
+				}
+				std::exception_ptr e(i->promise().exception);
+				i->destroy();
+				i = tasks.erase(i);
+				if(e) std::rethrow_exception(e);
+			}
+		}
+
+	public:
+		class urb_awaiter
+		{
+		private:
+			endpoint& ep;
+
+		public:
+			explicit urb_awaiter(endpoint& ep) noexcept : ep(ep) { }
+			bool await_ready() const noexcept { return !ep.pending.empty(); }
+			void await_suspend(std::coroutine_handle<> h)
+			{
+				if(ep.waiter) throw std::logic_error("endpoint is awaited already");
+				ep.waiter = h;
+			}
+			urb await_resume()
+			{
+				urb u(std::move(ep.pending.front()));
+				ep.pending.pop_front();
+				return u;
+			}
+		};
+
+		class port_stat_awaiter
+		{
+		private:
+			port_info& p;
+
+		public:
+			explicit port_stat_awaiter(port_info& p) noexcept : p(p) { }
+			bool await_ready() const noexcept { return !p.pending.empty(); }
+			void await_suspend(std::coroutine_handle<> h)
+			{
+				if(p.waiter) throw std::logic_error("port is awaited already");
+				p.waiter = h;
+			}
+			port_stat_work await_resume()
+			{
+				port_stat_work psw(p.pending.front());
+				p.pending.pop_front();
+				return psw;
+			}
+		};
+
+		explicit scheduler(controller& ctl) :
+			ctl(ctl),
+			ports(ctl.port_count()),
+			endpoints(ctl.port_count() * 32)
+		{
+		}
+
+		scheduler(const scheduler&) = delete;
+		scheduler& operator=(const scheduler&) = delete;
+
+		~scheduler()
+		{
+			for(auto h : tasks) h.destroy();
+		}
+
+		// the task runs until its first co_await right away
+		void spawn(task&& t)
+		{
+			if(!t.h) throw std::invalid_argument("t");
+			tasks.push_back(std::exchange(t.h, nullptr));
+			ready.push_back(tasks.back());
+			resume_ready();
+		}
+
+		// co_await next_urb(port, epadr) returns the next urb for the endpoint (only one
+		// task at a time may wait for an endpoint; the direction bit of epadr is
+		// ignored for endpoint 0)
+		urb_awaiter next_urb(uint8_t port, uint8_t epadr) { return urb_awaiter(endpoint_of(port, epadr)); }
+
+		// co_await next_port_stat(port) returns the next port stat of the port
+		port_stat_awaiter next_port_stat(uint8_t port)
+		{
+			if(!port || port > ports.size()) throw std::out_of_range("port");
+			return port_stat_awaiter(ports[port - 1]);
+		}
+
+		// gives the urb back (doesn't block, so it can be co_awaited or just called)
+		std::suspend_never complete(urb&& u)
+		{
+			ctl.giveback(u);
+			return {};
+		}
+
+		// handles the works which arrive within timeout (in milliseconds, -1 waits
+		// forever) and resumes the tasks which got something to do; returns false, if
+		// the timeout expired
+		bool run_once(int16_t timeout = -1)
+		{
+			std::optional<work> w(ctl.fetch_work(timeout));
+			if(!w) return false;
+			if(auto* psw = std::get_if<port_stat_work>(&*w)) handle_port_stat(*psw);
+			else if(auto* u = std::get_if<urb>(&*w)) handle_urb(std::move(*u));
+			else if(auto* cw = std::get_if<cancel_urb_work>(&*w)) handle_cancel(cw->handle);
+			resume_ready();
+			return true;
+		}
+
+		// loops until stop is called or all tasks are done
+		void run()
+		{
+			stopped = false;
+			while(!stopped && !tasks.empty())
+				run_once(100);
+		}
+
+		void stop() noexcept { stopped = true; }
+		size_t task_count() const noexcept { return tasks.size(); }
+	};
+#endif
+}
+
+#endif // _LIBUSB_VHCI_HPP
@@ -0,0 +1,568 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Capture of urbs into a pcap file (usbmon format). Every thread which passes a capture
+ * point gets a ring of its own, in which it is the only producer; the writer thread is
+ * the only consumer of all rings. It is woken up early when a ring gets half full, and a
+ * producer whose ring is full waits for it for a while before dropping the record.
+ * Records carry the generation of the capture, so that records which were produced while
+ * a capture stopped don't end up in the next one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libusb_vhci.h"
+#include "libusb_vhci_trace.h"
+
+#define CAPTURE_RING_SIZE           (1u << 20) // per thread (power of two)
+#define CAPTURE_MAX_SNAPLEN         (CAPTURE_RING_SIZE / 4)
+#define CAPTURE_MAX_ISO_DESCRIPTORS 1024
+#define CAPTURE_INTERVAL_MS         10         // of the writer thread
+#define CAPTURE_WAIT_MS             100        // for room in a full ring, before dropping
+#define CAPTURE_MAX_FDS             1024       // with a known bus number
+#define CAPTURE_SKIP                0xffffffffu
+
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+
+// the header of the binary interface of usbmon (64 bytes)
+struct usbmon_packet
+{
+	uint64_t id;          // urb handle
+	uint8_t type;         // 'S'ubmission or 'C'ompletion
+	uint8_t xfer_type;    // same as USB_VHCI_URB_TYPE_*
+	uint8_t epnum;        // with direction bit
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;      // 0, if setup is valid
+	char flag_data;       // 0, if there is data
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;       // -errno
+	uint32_t length;      // of the transfer
+	uint32_t len_cap;     // of the data in the record
+	union
+	{
+		uint8_t setup[8];
+		struct
+		{
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;       // number of iso descriptors which follow the header
+};
+
+struct usbmon_iso_desc
+{
+	int32_t status;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t pad;
+};
+
+struct pcap_file_header
+{
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+	uint32_t ts_sec, ts_usec;
+	uint32_t incl_len, orig_len;
+};
+
+// a record in a ring: followed by a pcap_record_header, the usbmon_packet, the iso
+// descriptors and the data; size is a multiple of 8
+struct ring_record
+{
+	uint32_t size;
+	uint32_t gen; // CAPTURE_SKIP: the rest of the ring is unused
+};
+
+struct capture_ring
+{
+	char *buf;
+	uint64_t head;    // written by the producer only
+	uint64_t tail;    // written by the writer only
+	uint64_t dropped;
+	int woken;        // set by the producer when it woke the writer, cleared by the writer
+	int dead;         // the thread has exited
+	struct capture_ring *next;
+};
+
+int usb_vhci_capture_active = 0;
+
+// everything but the rings themselves is protected by capture_lock
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t capture_drained = PTHREAD_COND_INITIALIZER;
+static struct capture_ring *rings = NULL;
+static FILE *capture_file = NULL;
+static pthread_t writer;
+static int writer_stop = 0;
+static int write_error = 0;
+static struct usb_vhci_capture_stats stats;
+// read by the producers while the capture is active
+static uint32_t capture_gen = 0;
+static uint32_t capture_snaplen = 0;
+static int64_t mono_to_real = 0; // ns
+
+// usb bus number of the controller of an fd (0, if unknown); set by usb_vhci_open
+static uint16_t fd_busnum[CAPTURE_MAX_FDS];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct capture_ring *my_ring = NULL;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// now + ms for pthread_cond_timedwait
+static void deadline(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += ms % 1000 * 1000000L;
+	if(ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void free_ring(struct capture_ring *r)
+{
+	free(r->buf);
+	free(r);
+}
+
+// thread exit
+static void ring_destructor(void *p)
+{
+	struct capture_ring *r = p;
+	pthread_mutex_lock(&capture_lock);
+	if(capture_file)
+	{
+		// the writer drains and frees it
+		__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		struct capture_ring **pr;
+		for(pr = &rings; *pr != r; pr = &(*pr)->next);
+		*pr = r->next;
+		free_ring(r);
+	}
+	pthread_mutex_unlock(&capture_lock);
+	my_ring = NULL;
+}
+
+static void create_key(void)
+{
+	pthread_key_create(&ring_key, ring_destructor);
+}
+
+static struct capture_ring *get_ring(void)
+{
+	struct capture_ring *r = my_ring;
+	if(r)
+		return r;
+	pthread_once(&key_once, create_key);
+	if(!(r = calloc(1, sizeof *r)))
+		return NULL;
+	if(!(r->buf = malloc(CAPTURE_RING_SIZE)))
+	{
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_lock(&capture_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&capture_lock);
+	pthread_setspecific(ring_key, r);
+	return my_ring = r;
+}
+
+// reserves size bytes (a multiple of 8) in the ring of the calling thread; NULL if full
+static struct ring_record *ring_reserve(struct capture_ring *r, uint32_t size, uint64_t *new_head)
+{
+	uint64_t head = r->head;
+	const uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	const uint32_t off = (uint32_t)head & (CAPTURE_RING_SIZE - 1);
+	const uint32_t contig = CAPTURE_RING_SIZE - off;
+	const uint64_t need = (contig < size) ? (uint64_t)contig + size : size;
+	if(head + need - tail > CAPTURE_RING_SIZE)
+		return NULL;
+	if(contig < size)
+	{
+		// records don't wrap around
+		struct ring_record *skip = (struct ring_record *)(r->buf + off);
+		skip->size = contig;
+		skip->gen = CAPTURE_SKIP;
+		head += contig;
+	}
+	*new_head = head + size;
+	return (struct ring_record *)(r->buf + ((uint32_t)head & (CAPTURE_RING_SIZE - 1)));
+}
+
+// the ring of the calling thread is full: wakes the writer and waits until it made room
+// (CAPTURE_WAIT_MS at most, so that a writer which is stuck in fwrite costs records, but
+// doesn't stall the device); NULL if the record has to be dropped
+static struct ring_record *ring_wait(struct capture_ring *r, uint32_t size, uint64_t *new_head)
+{
+	struct ring_record *rec;
+	struct timespec ts;
+	int timed_out = 0;
+	deadline(&ts, CAPTURE_WAIT_MS);
+	pthread_mutex_lock(&capture_lock);
+	pthread_cond_signal(&capture_wake);
+	while(!(rec = ring_reserve(r, size, new_head)) && capture_file && !writer_stop && !timed_out)
+		timed_out = pthread_cond_timedwait(&capture_drained, &capture_lock, &ts) == ETIMEDOUT;
+	pthread_mutex_unlock(&capture_lock);
+	return rec;
+}
+
+// copies the first len bytes of iov to dst
+static void copy_iov(uint8_t *dst, const struct iovec *iov, int iovcnt, uint32_t len)
+{
+	for(int i = 0; len && i < iovcnt; i++)
+	{
+		uint32_t n = (iov[i].iov_len < len) ? (uint32_t)iov[i].iov_len : len;
+		memcpy(dst, iov[i].iov_base, n);
+		dst += n;
+		len -= n;
+	}
+}
+
+static void capture(int fd, const struct usb_vhci_urb *urb, char type, const struct iovec *iov, int iovcnt, uint32_t data_len, uint64_t mono)
+{
+	struct capture_ring *r = get_ring();
+	if(!r)
+		return;
+	const uint32_t gen = __atomic_load_n(&capture_gen, __ATOMIC_ACQUIRE);
+	const uint32_t snaplen = capture_snaplen;
+	const int iso = usb_vhci_is_iso(urb->type);
+	uint32_t ndesc = iso ? (uint32_t)urb->packet_count : 0;
+	if(ndesc > CAPTURE_MAX_ISO_DESCRIPTORS)
+		ndesc = CAPTURE_MAX_ISO_DESCRIPTORS;
+	const uint32_t cap = (data_len < snaplen) ? data_len : snaplen;
+	const uint32_t incl = sizeof(struct usbmon_packet) + ndesc * sizeof(struct usbmon_iso_desc) + cap;
+	const uint32_t size = (sizeof(struct ring_record) + sizeof(struct pcap_record_header) + incl + 7) & ~7u;
+	uint64_t new_head;
+	struct ring_record *rec = ring_reserve(r, size, &new_head);
+	if(!rec && !(rec = ring_wait(r, size, &new_head)))
+	{
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	const uint64_t real = mono + (uint64_t)mono_to_real;
+	struct pcap_record_header *ph = (struct pcap_record_header *)(rec + 1);
+	struct usbmon_packet *mp = (struct usbmon_packet *)(ph + 1);
+	struct usbmon_iso_desc *desc = (struct usbmon_iso_desc *)(mp + 1);
+	rec->size = size;
+	rec->gen = gen;
+	ph->ts_sec = (uint32_t)(real / 1000000000u);
+	ph->ts_usec = (uint32_t)(real % 1000000000u / 1000u);
+	ph->incl_len = incl;
+	ph->orig_len = sizeof(struct usbmon_packet) + ndesc * sizeof(struct usbmon_iso_desc) + data_len;
+	memset(mp, 0, sizeof *mp);
+	mp->id = urb->handle;
+	mp->type = (uint8_t)type;
+	mp->xfer_type = urb->type;
+	mp->epnum = urb->epadr;
+	mp->devnum = urb->devadr;
+	mp->busnum = (fd >= 0 && fd < CAPTURE_MAX_FDS) ? __atomic_load_n(&fd_busnum[fd], __ATOMIC_RELAXED) : 0;
+	mp->ts_sec = (int64_t)ph->ts_sec;
+	mp->ts_usec = (int32_t)ph->ts_usec;
+	mp->flag_setup = '-';
+	mp->flag_data = cap ? 0 : (usb_vhci_is_in(urb->epadr) ? '<' : '>');
+	mp->length = (uint32_t)((type == 'S') ? urb->buffer_length : urb->buffer_actual);
+	mp->len_cap = cap;
+	mp->interval = urb->interval;
+	mp->xfer_flags = urb->flags;
+	mp->ndesc = ndesc;
+	if(type == 'S')
+	{
+		mp->status = -EINPROGRESS;
+		if(usb_vhci_is_control(urb->type))
+		{
+			mp->flag_setup = 0;
+			mp->s.setup[0] = urb->bmRequestType;
+			mp->s.setup[1] = urb->bRequest;
+			mp->s.setup[2] = (uint8_t)urb->wValue;
+			mp->s.setup[3] = (uint8_t)(urb->wValue >> 8);
+			mp->s.setup[4] = (uint8_t)urb->wIndex;
+			mp->s.setup[5] = (uint8_t)(urb->wIndex >> 8);
+			mp->s.setup[6] = (uint8_t)urb->wLength;
+			mp->s.setup[7] = (uint8_t)(urb->wLength >> 8);
+		}
+	}
+	else
+		mp->status = usb_vhci_to_errno(urb->status, iso);
+	if(iso)
+	{
+		mp->s.iso.error_count = (type == 'S') ? 0 : urb->error_count;
+		mp->s.iso.numdesc = urb->packet_count;
+		for(uint32_t i = 0; i < ndesc; i++)
+		{
+			const struct usb_vhci_iso_packet *p = &urb->iso_packets[i];
+			desc[i].status = (type == 'S') ? -EXDEV : usb_vhci_to_iso_packets_errno(p->status);
+			desc[i].offset = p->offset;
+			desc[i].length = (uint32_t)((type == 'S') ? p->packet_length : p->packet_actual);
+			desc[i].pad = 0;
+		}
+	}
+	copy_iov((uint8_t *)(desc + ndesc), iov, iovcnt, cap);
+	__atomic_store_n(&r->head, new_head, __ATOMIC_RELEASE);
+
+	// half full: don't wait for the interval of the writer (once until it drained)
+	if(new_head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= CAPTURE_RING_SIZE / 2 &&
+	   !__atomic_exchange_n(&r->woken, 1, __ATOMIC_ACQ_REL))
+	{
+		pthread_mutex_lock(&capture_lock);
+		pthread_cond_signal(&capture_wake);
+		pthread_mutex_unlock(&capture_lock);
+	}
+}
+
+void usb_vhci_capture_set_busnum(int fd, int32_t busnum)
+{
+	if(fd >= 0 && fd < CAPTURE_MAX_FDS)
+		__atomic_store_n(&fd_busnum[fd], (busnum > 0 && busnum <= 0xffff) ? (uint16_t)busnum : 0, __ATOMIC_RELAXED);
+}
+
+void usb_vhci_capture_submit(int fd, const struct usb_vhci_urb *urb)
+{
+	struct iovec iov;
+	uint32_t len = 0;
+	// IN urbs have no data yet; the data of iso urbs has all the packets in a row
+	if(usb_vhci_is_out(urb->epadr) && urb->buffer && urb->buffer_length > 0)
+		len = (uint32_t)urb->buffer_length;
+	iov.iov_base = urb->buffer;
+	iov.iov_len = len;
+	// the kernel tells when the urb was submitted
+	capture(fd, urb, 'S', &iov, 1, len, urb->enqueue_time ? urb->enqueue_time : clock_ns(CLOCK_MONOTONIC));
+}
+
+void usb_vhci_capture_giveback(int fd, const struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt)
+{
+	uint32_t len = 0;
+	if(usb_vhci_is_in(urb->epadr))
+		for(int i = 0; i < iovcnt; i++)
+			len += (uint32_t)iov[i].iov_len;
+	capture(fd, urb, 'C', iov, iovcnt, len, clock_ns(CLOCK_MONOTONIC));
+}
+
+// caller has capture_lock
+static void drain(void)
+{
+	const uint32_t gen = capture_gen;
+	struct capture_ring **pr = &rings;
+	while(*pr)
+	{
+		struct capture_ring *r = *pr;
+		// a dead ring is complete, if we drain it after seeing it dead
+		const int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+		const uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = r->tail;
+		while(tail != head)
+		{
+			const struct ring_record *rec = (const struct ring_record *)(r->buf + ((uint32_t)tail & (CAPTURE_RING_SIZE - 1)));
+			if(rec->gen == gen)
+			{
+				const struct pcap_record_header *ph = (const struct pcap_record_header *)(rec + 1);
+				if(fwrite(ph, sizeof *ph + ph->incl_len, 1, capture_file) != 1)
+					write_error = errno ? errno : EIO;
+				stats.records++;
+				stats.bytes += sizeof *ph + ph->incl_len;
+			}
+			tail += rec->size;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		__atomic_store_n(&r->woken, 0, __ATOMIC_RELEASE);
+		if(dead)
+		{
+			stats.dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+			*pr = r->next;
+			free_ring(r);
+		}
+		else
+			pr = &r->next;
+	}
+}
+
+static void *writer_start(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&capture_lock);
+	while(!writer_stop)
+	{
+		struct timespec ts;
+		drain();
+		pthread_cond_broadcast(&capture_drained);
+		fflush(capture_file);
+		deadline(&ts, CAPTURE_INTERVAL_MS);
+		pthread_cond_timedwait(&capture_wake, &capture_lock, &ts);
+	}
+	drain();
+	pthread_cond_broadcast(&capture_drained);
+	pthread_mutex_unlock(&capture_lock);
+	return NULL;
+}
+
+int usb_vhci_capture_start(const char *path, uint32_t snaplen)
+{
+	struct pcap_file_header fh;
+	int err;
+
+	if(!path)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!snaplen || snaplen > CAPTURE_MAX_SNAPLEN)
+		snaplen = CAPTURE_MAX_SNAPLEN;
+	pthread_mutex_lock(&capture_lock);
+	if(capture_file)
+	{
+		pthread_mutex_unlock(&capture_lock);
+		errno = EBUSY;
+		return -1;
+	}
+	if(!(capture_file = fopen(path, "wb")))
+		goto fail;
+	// the writer writes record by record
+	setvbuf(capture_file, NULL, _IOFBF, CAPTURE_RING_SIZE);
+	fh.magic = 0xa1b2c3d4;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.thiszone = 0;
+	fh.sigfigs = 0;
+	fh.snaplen = sizeof(struct usbmon_packet) + CAPTURE_MAX_ISO_DESCRIPTORS * sizeof(struct usbmon_iso_desc) + snaplen;
+	fh.linktype = LINKTYPE_USB_LINUX_MMAPPED;
+	if(fwrite(&fh, sizeof fh, 1, capture_file) != 1)
+		goto fail_close;
+	memset(&stats, 0, sizeof stats);
+	for(struct capture_ring *r = rings; r; r = r->next)
+		__atomic_store_n(&r->dropped, 0, __ATOMIC_RELAXED);
+	write_error = 0;
+	writer_stop = 0;
+	capture_snaplen = snaplen;
+	mono_to_real = (int64_t)(clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC));
+	__atomic_store_n(&capture_gen, capture_gen + 1, __ATOMIC_RELEASE);
+	if((err = pthread_create(&writer, NULL, writer_start, NULL)))
+	{
+		errno = err;
+		goto fail_close;
+	}
+	__atomic_store_n(&usb_vhci_capture_active, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&capture_lock);
+	return 0;
+
+fail_close:
+	err = errno;
+	fclose(capture_file);
+	remove(path);
+	errno = err;
+fail:
+	err = errno;
+	capture_file = NULL;
+	pthread_mutex_unlock(&capture_lock);
+	errno = err;
+	return -1;
+}
+
+int usb_vhci_capture_stop(struct usb_vhci_capture_stats *st)
+{
+	int err;
+	pthread_mutex_lock(&capture_lock);
+	if(!capture_file || writer_stop)
+	{
+		pthread_mutex_unlock(&capture_lock);
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_store_n(&usb_vhci_capture_active, 0, __ATOMIC_RELEASE);
+	writer_stop = 1;
+	pthread_cond_signal(&capture_wake);
+	pthread_mutex_unlock(&capture_lock);
+	pthread_join(writer, NULL);
+
+	pthread_mutex_lock(&capture_lock);
+	// threads may have exited after the last drain
+	for(struct capture_ring **pr = &rings; *pr;)
+	{
+		struct capture_ring *r = *pr;
+		stats.dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if(r->dead)
+		{
+			*pr = r->next;
+			free_ring(r);
+		}
+		else
+			pr = &r->next;
+	}
+	err = write_error;
+	if(fclose(capture_file) && !err)
+		err = errno;
+	capture_file = NULL;
+	if(st)
+		*st = stats;
+	pthread_mutex_unlock(&capture_lock);
+	if(err)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,368 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * usb_vhci_ctx: the buffer and iso packet array of a fetched urb share one block. Blocks
+ * are cached in free lists per power-of-two size class; blocks which are too big for
+ * the classes go straight back to the allocator.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libusb_vhci.h"
+
+#define CTX_MIN_CLASS_SHIFT 8                              // 256 bytes
+#define CTX_CLASS_COUNT     15                             // .. 4 MiB
+#define CTX_CLASS_CACHE     (16u << 20)                    // cached bytes per class
+#define CTX_NO_CLASS        0xff
+
+struct ctx_block
+{
+	struct ctx_block *next; // free list
+	size_t size;
+	uint8_t size_class;
+};
+
+// keeps iso_packets and buffer behind the header 16-byte aligned
+#define CTX_HEADER_SIZE ((sizeof(struct ctx_block) + 15) & ~(size_t)15)
+
+struct usb_vhci_ctx
+{
+	int fd;
+	struct usb_vhci_allocator allocator;
+	pthread_mutex_t lock; // protects the free lists and the stats
+	struct ctx_block *free_blocks[CTX_CLASS_COUNT];
+	uint32_t cached[CTX_CLASS_COUNT];
+	struct usb_vhci_ctx_stats stats;
+};
+
+static void *ctx_default_alloc(void *arg, size_t size)
+{
+	(void)arg;
+	return malloc(size);
+}
+
+static void ctx_default_free(void *arg, void *ptr, size_t size)
+{
+	(void)arg;
+	(void)size;
+	free(ptr);
+}
+
+static uint8_t ctx_size_class(size_t size)
+{
+	uint8_t c = 0;
+	while(c < CTX_CLASS_COUNT && ((size_t)1 << (c + CTX_MIN_CLASS_SHIFT)) < size)
+		c++;
+	return (c < CTX_CLASS_COUNT) ? c : CTX_NO_CLASS;
+}
+
+static uint32_t ctx_class_cache_limit(uint8_t c)
+{
+	uint32_t n = CTX_CLASS_CACHE >> (c + CTX_MIN_CLASS_SHIFT);
+	return (n < 4) ? 4 : (n > 256) ? 256 : n;
+}
+
+static struct ctx_block *ctx_get_block(struct usb_vhci_ctx *ctx, size_t size)
+{
+	struct ctx_block *b;
+	const uint8_t c = ctx_size_class(size);
+	if(c != CTX_NO_CLASS)
+	{
+		size = (size_t)1 << (c + CTX_MIN_CLASS_SHIFT);
+		pthread_mutex_lock(&ctx->lock);
+		if((b = ctx->free_blocks[c]))
+		{
+			ctx->free_blocks[c] = b->next;
+			ctx->cached[c]--;
+			ctx->stats.buffer_reuses++;
+			pthread_mutex_unlock(&ctx->lock);
+			return b;
+		}
+		ctx->stats.buffer_allocs++;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	if(!(b = ctx->allocator.alloc(ctx->allocator.arg, size)))
+		return NULL;
+	b->next = NULL;
+	b->size = size;
+	b->size_class = c;
+	return b;
+}
+
+static void ctx_put_block(struct usb_vhci_ctx *ctx, struct ctx_block *b)
+{
+	const uint8_t c = b->size_class;
+	if(c != CTX_NO_CLASS)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		if(ctx->cached[c] < ctx_class_cache_limit(c))
+		{
+			b->next = ctx->free_blocks[c];
+			ctx->free_blocks[c] = b;
+			ctx->cached[c]++;
+			pthread_mutex_unlock(&ctx->lock);
+			return;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	ctx->allocator.free(ctx->allocator.arg, b, b->size);
+}
+
+struct usb_vhci_ctx *usb_vhci_ctx_attach(int fd, const struct usb_vhci_allocator *allocator)
+{
+	struct usb_vhci_ctx *ctx;
+	if(fd == -1 || (allocator && (!allocator->alloc || !allocator->free)))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!(ctx = calloc(1, sizeof *ctx)))
+		return NULL;
+	ctx->fd = fd;
+	if(allocator)
+		ctx->allocator = *allocator;
+	else
+	{
+		ctx->allocator.alloc = ctx_default_alloc;
+		ctx->allocator.free  = ctx_default_free;
+		ctx->allocator.arg   = NULL;
+	}
+	pthread_mutex_init(&ctx->lock, NULL);
+	return ctx;
+}
+
+struct usb_vhci_ctx *usb_vhci_ctx_open(uint8_t port_count,
+                                       const struct usb_vhci_allocator *allocator,
+                                       int32_t *id,
+                                       int32_t *usb_busnum,
+                                       char    **bus_id)
+{
+	struct usb_vhci_ctx *ctx;
+	int err, fd = usb_vhci_open(port_count, id, usb_busnum, bus_id);
+	if(fd == -1)
+		return NULL;
+	if(!(ctx = usb_vhci_ctx_attach(fd, allocator)))
+	{
+		err = errno;
+		usb_vhci_close(fd);
+		if(bus_id)
+		{
+			free(*bus_id);
+			*bus_id = NULL;
+		}
+		errno = err;
+	}
+	return ctx;
+}
+
+static void ctx_free(struct usb_vhci_ctx *ctx)
+{
+	for(int c = 0; c < CTX_CLASS_COUNT; c++)
+	{
+		struct ctx_block *b;
+		while((b = ctx->free_blocks[c]))
+		{
+			ctx->free_blocks[c] = b->next;
+			ctx->allocator.free(ctx->allocator.arg, b, b->size);
+		}
+	}
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+int usb_vhci_ctx_close(struct usb_vhci_ctx *ctx)
+{
+	int ret;
+	if(!ctx)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	ret = usb_vhci_close(ctx->fd);
+	ctx_free(ctx);
+	return ret;
+}
+
+int usb_vhci_ctx_detach(struct usb_vhci_ctx *ctx)
+{
+	int fd;
+	if(!ctx)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	fd = ctx->fd;
+	ctx_free(ctx);
+	return fd;
+}
+
+int usb_vhci_ctx_get_fd(const struct usb_vhci_ctx *ctx)
+{
+	return ctx->fd;
+}
+
+int usb_vhci_ctx_fetch_work(struct usb_vhci_ctx *ctx, struct usb_vhci_work *work, int16_t timeout)
+{
+	struct usb_vhci_urb *urb = &work->work.urb;
+	struct ctx_block *b;
+	size_t iso_size;
+	int res = usb_vhci_fetch_work_timeout(ctx->fd, work, timeout);
+	if(res == -1 || work->type != USB_VHCI_WORK_TYPE_PROCESS_URB)
+		return (res == -1) ? -1 : 0;
+
+	urb->buffer = NULL;
+	urb->iso_packets = NULL;
+	iso_size = (size_t)urb->packet_count * sizeof *urb->iso_packets;
+	if(urb->buffer_length || iso_size)
+	{
+		if(!(b = ctx_get_block(ctx, CTX_HEADER_SIZE + iso_size + (size_t)urb->buffer_length)))
+		{
+			// the urb has been fetched already: it fails without its data (and without
+			// its iso packets, which makes the controller fail it, too)
+			urb->status = USB_VHCI_STATUS_ERROR;
+			urb->buffer_actual = 0;
+			urb->packet_count = 0;
+			urb->error_count = 0;
+			usb_vhci_giveback(ctx->fd, urb);
+			errno = ENOMEM;
+			return -1;
+		}
+		if(iso_size)
+			urb->iso_packets = (struct usb_vhci_iso_packet *)((char *)b + CTX_HEADER_SIZE);
+		if(urb->buffer_length)
+			urb->buffer = (uint8_t *)b + CTX_HEADER_SIZE + iso_size;
+	}
+
+	if(res && usb_vhci_fetch_data(ctx->fd, urb) == -1)
+	{
+		const int err = errno;
+		usb_vhci_ctx_release(ctx, urb);
+		errno = err;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stats.urbs++;
+	if(res && usb_vhci_is_out(urb->epadr))
+		ctx->stats.bytes_out += (uint64_t)urb->buffer_length;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+void usb_vhci_ctx_release(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb)
+{
+	char *p = urb->iso_packets ? (char *)urb->iso_packets : (char *)urb->buffer;
+	if(p)
+		ctx_put_block(ctx, (struct ctx_block *)(p - CTX_HEADER_SIZE));
+	urb->buffer = NULL;
+	urb->iso_packets = NULL;
+}
+
+// caller has no ctx->lock
+static int ctx_finish_giveback(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb, int ret, int64_t bytes_in)
+{
+	int err = errno;
+	if(!ret && bytes_in > 0)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		ctx->stats.bytes_in += (uint64_t)bytes_in;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	// the urb is done either way
+	usb_vhci_ctx_release(ctx, urb);
+	errno = err;
+	return ret;
+}
+
+int usb_vhci_ctx_giveback(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb)
+{
+	int ret = usb_vhci_giveback(ctx->fd, urb);
+	return ctx_finish_giveback(ctx, urb, ret, usb_vhci_is_in(urb->epadr) ? urb->buffer_actual : 0);
+}
+
+int usb_vhci_ctx_giveback_iov(struct usb_vhci_ctx *ctx, struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt)
+{
+	int64_t len = 0;
+	int ret = usb_vhci_giveback_iov(ctx->fd, urb, iov, iovcnt);
+	for(int i = 0; !ret && i < iovcnt; i++)
+		len += (int64_t)iov[i].iov_len;
+	return ctx_finish_giveback(ctx, urb, ret, len);
+}
+
+int usb_vhci_ctx_port_connect(struct usb_vhci_ctx *ctx, uint8_t port, uint8_t data_rate)
+{
+	return usb_vhci_port_connect(ctx->fd, port, data_rate);
+}
+
+int usb_vhci_ctx_port_disconnect(struct usb_vhci_ctx *ctx, uint8_t port)
+{
+	return usb_vhci_port_disconnect(ctx->fd, port);
+}
+
+int usb_vhci_ctx_port_disable(struct usb_vhci_ctx *ctx, uint8_t port)
+{
+	return usb_vhci_port_disable(ctx->fd, port);
+}
+
+int usb_vhci_ctx_port_resumed(struct usb_vhci_ctx *ctx, uint8_t port)
+{
+	return usb_vhci_port_resumed(ctx->fd, port);
+}
+
+int usb_vhci_ctx_port_overcurrent(struct usb_vhci_ctx *ctx, uint8_t port, uint8_t set)
+{
+	return usb_vhci_port_overcurrent(ctx->fd, port, set);
+}
+
+int usb_vhci_ctx_port_reset_done(struct usb_vhci_ctx *ctx, uint8_t port, uint8_t enable)
+{
+	return usb_vhci_port_reset_done(ctx->fd, port, enable);
+}
+
+void usb_vhci_ctx_get_stats(struct usb_vhci_ctx *ctx, struct usb_vhci_ctx_stats *stats)
+{
+	pthread_mutex_lock(&ctx->lock);
+	*stats = ctx->stats;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+int usb_vhci_ctx_set_thread_policy(struct usb_vhci_ctx *ctx, const struct usb_vhci_thread_policy *policy)
+{
+	(void)ctx;
+	return usb_vhci_thread_policy_apply(policy);
+}
@@ -0,0 +1,318 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// internal interface between broker and remote_hcd (shared memory transport); not
+// installed
+//
+// A remote_hcd connects to the unix socket (SOCK_SEQPACKET) of a broker and sends a
+// remote_hello. The broker answers with a remote_welcome, which carries a memfd and two
+// eventfds (SCM_RIGHTS): the memfd holds a remote_shm header and two rings, one for
+// each direction; the eventfds are the doorbells of the consumers of the rings. After
+// that, the socket only tells either side when the other one is gone.
+//
+// The rings are single producer, single consumer byte rings of messages (remote_msg
+// followed by the body of its type). Both sides can write the whole shared memory at
+// any time, so a consumer reads every field of a message which it validates only once
+// and works with that copy. A consumer which goes to sleep sets the sleeping
+// flag of its ring and checks the ring once more; producers only ring the doorbell,
+// if the flag is set. The same is done the other way around for a producer which
+// waits for room (producer_waiting), so that neither side makes a system call per
+// message while both are busy. Before a consumer goes to sleep, it polls its ring for
+// a moment (see remote_spin_time), because the answer of the other side is usually
+// faster than a wakeup.
+
+#ifndef _LIBUSB_VHCI_REMOTE_H
+#define _LIBUSB_VHCI_REMOTE_H 1
+
+#include <stdint.h>
+#include <string.h>
+#include "libusb_vhci.h"
+
+#define REMOTE_MAGIC           0x56484352u // "RCHV"
+#define REMOTE_VERSION         1
+#define REMOTE_MSG_ALIGN       8
+#define REMOTE_MAX_PORTS       31
+
+// message types
+#define REMOTE_MSG_SKIP        0 // the rest of the ring is unused
+#define REMOTE_MSG_PROCESS_URB 1 // broker -> client: usb_vhci_urb, iso packets, OUT data
+#define REMOTE_MSG_CANCEL_URB  2 // broker -> client: tag of the urb
+#define REMOTE_MSG_PORT_STAT   3 // broker -> client: usb_vhci_port_stat
+#define REMOTE_MSG_GIVEBACK    4 // client -> broker: usb_vhci_urb, iso packets, IN data
+#define REMOTE_MSG_PORT_OP     5 // client -> broker: op and arg
+
+// port operations (remote_msg::op)
+#define REMOTE_PORT_CONNECT    1 // arg: usb::data_rate
+#define REMOTE_PORT_DISCONNECT 2
+#define REMOTE_PORT_DISABLE    3
+#define REMOTE_PORT_RESUMED    4
+#define REMOTE_PORT_OVERCURRENT 5 // arg: set
+#define REMOTE_PORT_RESET_DONE 6 // arg: enable
+
+namespace usb
+{
+	namespace vhci
+	{
+		struct remote_hello
+		{
+			uint32_t magic;
+			uint32_t version;
+			uint8_t port_count;  // number of ports the client wants
+		};
+
+		struct remote_welcome
+		{
+			uint32_t magic;
+			uint32_t version;
+			int32_t error;       // errno, if the client was refused (no fds then)
+			uint32_t shm_size;
+			uint8_t port_count;
+			uint8_t ports[REMOTE_MAX_PORTS]; // ports of the hcd of the broker
+			int32_t id;          // of the controller, if the broker serves a local_hcd
+			int32_t usb_bus_num;
+			char bus_id[32];
+		};
+
+		struct remote_ring_ctl
+		{
+			uint64_t head;             // written by the producer
+			char _pad0[56];
+			uint64_t tail;             // written by the consumer
+			char _pad1[56];
+			uint32_t sleeping;         // the consumer waits for the doorbell
+			uint32_t producer_waiting; // the producer waits for room
+			char _pad2[56];
+		};
+
+		struct remote_shm
+		{
+			uint32_t magic;
+			uint32_t ring_size;
+			char _pad[56];
+			remote_ring_ctl to_client;
+			remote_ring_ctl to_broker;
+			// followed by the data of to_client and to_broker (ring_size bytes each) at
+			// remote_shm_data_offset
+		};
+
+		static const size_t remote_shm_data_offset = 4096;
+
+		struct remote_msg
+		{
+			uint32_t size;  // with header, a multiple of REMOTE_MSG_ALIGN
+			uint16_t type;
+			uint8_t port;   // port of the client (1 .. port_count)
+			uint8_t op;
+			uint64_t tag;   // urb: handle on the client side; PORT_OP: arg
+		};
+
+		inline uint32_t remote_msg_size(size_t body) _LIB_USB_VHCI_NOEXCEPT
+		{
+			return static_cast<uint32_t>((sizeof(remote_msg) + body + REMOTE_MSG_ALIGN - 1) & ~static_cast<size_t>(REMOTE_MSG_ALIGN - 1));
+		}
+
+		inline void remote_cpu_relax() _LIB_USB_VHCI_NOEXCEPT
+		{
+#if defined(__i386__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+
+		// how long a consumer polls its ring before it goes to sleep, in nanoseconds; 0
+		// with a single cpu, where the other side can't run meanwhile
+		uint64_t remote_spin_time() _LIB_USB_VHCI_NOEXCEPT;
+
+		inline void* remote_msg_body(remote_msg* m) _LIB_USB_VHCI_NOEXCEPT { return m + 1; }
+		inline const void* remote_msg_body(const remote_msg* m) _LIB_USB_VHCI_NOEXCEPT { return m + 1; }
+
+		// one side of a ring in the shared memory
+		class remote_ring
+		{
+		private:
+			remote_ring_ctl* ctl;
+			char* buf;
+			uint32_t size;
+			uint64_t pending;  // of the producer: head at the reserved message
+			uint32_t reserved; // of the producer: size of the reserved message
+
+			// a message of msg_size bytes at off lies within the ring
+			bool valid(uint32_t off, uint32_t msg_size) const _LIB_USB_VHCI_NOEXCEPT
+			{
+				return msg_size >= sizeof(remote_msg) &&
+				       !(msg_size & (REMOTE_MSG_ALIGN - 1)) &&
+				       msg_size <= size - off;
+			}
+
+		public:
+			remote_ring() _LIB_USB_VHCI_NOEXCEPT : ctl(NULL), buf(NULL), size(0), pending(0), reserved(0) { }
+			remote_ring(remote_ring_ctl* ctl, char* buf, uint32_t size) _LIB_USB_VHCI_NOEXCEPT :
+				ctl(ctl), buf(buf), size(size), pending(0), reserved(0) { }
+
+			uint32_t get_max_msg_size() const _LIB_USB_VHCI_NOEXCEPT { return size / 2; }
+
+			// producer: returns NULL if there is no room for a message of msg_size bytes
+			// (from remote_msg_size); commit publishes it (m->size may be made smaller
+			// before)
+			remote_msg* reserve(uint32_t msg_size) _LIB_USB_VHCI_NOEXCEPT
+			{
+				uint64_t head(ctl->head);
+				const uint64_t tail(__atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE));
+				const uint32_t off(static_cast<uint32_t>(head) & (size - 1));
+				const uint32_t contig(size - off);
+				const uint64_t need((contig < msg_size) ? static_cast<uint64_t>(contig) + msg_size : msg_size);
+				if(msg_size > get_max_msg_size() || head + need - tail > size) return NULL;
+				if(contig < msg_size)
+				{
+					// messages don't wrap around
+					remote_msg* skip(reinterpret_cast<remote_msg*>(buf + off));
+					skip->size = contig;
+					skip->type = REMOTE_MSG_SKIP;
+					head += contig;
+				}
+				pending = head;
+				reserved = msg_size;
+				remote_msg* m(reinterpret_cast<remote_msg*>(buf + (static_cast<uint32_t>(head) & (size - 1))));
+				m->size = msg_size;
+				return m;
+			}
+
+			// returns true, if the consumer has to be woken up
+			bool commit(const remote_msg* m) _LIB_USB_VHCI_NOEXCEPT
+			{
+				// the consumer may have changed m->size meanwhile; never beyond the
+				// reservation
+				uint32_t msg_size(__atomic_load_n(&m->size, __ATOMIC_RELAXED));
+				if(msg_size > reserved || !valid(0, msg_size)) msg_size = reserved;
+				__atomic_store_n(&ctl->head, pending + msg_size, __ATOMIC_RELEASE);
+				// pairs with the fence in prepare_wait
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+				return __atomic_load_n(&ctl->sleeping, __ATOMIC_RELAXED);
+			}
+
+			// consumer: returns NULL if the ring is empty; hdr gets a copy of the header
+			// of the message, whose size is 0, if the message doesn't lie within the ring
+			// (the other side is broken). Only the copy is to be used for the header, and
+			// hdr.size for pop.
+			const remote_msg* peek(remote_msg& hdr) _LIB_USB_VHCI_NOEXCEPT
+			{
+				while(true)
+				{
+					const uint64_t tail(ctl->tail);
+					if(tail == __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE)) return NULL;
+					const uint32_t off(static_cast<uint32_t>(tail) & (size - 1));
+					const remote_msg* m(reinterpret_cast<const remote_msg*>(buf + off));
+					memcpy(&hdr, m, sizeof(hdr));
+					if(!valid(off, hdr.size)) hdr.size = 0;
+					if(!hdr.size || hdr.type != REMOTE_MSG_SKIP) return m;
+					__atomic_store_n(&ctl->tail, tail + hdr.size, __ATOMIC_RELEASE);
+				}
+			}
+
+			// msg_size from the header which peek returned; returns true, if the producer
+			// waits for room and has to be woken up
+			bool pop(uint32_t msg_size) _LIB_USB_VHCI_NOEXCEPT
+			{
+				__atomic_store_n(&ctl->tail, ctl->tail + msg_size, __ATOMIC_RELEASE);
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+				return __atomic_load_n(&ctl->producer_waiting, __ATOMIC_RELAXED) &&
+				       __atomic_exchange_n(&ctl->producer_waiting, 0, __ATOMIC_RELAXED);
+			}
+
+			bool empty() const _LIB_USB_VHCI_NOEXCEPT
+			{
+				return __atomic_load_n(&ctl->tail, __ATOMIC_RELAXED) == __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+			}
+
+			// consumer: polls the ring for up to ns nanoseconds (see remote_spin_time);
+			// returns true, if it got a message
+			bool spin(uint64_t ns) const _LIB_USB_VHCI_NOEXCEPT
+			{
+				if(!empty()) return true;
+				if(!ns) return false;
+				const uint64_t end(latency_histogram::now() + ns);
+				do
+				{
+					for(int i(0); i < 64; i++)
+					{
+						if(!empty()) return true;
+						remote_cpu_relax();
+					}
+				} while(latency_histogram::now() < end);
+				return false;
+			}
+
+			// consumer: returns false (and doesn't sleep), if the ring got a message
+			bool prepare_wait() _LIB_USB_VHCI_NOEXCEPT
+			{
+				__atomic_store_n(&ctl->sleeping, 1, __ATOMIC_RELAXED);
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+				if(empty()) return true;
+				__atomic_store_n(&ctl->sleeping, 0, __ATOMIC_RELAXED);
+				return false;
+			}
+
+			void end_wait() _LIB_USB_VHCI_NOEXCEPT
+			{
+				__atomic_store_n(&ctl->sleeping, 0, __ATOMIC_RELAXED);
+			}
+
+			// producer: asks the consumer to ring the doorbell after the next pop
+			void set_producer_waiting() _LIB_USB_VHCI_NOEXCEPT
+			{
+				__atomic_store_n(&ctl->producer_waiting, 1, __ATOMIC_RELAXED);
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			}
+		};
+
+		// writes 1 into an eventfd
+		void remote_ring_doorbell(int fd) _LIB_USB_VHCI_NOEXCEPT;
+		// resets an eventfd (non-blocking)
+		void remote_clear_doorbell(int fd) _LIB_USB_VHCI_NOEXCEPT;
+		// room for an urb message with the whole buffer (so that the giveback of an urb
+		// fits, if the urb did)
+		uint32_t remote_urb_msg_size(const usb_vhci_urb& urb) _LIB_USB_VHCI_NOEXCEPT;
+		// copies an urb into a message of that size and shrinks it to the data of the
+		// message type: OUT data for PROCESS_URB, IN data (from the buffer or the in-data
+		// iovec) for GIVEBACK
+		void remote_put_urb(remote_msg* m, const usb::urb& u) _LIB_USB_VHCI_NOEXCEPT;
+		// the parts of an urb message of msg_size bytes (from the header which peek
+		// returned): urb gets a copy of the urb (buffer and iso_packets are meaningless,
+		// packet_count of iso urbs is the number of iso_packets); iso_packets and data
+		// point into the message (NULL, if it has none), so their contents may still
+		// change. Returns false, if the message is shorter than its packets and data.
+		bool remote_get_urb(const remote_msg* m, uint32_t msg_size,
+		                    usb_vhci_urb& urb,
+		                    const usb_vhci_iso_packet** iso_packets,
+		                    const uint8_t** data,
+		                    int32_t* data_length) _LIB_USB_VHCI_NOEXCEPT;
+	}
+}
+
+#endif // _LIBUSB_VHCI_REMOTE_H
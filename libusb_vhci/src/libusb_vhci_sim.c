@@ -0,0 +1,969 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated controller: implements the ioctl interface of /dev/usb-vhci in the calling
+ * process, so that device implementations (and the queueing of this library) can run
+ * without the kernel modules. The part of usbcore (submitting, unlinking and reaping
+ * urbs) and of the hub driver (Set/ClearPortFeature) is played by the caller through
+ * the usb_vhci_sim_* functions.
+ *
+ * The urb lists and the port state machine are the ones of the kernel module: they come
+ * from usb-vhci-core.h of vhci-hcd, built in user space against its sim/vhci-shim.h (see
+ * --with-vhci-hcd of configure). What is left here is the part of usb-vhci-iocifc.c
+ * which copies between the ioctl structures and the urbs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+
+#include "libusb_vhci.h"
+#include "libusb_vhci_sim.h"
+
+int usb_vhci_sim_count = 0;
+
+#ifdef HAVE_VHCI_SIM
+
+#define USB_VHCI_SIM
+#include "usb-vhci-hcd.h"
+
+// an urb which was submitted by the simulated host
+struct sim_urb
+{
+	struct urb urb;                // what the core sees; its address is the handle for the device
+	struct usb_vhci_urb_priv urbp; // linked into the lists of the core (or into done)
+	struct usb_vhci_urb host;      // as submitted (buffer and iso_packets belong to the host)
+};
+
+struct usb_vhci_sim
+{
+	struct usb_vhci_sim *next;    // registry
+	int fd;                       // eventfd; readable while there is work for the device
+	int event_set;
+	int users;                    // protected by sim_registry_lock
+	int closed;
+	int kicked;                   // set by USB_VHCI_HCD_IOCKICK
+	uint32_t flags;
+	pthread_mutex_t lock;         // plays the role of vhc.lock (which isn't used)
+	pthread_cond_t work_cond;     // signaled when work for the device gets available
+	pthread_cond_t done_cond;     // signaled when an urb gets completed
+	struct usb_vhci_hcd vhc;      // urb lists and ports
+	struct list_head done;        // completed urbs, which were not reaped yet
+	uint8_t port_sched_offset;
+	struct usb_vhci_port ports[];
+};
+
+static pthread_mutex_t sim_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usb_vhci_sim *sim_registry = NULL;
+static int32_t sim_next_id = 0;
+
+static inline struct sim_urb *sim_urb_of(struct usb_vhci_urb_priv *urbp)
+{
+	return container_of(urbp, struct sim_urb, urbp);
+}
+
+static inline uint64_t sim_handle(const struct usb_vhci_urb_priv *urbp)
+{
+	return (uint64_t)(uintptr_t)urbp->urb;
+}
+
+// waits until pred returns non-zero, the controller gets closed or the timeout
+// (milliseconds; -1 means infinite) expires
+// caller has sim->lock
+static void sim_wait(struct usb_vhci_sim *sim, pthread_cond_t *cond, int16_t timeout,
+                     int (*pred)(const struct usb_vhci_sim *))
+{
+	struct timespec ts;
+	if(!timeout || pred(sim))
+		return;
+	if(timeout > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000l;
+		if(ts.tv_nsec >= 1000000000l)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000l;
+		}
+	}
+	while(!sim->closed && !pred(sim))
+	{
+		if(timeout < 0)
+			pthread_cond_wait(cond, &sim->lock);
+		else if(pthread_cond_timedwait(cond, &sim->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+}
+
+static struct usb_vhci_sim *sim_get(int fd)
+{
+	struct usb_vhci_sim *sim;
+	pthread_mutex_lock(&sim_registry_lock);
+	for(sim = sim_registry; sim; sim = sim->next)
+	{
+		if(sim->fd == fd)
+		{
+			sim->users++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim_registry_lock);
+	return sim;
+}
+
+static void sim_free(struct usb_vhci_sim *sim)
+{
+	struct list_head *lists[] = { &sim->vhc.urbp_list_inbox, &sim->vhc.urbp_list_fetched,
+	                              &sim->vhc.urbp_list_cancel, &sim->vhc.urbp_list_canceling, &sim->done };
+	struct usb_vhci_urb_priv *urbp, *n;
+	for(size_t i = 0; i < sizeof lists / sizeof *lists; i++)
+		list_for_each_entry_safe(urbp, n, lists[i], urbp_list)
+			free(sim_urb_of(urbp));
+	pthread_cond_destroy(&sim->done_cond);
+	pthread_cond_destroy(&sim->work_cond);
+	pthread_mutex_destroy(&sim->lock);
+	while(close(sim->fd) == -1 && errno == EINTR);
+	free(sim);
+}
+
+static void sim_put(struct usb_vhci_sim *sim)
+{
+	int last;
+	pthread_mutex_lock(&sim_registry_lock);
+	last = !--sim->users && sim->closed;
+	pthread_mutex_unlock(&sim_registry_lock);
+	if(last)
+		sim_free(sim);
+}
+
+static int sim_has_work(const struct usb_vhci_sim *sim)
+{
+	return usb_vhci_has_work_locked(&sim->vhc);
+}
+
+static int sim_has_work_or_kick(const struct usb_vhci_sim *sim)
+{
+	return sim->kicked || sim_has_work(sim);
+}
+
+static int sim_has_done(const struct usb_vhci_sim *sim)
+{
+	return !list_empty(&sim->done);
+}
+
+// keeps the eventfd readable while there is work for the device and wakes up a thread
+// which waits in FETCHWORK
+// caller has sim->lock
+static void sim_work_changed(struct usb_vhci_sim *sim)
+{
+	uint64_t v = 1;
+	int has_work = sim_has_work(sim);
+	if(has_work)
+		pthread_cond_signal(&sim->work_cond);
+	if(has_work && !sim->event_set)
+		sim->event_set = write(sim->fd, &v, sizeof v) == sizeof v;
+	else if(!has_work && sim->event_set)
+		sim->event_set = read(sim->fd, &v, sizeof v) != sizeof v;
+}
+
+// su must not be in any list of the core
+// caller has sim->lock
+static void sim_complete(struct usb_vhci_sim *sim, struct sim_urb *su)
+{
+	list_add_tail(&su->urbp.urbp_list, &sim->done);
+	pthread_cond_signal(&sim->done_cond);
+}
+
+// caller has sim->lock
+static struct sim_urb *sim_find_fetched(struct usb_vhci_sim *sim, uint64_t handle, int *canceled)
+{
+	struct usb_vhci_urb_priv *urbp;
+	urbp = usb_vhci_find_fetched(&sim->vhc, (const void *)(uintptr_t)handle, canceled);
+	return urbp ? sim_urb_of(urbp) : NULL;
+}
+
+// searches an urb which the host didn't reap yet by the handle which the host gave it
+// caller has sim->lock
+static struct sim_urb *sim_find_host_handle(struct usb_vhci_sim *sim, uint64_t handle)
+{
+	struct list_head *lists[] = { &sim->vhc.urbp_list_inbox, &sim->vhc.urbp_list_fetched,
+	                              &sim->vhc.urbp_list_cancel, &sim->vhc.urbp_list_canceling };
+	struct usb_vhci_urb_priv *urbp;
+	for(size_t i = 0; i < sizeof lists / sizeof *lists; i++)
+		list_for_each_entry(urbp, lists[i], urbp_list)
+			if(sim_urb_of(urbp)->host.handle == handle)
+				return sim_urb_of(urbp);
+	return NULL;
+}
+
+// caller has sim->lock
+static void sim_complete_canceled(struct usb_vhci_sim *sim, struct sim_urb *su)
+{
+	list_del(&su->urbp.urbp_list);
+	su->host.status = USB_VHCI_STATUS_CANCELED;
+	sim_complete(sim, su);
+}
+
+// Set/ClearPortFeature (like the hub_control handler of the kernel module); returns
+// -EPIPE for unsupported features
+// caller has sim->lock
+static int sim_port_feature(struct usb_vhci_sim *sim, uint8_t port, int set, uint16_t feature)
+{
+	int ret = usb_vhci_port_feature(&sim->ports[port - 1], set, feature);
+	if(ret < 0)
+		return ret;
+	if(ret)
+		sim->vhc.port_update |= 1u << port;
+	return 0;
+}
+
+// emulates the hub driver, which reacts on the status change which has just been
+// reported to the device: acknowledges all change bits and resets newly connected
+// devices
+// caller has sim->lock
+static void sim_hub_event(struct usb_vhci_sim *sim, uint8_t port)
+{
+	const struct usb_vhci_port *p = &sim->ports[port - 1];
+	if(p->port_change & USB_PORT_STAT_C_CONNECTION)
+	{
+		sim_port_feature(sim, port, 0, USB_PORT_FEAT_C_CONNECTION);
+		if(p->port_status & USB_PORT_STAT_CONNECTION)
+			sim_port_feature(sim, port, 1, USB_PORT_FEAT_RESET);
+	}
+	if(p->port_change & USB_PORT_STAT_C_RESET)
+		sim_port_feature(sim, port, 0, USB_PORT_FEAT_C_RESET);
+	if(p->port_change & USB_PORT_STAT_C_ENABLE)
+		sim_port_feature(sim, port, 0, USB_PORT_FEAT_C_ENABLE);
+	if(p->port_change & USB_PORT_STAT_C_SUSPEND)
+		sim_port_feature(sim, port, 0, USB_PORT_FEAT_C_SUSPEND);
+	if(p->port_change & USB_PORT_STAT_C_OVERCURRENT)
+		sim_port_feature(sim, port, 0, USB_PORT_FEAT_C_OVER_CURRENT);
+}
+
+// USB_VHCI_HCD_IOCPORTSTAT (same checks as usb_vhci_apply_port_stat in the kernel module)
+// caller has sim->lock
+static int sim_port_stat(struct usb_vhci_sim *sim, const struct usb_vhci_ioc_port_stat *ps)
+{
+	int ret;
+	if(!ps->index || ps->index > sim->vhc.port_count)
+		return -EINVAL;
+	if(ps->change != USB_PORT_STAT_C_CONNECTION &&
+	   ps->change != USB_PORT_STAT_C_ENABLE &&
+	   ps->change != USB_PORT_STAT_C_SUSPEND &&
+	   ps->change != USB_PORT_STAT_C_OVERCURRENT &&
+	   ps->change != USB_PORT_STAT_C_RESET &&
+	   ps->change != (USB_PORT_STAT_C_RESET | USB_PORT_STAT_C_ENABLE))
+		return -EINVAL;
+	if((ret = usb_vhci_port_stat_apply(&sim->ports[ps->index - 1], ps->status, ps->change)))
+		return ret;
+	sim->vhc.port_update |= 1u << ps->index;
+	return 0;
+}
+
+// USB_VHCI_HCD_IOCFETCHWORK{,TS} (ts may be NULL)
+static int sim_fetch_work(struct usb_vhci_sim *sim, struct usb_vhci_ioc_work *w, struct usb_vhci_ioc_work_ts *ts)
+{
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_port stat;
+	uint8_t port;
+	int16_t timeout = w->timeout;
+	int ret = 0;
+
+	if(timeout > 1000)
+		timeout = 1000;
+
+	pthread_mutex_lock(&sim->lock);
+	sim_wait(sim, &sim->work_cond, timeout, sim_has_work_or_kick);
+	if(sim->closed)
+	{
+		ret = -EBADF;
+		goto end;
+	}
+	// like in the kernel module, a kick is consumed only by a fetch which would wait
+	if(timeout && sim->kicked && !sim_has_work(sim))
+	{
+		sim->kicked = 0;
+		ret = -EINTR;
+		goto end;
+	}
+
+	if((urbp = usb_vhci_next_cancel(&sim->vhc)))
+	{
+		w->type = USB_VHCI_WORK_TYPE_CANCEL_URB;
+		w->handle = sim_handle(urbp);
+		if(ts)
+		{
+			ts->enqueue_time = urbp->enqueue_time;
+			ts->seq = urbp->seq;
+		}
+		goto end;
+	}
+
+	if((port = usb_vhci_next_port_update(&sim->vhc, &sim->port_sched_offset, &stat)))
+	{
+		w->type = USB_VHCI_WORK_TYPE_PORT_STAT;
+		w->work.port.index  = port;
+		w->work.port.status = stat.port_status;
+		w->work.port.change = stat.port_change;
+		w->work.port.flags  = stat.port_flags;
+		if(ts)
+			ts->enqueue_time = ts->seq = 0;
+		if(!(sim->flags & USB_VHCI_SIM_FLAG_NO_HUB))
+			sim_hub_event(sim, port);
+		goto end;
+	}
+
+	if((urbp = usb_vhci_peek_inbox(&sim->vhc)))
+	{
+		const struct usb_vhci_urb *u = &sim_urb_of(urbp)->host;
+		usb_vhci_mark_fetched(&sim->vhc, urbp);
+		memset(&w->work.urb, 0, sizeof w->work.urb);
+		if(usb_vhci_is_control(u->type))
+		{
+			w->work.urb.setup_packet.bmRequestType = u->bmRequestType;
+			w->work.urb.setup_packet.bRequest      = u->bRequest;
+			w->work.urb.setup_packet.wValue        = u->wValue;
+			w->work.urb.setup_packet.wIndex        = u->wIndex;
+			w->work.urb.setup_packet.wLength       = u->wLength;
+		}
+		w->work.urb.buffer_length = u->buffer_length;
+		w->work.urb.interval      = u->interval;
+		w->work.urb.packet_count  = u->packet_count;
+		w->work.urb.flags         = u->flags;
+		w->work.urb.address       = u->devadr;
+		w->work.urb.endpoint      = u->epadr;
+		w->work.urb.type          = u->type;
+		w->type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+		w->handle = sim_handle(urbp);
+		if(ts)
+		{
+			ts->enqueue_time = urbp->enqueue_time;
+			ts->seq = urbp->seq;
+		}
+		goto end;
+	}
+
+	ret = -ETIMEDOUT;
+end:
+	sim_work_changed(sim);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+// USB_VHCI_HCD_IOCFETCHDATA
+// caller has sim->lock
+static int sim_fetch_data(struct usb_vhci_sim *sim, const struct usb_vhci_ioc_urb_data *d)
+{
+	struct sim_urb *su;
+	const struct usb_vhci_urb *u;
+	int canceled, is_in, is_iso;
+
+	if(!(su = sim_find_fetched(sim, d->handle, &canceled)))
+		return -ENOENT;
+	if(canceled)
+	{
+		// the device knows about the cancelation, so the urb can return to the host now
+		sim_complete_canceled(sim, su);
+		return -ECANCELED;
+	}
+
+	u = &su->host;
+	is_in = usb_vhci_is_in(u->epadr);
+	is_iso = usb_vhci_is_iso(u->type);
+	if(is_iso)
+	{
+		if(d->packet_count != u->packet_count || (d->packet_count && !d->iso_packets))
+			return -EINVAL;
+	}
+	else if(is_in || !u->buffer_length)
+		return -ENODATA;
+
+	if(!is_in && u->buffer_length)
+	{
+		if(!d->buffer || d->buffer_length < u->buffer_length)
+			return -EINVAL;
+		memcpy(d->buffer, u->buffer, u->buffer_length);
+	}
+	for(int i = 0; is_iso && i < u->packet_count; i++)
+	{
+		d->iso_packets[i].offset        = u->iso_packets[i].offset;
+		d->iso_packets[i].packet_length = (uint32_t)u->iso_packets[i].packet_length;
+	}
+	return 0;
+}
+
+// USB_VHCI_HCD_IOCGIVEBACK (same checks as ioc_giveback_common in the kernel module)
+// caller has sim->lock
+static int sim_giveback(struct usb_vhci_sim *sim, const struct usb_vhci_ioc_giveback *gb)
+{
+	struct sim_urb *su;
+	struct usb_vhci_urb *u;
+	int canceled, is_in, is_iso, ret;
+	const int32_t act = gb->buffer_actual;
+
+	if(!(su = sim_find_fetched(sim, gb->handle, &canceled)))
+		return -ENOENT;
+	ret = canceled ? -ECANCELED : 0;
+	list_del(&su->urbp.urbp_list);
+
+	u = &su->host;
+	is_in = usb_vhci_is_in(u->epadr);
+	is_iso = usb_vhci_is_iso(u->type);
+	if(is_iso)
+	{
+		if(is_in && act != u->buffer_length)
+		{
+			ret = -ENOBUFS;
+			goto done_with_errors;
+		}
+		if(gb->packet_count != u->packet_count || (gb->packet_count && !gb->iso_packets))
+		{
+			ret = -EINVAL;
+			goto done_with_errors;
+		}
+	}
+	else if(act < 0 || act > u->buffer_length)
+	{
+		ret = is_in ? -ENOBUFS : -EINVAL;
+		goto done_with_errors;
+	}
+	if(is_in)
+	{
+		if(act && !gb->buffer)
+		{
+			// the data might have been transfered by USB_VHCI_HCD_IOCGIVEBACKPART already
+			if(act > su->urbp.in_streamed)
+			{
+				ret = -EINVAL;
+				goto done_with_errors;
+			}
+		}
+		else if(act)
+			memcpy(u->buffer, gb->buffer, act);
+	}
+	else if(gb->buffer)
+	{
+		ret = -EINVAL;
+		goto done_with_errors;
+	}
+
+	for(int i = 0; is_iso && i < u->packet_count; i++)
+	{
+		u->iso_packets[i].packet_actual = (int32_t)gb->iso_packets[i].packet_actual;
+		u->iso_packets[i].status = usb_vhci_from_iso_packets_errno(gb->iso_packets[i].status);
+	}
+	u->buffer_actual = act;
+	u->error_count = gb->error_count;
+	u->status = canceled ? USB_VHCI_STATUS_CANCELED : usb_vhci_from_errno(gb->status, is_iso);
+	sim_complete(sim, su);
+	return ret;
+
+done_with_errors:
+	u->status = canceled ? USB_VHCI_STATUS_CANCELED : USB_VHCI_STATUS_ERROR;
+	sim_complete(sim, su);
+	return ret;
+}
+
+// USB_VHCI_HCD_IOCFETCHDATAPART and USB_VHCI_HCD_IOCGIVEBACKPART
+// caller has sim->lock
+static int sim_data_part(struct usb_vhci_sim *sim, const struct usb_vhci_ioc_data_part *p, int giveback)
+{
+	struct sim_urb *su;
+	const struct usb_vhci_urb *u;
+	int canceled, is_in;
+
+	if(!(su = sim_find_fetched(sim, p->handle, &canceled)))
+		return -ENOENT;
+	if(canceled)
+	{
+		// canceled urbs have to be completed by USB_VHCI_HCD_IOCGIVEBACK (or USB_VHCI_HCD_IOCFETCHDATA)
+		if(!giveback)
+			sim_complete_canceled(sim, su);
+		return -ECANCELED;
+	}
+
+	u = &su->host;
+	is_in = usb_vhci_is_in(u->epadr);
+	if(giveback ? !is_in : (is_in || !u->buffer_length))
+		return giveback ? -EINVAL : -ENODATA;
+	if(p->offset < 0 || p->length < 0 || p->offset > u->buffer_length ||
+	   p->length > u->buffer_length - p->offset || (p->length && !p->buffer))
+		return giveback ? -ENOBUFS : -EINVAL;
+
+	if(!giveback)
+	{
+		memcpy(p->buffer, u->buffer + p->offset, p->length);
+		return 0;
+	}
+	if(p->offset > su->urbp.in_streamed)
+		return -EINVAL;
+	memcpy(u->buffer + p->offset, p->buffer, p->length);
+	if(p->offset + p->length > su->urbp.in_streamed)
+		su->urbp.in_streamed = p->offset + p->length;
+	return 0;
+}
+
+int usb_vhci_sim_ioctl(int fd, unsigned long request, void *arg, int *result)
+{
+	struct usb_vhci_sim *sim = sim_get(fd);
+	int ret;
+	if(!sim)
+		return 0;
+
+	switch(request)
+	{
+	case USB_VHCI_HCD_IOCFETCHWORK:
+		ret = sim_fetch_work(sim, arg, NULL);
+		break;
+	case USB_VHCI_HCD_IOCFETCHWORK_RO:
+		((struct usb_vhci_ioc_work *)arg)->timeout = 100;
+		ret = sim_fetch_work(sim, arg, NULL);
+		break;
+	case USB_VHCI_HCD_IOCFETCHWORKTS:
+		ret = sim_fetch_work(sim, &((struct usb_vhci_ioc_work_ts *)arg)->work, arg);
+		break;
+	case USB_VHCI_HCD_IOCPORTSTAT:
+		pthread_mutex_lock(&sim->lock);
+		if(!(ret = sim_port_stat(sim, arg)))
+			sim_work_changed(sim);
+		pthread_mutex_unlock(&sim->lock);
+		break;
+	case USB_VHCI_HCD_IOCGIVEBACK:
+		pthread_mutex_lock(&sim->lock);
+		ret = sim_giveback(sim, arg);
+		pthread_mutex_unlock(&sim->lock);
+		break;
+	case USB_VHCI_HCD_IOCFETCHDATA:
+		pthread_mutex_lock(&sim->lock);
+		ret = sim_fetch_data(sim, arg);
+		pthread_mutex_unlock(&sim->lock);
+		break;
+	case USB_VHCI_HCD_IOCFETCHDATAPART:
+	case USB_VHCI_HCD_IOCGIVEBACKPART:
+		pthread_mutex_lock(&sim->lock);
+		ret = sim_data_part(sim, arg, request == USB_VHCI_HCD_IOCGIVEBACKPART);
+		pthread_mutex_unlock(&sim->lock);
+		break;
+	case USB_VHCI_HCD_IOCKICK:
+		pthread_mutex_lock(&sim->lock);
+		sim->kicked = 1;
+		pthread_cond_broadcast(&sim->work_cond);
+		pthread_mutex_unlock(&sim->lock);
+		ret = 0;
+		break;
+	case USB_VHCI_HCD_IOCREGISTER:
+		ret = -EPROTO; // already registered
+		break;
+	default:
+		// (the in-kernel responder isn't simulated)
+		ret = -ENOTTY;
+		break;
+	}
+
+	sim_put(sim);
+	if(ret < 0)
+	{
+		errno = -ret;
+		ret = -1;
+	}
+	*result = ret;
+	return 1;
+}
+
+int usb_vhci_sim_close(int fd, int *result)
+{
+	struct usb_vhci_sim *sim, **s;
+	pthread_mutex_lock(&sim_registry_lock);
+	for(s = &sim_registry; *s; s = &(*s)->next)
+		if((*s)->fd == fd)
+			break;
+	if(!(sim = *s))
+	{
+		pthread_mutex_unlock(&sim_registry_lock);
+		return 0;
+	}
+	*s = sim->next;
+	__atomic_store_n(&usb_vhci_sim_count, usb_vhci_sim_count - 1, __ATOMIC_RELEASE);
+	sim->users++;
+	pthread_mutex_unlock(&sim_registry_lock);
+
+	// wake up everyone who waits for this controller
+	pthread_mutex_lock(&sim->lock);
+	sim->closed = 1;
+	pthread_cond_broadcast(&sim->work_cond);
+	pthread_cond_broadcast(&sim->done_cond);
+	pthread_mutex_unlock(&sim->lock);
+
+	sim_put(sim);
+	*result = 0;
+	return 1;
+}
+
+int usb_vhci_sim_open(uint8_t port_count, uint32_t flags, int32_t *id, int32_t *usb_busnum, char **bus_id)
+{
+	struct usb_vhci_sim *sim;
+	pthread_condattr_t attr;
+	int32_t _id;
+
+	if(!port_count || port_count > 31)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!(sim = calloc(1, sizeof *sim + port_count * sizeof *sim->ports)))
+		return -1;
+	if((sim->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+	{
+		int err = errno;
+		free(sim);
+		errno = err;
+		return -1;
+	}
+
+	sim->flags = flags;
+	sim->vhc.ports = sim->ports;
+	sim->vhc.port_count = port_count;
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim->work_cond, &attr);
+	pthread_cond_init(&sim->done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	INIT_LIST_HEAD(&sim->vhc.urbp_list_inbox);
+	INIT_LIST_HEAD(&sim->vhc.urbp_list_fetched);
+	INIT_LIST_HEAD(&sim->vhc.urbp_list_cancel);
+	INIT_LIST_HEAD(&sim->vhc.urbp_list_canceling);
+	INIT_LIST_HEAD(&sim->vhc.urbp_list_done);
+	INIT_LIST_HEAD(&sim->vhc.urbp_list_shaped);
+	INIT_LIST_HEAD(&sim->vhc.resp_rules);
+	INIT_LIST_HEAD(&sim->done);
+	// the hub driver powers all ports right after the controller was registered
+	for(uint8_t i = 0; i < port_count && !(flags & USB_VHCI_SIM_FLAG_NO_HUB); i++)
+		sim_port_feature(sim, i + 1, 1, USB_PORT_FEAT_POWER);
+	sim_work_changed(sim);
+
+	pthread_mutex_lock(&sim_registry_lock);
+	_id = sim_next_id++;
+	sim->next = sim_registry;
+	sim_registry = sim;
+	__atomic_store_n(&usb_vhci_sim_count, usb_vhci_sim_count + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sim_registry_lock);
+
+	if(id) *id = _id;
+	if(usb_busnum) *usb_busnum = 0;
+	if(bus_id)
+	{
+		if((*bus_id = malloc(32)))
+			snprintf(*bus_id, 32, "usb_vhci_sim.%d", (int)_id);
+	}
+	return sim->fd;
+}
+
+int usb_vhci_sim_submit(int fd, const struct usb_vhci_urb *urb)
+{
+	struct usb_vhci_sim *sim;
+	struct sim_urb *su;
+
+	if(!urb || urb->type > USB_VHCI_URB_TYPE_BULK || urb->buffer_length < 0 ||
+	   (urb->buffer_length && !urb->buffer) ||
+	   (usb_vhci_is_iso(urb->type) && (urb->packet_count <= 0 || !urb->iso_packets)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	for(int i = 0; usb_vhci_is_iso(urb->type) && i < urb->packet_count; i++)
+	{
+		const struct usb_vhci_iso_packet *p = &urb->iso_packets[i];
+		if(p->packet_length < 0 || p->offset > (uint32_t)urb->buffer_length ||
+		   (uint32_t)p->packet_length > urb->buffer_length - p->offset)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if(!(sim = sim_get(fd)))
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if(!(su = malloc(sizeof *su)))
+	{
+		sim_put(sim);
+		return -1;
+	}
+
+	memset(su, 0, sizeof *su);
+	su->host = *urb;
+	if(!usb_vhci_is_iso(urb->type))
+	{
+		su->host.packet_count = 0;
+		su->host.iso_packets = NULL;
+	}
+	// the direction of a control transfer is given by its setup packet
+	if(usb_vhci_is_control(urb->type))
+		su->host.epadr = (urb->epadr & 0x7f) | (urb->bmRequestType & 0x80);
+	su->host.status = USB_VHCI_STATUS_PENDING;
+	su->host.buffer_actual = 0;
+	su->host.error_count = 0;
+	for(int i = 0; i < su->host.packet_count; i++)
+	{
+		su->host.iso_packets[i].packet_actual = 0;
+		su->host.iso_packets[i].status = USB_VHCI_STATUS_PENDING;
+	}
+	su->urb.hcpriv = &su->urbp;
+	su->urb.transfer_buffer = su->host.buffer;
+	su->urb.transfer_buffer_length = su->host.buffer_length;
+	su->urbp.urb = &su->urb;
+
+	pthread_mutex_lock(&sim->lock);
+	su->urbp.enqueue_time = ktime_get();
+	usb_vhci_queue_urbp(&sim->vhc, &su->urbp);
+	su->host.seq = su->urbp.seq;
+	su->host.enqueue_time = su->urbp.enqueue_time;
+	sim_work_changed(sim);
+	pthread_mutex_unlock(&sim->lock);
+	sim_put(sim);
+	return 0;
+}
+
+int usb_vhci_sim_unlink(int fd, uint64_t handle)
+{
+	struct usb_vhci_sim *sim;
+	struct sim_urb *su;
+	int cancel, ret = 1;
+
+	if(!(sim = sim_get(fd)))
+	{
+		errno = EBADF;
+		return -1;
+	}
+	pthread_mutex_lock(&sim->lock);
+	if(!(su = sim_find_host_handle(sim, handle)))
+	{
+		errno = ENOENT;
+		ret = -1;
+	}
+	else if(usb_vhci_unqueue_urb(&sim->vhc, &su->urb, &cancel))
+	{
+		// the device doesn't know about it yet
+		sim_complete_canceled(sim, su);
+		sim_work_changed(sim);
+		ret = 0;
+	}
+	else if(cancel)
+		// the device has to acknowledge the cancelation
+		sim_work_changed(sim);
+	pthread_mutex_unlock(&sim->lock);
+	sim_put(sim);
+	return ret;
+}
+
+int usb_vhci_sim_reap(int fd, struct usb_vhci_urb *urb, int16_t timeout)
+{
+	struct usb_vhci_sim *sim;
+	struct sim_urb *su = NULL;
+	int ret = 0;
+
+	if(!(sim = sim_get(fd)))
+	{
+		errno = EBADF;
+		return -1;
+	}
+	pthread_mutex_lock(&sim->lock);
+	sim_wait(sim, &sim->done_cond, timeout, sim_has_done);
+	if(sim->closed)
+	{
+		errno = EBADF;
+		ret = -1;
+	}
+	else if(list_empty(&sim->done))
+	{
+		errno = ETIMEDOUT;
+		ret = -1;
+	}
+	else
+	{
+		su = sim_urb_of(list_entry(sim->done.next, struct usb_vhci_urb_priv, urbp_list));
+		list_del(&su->urbp.urbp_list);
+	}
+	pthread_mutex_unlock(&sim->lock);
+	sim_put(sim);
+	if(su)
+	{
+		*urb = su->host;
+		free(su);
+	}
+	return ret;
+}
+
+int usb_vhci_sim_port_feature(int fd, uint8_t port, uint8_t set, uint16_t feature)
+{
+	struct usb_vhci_sim *sim;
+	int ret;
+
+	if(!(sim = sim_get(fd)))
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if(!port || port > sim->vhc.port_count)
+		ret = -EINVAL;
+	else
+	{
+		pthread_mutex_lock(&sim->lock);
+		ret = sim_port_feature(sim, port, set, feature);
+		sim_work_changed(sim);
+		pthread_mutex_unlock(&sim->lock);
+	}
+	sim_put(sim);
+	if(ret < 0)
+	{
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+int usb_vhci_sim_get_port_stat(int fd, uint8_t port, struct usb_vhci_port_stat *stat)
+{
+	struct usb_vhci_sim *sim;
+	int ret = 0;
+
+	if(!(sim = sim_get(fd)))
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if(!port || port > sim->vhc.port_count)
+	{
+		errno = EINVAL;
+		ret = -1;
+	}
+	else
+	{
+		pthread_mutex_lock(&sim->lock);
+		stat->index  = port;
+		stat->status = sim->ports[port - 1].port_status;
+		stat->change = sim->ports[port - 1].port_change;
+		stat->flags  = sim->ports[port - 1].port_flags;
+		pthread_mutex_unlock(&sim->lock);
+	}
+	sim_put(sim);
+	return ret;
+}
+
+#else // HAVE_VHCI_SIM
+
+// built without usb-vhci-core.h (see --with-vhci-hcd of configure): there are no
+// simulated controllers, so usb_vhci_sim_count stays zero
+
+int usb_vhci_sim_ioctl(int fd, unsigned long request, void *arg, int *result)
+{
+	(void)fd;
+	(void)request;
+	(void)arg;
+	(void)result;
+	return 0;
+}
+
+int usb_vhci_sim_close(int fd, int *result)
+{
+	(void)fd;
+	(void)result;
+	return 0;
+}
+
+int usb_vhci_sim_open(uint8_t port_count, uint32_t flags, int32_t *id, int32_t *usb_busnum, char **bus_id)
+{
+	(void)port_count;
+	(void)flags;
+	(void)id;
+	(void)usb_busnum;
+	(void)bus_id;
+	errno = ENOSYS;
+	return -1;
+}
+
+int usb_vhci_sim_submit(int fd, const struct usb_vhci_urb *urb)
+{
+	(void)fd;
+	(void)urb;
+	errno = EBADF;
+	return -1;
+}
+
+int usb_vhci_sim_unlink(int fd, uint64_t handle)
+{
+	(void)fd;
+	(void)handle;
+	errno = EBADF;
+	return -1;
+}
+
+int usb_vhci_sim_reap(int fd, struct usb_vhci_urb *urb, int16_t timeout)
+{
+	(void)fd;
+	(void)urb;
+	(void)timeout;
+	errno = EBADF;
+	return -1;
+}
+
+int usb_vhci_sim_port_feature(int fd, uint8_t port, uint8_t set, uint16_t feature)
+{
+	(void)fd;
+	(void)port;
+	(void)set;
+	(void)feature;
+	errno = EBADF;
+	return -1;
+}
+
+int usb_vhci_sim_get_port_stat(int fd, uint8_t port, struct usb_vhci_port_stat *stat)
+{
+	(void)fd;
+	(void)port;
+	(void)stat;
+	errno = EBADF;
+	return -1;
+}
+
+#endif // HAVE_VHCI_SIM
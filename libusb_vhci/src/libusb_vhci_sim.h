@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// internal interface between libusb_vhci.c and the simulated controller
+// (libusb_vhci_sim.c); not installed
+
+#ifndef _LIBUSB_VHCI_SIM_H
+#define _LIBUSB_VHCI_SIM_H 1
+
+#define USB_VHCI_SIM_HIDDEN __attribute__((visibility("hidden")))
+
+// number of open simulated controllers (the fast path of libusb_vhci.c skips the
+// lookup of the file descriptor, if this is zero); changed under the registry lock of
+// libusb_vhci_sim.c, read without it through usb_vhci_sim_active
+extern int usb_vhci_sim_count USB_VHCI_SIM_HIDDEN;
+
+static inline int usb_vhci_sim_active(void)
+{
+	return __atomic_load_n(&usb_vhci_sim_count, __ATOMIC_ACQUIRE);
+}
+
+// If fd belongs to a simulated controller, then these functions return non-zero and
+// store the result of the operation in *result. (errno is set like the real
+// ioctl/close would set it.)
+int usb_vhci_sim_ioctl(int fd, unsigned long request, void *arg, int *result) USB_VHCI_SIM_HIDDEN;
+int usb_vhci_sim_close(int fd, int *result) USB_VHCI_SIM_HIDDEN;
+
+#endif // _LIBUSB_VHCI_SIM_H
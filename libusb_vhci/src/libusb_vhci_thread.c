@@ -0,0 +1,158 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Execution policy of the threads which fetch and process works: scheduling class and
+ * priority, CPU affinity, locked memory and prefaulted stacks. Threads which are created
+ * by the library get the policy through their attributes (so that pthread_create fails
+ * with EPERM, if the caller may not use real-time priorities) and prefault their stack
+ * when they start.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_attr_setaffinity_np, pthread_setaffinity_np, pthread_getattr_np
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <alloca.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libusb_vhci.h"
+
+// stays untouched below the prefaulted part of a stack (for the frames of the callees)
+#define THREAD_STACK_RESERVE (64 * 1024)
+
+static int thread_check_policy(const struct usb_vhci_thread_policy *policy)
+{
+	int min, max;
+	if(!policy || (policy->flags & ~USB_VHCI_THREAD_MLOCKALL) ||
+	   (policy->cpu_set && !policy->cpu_set_size))
+		return EINVAL;
+	if(policy->stack_size && (policy->stack_size < (size_t)PTHREAD_STACK_MIN ||
+	                          policy->prefault_size > policy->stack_size / 2))
+		return EINVAL;
+	if(policy->sched_policy == SCHED_OTHER)
+		return policy->sched_priority ? EINVAL : 0;
+	if(policy->sched_policy != SCHED_FIFO && policy->sched_policy != SCHED_RR)
+		return EINVAL;
+	min = sched_get_priority_min(policy->sched_policy);
+	max = sched_get_priority_max(policy->sched_policy);
+	if(policy->sched_priority < min || policy->sched_priority > max)
+		return EINVAL;
+	return 0;
+}
+
+int usb_vhci_thread_policy_init_attr(const struct usb_vhci_thread_policy *policy, pthread_attr_t *attr)
+{
+	struct sched_param param;
+	int err;
+	if(!attr) { errno = EINVAL; return -1; }
+	if((err = thread_check_policy(policy))) { errno = err; return -1; }
+	if(policy->stack_size && (err = pthread_attr_setstacksize(attr, policy->stack_size)))
+		goto fail;
+	// SCHED_OTHER keeps inheriting the scheduling of the creating thread
+	if(policy->sched_policy != SCHED_OTHER)
+	{
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = policy->sched_priority;
+		if((err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED)) ||
+		   (err = pthread_attr_setschedpolicy(attr, policy->sched_policy)) ||
+		   (err = pthread_attr_setschedparam(attr, &param)))
+			goto fail;
+	}
+	if(policy->cpu_set &&
+	   (err = pthread_attr_setaffinity_np(attr, policy->cpu_set_size, (const cpu_set_t *)policy->cpu_set)))
+		goto fail;
+	return 0;
+fail:
+	errno = err;
+	return -1;
+}
+
+void usb_vhci_thread_prefault(size_t size)
+{
+	pthread_attr_t attr;
+	void *stack;
+	size_t stack_size;
+	char *sp = (char *)&attr;
+	volatile char *p;
+	if(!size) return;
+	// never touch more than the thread has below the current frame
+	if(!pthread_getattr_np(pthread_self(), &attr))
+	{
+		if(!pthread_attr_getstack(&attr, &stack, &stack_size) &&
+		   sp > (char *)stack && sp <= (char *)stack + stack_size)
+		{
+			size_t avail = (size_t)(sp - (char *)stack);
+			avail = (avail > THREAD_STACK_RESERVE) ? avail - THREAD_STACK_RESERVE : 0;
+			if(size > avail) size = avail;
+		}
+		else size = 0;
+		pthread_attr_destroy(&attr);
+	}
+	else size = 0;
+	if(!size) return;
+	p = (volatile char *)alloca(size);
+	while(size)
+	{
+		size_t step = (size > 4096) ? 4096 : size;
+		size -= step;
+		p[size] = 0;
+	}
+}
+
+int usb_vhci_thread_policy_apply(const struct usb_vhci_thread_policy *policy)
+{
+	struct sched_param param;
+	int err;
+	if((err = thread_check_policy(policy))) { errno = err; return -1; }
+	if((policy->flags & USB_VHCI_THREAD_MLOCKALL) && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		return -1;
+	if(policy->cpu_set &&
+	   (err = pthread_setaffinity_np(pthread_self(), policy->cpu_set_size, (const cpu_set_t *)policy->cpu_set)))
+		goto fail;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = policy->sched_priority;
+	if((err = pthread_setschedparam(pthread_self(), policy->sched_policy, &param)))
+		goto fail;
+	usb_vhci_thread_prefault(policy->prefault_size);
+	return 0;
+fail:
+	errno = err;
+	return -1;
+}
@@ -0,0 +1,82 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// internal trace points of libusb_vhci; not installed
+//
+// Every trace point is a USDT probe of provider libusb_vhci (if sys/sdt.h was found by
+// configure) with the arguments fd, handle, port, epadr, length and status, and it calls
+// the callback of usb_vhci_set_trace. Without a callback this costs a load and a
+// branch, which is predicted not taken.
+
+#ifndef _LIBUSB_VHCI_TRACE_H
+#define _LIBUSB_VHCI_TRACE_H 1
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define USB_VHCI_SDT(name, fd, handle, port, epadr, length, status) \
+	STAP_PROBE6(libusb_vhci, name, fd, handle, port, epadr, length, status)
+#else
+#define USB_VHCI_SDT(name, fd, handle, port, epadr, length, status) do { } while(0)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// set by usb_vhci_set_trace
+extern usb_vhci_trace_func usb_vhci_trace_callback;
+
+void usb_vhci_trace_emit(int point, int fd, uint64_t handle, uint8_t port, uint8_t epadr, int32_t length, int32_t status);
+
+// capture points of usb_vhci_capture_start (libusb_vhci_capture.c); only to be called,
+// if usb_vhci_capture_active is set
+extern int usb_vhci_capture_active;
+void usb_vhci_capture_submit(int fd, const struct usb_vhci_urb *urb);
+void usb_vhci_capture_giveback(int fd, const struct usb_vhci_urb *urb, const struct iovec *iov, int iovcnt);
+// remembers the usb bus number of the controller of fd for the records (0: unknown);
+// may be called whether a capture is active or not
+void usb_vhci_capture_set_busnum(int fd, int32_t busnum);
+
+#ifdef __cplusplus
+}
+#endif
+
+// name is the name of the USDT probe, point the USB_VHCI_TRACE_* constant
+#define USB_VHCI_TRACE(name, point, fd, handle, port, epadr, length, status) \
+	do \
+	{ \
+		USB_VHCI_SDT(name, fd, handle, port, epadr, length, status); \
+		if(__builtin_expect(__atomic_load_n(&usb_vhci_trace_callback, __ATOMIC_RELAXED) != NULL, 0)) \
+			usb_vhci_trace_emit(point, fd, handle, port, epadr, length, status); \
+	} while(0)
+
+#define USB_VHCI_CAPTURING() __builtin_expect(__atomic_load_n(&usb_vhci_capture_active, __ATOMIC_RELAXED), 0)
+
+#endif // _LIBUSB_VHCI_TRACE_H
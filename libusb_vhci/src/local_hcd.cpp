@@ -33,25 +33,136 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <new>
 #include "libusb_vhci.h"
 
+namespace
+{
+	// state of a detached local_hcd; only meant for the same version of the library on
+	// the same machine (the works contain usb_vhci_urb as is), so restore checks the
+	// package version and the sizes of the structures
+	const uint32_t state_magic(0x54534856); // "VHST"
+	const uint32_t state_version(2);
+#ifdef PACKAGE_VERSION
+	const char state_package_version[] = PACKAGE_VERSION;
+#else
+	const char state_package_version[] = "";
+#endif
+
+	struct state_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		char package_version[16];
+		uint16_t urb_size;        // sizeof(usb_vhci_urb)
+		uint16_t iso_packet_size; // sizeof(usb_vhci_iso_packet)
+		uint16_t work_size;       // sizeof(state_work)
+		int32_t id;
+		int32_t usb_bus_num;
+		uint32_t bus_id_length; // followed by the bus id
+		uint32_t work_count;
+		uint8_t port_count;     // followed by a state_port per port and the works
+	};
+
+	struct state_port
+	{
+		uint16_t status;
+		uint16_t change;
+		uint8_t flags;
+		uint8_t adr;
+	};
+
+	// followed by a state_port (port stat), or by usb_vhci_urb, its iso packets and
+	// data_length bytes of OUT data (process urb)
+	struct state_work
+	{
+		uint8_t type;
+		uint8_t port;
+		uint8_t trigger_flags;
+		int32_t data_length;
+		uint64_t handle;        // cancel urb
+	};
+
+	void put(std::vector<uint8_t>& state, const void* p, size_t n) _LIB_USB_VHCI_THROW((std::bad_alloc))
+	{
+		const uint8_t* b(static_cast<const uint8_t*>(p));
+		state.insert(state.end(), b, b + n);
+	}
+
+	void get(const std::vector<uint8_t>& state, size_t& pos, void* p, size_t n) _LIB_USB_VHCI_THROW((std::invalid_argument))
+	{
+		if(n > state.size() - pos) throw std::invalid_argument("state");
+		if(n) memcpy(p, &state[pos], n);
+		pos += n;
+	}
+
+	void init_header(state_header& h) _LIB_USB_VHCI_NOEXCEPT
+	{
+		memset(&h, 0, sizeof(h));
+		h.magic = state_magic;
+		h.version = state_version;
+		strncpy(h.package_version, state_package_version, sizeof(h.package_version) - 1);
+		h.urb_size = sizeof(usb_vhci_urb);
+		h.iso_packet_size = sizeof(usb_vhci_iso_packet);
+		h.work_size = sizeof(state_work);
+	}
+}
+
 namespace usb
 {
 	namespace vhci
 	{
-		local_hcd::local_hcd(uint8_t ports) throw(std::exception) :
+		local_hcd::local_hcd(uint8_t ports) _LIB_USB_VHCI_THROW((std::exception)) :
 			hcd(ports),
 			fd(-1),
 			id(),
 			usb_bus_num(),
 			bus_id(),
-			port_info(NULL)
+			port_info(NULL),
+			pool(NULL),
+			kick_supported(false),
+			detached(false)
+		{
+			char* _bus_id(NULL);
+			fd = usb_vhci_open(get_port_count(), &id, &usb_bus_num, &_bus_id);
+			init(_bus_id);
+		}
+
+		local_hcd::local_hcd(uint8_t ports, uint32_t sim_flags) _LIB_USB_VHCI_THROW((std::exception)) :
+			hcd(ports),
+			fd(-1),
+			id(),
+			usb_bus_num(),
+			bus_id(),
+			port_info(NULL),
+			pool(NULL),
+			kick_supported(false),
+			detached(false)
 		{
-			uint8_t c = get_port_count();
 			char* _bus_id(NULL);
-			fd = usb_vhci_open(c, &id, &usb_bus_num, &_bus_id);
+			fd = usb_vhci_sim_open(get_port_count(), sim_flags, &id, &usb_bus_num, &_bus_id);
+			init(_bus_id);
+		}
+
+		local_hcd::local_hcd(int fd, const std::vector<uint8_t>& state) _LIB_USB_VHCI_THROW((std::exception)) :
+			hcd(state_port_count(state)),
+			fd(fd),
+			id(),
+			usb_bus_num(),
+			bus_id(),
+			port_info(NULL),
+			pool(NULL),
+			kick_supported(false),
+			detached(false)
+		{
+			init(NULL, &state);
+		}
+
+		void local_hcd::init(char* _bus_id, const std::vector<uint8_t>* state) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			uint8_t c = get_port_count();
 			if(fd == -1) throw std::exception();
 			if(_bus_id)
 			{
@@ -59,18 +170,259 @@ namespace usb
 				free(_bus_id);
 			}
 			if(c) port_info = new _port_info[c];
+			pool = new urb_pool;
+			if(state)
+			{
+				try
+				{
+					restore(*state);
+				}
+				catch(...)
+				{
+					// fd stays with the caller
+					delete[] port_info;
+					port_info = NULL;
+					pool->destroy();
+					pool = NULL;
+					throw;
+				}
+			}
+			// the pending kick only makes the first fetch of bg_work return early
+			kick_supported = usb_vhci_kick(fd) == 0;
 			init_bg_thread();
 		}
 
-		local_hcd::~local_hcd() throw()
+		local_hcd::~local_hcd() _LIB_USB_VHCI_NOEXCEPT
 		{
 			join_bg_thread();
-			usb_vhci_close(fd);
+			if(!detached) usb_vhci_close(fd);
 			delete[] port_info;
+			// works which are still queued in hcd return their blocks later
+			if(pool) pool->destroy();
+		}
+
+		uint8_t local_hcd::state_port_count(const std::vector<uint8_t>& state) _LIB_USB_VHCI_THROW((std::invalid_argument))
+		{
+			size_t pos(0);
+			state_header h, expected;
+			get(state, pos, &h, sizeof(h));
+			init_header(expected);
+			if(h.magic != expected.magic || h.version != expected.version ||
+			   memcmp(h.package_version, expected.package_version, sizeof(h.package_version)) ||
+			   h.urb_size != expected.urb_size ||
+			   h.iso_packet_size != expected.iso_packet_size ||
+			   h.work_size != expected.work_size ||
+			   !h.port_count)
+				throw std::invalid_argument("state");
+			return h.port_count;
+		}
+
+		void local_hcd::restore(const std::vector<uint8_t>& state) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			size_t pos(0);
+			state_header h;
+			get(state, pos, &h, sizeof(h));
+			if(h.bus_id_length > state.size()) throw std::invalid_argument("state");
+			std::string _bus_id(h.bus_id_length, '\0');
+			if(h.bus_id_length) get(state, pos, &_bus_id[0], h.bus_id_length);
+			for(uint8_t i(0); i < get_port_count(); i++)
+			{
+				state_port p;
+				get(state, pos, &p, sizeof(p));
+				port_info[i] = _port_info(p.adr, port_stat(p.status, p.change, p.flags));
+			}
+
+			// nothing gets enqueued, unless the whole state is fine
+			std::vector<work*> ws;
+			try
+			{
+				for(uint32_t i(0); i < h.work_count; i++)
+				{
+					state_work sw;
+					get(state, pos, &sw, sizeof(sw));
+					if(!sw.port || sw.port > get_port_count()) throw std::invalid_argument("state");
+					ws.reserve(ws.size() + 1);
+					switch(sw.type)
+					{
+					case work_type_port_stat:
+					{
+						state_port p;
+						get(state, pos, &p, sizeof(p));
+						ws.push_back(new port_stat_work(sw.port, port_stat(p.status, p.change, p.flags), sw.trigger_flags));
+						break;
+					}
+					case work_type_cancel_urb:
+						ws.push_back(new cancel_urb_work(sw.port, sw.handle));
+						break;
+					case work_type_process_urb:
+					{
+						usb_vhci_urb u;
+						get(state, pos, &u, sizeof(u));
+						u.buffer = NULL;
+						u.iso_packets = NULL;
+						const int32_t packets(usb_vhci_is_iso(u.type) ? u.packet_count : 0);
+						if(packets < 0 || sw.data_length < 0 || sw.data_length > u.buffer_length)
+							throw std::invalid_argument("state");
+						usb::urb* _u(pool->alloc_urb(u));
+						if(!_u) throw std::bad_alloc();
+						try
+						{
+							get(state, pos, _u->get_internal()->iso_packets, packets * sizeof(usb_vhci_iso_packet));
+							get(state, pos, _u->get_buffer(), sw.data_length);
+						}
+						catch(...)
+						{
+							pool->free_urb(_u);
+							throw;
+						}
+						ws.push_back(pool->make_work(sw.port, _u));
+						break;
+					}
+					default:
+						throw std::invalid_argument("state");
+					}
+				}
+			}
+			catch(...)
+			{
+				for(size_t i(0); i < ws.size(); i++) delete ws[i];
+				throw;
+			}
+
+			bus_id.swap(_bus_id);
+			id = h.id;
+			usb_bus_num = h.usb_bus_num;
+			lock _(get_lock());
+			for(size_t i(0); i < ws.size(); i++) enqueue_work(ws[i]);
+			if(!ws.empty()) on_work_enqueued();
+		}
+
+		int local_hcd::detach(std::vector<uint8_t>& state, int timeout) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			local_hcd& _this(const_cast<local_hcd&>(*this));
+			join_bg_thread();
+			{
+				lock _(get_lock());
+				_this.set_draining(true);
+			}
+			// the vhci-hcd knows the urbs which were handed out as fetched by this
+			// process, so they have to be finished here; cancelations are still fetched
+			// meanwhile, new urbs stay in the inbox
+			const uint64_t end(latency_histogram::now() + static_cast<uint64_t>(timeout) * 1000000u);
+			while(true)
+			{
+				{
+					lock _(get_lock());
+					if(!_this.get_processing_count()) break;
+				}
+				int16_t ms(10);
+				if(timeout >= 0)
+				{
+					const uint64_t now(latency_histogram::now());
+					if(now >= end)
+					{
+						{
+							lock _(get_lock());
+							_this.set_draining(false);
+						}
+						init_bg_thread();
+						throw std::exception();
+					}
+					if(end - now < 10000000u) ms = static_cast<int16_t>((end - now) / 1000000u + 1);
+				}
+				_this.fetch_vhci_work(ms);
+			}
+			std::vector<work*> ws;
+			try
+			{
+				take_works(ws);
+				lock _(get_lock());
+				state_header h;
+				init_header(h);
+				h.id = id;
+				h.usb_bus_num = usb_bus_num;
+				h.bus_id_length = static_cast<uint32_t>(_this.bus_id.size());
+				h.work_count = static_cast<uint32_t>(ws.size());
+				h.port_count = get_port_count();
+				state.clear();
+				put(state, &h, sizeof(h));
+				put(state, _this.bus_id.data(), _this.bus_id.size());
+				for(uint8_t i(0); i < get_port_count(); i++)
+				{
+					state_port p;
+					memset(&p, 0, sizeof(p));
+					p.status = _this.port_info[i].stat.get_status();
+					p.change = _this.port_info[i].stat.get_change();
+					p.flags = _this.port_info[i].stat.get_flags();
+					p.adr = _this.port_info[i].adr;
+					put(state, &p, sizeof(p));
+				}
+				for(size_t i(0); i < ws.size(); i++)
+				{
+					state_work sw;
+					memset(&sw, 0, sizeof(sw));
+					sw.type = ws[i]->get_type();
+					sw.port = ws[i]->get_port();
+					switch(ws[i]->get_type())
+					{
+					case work_type_port_stat:
+					{
+						const port_stat_work* psw(static_cast<const port_stat_work*>(ws[i]));
+						state_port p;
+						memset(&p, 0, sizeof(p));
+						p.status = psw->get_port_stat().get_status();
+						p.change = psw->get_port_stat().get_change();
+						p.flags = psw->get_port_stat().get_flags();
+						sw.trigger_flags = psw->get_trigger_flags();
+						put(state, &sw, sizeof(sw));
+						put(state, &p, sizeof(p));
+						break;
+					}
+					case work_type_cancel_urb:
+						sw.handle = static_cast<const cancel_urb_work*>(ws[i])->get_handle();
+						put(state, &sw, sizeof(sw));
+						break;
+					case work_type_process_urb:
+					{
+						// only OUT urbs have data before they are processed
+						const usb::urb* u(static_cast<const process_urb_work*>(ws[i])->get_urb());
+						const usb_vhci_urb& _u(*u->get_internal());
+						const int32_t packets(u->is_isochronous() ? _u.packet_count : 0);
+						sw.data_length = u->is_out() ? _u.buffer_length : 0;
+						put(state, &sw, sizeof(sw));
+						put(state, &_u, sizeof(_u));
+						put(state, _u.iso_packets, packets * sizeof(usb_vhci_iso_packet));
+						put(state, _u.buffer, sw.data_length);
+						break;
+					}
+					}
+				}
+			}
+			catch(std::bad_alloc&)
+			{
+				// back to where we were
+				state.clear();
+				{
+					lock _(get_lock());
+					for(size_t i(0); i < ws.size(); i++) _this.enqueue_work(ws[i]);
+					if(!ws.empty()) _this.on_work_enqueued();
+					_this.set_draining(false);
+				}
+				try { init_bg_thread(); }
+				catch(...) { }
+				throw;
+			}
+			for(size_t i(0); i < ws.size(); i++) delete ws[i];
+			{
+				lock _(get_lock());
+				_this.set_draining(false);
+			}
+			_this.detached = true;
+			return fd;
 		}
 
 		// caller has _lock
-		uint8_t local_hcd::address_from_port(uint8_t port) const throw(std::invalid_argument, std::out_of_range)
+		uint8_t local_hcd::address_from_port(uint8_t port) const _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -78,7 +430,7 @@ namespace usb
 		}
 
 		// caller has _lock
-		uint8_t local_hcd::port_from_address(uint8_t address) const throw(std::invalid_argument)
+		uint8_t local_hcd::port_from_address(uint8_t address) const _LIB_USB_VHCI_THROW((std::invalid_argument))
 		{
 			if(address > 0x7f) throw std::invalid_argument("address");
 			for(uint8_t i(0); i < get_port_count(); i++)
@@ -87,17 +439,28 @@ namespace usb
 			return 0;
 		}
 
-		void local_hcd::bg_work() volatile throw()
+		void local_hcd::bg_work() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			// without kick, join_bg_thread has to wait for the timeout
+			fetch_vhci_work(kick_supported ? USB_VHCI_TIMEOUT_INFINITE : 100);
+		}
+
+		void local_hcd::kick_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(kick_supported) usb_vhci_kick(fd);
+		}
+
+		bool local_hcd::fetch_vhci_work(int16_t timeout) volatile _LIB_USB_VHCI_NOEXCEPT
 		{
 			local_hcd& _this(const_cast<local_hcd&>(*this));
 			usb_vhci_work w;
-			int res(usb_vhci_fetch_work(_this.fd, &w));
+			int res(usb_vhci_fetch_work_timeout(_this.fd, &w, timeout));
 			if(res == -1)
 			{
 				if(errno == ETIMEDOUT || errno == EINTR || errno == ENODATA)
-					return;
-				// TODO: debug msg
-				return;
+					return false;
+				_this.count_fetch_error();
+				return false;
 			}
 			uint8_t index;
 			switch(w.type)
@@ -108,9 +471,11 @@ namespace usb
 				port_stat nps(w.work.port_stat.status,
 				              w.work.port_stat.change,
 				              w.work.port_stat.flags);
-				// TODO: debug msg
 				if(!index || index > _this.get_port_count())
+				{
+					_this.count_dropped_work();
 					break;
+				}
 				bool nomem_retry(false);
 				port_stat_work* psw(NULL);
 			retry_ps:
@@ -120,7 +485,7 @@ namespace usb
 					if(is_thread_shutdown())
 					{
 						delete psw;
-						return;
+						return true;
 					}
 				}
 				else
@@ -161,91 +526,49 @@ namespace usb
 			} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
 			case USB_VHCI_WORK_TYPE_PROCESS_URB:
 			{
+				// work, urb, iso packets and data buffer share one block of the pool
+				usb::urb* u;
+				while(!(u = pool->alloc_urb(w.work.urb)))
+				{
+					// wait for others to free mem
+					usleep(100000);
+					if(is_thread_shutdown()) return true;
+				}
+				if(res)
+				{
+					res = usb_vhci_fetch_data(fd, u->get_internal());
+					if(res == -1)
+					{
+						// canceled meanwhile is not an error
+						if(errno != ECANCELED) _this.count_fetch_data_error();
+						pool->free_urb(u);
+						break;
+					}
+				}
 				bool nomem_retry(false);
-				process_urb_work* puw(NULL);
 			retry_pu:
 				if(nomem_retry)
 				{
 					usleep(100000);
 					if(is_thread_shutdown())
 					{
-						delete puw; // dtor of puw deletes the urb and the data buffers, too
-						return;
+						pool->free_urb(u);
+						return true;
 					}
 				}
 				else
 				{
 					nomem_retry = true;
 				}
-				if(w.work.urb.buffer_length)
-				{
-					do
-					{
-						w.work.urb.buffer = new(std::nothrow) uint8_t[w.work.urb.buffer_length];
-						if(!w.work.urb.buffer)
-						{
-							// wait for others to free mem
-							usleep(100000);
-							if(is_thread_shutdown()) return;
-						}
-					} while(!w.work.urb.buffer);
-				}
-				if(w.work.urb.packet_count)
-				{
-					do
-					{
-						w.work.urb.iso_packets = new(std::nothrow) usb_vhci_iso_packet[w.work.urb.packet_count];
-						if(!w.work.urb.iso_packets)
-						{
-							// wait for others to free mem
-							usleep(100000);
-							if(is_thread_shutdown()) return;
-						}
-					} while(!w.work.urb.iso_packets);
-				}
-				usb::urb* u(NULL);
-				while(!u)
-				{
-					if(!(u = new(std::nothrow) usb::urb(w.work.urb, true)))
-					{
-						// wait for others to free mem
-						usleep(100000);
-						if(is_thread_shutdown()) return;
-					}
-				}
-				if(res)
-				{
-					res = usb_vhci_fetch_data(fd, u->get_internal());
-					if(res == -1)
-					{
-						delete u;
-						// TODO: debug msg
-						//if(errno == ECANCELED) {} else {}
-						break;
-					}
-				}
 				lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
 				index = _this.port_from_address(w.work.urb.devadr);
-				// TODO: debug msg
 				if(!index)
 				{
-					delete puw; // dtor of puw deletes the urb and the data buffers, too
+					pool->free_urb(u);
+					_this.count_dropped_work();
 					break;
 				}
-				if(!puw)
-				{
-					if(!(puw = new(std::nothrow) process_urb_work(index, u)))
-					{
-						// jump outside the lock and wait for others to free mem
-						goto retry_pu;
-					}
-				}
-				else
-				{
-					// reuse already allocated mem
-					puw->~process_urb_work();
-					new(puw) process_urb_work(index, u);
-				}
+				process_urb_work* puw(pool->make_work(index, u));
 				uint8_t rollback_address(_this.port_info[index - 1].adr);
 				if(u->is_control())
 				{
@@ -272,6 +595,8 @@ namespace usb
 				{
 					// rollback changes on 'this'
 					_this.port_info[index - 1].adr = rollback_address;
+					// the urb stays in its block; only the work gets recreated
+					puw->~process_urb_work();
 					// jump outside the lock and wait for others to free mem
 					goto retry_pu;
 				}
@@ -282,14 +607,15 @@ namespace usb
 				cancel_process_urb_work(w.work.handle);
 				break;
 			}
+			return true;
 		}
 
 		// caller has _lock
-		void local_hcd::canceling_work(work* w, bool in_progress) throw(std::exception)
+		void local_hcd::canceling_work(work* w, bool in_progress) _LIB_USB_VHCI_THROW((std::exception))
 		{
-			process_urb_work* uw;
-			if(in_progress && (uw = dynamic_cast<process_urb_work*>(w)))
+			if(in_progress && w->get_type() == work_type_process_urb)
 			{
+				process_urb_work* uw(static_cast<process_urb_work*>(w));
 				cancel_urb_work* cw = new cancel_urb_work(uw->get_port(), uw->get_urb()->get_handle());
 				try { enqueue_work(cw); }
 				catch(...)
@@ -301,21 +627,21 @@ namespace usb
 			}
 		}
 
-		// caller has _lock
-		void local_hcd::finishing_work(work* w) throw(std::exception)
+		// caller may have _lock (only uses fd)
+		void local_hcd::finishing_work(work* w) _LIB_USB_VHCI_THROW((std::exception))
 		{
-			process_urb_work* uw(dynamic_cast<process_urb_work*>(w));
-			if(uw)
+			if(w->get_type() == work_type_process_urb)
 			{
-				const usb::urb* urb(uw->get_urb());
-				if(usb_vhci_giveback(fd, urb->get_internal()) == -1)
-				{
-					// TODO: debug msg
-				}
+				const usb::urb* urb(static_cast<process_urb_work*>(w)->get_urb());
+				const iovec* iov;
+				const int iovcnt(urb->get_in_data(&iov));
+				if((iovcnt ? usb_vhci_giveback_iov(fd, urb->get_internal(), iov, iovcnt) :
+				             usb_vhci_giveback(fd, urb->get_internal())) == -1)
+					count_giveback_error(w->get_port());
 			}
 		}
 
-		const port_stat& local_hcd::get_port_stat(uint8_t port) volatile throw(std::invalid_argument, std::out_of_range)
+		const port_stat& local_hcd::get_port_stat(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -323,7 +649,7 @@ namespace usb
 			return port_info[port - 1].stat;
 		}
 
-		void local_hcd::port_connect(uint8_t port, usb::data_rate rate) volatile throw(std::exception)
+		void local_hcd::port_connect(uint8_t port, usb::data_rate rate) volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -331,7 +657,7 @@ namespace usb
 				throw std::exception();
 		}
 
-		void local_hcd::port_disconnect(uint8_t port) volatile throw(std::exception)
+		void local_hcd::port_disconnect(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -339,7 +665,7 @@ namespace usb
 				throw std::exception();
 		}
 
-		void local_hcd::port_disable(uint8_t port) volatile throw(std::exception)
+		void local_hcd::port_disable(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -347,7 +673,7 @@ namespace usb
 				throw std::exception();
 		}
 
-		void local_hcd::port_resumed(uint8_t port) volatile throw(std::exception)
+		void local_hcd::port_resumed(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -355,7 +681,7 @@ namespace usb
 				throw std::exception();
 		}
 
-		void local_hcd::port_overcurrent(uint8_t port, bool set) volatile throw(std::exception)
+		void local_hcd::port_overcurrent(uint8_t port, bool set) volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
@@ -363,12 +689,27 @@ namespace usb
 				throw std::exception();
 		}
 
-		void local_hcd::port_reset_done(uint8_t port, bool enable) volatile throw(std::exception)
+		void local_hcd::port_reset_done(uint8_t port, bool enable) volatile _LIB_USB_VHCI_THROW((std::exception))
 		{
 			if(!port) throw std::invalid_argument("port");
 			if(port > get_port_count()) throw std::out_of_range("port");
 			if(usb_vhci_port_reset_done(fd, port, enable) == -1)
 				throw std::exception();
 		}
+
+		void local_hcd::add_responder(uint8_t port, const usb_vhci_responder& rule) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			if(usb_vhci_responder_add(fd, port, &rule) == -1)
+				throw std::exception();
+		}
+
+		void local_hcd::clear_responders(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(port > get_port_count()) throw std::out_of_range("port");
+			if(usb_vhci_responder_clear(fd, port) == -1)
+				throw std::exception();
+		}
 	}
 }
@@ -0,0 +1,205 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		reactor::source::source(local_hcd& dev, const hcd::callback& handler) _LIB_USB_VHCI_NOEXCEPT :
+			dev(&dev),
+			handler(handler),
+			vhci_watch(),
+			work_watch()
+		{
+			vhci_watch.src = this;
+			vhci_watch.vhci = true;
+			work_watch.src = this;
+			work_watch.vhci = false;
+		}
+
+		reactor::reactor() _LIB_USB_VHCI_THROW((std::exception)) :
+			epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+			wake_fd(-1),
+			sources(),
+			removed(),
+			dispatching(false),
+			stopped(false)
+		{
+			if(epoll_fd == -1) throw std::exception();
+			wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = NULL;
+			if(wake_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+			{
+				if(wake_fd != -1) close(wake_fd);
+				close(epoll_fd);
+				throw std::exception();
+			}
+		}
+
+		reactor::~reactor() _LIB_USB_VHCI_NOEXCEPT
+		{
+			dispatching = false;
+			while(!sources.empty())
+			{
+				// if restarting its background thread fails, the hcd is removed anyway
+				try { remove(*sources.back()->dev); }
+				catch(...) { }
+			}
+			for(size_t i(0); i < removed.size(); i++)
+				delete removed[i];
+			close(wake_fd);
+			close(epoll_fd);
+		}
+
+		void reactor::add(local_hcd& dev, hcd::callback handler) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			for(size_t i(0); i < sources.size(); i++)
+				if(sources[i]->dev == &dev) throw std::invalid_argument("dev");
+			sources.reserve(sources.size() + 1);
+			source* s(new source(dev, handler));
+			// the reactor fetches the works of the vhci-hcd from now on
+			dev.join_bg_thread();
+			epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = &s->vhci_watch;
+			bool ok(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev.get_fd(), &ev) != -1);
+			if(ok)
+			{
+				ev.data.ptr = &s->work_watch;
+				ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev.get_work_fd(), &ev) != -1;
+				if(!ok) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev.get_fd(), &ev);
+			}
+			if(!ok)
+			{
+				delete s;
+				dev.init_bg_thread();
+				throw std::exception();
+			}
+			sources.push_back(s);
+			// works which were enqueued before and are not signaled anymore
+			const uint64_t one(1);
+			ssize_t res(write(dev.get_work_fd(), &one, sizeof(one)));
+			static_cast<void>(res);
+		}
+
+		bool reactor::remove(local_hcd& dev) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			for(size_t i(0); i < sources.size(); i++)
+			{
+				source* s(sources[i]);
+				if(s->dev != &dev) continue;
+				epoll_event ev;
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev.get_fd(), &ev);
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev.get_work_fd(), &ev);
+				sources.erase(sources.begin() + i);
+				s->dev = NULL;
+				// events of the current run_once may still refer to s
+				if(dispatching)
+				{
+					try { removed.push_back(s); }
+					catch(std::bad_alloc&)
+					{
+						// leaks s rather than risking a dangling watch
+					}
+				}
+				else delete s;
+				dev.init_bg_thread();
+				return true;
+			}
+			return false;
+		}
+
+		void reactor::dispatch(watch* w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			source* s(w->src);
+			if(!s->dev) return;
+			if(w->vhci)
+			{
+				// a limited number per wakeup, so that a busy controller doesn't starve
+				// the others (epoll is level-triggered)
+				for(int i(0); i < 64 && s->dev && s->dev->fetch_vhci_work(0); i++);
+				if(!s->dev) return;
+			}
+			// resets the work fd
+			if(s->dev->wait_for_work(0)) s->handler.call(*s->dev);
+		}
+
+		bool reactor::run_once(int timeout) _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(size_t i(0); i < removed.size(); i++)
+				delete removed[i];
+			removed.clear();
+			epoll_event ev[32];
+			int n(epoll_wait(epoll_fd, ev, 32, timeout));
+			if(n <= 0) return false;
+			dispatching = true;
+			for(int i(0); i < n; i++)
+			{
+				if(!ev[i].data.ptr)
+				{
+					uint64_t val;
+					ssize_t res(read(wake_fd, &val, sizeof(val)));
+					static_cast<void>(res);
+					continue;
+				}
+				dispatch(static_cast<watch*>(ev[i].data.ptr));
+			}
+			dispatching = false;
+			return true;
+		}
+
+		void reactor::run() _LIB_USB_VHCI_NOEXCEPT
+		{
+			// consumes the stop request
+			while(!__atomic_exchange_n(&stopped, false, __ATOMIC_ACQ_REL))
+				run_once(-1);
+		}
+
+		void reactor::stop() _LIB_USB_VHCI_NOEXCEPT
+		{
+			__atomic_store_n(&stopped, true, __ATOMIC_RELEASE);
+			const uint64_t one(1);
+			ssize_t res(write(wake_fd, &one, sizeof(one)));
+			static_cast<void>(res);
+		}
+	}
+}
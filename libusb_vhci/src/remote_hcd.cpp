@@ -0,0 +1,591 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <new>
+#include "libusb_vhci_remote.h"
+
+namespace
+{
+	// the remote_hcd whose bg_work runs on this thread: begin_send can't wait for
+	// bg_work there
+	__thread const volatile void* consumer(NULL);
+
+	struct consumer_scope
+	{
+		explicit consumer_scope(const volatile void* hcd) _LIB_USB_VHCI_NOEXCEPT { consumer = hcd; }
+		~consumer_scope() _LIB_USB_VHCI_NOEXCEPT { consumer = NULL; }
+	private:
+		consumer_scope(const consumer_scope&) _LIB_USB_VHCI_NOEXCEPT;
+		consumer_scope& operator=(const consumer_scope&) _LIB_USB_VHCI_NOEXCEPT;
+	};
+
+	// the fallback for a producer which waits for room while it has the lock of the
+	// hcd (e.g. in a work enqueued callback), which bg_work may need before it gets
+	// to wake_producers
+	const long room_timeout(10000000L); // ns
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		remote_hcd::remote_hcd(const std::string& path, uint8_t ports) _LIB_USB_VHCI_THROW((std::exception)) :
+			hcd(ports),
+			sock(-1),
+			in_fd(-1),
+			out_fd(-1),
+			kick_fd(-1),
+			shm(NULL),
+			shm_size(0),
+			in(NULL),
+			out(NULL),
+			out_lock(),
+			out_room(),
+			out_waiting(0),
+			id(),
+			usb_bus_num(),
+			bus_id(),
+			port_info(NULL),
+			pool(NULL),
+			connected(false)
+		{
+			pthread_mutex_init(&out_lock, NULL);
+			pthread_cond_init(&out_room, NULL);
+			try
+			{
+				connect(path);
+				port_info = new _port_info[get_port_count()];
+				pool = new urb_pool;
+				init_bg_thread();
+			}
+			catch(...)
+			{
+				cleanup();
+				throw;
+			}
+		}
+
+		remote_hcd::~remote_hcd() _LIB_USB_VHCI_NOEXCEPT
+		{
+			join_bg_thread();
+			cleanup();
+		}
+
+		void remote_hcd::connect(const std::string& path) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			sockaddr_un a;
+			memset(&a, 0, sizeof(a));
+			a.sun_family = AF_UNIX;
+			if(path.empty() || path.size() >= sizeof(a.sun_path)) throw std::invalid_argument("path");
+			path.copy(a.sun_path, path.size());
+			sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+			if(sock == -1) throw std::exception();
+			if(::connect(sock, reinterpret_cast<sockaddr*>(&a), sizeof(a)) == -1) throw std::exception();
+
+			remote_hello h;
+			memset(&h, 0, sizeof(h));
+			h.magic = REMOTE_MAGIC;
+			h.version = REMOTE_VERSION;
+			h.port_count = get_port_count();
+			if(send(sock, &h, sizeof(h), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(h))) throw std::exception();
+
+			// the welcome carries the memfd and the doorbells of both rings
+			remote_welcome wl;
+			memset(&wl, 0, sizeof(wl));
+			iovec iov = { &wl, sizeof(wl) };
+			union
+			{
+				cmsghdr align;
+				char buf[CMSG_SPACE(3 * sizeof(int))];
+			} cbuf;
+			msghdr mh;
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = &iov;
+			mh.msg_iovlen = 1;
+			mh.msg_control = cbuf.buf;
+			mh.msg_controllen = sizeof(cbuf.buf);
+			ssize_t res;
+			do res = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+			while(res == -1 && errno == EINTR);
+			int fds[3] = { -1, -1, -1 };
+			if(res != -1)
+			{
+				for(cmsghdr* c(CMSG_FIRSTHDR(&mh)); c; c = CMSG_NXTHDR(&mh, c))
+				{
+					if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+					const size_t n((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+					memcpy(fds, CMSG_DATA(c), ((n < 3) ? n : 3) * sizeof(int));
+					break;
+				}
+			}
+			in_fd = fds[1];
+			out_fd = fds[2];
+			const bool valid(res == static_cast<ssize_t>(sizeof(wl)) &&
+			                 wl.magic == REMOTE_MAGIC &&
+			                 wl.version == REMOTE_VERSION);
+			if(fds[0] != -1)
+			{
+				if(valid && !wl.error)
+				{
+					shm = mmap(NULL, wl.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+					if(shm == MAP_FAILED) shm = NULL;
+					else shm_size = wl.shm_size;
+				}
+				close(fds[0]);
+			}
+			if(res == -1) throw std::exception();
+			if(valid && wl.error)
+			{
+				errno = wl.error;
+				throw std::exception();
+			}
+			if(!valid || !shm || in_fd == -1 || out_fd == -1 || wl.port_count != get_port_count())
+			{
+				errno = EPROTO;
+				throw std::exception();
+			}
+
+			remote_shm* hdr(static_cast<remote_shm*>(shm));
+			const uint32_t ring_size(hdr->ring_size);
+			if(hdr->magic != REMOTE_MAGIC ||
+			   ring_size < 4096 || (ring_size & (ring_size - 1)) ||
+			   remote_shm_data_offset + 2 * static_cast<size_t>(ring_size) > shm_size)
+			{
+				errno = EPROTO;
+				throw std::exception();
+			}
+			char* data(static_cast<char*>(shm) + remote_shm_data_offset);
+			in = new remote_ring(&hdr->to_client, data, ring_size);
+			out = new remote_ring(&hdr->to_broker, data + ring_size, ring_size);
+			id = wl.id;
+			usb_bus_num = wl.usb_bus_num;
+			bus_id.assign(wl.bus_id, strnlen(wl.bus_id, sizeof(wl.bus_id)));
+			kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(kick_fd == -1) throw std::exception();
+			connected = true;
+		}
+
+		void remote_hcd::cleanup() _LIB_USB_VHCI_NOEXCEPT
+		{
+			connected = false;
+			delete in;
+			delete out;
+			in = out = NULL;
+			if(shm) munmap(shm, shm_size);
+			shm = NULL;
+			if(sock != -1) close(sock);
+			if(in_fd != -1) close(in_fd);
+			if(out_fd != -1) close(out_fd);
+			if(kick_fd != -1) close(kick_fd);
+			sock = in_fd = out_fd = kick_fd = -1;
+			delete[] port_info;
+			port_info = NULL;
+			// works which are still queued in hcd return their blocks later
+			if(pool) pool->destroy();
+			pool = NULL;
+			pthread_mutex_destroy(&out_lock);
+			pthread_cond_destroy(&out_room);
+		}
+
+		// caller has _lock
+		uint8_t remote_hcd::address_from_port(uint8_t port) const _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			return port_info[port - 1].adr;
+		}
+
+		// caller has _lock
+		uint8_t remote_hcd::port_from_address(uint8_t address) const _LIB_USB_VHCI_THROW((std::invalid_argument))
+		{
+			if(address > 0x7f) throw std::invalid_argument("address");
+			for(uint8_t i(0); i < get_port_count(); i++)
+				if(port_info[i].adr == address)
+					return i + 1;
+			return 0;
+		}
+
+		void remote_hcd::bg_work() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_hcd& _this(const_cast<remote_hcd&>(*this));
+			consumer_scope scope(this);
+			if(!connected)
+			{
+				// nothing comes anymore; wait for join_bg_thread
+				pollfd p = { kick_fd, POLLIN, 0 };
+				if(poll(&p, 1, -1) > 0) remote_clear_doorbell(kick_fd);
+				return;
+			}
+			int n(0);
+			remote_msg hdr;
+			for(const remote_msg* m; n < 64 && (m = _this.in->peek(hdr)); n++)
+			{
+				if(!hdr.size)
+				{
+					// nothing can be trusted in the ring anymore
+					connected = false;
+					wake_producers();
+					lock _(get_lock());
+					_this.lost_broker();
+					return;
+				}
+				_this.handle_msg(hdr, m);
+				if(_this.in->pop(hdr.size)) remote_ring_doorbell(out_fd);
+			}
+			// the doorbell may have been rung for room in out meanwhile
+			if(__atomic_load_n(&_this.out_waiting, __ATOMIC_RELAXED)) wake_producers();
+			if(n || _this.in->spin(remote_spin_time()) || !_this.in->prepare_wait()) return;
+			pollfd p[3] = { { in_fd, POLLIN, 0 }, { sock, POLLIN, 0 }, { kick_fd, POLLIN, 0 } };
+			const int res(poll(p, 3, -1));
+			_this.in->end_wait();
+			if(res <= 0) return;
+			if(p[0].revents)
+			{
+				remote_clear_doorbell(in_fd);
+				wake_producers();
+			}
+			if(p[2].revents) remote_clear_doorbell(kick_fd);
+			if(!p[1].revents) return;
+			// nothing is sent over the socket after the welcome; so this is EOF
+			char c;
+			const ssize_t r(recv(sock, &c, sizeof(c), MSG_DONTWAIT));
+			if(r == -1 && (errno == EAGAIN || errno == EINTR)) return;
+			connected = false;
+			wake_producers();
+			lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
+			_this.lost_broker();
+		} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
+
+		// caller has _lock
+		void remote_hcd::lost_broker() _LIB_USB_VHCI_NOEXCEPT
+		{
+			// the broker is gone and so are the devices for the host; tell ours
+			for(uint8_t i(0); i < get_port_count(); i++)
+			{
+				const port_stat& prev(port_info[i].stat);
+				if(!prev.get_connection()) continue;
+				port_stat nps(prev.get_status() & USB_VHCI_PORT_STAT_POWER, USB_VHCI_PORT_STAT_C_CONNECTION, 0);
+				try
+				{
+					enqueue_work(new port_stat_work(i + 1, nps, prev));
+				}
+				catch(std::bad_alloc&)
+				{
+					count_dropped_work();
+				}
+				port_info[i].stat = nps;
+				port_info[i].adr = 0xff;
+			}
+			on_work_enqueued();
+		}
+
+		void remote_hcd::handle_msg(const remote_msg& hdr, const remote_msg* m) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const uint8_t index(hdr.port);
+			if(!index || index > get_port_count())
+			{
+				count_dropped_work();
+				return;
+			}
+			switch(hdr.type)
+			{
+			case REMOTE_MSG_PORT_STAT:
+			{
+				if(hdr.size < remote_msg_size(sizeof(usb_vhci_port_stat)))
+				{
+					count_dropped_work();
+					break;
+				}
+				usb_vhci_port_stat ps;
+				memcpy(&ps, remote_msg_body(m), sizeof(ps));
+				port_stat nps(ps.status, ps.change, ps.flags);
+				while(true)
+				{
+					{
+						lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
+						port_stat_work* psw(new(std::nothrow) port_stat_work(index, nps, port_info[index - 1].stat));
+						if(psw)
+						{
+							enqueue_work(psw);
+							port_info[index - 1].stat = nps;
+							// invalidate address on CONNECTION state change
+							if(nps.get_connection_changed()) port_info[index - 1].adr = 0xff;
+							// set address to 0 after successfull RESET
+							if(nps.get_reset_changed() && !nps.get_reset() && nps.get_enable())
+								port_info[index - 1].adr = 0x00;
+							on_work_enqueued();
+							return;
+						}
+					} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
+					// wait for others to free mem
+					usleep(100000);
+					if(is_thread_shutdown()) return;
+				}
+			}
+			case REMOTE_MSG_PROCESS_URB:
+			{
+				usb_vhci_urb tmp;
+				const usb_vhci_iso_packet* iso;
+				const uint8_t* data;
+				int32_t data_length;
+				if(!remote_get_urb(m, hdr.size, tmp, &iso, &data, &data_length))
+				{
+					count_dropped_work();
+					break;
+				}
+				tmp.handle = hdr.tag;
+				tmp.buffer = NULL;
+				tmp.iso_packets = NULL;
+				// work, urb, iso packets and data buffer share one block of the pool
+				usb::urb* u;
+				try
+				{
+					while(!(u = pool->alloc_urb(tmp)))
+					{
+						// wait for others to free mem
+						usleep(100000);
+						if(is_thread_shutdown()) return;
+					}
+				}
+				catch(std::invalid_argument&)
+				{
+					count_dropped_work();
+					break;
+				}
+				if(iso) memcpy(u->get_internal()->iso_packets, iso, tmp.packet_count * sizeof(usb_vhci_iso_packet));
+				if(data) memcpy(u->get_buffer(), data, (data_length < tmp.buffer_length) ? data_length : tmp.buffer_length);
+				lock _(get_lock()); //  vvvv LOCKED vvvv  --  ^^^^ NOT LOCKED ^^^^
+				process_urb_work* puw(pool->make_work(index, u));
+				if(u->is_control())
+				{
+					// SET_ADDRESS?
+					if(!u->get_endpoint_number() &&
+					   !u->get_bmRequestType() &&
+					   u->get_bRequest() == 5)
+					{
+						uint16_t val(u->get_wValue());
+						if(val > 0x7f)
+							u->stall();
+						else
+						{
+							u->ack();
+							port_info[index - 1].adr = static_cast<uint8_t>(val);
+						}
+					}
+				}
+				enqueue_work(puw);
+				on_work_enqueued();
+				break;
+			} //  vvvv NOT LOCKED vvvv  --  ^^^^ LOCKED ^^^^
+			case REMOTE_MSG_CANCEL_URB:
+				try
+				{
+					cancel_process_urb_work(hdr.tag);
+				}
+				catch(...)
+				{
+					count_dropped_work();
+				}
+				break;
+			default:
+				count_dropped_work();
+				break;
+			}
+		}
+
+		remote_msg* remote_hcd::begin_send(uint32_t msg_size) volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_hcd& _this(const_cast<remote_hcd&>(*this));
+			if(!connected) return NULL;
+			pthread_mutex_lock(&_this.out_lock);
+			remote_msg* m;
+			while(!(m = _this.out->reserve(msg_size)))
+			{
+				if(!connected || msg_size > _this.out->get_max_msg_size())
+				{
+					pthread_mutex_unlock(&_this.out_lock);
+					return NULL;
+				}
+				// the broker rings in_fd after its next pop
+				_this.out->set_producer_waiting();
+				if((m = _this.out->reserve(msg_size))) break;
+				if(consumer == this)
+				{
+					// called by bg_work (which gives canceled urbs back): wait for the
+					// doorbell right here
+					pthread_mutex_unlock(&_this.out_lock);
+					pollfd p[2] = { { in_fd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+					if(poll(p, 2, -1) > 0 && p[0].revents)
+					{
+						remote_clear_doorbell(in_fd);
+						wake_producers();
+					}
+					// bg_work finds out about EOF
+					if(p[1].revents) return NULL;
+					pthread_mutex_lock(&_this.out_lock);
+					continue;
+				}
+				timespec end;
+				clock_gettime(CLOCK_REALTIME, &end);
+				end.tv_nsec += room_timeout;
+				if(end.tv_nsec >= 1000000000L)
+				{
+					end.tv_sec++;
+					end.tv_nsec -= 1000000000L;
+				}
+				_this.out_waiting++;
+				pthread_cond_timedwait(&_this.out_room, &_this.out_lock, &end);
+				_this.out_waiting--;
+			}
+			return m;
+		}
+
+		void remote_hcd::wake_producers() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_hcd& _this(const_cast<remote_hcd&>(*this));
+			pthread_mutex_lock(&_this.out_lock);
+			if(_this.out_waiting) pthread_cond_broadcast(&_this.out_room);
+			pthread_mutex_unlock(&_this.out_lock);
+		}
+
+		void remote_hcd::end_send(remote_msg* m) volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			remote_hcd& _this(const_cast<remote_hcd&>(*this));
+			const bool wake(_this.out->commit(m));
+			pthread_mutex_unlock(&_this.out_lock);
+			if(wake) remote_ring_doorbell(out_fd);
+		}
+
+		void remote_hcd::kick_bg_thread() volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(kick_fd != -1) remote_ring_doorbell(kick_fd);
+		}
+
+		// caller has _lock
+		void remote_hcd::canceling_work(work* w, bool in_progress) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(in_progress && w->get_type() == work_type_process_urb)
+			{
+				process_urb_work* uw(static_cast<process_urb_work*>(w));
+				cancel_urb_work* cw = new cancel_urb_work(uw->get_port(), uw->get_urb()->get_handle());
+				try { enqueue_work(cw); }
+				catch(...)
+				{
+					delete cw;
+					throw;
+				}
+				on_work_enqueued();
+			}
+		}
+
+		// caller may have _lock (only uses out)
+		void remote_hcd::finishing_work(work* w) _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(w->get_type() == work_type_process_urb)
+			{
+				const usb::urb* urb(static_cast<process_urb_work*>(w)->get_urb());
+				remote_msg* m(begin_send(remote_urb_msg_size(*urb->get_internal())));
+				if(!m)
+				{
+					count_giveback_error(w->get_port());
+					return;
+				}
+				m->type = REMOTE_MSG_GIVEBACK;
+				m->port = w->get_port();
+				m->op = 0;
+				m->tag = urb->get_handle();
+				remote_put_urb(m, *urb);
+				end_send(m);
+			}
+		}
+
+		void remote_hcd::port_op(uint8_t port, uint8_t op, uint32_t arg) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			remote_msg* m(begin_send(remote_msg_size(0)));
+			if(!m) throw std::exception();
+			m->type = REMOTE_MSG_PORT_OP;
+			m->port = port;
+			m->op = op;
+			m->tag = arg;
+			end_send(m);
+		}
+
+		const port_stat& remote_hcd::get_port_stat(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::invalid_argument, std::out_of_range))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			lock _(get_lock());
+			return port_info[port - 1].stat;
+		}
+
+		void remote_hcd::port_connect(uint8_t port, usb::data_rate rate) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			port_op(port, REMOTE_PORT_CONNECT, rate);
+		}
+
+		void remote_hcd::port_disconnect(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			port_op(port, REMOTE_PORT_DISCONNECT, 0);
+		}
+
+		void remote_hcd::port_disable(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			port_op(port, REMOTE_PORT_DISABLE, 0);
+		}
+
+		void remote_hcd::port_resumed(uint8_t port) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			port_op(port, REMOTE_PORT_RESUMED, 0);
+		}
+
+		void remote_hcd::port_overcurrent(uint8_t port, bool set) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			port_op(port, REMOTE_PORT_OVERCURRENT, set);
+		}
+
+		void remote_hcd::port_reset_done(uint8_t port, bool enable) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			port_op(port, REMOTE_PORT_RESET_DONE, enable);
+		}
+	}
+}
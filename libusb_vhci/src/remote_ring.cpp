@@ -0,0 +1,153 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include "libusb_vhci_remote.h"
+
+namespace
+{
+	// see remote_spin_time: a bit more than the round trip of a message which the other
+	// side answers right away, and still much less than a sleep on the doorbell
+	const uint64_t spin_time(20000);
+
+	// body of PROCESS_URB and GIVEBACK messages; followed by the iso packets and the data
+	struct urb_body
+	{
+		usb_vhci_urb urb; // buffer and iso_packets are meaningless
+		int32_t data_length;
+		int32_t _pad;
+	};
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		uint64_t remote_spin_time() _LIB_USB_VHCI_NOEXCEPT
+		{
+			static const uint64_t t((sysconf(_SC_NPROCESSORS_ONLN) > 1) ? spin_time : 0);
+			return t;
+		}
+
+		void remote_ring_doorbell(int fd) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const uint64_t one(1);
+			ssize_t res(write(fd, &one, sizeof(one)));
+			static_cast<void>(res); // EAGAIN: counter is non-zero anyway
+		}
+
+		void remote_clear_doorbell(int fd) _LIB_USB_VHCI_NOEXCEPT
+		{
+			uint64_t val;
+			ssize_t res(read(fd, &val, sizeof(val)));
+			static_cast<void>(res);
+		}
+
+		uint32_t remote_urb_msg_size(const usb_vhci_urb& urb) _LIB_USB_VHCI_NOEXCEPT
+		{
+			const size_t packets(usb_vhci_is_iso(urb.type) ? static_cast<size_t>(urb.packet_count) : 0);
+			const size_t data((urb.buffer_length > 0) ? static_cast<size_t>(urb.buffer_length) : 0);
+			const size_t body(sizeof(urb_body) + packets * sizeof(usb_vhci_iso_packet) + data);
+			// too big for any ring
+			if(body > 0x7fffffff) return 0xffffffff;
+			return remote_msg_size(body);
+		}
+
+		void remote_put_urb(remote_msg* m, const usb::urb& u) _LIB_USB_VHCI_NOEXCEPT
+		{
+			urb_body* b(static_cast<urb_body*>(remote_msg_body(m)));
+			const usb_vhci_urb& urb(*u.get_internal());
+			const int32_t packets(usb_vhci_is_iso(urb.type) ? urb.packet_count : 0);
+			uint8_t* data(reinterpret_cast<uint8_t*>(b + 1) + packets * sizeof(usb_vhci_iso_packet));
+			b->urb = urb;
+			b->data_length = 0;
+			if(packets) memcpy(b + 1, urb.iso_packets, packets * sizeof(usb_vhci_iso_packet));
+			if(m->type == REMOTE_MSG_PROCESS_URB)
+			{
+				if(u.is_out() && urb.buffer_length > 0)
+				{
+					memcpy(data, urb.buffer, urb.buffer_length);
+					b->data_length = urb.buffer_length;
+				}
+			}
+			else if(u.is_in() && urb.buffer_actual > 0)
+			{
+				int32_t left((urb.buffer_actual < urb.buffer_length) ? urb.buffer_actual : urb.buffer_length);
+				const iovec* iov;
+				int iovcnt(u.get_in_data(&iov));
+				if(!iovcnt)
+				{
+					memcpy(data, urb.buffer, left);
+					b->data_length = left;
+				}
+				for(int i(0); i < iovcnt && left > 0; i++)
+				{
+					const int32_t n((iov[i].iov_len < static_cast<size_t>(left)) ? static_cast<int32_t>(iov[i].iov_len) : left);
+					memcpy(data + b->data_length, iov[i].iov_base, n);
+					b->data_length += n;
+					left -= n;
+				}
+				b->urb.buffer_actual = b->data_length;
+			}
+			m->size = remote_msg_size(sizeof(urb_body) + packets * sizeof(usb_vhci_iso_packet) + b->data_length);
+		}
+
+		bool remote_get_urb(const remote_msg* m, uint32_t msg_size,
+		                    usb_vhci_urb& urb,
+		                    const usb_vhci_iso_packet** iso_packets,
+		                    const uint8_t** data,
+		                    int32_t* data_length) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(msg_size < remote_msg_size(sizeof(urb_body))) return false;
+			// the other side may be broken (or hostile), and it may change the message
+			// after it was checked: everything is taken from this copy
+			const urb_body* p(static_cast<const urb_body*>(remote_msg_body(m)));
+			urb_body b;
+			memcpy(&b, p, sizeof(b));
+			const int32_t packets(usb_vhci_is_iso(b.urb.type) ? b.urb.packet_count : 0);
+			if(packets < 0 || b.data_length < 0 ||
+			   msg_size < remote_msg_size(sizeof(urb_body) +
+			                              static_cast<size_t>(packets) * sizeof(usb_vhci_iso_packet) +
+			                              static_cast<size_t>(b.data_length)))
+				return false;
+			urb = b.urb;
+			if(usb_vhci_is_iso(urb.type)) urb.packet_count = packets;
+			*iso_packets = packets ? reinterpret_cast<const usb_vhci_iso_packet*>(p + 1) : NULL;
+			*data_length = b.data_length;
+			*data = b.data_length ? reinterpret_cast<const uint8_t*>(p + 1) + packets * sizeof(usb_vhci_iso_packet) : NULL;
+			return true;
+		}
+	}
+}
@@ -0,0 +1,97 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		sim_hcd::sim_hcd(uint8_t ports, uint32_t flags) _LIB_USB_VHCI_THROW((std::exception)) :
+			local_hcd(ports, flags)
+		{
+		}
+
+		sim_hcd::~sim_hcd() _LIB_USB_VHCI_NOEXCEPT
+		{
+		}
+
+		void sim_hcd::submit(const usb_vhci_urb& urb) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(usb_vhci_sim_submit(get_fd(), &urb) == -1)
+			{
+				if(errno == EINVAL) throw std::invalid_argument("urb");
+				if(errno == ENOMEM) throw std::bad_alloc();
+				throw std::exception();
+			}
+		}
+
+		bool sim_hcd::unlink(uint64_t handle) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			int res(usb_vhci_sim_unlink(get_fd(), handle));
+			if(res == -1)
+			{
+				if(errno == ENOENT) throw std::invalid_argument("handle");
+				throw std::exception();
+			}
+			return res;
+		}
+
+		bool sim_hcd::reap(usb_vhci_urb& urb, int16_t timeout) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(usb_vhci_sim_reap(get_fd(), &urb, timeout) == -1)
+			{
+				if(errno == ETIMEDOUT) return false;
+				throw std::exception();
+			}
+			return true;
+		}
+
+		void sim_hcd::set_port_feature(uint8_t port, uint16_t feature) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			if(usb_vhci_sim_port_feature(get_fd(), port, 1, feature) == -1)
+				throw std::invalid_argument("feature");
+		}
+
+		void sim_hcd::clear_port_feature(uint8_t port, uint16_t feature) volatile _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(!port) throw std::invalid_argument("port");
+			if(port > get_port_count()) throw std::out_of_range("port");
+			if(usb_vhci_sim_port_feature(get_fd(), port, 0, feature) == -1)
+				throw std::invalid_argument("feature");
+		}
+	}
+}
@@ -0,0 +1,317 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+
+#include "libusb_vhci.h"
+
+namespace usb
+{
+	namespace vhci
+	{
+		latency_histogram::latency_histogram() _LIB_USB_VHCI_NOEXCEPT :
+			buckets(),
+			count(0),
+			sum(0),
+			max(0)
+		{
+		}
+
+		latency_histogram::latency_histogram(const latency_histogram& h) _LIB_USB_VHCI_NOEXCEPT :
+			buckets(),
+			count(0),
+			sum(0),
+			max(0)
+		{
+			*this = h;
+		}
+
+		// h may be recorded to meanwhile; the counters are loaded one by one
+		latency_histogram& latency_histogram::operator=(const latency_histogram& h) _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(int i(0); i < bucket_count; i++)
+				buckets[i] = __atomic_load_n(&h.buckets[i], __ATOMIC_RELAXED);
+			count = __atomic_load_n(&h.count, __ATOMIC_RELAXED);
+			sum = __atomic_load_n(&h.sum, __ATOMIC_RELAXED);
+			max = __atomic_load_n(&h.max, __ATOMIC_RELAXED);
+			return *this;
+		}
+
+		uint64_t latency_histogram::now() _LIB_USB_VHCI_NOEXCEPT
+		{
+			timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+		}
+
+		int latency_histogram::bucket_of(uint64_t ns) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(ns < 8) return static_cast<int>(ns);
+			// the 3 bits after the leading one select the sub-bucket
+			const int e(63 - __builtin_clzll(ns));
+			return (e - 2) * 8 + static_cast<int>((ns >> (e - 3)) & 7);
+		}
+
+		uint64_t latency_histogram::get_bucket_start(int i) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(i < 8) return static_cast<uint64_t>(i);
+			return static_cast<uint64_t>(8 + (i & 7)) << (i / 8 - 1);
+		}
+
+		void latency_histogram::record(uint64_t ns) _LIB_USB_VHCI_NOEXCEPT
+		{
+			__atomic_fetch_add(&buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&sum, ns, __ATOMIC_RELAXED);
+			uint64_t m(__atomic_load_n(&max, __ATOMIC_RELAXED));
+			while(ns > m && !__atomic_compare_exchange_n(&max, &m, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+		}
+
+		void latency_histogram::reset() _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(int i(0); i < bucket_count; i++)
+				__atomic_store_n(&buckets[i], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&sum, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&max, 0, __ATOMIC_RELAXED);
+		}
+
+		uint64_t latency_histogram::get_percentile(double percentile) const _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(!count) return 0;
+			if(percentile < 0.0) percentile = 0.0;
+			else if(percentile > 100.0) percentile = 100.0;
+			uint64_t rank(static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(count) + 0.5));
+			if(!rank) rank = 1;
+			uint64_t n(0);
+			for(int i(0); i < bucket_count; i++)
+			{
+				n += buckets[i];
+				if(n >= rank)
+				{
+					// the last bucket ends at 2^64
+					const uint64_t end((i + 1 < bucket_count) ? get_bucket_start(i + 1) - 1 : ~0ull);
+					return (end < max) ? end : max;
+				}
+			}
+			return max;
+		}
+
+		port_statistics::port_statistics() _LIB_USB_VHCI_NOEXCEPT :
+			urbs(),
+			bytes_out(0),
+			bytes_in(0),
+			cancels(0),
+			giveback_errors(0),
+			latency()
+		{
+		}
+
+		port_statistics::port_statistics(const port_statistics& s) _LIB_USB_VHCI_NOEXCEPT :
+			urbs(),
+			bytes_out(0),
+			bytes_in(0),
+			cancels(0),
+			giveback_errors(0),
+			latency()
+		{
+			*this = s;
+		}
+
+		// s may be counted on meanwhile; the counters are loaded one by one
+		port_statistics& port_statistics::operator=(const port_statistics& s) _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(int t(0); t < 4; t++)
+				for(int d(0); d < 2; d++)
+					urbs[t][d] = __atomic_load_n(&s.urbs[t][d], __ATOMIC_RELAXED);
+			bytes_out = __atomic_load_n(&s.bytes_out, __ATOMIC_RELAXED);
+			bytes_in = __atomic_load_n(&s.bytes_in, __ATOMIC_RELAXED);
+			cancels = __atomic_load_n(&s.cancels, __ATOMIC_RELAXED);
+			giveback_errors = __atomic_load_n(&s.giveback_errors, __ATOMIC_RELAXED);
+			latency = s.latency;
+			return *this;
+		}
+
+		void port_statistics::reset() _LIB_USB_VHCI_NOEXCEPT
+		{
+			for(int t(0); t < 4; t++)
+				for(int d(0); d < 2; d++)
+					__atomic_store_n(&urbs[t][d], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&bytes_out, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&bytes_in, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&cancels, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&giveback_errors, 0, __ATOMIC_RELAXED);
+			latency.reset();
+		}
+
+		uint64_t port_statistics::get_urb_count() const _LIB_USB_VHCI_NOEXCEPT
+		{
+			uint64_t n(0);
+			for(int t(0); t < 4; t++)
+				n += urbs[t][0] + urbs[t][1];
+			return n;
+		}
+
+		void hcd::dump_statistics(FILE* f) volatile _LIB_USB_VHCI_NOEXCEPT
+		{
+			const hcd_statistics s(get_statistics());
+			fprintf(f, "hcd: inbox %lu (max %lu), processing %lu (max %lu), fetch errors %llu, "
+			           "fetch data errors %llu, dropped works %llu, giveback errors %llu\n",
+			        static_cast<unsigned long>(s.inbox), static_cast<unsigned long>(s.inbox_max),
+			        static_cast<unsigned long>(s.processing), static_cast<unsigned long>(s.processing_max),
+			        static_cast<unsigned long long>(s.fetch_errors),
+			        static_cast<unsigned long long>(s.fetch_data_errors),
+			        static_cast<unsigned long long>(s.dropped_works),
+			        static_cast<unsigned long long>(s.giveback_errors));
+			for(uint8_t port(1); port <= get_port_count(); port++)
+			{
+				const port_statistics ps(get_port_statistics(port));
+				if(!ps.get_urb_count() && !ps.cancels) continue;
+				const latency_histogram& l(ps.latency);
+				// urbs out/in by type; latencies in microseconds
+				fprintf(f, "port %u: ctrl %llu/%llu, int %llu/%llu, bulk %llu/%llu, iso %llu/%llu, "
+				           "bytes %llu/%llu, cancels %llu, giveback errors %llu, "
+				           "latency us mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+				        port,
+				        static_cast<unsigned long long>(ps.urbs[urb_type_control][0]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_control][1]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_interrupt][0]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_interrupt][1]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_bulk][0]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_bulk][1]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_isochronous][0]),
+				        static_cast<unsigned long long>(ps.urbs[urb_type_isochronous][1]),
+				        static_cast<unsigned long long>(ps.bytes_out),
+				        static_cast<unsigned long long>(ps.bytes_in),
+				        static_cast<unsigned long long>(ps.cancels),
+				        static_cast<unsigned long long>(ps.giveback_errors),
+				        l.get_mean() / 1000.0,
+				        l.get_percentile(50.0) / 1000.0,
+				        l.get_percentile(90.0) / 1000.0,
+				        l.get_percentile(99.0) / 1000.0,
+				        l.get_percentile(99.9) / 1000.0,
+				        l.get_max() / 1000.0);
+			}
+			fflush(f);
+		}
+
+		statistics_dump::statistics_dump(hcd& dev, hcd::callback cb, int interval) _LIB_USB_VHCI_THROW((std::exception)) :
+			dev(dev),
+			cb(cb),
+			file(NULL),
+			interval(interval),
+			thread(),
+			mutex(),
+			wake(),
+			shutdown(false)
+		{
+			start();
+		}
+
+		statistics_dump::statistics_dump(hcd& dev, FILE* f, int interval) _LIB_USB_VHCI_THROW((std::exception)) :
+			dev(dev),
+			cb(dump_to_file, this),
+			file(f),
+			interval(interval),
+			thread(),
+			mutex(),
+			wake(),
+			shutdown(false)
+		{
+			if(!f) throw std::invalid_argument("f");
+			start();
+		}
+
+		void statistics_dump::start() _LIB_USB_VHCI_THROW((std::exception))
+		{
+			if(interval <= 0) throw std::invalid_argument("interval");
+			pthread_condattr_t attr;
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+			pthread_cond_init(&wake, &attr);
+			pthread_condattr_destroy(&attr);
+			pthread_mutex_init(&mutex, NULL);
+			if(pthread_create(&thread, NULL, thread_start, this))
+			{
+				pthread_mutex_destroy(&mutex);
+				pthread_cond_destroy(&wake);
+				throw std::exception();
+			}
+		}
+
+		statistics_dump::~statistics_dump() _LIB_USB_VHCI_NOEXCEPT
+		{
+			{
+				lock _(mutex);
+				shutdown = true;
+				pthread_cond_signal(&wake);
+			}
+			pthread_join(thread, NULL);
+			pthread_mutex_destroy(&mutex);
+			pthread_cond_destroy(&wake);
+		}
+
+		void* statistics_dump::thread_start(void* _this) _LIB_USB_VHCI_NOEXCEPT
+		{
+			reinterpret_cast<statistics_dump*>(_this)->run();
+			return NULL;
+		}
+
+		void statistics_dump::dump_to_file(void* _this, hcd& from) _LIB_USB_VHCI_NOEXCEPT
+		{
+			from.dump_statistics(reinterpret_cast<statistics_dump*>(_this)->file);
+		}
+
+		void statistics_dump::run() _LIB_USB_VHCI_NOEXCEPT
+		{
+			timespec next;
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			lock _(mutex);
+			while(true)
+			{
+				// fixed rate, independent of how long the reports take
+				next.tv_sec += interval / 1000;
+				next.tv_nsec += (interval % 1000) * 1000000L;
+				if(next.tv_nsec >= 1000000000L)
+				{
+					next.tv_sec++;
+					next.tv_nsec -= 1000000000L;
+				}
+				while(!shutdown && pthread_cond_timedwait(&wake, &mutex, &next) != ETIMEDOUT) { }
+				if(shutdown) break;
+				cb.call(dev);
+			}
+		}
+	}
+}
@@ -38,7 +38,7 @@
 
 namespace usb
 {
-	void urb::_cpy(const usb_vhci_urb& u) throw(std::bad_alloc)
+	void urb::_cpy(const usb_vhci_urb& u) _LIB_USB_VHCI_THROW((std::bad_alloc))
 	{
 		if(_urb.buffer_length)
 		{
@@ -52,7 +52,7 @@ namespace usb
 		}
 	}
 
-	void urb::_chk() throw(std::invalid_argument)
+	void urb::_chk() _LIB_USB_VHCI_THROW((std::invalid_argument))
 	{
 		switch(_urb.type)
 		{
@@ -70,7 +70,12 @@ namespace usb
 		}
 	}
 
-	urb::urb(const urb& urb) throw(std::bad_alloc) : _urb(urb._urb)
+	urb::urb(const urb& urb) _LIB_USB_VHCI_THROW((std::bad_alloc)) :
+		_urb(urb._urb),
+		_own(true),
+		_in_iov(urb._in_iov),
+		_in_iovcnt(urb._in_iovcnt),
+		_in_one(urb._in_one)
 	{
 		_urb.buffer = NULL;
 		_urb.iso_packets = NULL;
@@ -96,7 +101,7 @@ namespace usb
 	         uint8_t bRequest,
 	         uint16_t wValue,
 	         uint16_t wIndex,
-	         uint16_t wLength) throw(std::invalid_argument, std::bad_alloc) : _urb()
+	         uint16_t wLength) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc)) : _urb(), _own(true), _in_iov(NULL), _in_iovcnt(0), _in_one()
 	{
 		_urb.handle = handle;
 		_urb.buffer_length = buffer_length;
@@ -186,7 +191,7 @@ namespace usb
 		}
 	}
 
-	urb::urb(const usb_vhci_urb& urb) throw(std::invalid_argument, std::bad_alloc) : _urb(urb)
+	urb::urb(const usb_vhci_urb& urb) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc)) : _urb(urb), _own(true), _in_iov(NULL), _in_iovcnt(0), _in_one()
 	{
 		_urb.buffer = NULL;
 		_urb.iso_packets = NULL;
@@ -194,7 +199,7 @@ namespace usb
 		_cpy(urb);
 	}
 
-	urb::urb(const usb_vhci_urb& urb, bool own) throw(std::invalid_argument, std::bad_alloc) : _urb(urb)
+	urb::urb(const usb_vhci_urb& urb, bool own) _LIB_USB_VHCI_THROW((std::invalid_argument, std::bad_alloc)) : _urb(urb), _own(true), _in_iov(NULL), _in_iovcnt(0), _in_one()
 	{
 		if(!own)
 		{
@@ -213,28 +218,65 @@ namespace usb
 		}
 	}
 
-	urb::~urb() throw()
+	urb::~urb() _LIB_USB_VHCI_NOEXCEPT
 	{
+		if(!_own)
+			return;
 		if(_urb.buffer)
 			delete[] _urb.buffer;
 		if(_urb.iso_packets)
 			delete[] _urb.iso_packets;
 	}
 
-	urb& urb::operator=(const urb& urb) throw(std::bad_alloc)
+	urb& urb::operator=(const urb& urb) _LIB_USB_VHCI_THROW((std::bad_alloc))
 	{
-		if(_urb.buffer)
+		if(_own && _urb.buffer)
 			delete[] _urb.buffer;
-		if(_urb.iso_packets)
+		if(_own && _urb.iso_packets)
 			delete[] _urb.iso_packets;
 		_urb = urb._urb;
+		_own = true;
 		_urb.buffer = NULL;
 		_urb.iso_packets = NULL;
 		_cpy(urb._urb);
+		_in_iov = urb._in_iov;
+		_in_iovcnt = urb._in_iovcnt;
+		_in_one = urb._in_one;
 		return *this;
 	}
 
-	void urb::set_iso_results() throw(std::logic_error)
+	void urb::set_in_data(const void* data) _LIB_USB_VHCI_NOEXCEPT
+	{
+		_in_one.iov_base = const_cast<void*>(data);
+		_in_one.iov_len = 0;
+		_in_iov = NULL;
+		_in_iovcnt = data ? 1 : 0;
+	}
+
+	void urb::set_in_data(const iovec* iov, int iovcnt) _LIB_USB_VHCI_NOEXCEPT
+	{
+		size_t len(0);
+		for(int i(0); i < iovcnt; i++)
+			len += iov[i].iov_len;
+		_urb.buffer_actual = static_cast<int32_t>(len);
+		_in_iov = iov;
+		_in_iovcnt = iovcnt;
+	}
+
+	int urb::get_in_data(const iovec** iov) const _LIB_USB_VHCI_NOEXCEPT
+	{
+		if(_in_iov)
+		{
+			*iov = _in_iov;
+			return _in_iovcnt;
+		}
+		// buffer_actual may have changed after set_in_data (e.g. by set_iso_results)
+		_in_one.iov_len = (_urb.buffer_actual > 0) ? static_cast<size_t>(_urb.buffer_actual) : 0;
+		*iov = &_in_one;
+		return _in_iovcnt;
+	}
+
+	void urb::set_iso_results() _LIB_USB_VHCI_THROW((std::logic_error))
 	{
 		if(!is_isochronous())
 			throw std::logic_error("not an isochronous urb");
@@ -0,0 +1,242 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <new>
+#include "libusb_vhci.h"
+
+namespace
+{
+	// Layout of a block:
+	//   header | process_urb_work | usb::urb | iso packets | data buffer
+	// Every part starts at a multiple of pool_align. A process_urb_work which was
+	// allocated by its operator new has the same header in front of it (with pool == NULL).
+	const size_t pool_align = 16;
+
+	inline size_t pool_round(size_t n) _LIB_USB_VHCI_NOEXCEPT
+	{
+		return (n + pool_align - 1) & ~(pool_align - 1);
+	}
+
+	inline size_t class_size(int c) _LIB_USB_VHCI_NOEXCEPT
+	{
+		return static_cast<size_t>(512) << c;
+	}
+
+	// keeps up to 4 MiB per size class (but at least 4 and at most 256 blocks)
+	inline uint32_t max_cached(int c) _LIB_USB_VHCI_NOEXCEPT
+	{
+		uint32_t n((4u << 20) / class_size(c));
+		return (n > 256) ? 256 : (n < 4) ? 4 : n;
+	}
+}
+
+namespace usb
+{
+	namespace vhci
+	{
+		struct urb_pool::block
+		{
+			block* next;    // link in the free list
+			urb_pool* pool; // NULL for works which were allocated by process_urb_work::operator new
+			int size_class; // -1 for blocks which are too large to be cached
+		};
+
+		namespace
+		{
+			inline size_t header_size() _LIB_USB_VHCI_NOEXCEPT
+			{
+				return pool_round(sizeof(urb_pool*) * 2 + sizeof(int));
+			}
+
+			inline size_t urb_offset() _LIB_USB_VHCI_NOEXCEPT
+			{
+				return header_size() + pool_round(sizeof(process_urb_work));
+			}
+
+			inline size_t iso_offset() _LIB_USB_VHCI_NOEXCEPT
+			{
+				return urb_offset() + pool_round(sizeof(usb::urb));
+			}
+		}
+
+		urb_pool::urb_pool() _LIB_USB_VHCI_NOEXCEPT :
+			mutex(),
+			free_blocks(),
+			cached(),
+			outstanding(0),
+			orphaned(false)
+		{
+			pthread_mutex_init(&mutex, NULL);
+		}
+
+		urb_pool::~urb_pool() _LIB_USB_VHCI_NOEXCEPT
+		{
+			pthread_mutex_destroy(&mutex);
+		}
+
+		void urb_pool::destroy() _LIB_USB_VHCI_NOEXCEPT
+		{
+			bool last;
+			{
+				lock _(mutex);
+				for(int c(0); c < class_count; c++)
+				{
+					while(free_blocks[c])
+					{
+						block* b(free_blocks[c]);
+						free_blocks[c] = b->next;
+						free(b);
+					}
+					cached[c] = 0;
+				}
+				orphaned = true;
+				last = !outstanding;
+			}
+			if(last) delete this;
+		}
+
+		urb_pool::block* urb_pool::get_block(const void* p) _LIB_USB_VHCI_NOEXCEPT
+		{
+			return reinterpret_cast<block*>(const_cast<char*>(static_cast<const char*>(p)) - header_size());
+		}
+
+		void urb_pool::put_block(block* b) _LIB_USB_VHCI_NOEXCEPT
+		{
+			bool last;
+			{
+				lock _(mutex);
+				outstanding--;
+				const int c(b->size_class);
+				if(!orphaned && c >= 0 && cached[c] < max_cached(c))
+				{
+					b->next = free_blocks[c];
+					free_blocks[c] = b;
+					cached[c]++;
+					return;
+				}
+				last = orphaned && !outstanding;
+			}
+			free(b);
+			if(last) delete this;
+		}
+
+		usb::urb* urb_pool::alloc_urb(const usb_vhci_urb& urb) _LIB_USB_VHCI_THROW((std::invalid_argument))
+		{
+			const int32_t packets(usb_vhci_is_iso(urb.type) ? urb.packet_count : 0);
+			if(urb.buffer_length < 0 || packets < 0) throw std::invalid_argument("urb");
+			const size_t buffer_offset(iso_offset() + pool_round(packets * sizeof(usb_vhci_iso_packet)));
+			const size_t size(buffer_offset + urb.buffer_length);
+			int c(0);
+			while(c < class_count && size > class_size(c)) c++;
+
+			block* b(NULL);
+			{
+				lock _(mutex);
+				if(c < class_count && (b = free_blocks[c]))
+				{
+					free_blocks[c] = b->next;
+					cached[c]--;
+				}
+				outstanding++;
+			}
+			if(!b)
+			{
+				if(!(b = static_cast<block*>(malloc((c < class_count) ? class_size(c) : size))))
+				{
+					lock _(mutex);
+					outstanding--;
+					return NULL;
+				}
+				b->pool = this;
+				b->size_class = (c < class_count) ? c : -1;
+			}
+			b->next = NULL;
+
+			char* base(reinterpret_cast<char*>(b));
+			usb_vhci_urb u(urb);
+			u.buffer = urb.buffer_length ? reinterpret_cast<uint8_t*>(base + buffer_offset) : NULL;
+			u.iso_packets = packets ? reinterpret_cast<usb_vhci_iso_packet*>(base + iso_offset()) : NULL;
+			usb::urb* _u;
+			try
+			{
+				_u = new(base + urb_offset()) usb::urb(u, true);
+			}
+			catch(...)
+			{
+				put_block(b);
+				throw;
+			}
+			_u->_own = false;
+			return _u;
+		}
+
+		process_urb_work* urb_pool::make_work(uint8_t port, usb::urb* urb) _LIB_USB_VHCI_THROW((std::invalid_argument))
+		{
+			char* base(reinterpret_cast<char*>(urb) - urb_offset());
+			return new(base + header_size()) process_urb_work(port, urb, true);
+		}
+
+		void urb_pool::free_urb(usb::urb* urb) _LIB_USB_VHCI_NOEXCEPT
+		{
+			block* b(reinterpret_cast<block*>(reinterpret_cast<char*>(urb) - urb_offset()));
+			urb->~urb();
+			b->pool->put_block(b);
+		}
+
+		void* process_urb_work::operator new(size_t size) _LIB_USB_VHCI_THROW((std::bad_alloc))
+		{
+			urb_pool::block* b(static_cast<urb_pool::block*>(malloc(header_size() + size)));
+			if(!b) throw std::bad_alloc();
+			b->next = NULL;
+			b->pool = NULL;
+			b->size_class = -1;
+			return reinterpret_cast<char*>(b) + header_size();
+		}
+
+		void process_urb_work::operator delete(void* p) _LIB_USB_VHCI_NOEXCEPT
+		{
+			if(!p) return;
+			urb_pool::block* b(urb_pool::get_block(p));
+			if(!b->pool)
+			{
+				free(b);
+				return;
+			}
+			// the urb of a pooled block lives as long as the block
+			reinterpret_cast<usb::urb*>(reinterpret_cast<char*>(b) + urb_offset())->~urb();
+			b->pool->put_block(b);
+		}
+	}
+}
@@ -38,54 +38,96 @@ namespace usb
 {
 	namespace vhci
 	{
-		work::work(uint8_t port) throw(std::invalid_argument) : port(port), canceled(false)
+		work::work(uint8_t port, work_type type) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			port(port),
+			canceled(false),
+			type(type),
+			prev(NULL),
+			next(NULL),
+			next_handle(NULL),
+			in_progress(false),
+			enqueued(0)
 		{
 			if(port == 0) throw std::invalid_argument("port");
 		}
 
-		work::~work() throw()
+		// a copy is not queued anywhere
+		work::work(const work& w) _LIB_USB_VHCI_NOEXCEPT :
+			port(w.port),
+			canceled(w.canceled),
+			type(w.type),
+			prev(NULL),
+			next(NULL),
+			next_handle(NULL),
+			in_progress(false),
+			enqueued(0)
 		{
 		}
 
-		void work::cancel() throw()
+		// keeps the bookkeeping of hcd (and the type) of this work
+		work& work::operator=(const work& w) _LIB_USB_VHCI_NOEXCEPT
+		{
+			port = w.port;
+			canceled = w.canceled;
+			return *this;
+		}
+
+		work::~work() _LIB_USB_VHCI_NOEXCEPT
+		{
+		}
+
+		void work::cancel() _LIB_USB_VHCI_NOEXCEPT
 		{
 			canceled = true;
 		}
 
-		process_urb_work::process_urb_work(uint8_t port, usb::urb* urb) throw(std::invalid_argument) :
-			work(port),
-			urb(urb)
+		process_urb_work::process_urb_work(uint8_t port, usb::urb* urb) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			work(port, work_type_process_urb),
+			urb(urb),
+			pooled(false)
 		{
 			if(!urb) throw std::invalid_argument("urb");
 		}
 
-		process_urb_work::process_urb_work(const process_urb_work& work) throw(std::bad_alloc) :
+		process_urb_work::process_urb_work(uint8_t port, usb::urb* urb, bool pooled) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			work(port, work_type_process_urb),
+			urb(urb),
+			pooled(pooled)
+		{
+			if(!urb) throw std::invalid_argument("urb");
+		}
+
+		process_urb_work::process_urb_work(const process_urb_work& work) _LIB_USB_VHCI_THROW((std::bad_alloc)) :
 			usb::vhci::work(work),
-			urb(new usb::urb(*work.urb))
+			urb(new usb::urb(*work.urb)),
+			pooled(false)
 		{
 		}
 
-		process_urb_work& process_urb_work::operator=(const process_urb_work& work) throw(std::bad_alloc)
+		process_urb_work& process_urb_work::operator=(const process_urb_work& work) _LIB_USB_VHCI_THROW((std::bad_alloc))
 		{
+			usb::urb* u(new usb::urb(*work.urb));
 			usb::vhci::work::operator=(work);
-			delete urb;
-			urb = new usb::urb(*work.urb);
+			// a pooled urb is destroyed together with its block
+			if(!pooled) delete urb;
+			urb = u;
+			pooled = false;
 			return *this;
 		}
 
-		process_urb_work::~process_urb_work() throw()
+		process_urb_work::~process_urb_work() _LIB_USB_VHCI_NOEXCEPT
 		{
-			delete urb;
+			if(!pooled) delete urb;
 		}
 
-		cancel_urb_work::cancel_urb_work(uint8_t port, uint64_t handle) throw(std::invalid_argument) :
-			work(port),
+		cancel_urb_work::cancel_urb_work(uint8_t port, uint64_t handle) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			work(port, work_type_cancel_urb),
 			handle(handle)
 		{
 		}
 
-		port_stat_work::port_stat_work(uint8_t port, const port_stat& stat) throw(std::invalid_argument) :
-			work(port),
+		port_stat_work::port_stat_work(uint8_t port, const port_stat& stat) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			work(port, work_type_port_stat),
 			stat(stat),
 			trigger_flags(0)
 		{
@@ -93,8 +135,17 @@ namespace usb
 
 		port_stat_work::port_stat_work(uint8_t port,
 		                               const port_stat& stat,
-		                               const port_stat& prev) throw(std::invalid_argument) :
-			work(port),
+		                               uint8_t trigger_flags) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			work(port, work_type_port_stat),
+			stat(stat),
+			trigger_flags(trigger_flags)
+		{
+		}
+
+		port_stat_work::port_stat_work(uint8_t port,
+		                               const port_stat& stat,
+		                               const port_stat& prev) _LIB_USB_VHCI_THROW((std::invalid_argument)) :
+			work(port, work_type_port_stat),
 			stat(stat),
 			trigger_flags(0)
 		{
@@ -0,0 +1,8 @@
+#!/bin/sh
+# a short run of bench/vhci_bench with a capture (-c): the writer of the capture has to
+# keep up with the benchmark, i.e. no record may be dropped
+pcap=bench_capture.$$.pcap
+trap 'rm -f $pcap' EXIT
+out=`../bench/vhci_bench -n 2000 -W 100 -c $pcap -o /dev/null 2>&1` || { echo "$out"; exit 1; }
+echo "$out" | tail -1
+echo "$out" | grep -q 'dropped 0$'
@@ -0,0 +1,436 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Broker with a simulated controller and its clients: a remote_hcd gets urbs of all
+ * kinds through the rings, and a connection which doesn't send its hello doesn't hold up
+ * the others. Hand-made clients give urbs back with bad lengths and counts: what fits
+ * the urb is clamped to it, anything else gets the client dropped (and its urbs failed),
+ * but the broker never reads beyond a message.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../src/libusb_vhci_remote.h"
+#include "check.h"
+
+using namespace usb::vhci;
+
+// body of PROCESS_URB and GIVEBACK messages, like in remote_ring.cpp
+struct urb_body
+{
+	usb_vhci_urb urb;
+	int32_t data_length;
+	int32_t _pad;
+};
+
+// hand-made client
+struct peer
+{
+	int sock;
+	int in_fd;
+	int out_fd;
+	void* shm;
+	size_t shm_size;
+	remote_ring* in;
+	remote_ring* out;
+};
+
+static char path[64];
+static sim_hcd* h;
+static broker* b;
+static remote_hcd* r;
+static volatile int stop_device;
+
+static void wait_for_port(bool enabled)
+{
+	const uint64_t end(check_now_ms() + 2000);
+	while(h->get_port_stat(1).get_enable() != enabled && check_now_ms() < end)
+		usleep(1000);
+	CHECK(h->get_port_stat(1).get_enable() == enabled);
+}
+
+static void wait_for_clients(size_t count)
+{
+	const uint64_t end(check_now_ms() + 2000);
+	while(b->get_client_count() != count && check_now_ms() < end)
+		usleep(1000);
+	CHECK(b->get_client_count() == count);
+}
+
+static int connect_socket()
+{
+	sockaddr_un a;
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	strcpy(a.sun_path, path);
+	const int fd(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+	CHECK(fd != -1 && !connect(fd, reinterpret_cast<sockaddr*>(&a), sizeof(a)));
+	return fd;
+}
+
+// the device behind r: answers IN urbs with 0xab
+static void* device(void*)
+{
+	while(!__atomic_load_n(&stop_device, __ATOMIC_ACQUIRE))
+	{
+		if(!r->wait_for_work(10)) continue;
+		work* w;
+		bool more;
+		do
+		{
+			more = r->next_work(&w);
+			if(!w) continue;
+			if(port_stat_work* p = dynamic_cast<port_stat_work*>(w))
+			{
+				if(p->triggers_reset()) r->port_reset_done(p->get_port());
+			}
+			else if(process_urb_work* u = dynamic_cast<process_urb_work*>(w))
+			{
+				usb::urb* urb(u->get_urb());
+				if(urb->is_isochronous())
+				{
+					for(int32_t i(0); i < urb->get_iso_packet_count(); i++)
+					{
+						urb->set_iso_packet_actual(i, urb->get_iso_packet_length(i));
+						urb->ack_iso(i);
+					}
+					if(urb->is_in()) memset(urb->get_buffer(), 0xab, urb->get_buffer_length());
+				}
+				else if(urb->is_in())
+				{
+					memset(urb->get_buffer(), 0xab, urb->get_buffer_length());
+					urb->set_buffer_actual(urb->get_buffer_length());
+				}
+				urb->ack();
+			}
+			r->finish_work(w);
+		} while(more);
+	}
+	return NULL;
+}
+
+static uint8_t buf[1024];
+static uint8_t burst_bufs[64][1900];
+static usb_vhci_iso_packet iso[4];
+
+static void submit(uint64_t handle, uint8_t type, uint8_t epadr, int32_t length, int32_t packets, uint8_t* data = buf)
+{
+	usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = handle;
+	u.type = type;
+	u.epadr = epadr;
+	u.buffer = data;
+	u.buffer_length = length;
+	if(packets)
+	{
+		memset(iso, 0, sizeof(iso));
+		for(int32_t i(0); i < packets; i++)
+		{
+			iso[i].offset = static_cast<uint32_t>(i * length / packets);
+			iso[i].packet_length = length / packets;
+		}
+		u.iso_packets = iso;
+		u.packet_count = packets;
+	}
+	memset(data, 0x11, length);
+	h->submit(u);
+}
+
+static usb_vhci_urb reap(uint64_t handle)
+{
+	usb_vhci_urb u;
+	CHECK(h->reap(u, 2000));
+	CHECK(u.handle == handle);
+	return u;
+}
+
+static void peer_send(peer& p, remote_msg* m)
+{
+	p.out->commit(m);
+	remote_ring_doorbell(p.out_fd);
+}
+
+static void peer_port_op(peer& p, uint8_t port, uint8_t op, uint64_t arg)
+{
+	remote_msg* m(p.out->reserve(remote_msg_size(0)));
+	CHECK(m);
+	m->type = REMOTE_MSG_PORT_OP;
+	m->port = port;
+	m->op = op;
+	m->tag = arg;
+	peer_send(p, m);
+}
+
+// next message of the broker (of type, the others are skipped); the caller pops it
+static const remote_msg* peer_next(peer& p, remote_msg& hdr, uint16_t type)
+{
+	const uint64_t end(check_now_ms() + 2000);
+	while(check_now_ms() < end)
+	{
+		const remote_msg* m(p.in->peek(hdr));
+		if(!m)
+		{
+			usleep(1000);
+			continue;
+		}
+		CHECK(hdr.size);
+		if(hdr.type == type) return m;
+		if(hdr.type == REMOTE_MSG_PORT_STAT && hdr.port == 1)
+		{
+			// the hub resets the device after the connect
+			const usb_vhci_port_stat* ps(static_cast<const usb_vhci_port_stat*>(remote_msg_body(m)));
+			if(ps->status & USB_VHCI_PORT_STAT_RESET) peer_port_op(p, 1, REMOTE_PORT_RESET_DONE, 1);
+		}
+		p.in->pop(hdr.size);
+	}
+	CHECK(!"no message");
+	return NULL;
+}
+
+static void peer_connect(peer& p)
+{
+	memset(&p, 0, sizeof(p));
+	p.sock = connect_socket();
+	remote_hello hl;
+	memset(&hl, 0, sizeof(hl));
+	hl.magic = REMOTE_MAGIC;
+	hl.version = REMOTE_VERSION;
+	hl.port_count = 1;
+	CHECK(send(p.sock, &hl, sizeof(hl), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(hl)));
+	remote_welcome wl;
+	iovec iov = { &wl, sizeof(wl) };
+	union
+	{
+		cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cbuf;
+	msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf.buf;
+	mh.msg_controllen = sizeof(cbuf.buf);
+	CHECK(recvmsg(p.sock, &mh, MSG_CMSG_CLOEXEC) == static_cast<ssize_t>(sizeof(wl)) && !wl.error);
+	cmsghdr* c(CMSG_FIRSTHDR(&mh));
+	CHECK(c && c->cmsg_type == SCM_RIGHTS);
+	int fds[3];
+	memcpy(fds, CMSG_DATA(c), sizeof(fds));
+	p.shm_size = wl.shm_size;
+	p.shm = mmap(NULL, p.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	CHECK(p.shm != MAP_FAILED);
+	close(fds[0]);
+	p.in_fd = fds[1];
+	p.out_fd = fds[2];
+	remote_shm* hdr(static_cast<remote_shm*>(p.shm));
+	char* data(static_cast<char*>(p.shm) + remote_shm_data_offset);
+	p.in = new remote_ring(&hdr->to_client, data, hdr->ring_size);
+	p.out = new remote_ring(&hdr->to_broker, data + hdr->ring_size, hdr->ring_size);
+	peer_port_op(p, 1, REMOTE_PORT_CONNECT, usb::data_rate_full);
+	const uint64_t end(check_now_ms() + 2000);
+	while(!h->get_port_stat(1).get_enable() && check_now_ms() < end)
+	{
+		remote_msg hdr2;
+		if(const remote_msg* m = p.in->peek(hdr2))
+		{
+			if(hdr2.type == REMOTE_MSG_PORT_STAT)
+			{
+				const usb_vhci_port_stat* ps(static_cast<const usb_vhci_port_stat*>(remote_msg_body(m)));
+				if(ps->status & USB_VHCI_PORT_STAT_RESET) peer_port_op(p, 1, REMOTE_PORT_RESET_DONE, 1);
+			}
+			p.in->pop(hdr2.size);
+		}
+		else
+			usleep(1000);
+	}
+	CHECK(h->get_port_stat(1).get_enable());
+}
+
+// the broker has dropped the peer: its socket is closed
+static void peer_check_dropped(peer& p)
+{
+	char c;
+	CHECK(recv(p.sock, &c, sizeof(c), 0) == 0);
+	wait_for_clients(0);
+	wait_for_port(false);
+	delete p.in;
+	delete p.out;
+	munmap(p.shm, p.shm_size);
+	close(p.sock);
+	close(p.in_fd);
+	close(p.out_fd);
+}
+
+// takes the urb from the broker and gives it back with data_length bytes of data and
+// packets iso packets (claimed, the message holds only the real ones)
+static void peer_giveback(peer& p, int32_t data_length, int32_t packets, int32_t real_packets, int32_t real_data)
+{
+	remote_msg hdr;
+	const remote_msg* m(peer_next(p, hdr, REMOTE_MSG_PROCESS_URB));
+	urb_body body;
+	memcpy(&body, remote_msg_body(m), sizeof(body));
+	p.in->pop(hdr.size);
+
+	const size_t size(sizeof(urb_body) + real_packets * sizeof(usb_vhci_iso_packet) + real_data);
+	remote_msg* g(p.out->reserve(remote_msg_size(size)));
+	CHECK(g);
+	g->type = REMOTE_MSG_GIVEBACK;
+	g->port = 1;
+	g->op = 0;
+	g->tag = hdr.tag;
+	urb_body* gb(static_cast<urb_body*>(remote_msg_body(g)));
+	gb->urb = body.urb;
+	gb->urb.status = USB_VHCI_STATUS_SUCCESS;
+	gb->urb.buffer_actual = data_length;
+	gb->urb.packet_count = packets;
+	gb->urb.error_count = 0;
+	gb->data_length = data_length;
+	usb_vhci_iso_packet* ip(reinterpret_cast<usb_vhci_iso_packet*>(gb + 1));
+	for(int32_t i(0); i < real_packets; i++)
+	{
+		memset(&ip[i], 0, sizeof(ip[i]));
+		ip[i].packet_actual = 1000;
+	}
+	memset(ip + real_packets, 0xcd, real_data);
+	peer_send(p, g);
+}
+
+int main()
+{
+	snprintf(path, sizeof(path), "/tmp/vhci-broker-test-%d", static_cast<int>(getpid()));
+	h = new sim_hcd(1);
+	b = new broker(*h, path, 4096);
+
+	// a connection without hello must not hold up the next one
+	const int silent(connect_socket());
+	uint64_t start(check_now_ms());
+	r = new remote_hcd(path, 1);
+	CHECK(check_now_ms() - start < 500);
+	wait_for_clients(1);
+
+	pthread_t device_thread;
+	CHECK(!pthread_create(&device_thread, NULL, device, NULL));
+	r->port_connect(1, usb::data_rate_full);
+	wait_for_port(true);
+	for(uint64_t handle(1); handle <= 200; handle++)
+	{
+		const bool in(handle & 1);
+		submit(handle, USB_VHCI_URB_TYPE_BULK, in ? 0x81 : 0x02, 512, 0);
+		const usb_vhci_urb u(reap(handle));
+		CHECK(u.status == USB_VHCI_STATUS_SUCCESS);
+		if(in) CHECK(u.buffer_actual == 512 && buf[0] == 0xab && buf[511] == 0xab);
+	}
+	submit(1000, USB_VHCI_URB_TYPE_ISO, 0x83, 256, 4);
+	usb_vhci_urb u(reap(1000));
+	CHECK(u.status == USB_VHCI_STATUS_SUCCESS && u.packet_count == 4);
+	for(int i(0); i < 4; i++)
+		CHECK(u.iso_packets[i].packet_actual == 64);
+	CHECK(buf[255] == 0xab);
+
+	// givebacks which take almost half of the ring each: the device has to wait for
+	// room in it
+	for(uint64_t i(0); i < 64; i++)
+		submit(5000 + i, USB_VHCI_URB_TYPE_BULK, 0x81, sizeof(burst_bufs[i]), 0, burst_bufs[i]);
+	for(uint64_t i(0); i < 64; i++)
+	{
+		u = reap(5000 + i);
+		CHECK(u.status == USB_VHCI_STATUS_SUCCESS && u.buffer_actual == static_cast<int32_t>(sizeof(burst_bufs[i])));
+		CHECK(burst_bufs[i][0] == 0xab && burst_bufs[i][sizeof(burst_bufs[i]) - 1] == 0xab);
+	}
+
+	// the silent connection is dropped after a second
+	char c;
+	CHECK(recv(silent, &c, sizeof(c), 0) == 0);
+	close(silent);
+	__atomic_store_n(&stop_device, 1, __ATOMIC_RELEASE);
+	CHECK(!pthread_join(device_thread, NULL));
+	delete r;
+	wait_for_clients(0);
+	wait_for_port(false);
+
+	// bad port and too long data or too many iso packets: ignored or clamped
+	peer p;
+	peer_connect(p);
+	peer_port_op(p, 200, REMOTE_PORT_DISABLE, 0);
+	submit(2000, USB_VHCI_URB_TYPE_BULK, 0x81, 64, 0);
+	peer_giveback(p, 512, 0, 0, 512);
+	u = reap(2000);
+	CHECK(u.status == USB_VHCI_STATUS_SUCCESS && u.buffer_actual == 64 && buf[63] == 0xcd);
+	submit(2001, USB_VHCI_URB_TYPE_ISO, 0x83, 128, 2);
+	peer_giveback(p, 128, 4, 4, 128);
+	u = reap(2001);
+	CHECK(u.status == USB_VHCI_STATUS_SUCCESS && u.packet_count == 2);
+	CHECK(u.iso_packets[0].packet_actual == 64 && u.iso_packets[1].packet_actual == 64);
+	CHECK(b->get_client_count() == 1);
+
+	// more data than the message has
+	submit(2002, USB_VHCI_URB_TYPE_BULK, 0x81, 64, 0);
+	peer_giveback(p, 1 << 30, 0, 0, 64);
+	CHECK(reap(2002).status != USB_VHCI_STATUS_SUCCESS);
+	peer_check_dropped(p);
+
+	// more iso packets than the message has, and a negative count
+	peer_connect(p);
+	submit(3000, USB_VHCI_URB_TYPE_ISO, 0x83, 128, 2);
+	peer_giveback(p, 0, 1000, 2, 0);
+	CHECK(reap(3000).status != USB_VHCI_STATUS_SUCCESS);
+	peer_check_dropped(p);
+	peer_connect(p);
+	submit(3001, USB_VHCI_URB_TYPE_ISO, 0x83, 128, 2);
+	peer_giveback(p, 0, -1, 0, 0);
+	CHECK(reap(3001).status != USB_VHCI_STATUS_SUCCESS);
+	peer_check_dropped(p);
+
+	// a message size which doesn't fit the ring
+	peer_connect(p);
+	submit(4000, USB_VHCI_URB_TYPE_BULK, 0x81, 64, 0);
+	remote_msg hdr;
+	const remote_msg* m(peer_next(p, hdr, REMOTE_MSG_PROCESS_URB));
+	static_cast<void>(m);
+	p.in->pop(hdr.size);
+	remote_msg* g(p.out->reserve(remote_msg_size(0)));
+	CHECK(g);
+	g->type = REMOTE_MSG_GIVEBACK;
+	g->tag = hdr.tag;
+	g->size = 1u << 20;
+	peer_send(p, g);
+	CHECK(reap(4000).status != USB_VHCI_STATUS_SUCCESS);
+	peer_check_dropped(p);
+
+	delete b;
+	delete h;
+	puts("OK");
+	return 0;
+}
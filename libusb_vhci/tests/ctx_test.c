@@ -0,0 +1,211 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * usb_vhci_ctx on the simulated controller: the data of OUT urbs and the iso packets
+ * are fetched into blocks of the context, blocks of a size class are reused, blocks
+ * which are too big for the classes go back to the allocator, and an urb for which the
+ * allocator has no memory is given back with an error instead of being retried
+ * forever. Nothing is left allocated after usb_vhci_ctx_close.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "../src/libusb_vhci.h"
+#include "check.h"
+
+static int out_of_memory;
+static size_t allocated;
+
+static void *test_alloc(void *arg, size_t size)
+{
+	void *p;
+	(void)arg;
+	if(out_of_memory || !(p = malloc(size)))
+		return NULL;
+	allocated += size;
+	return p;
+}
+
+static void test_free(void *arg, void *ptr, size_t size)
+{
+	(void)arg;
+	CHECK(allocated >= size);
+	allocated -= size;
+	free(ptr);
+}
+
+// skips the port stat works
+static void fetch_urb(struct usb_vhci_ctx *ctx, struct usb_vhci_work *w)
+{
+	const uint64_t end = check_now_ms() + 1000;
+	do
+	{
+		if(!usb_vhci_ctx_fetch_work(ctx, w, 100) && w->type == USB_VHCI_WORK_TYPE_PROCESS_URB)
+			return;
+	} while(check_now_ms() < end);
+	CHECK(!"no urb");
+}
+
+static void submit(int fd, uint64_t handle, uint8_t type, uint8_t epadr, uint8_t *buf, int32_t len,
+                   struct usb_vhci_iso_packet *iso, int32_t packet_count)
+{
+	struct usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = handle;
+	u.type = type;
+	u.epadr = epadr;
+	u.buffer = buf;
+	u.buffer_length = len;
+	u.iso_packets = iso;
+	u.packet_count = packet_count;
+	CHECK(!usb_vhci_sim_submit(fd, &u));
+}
+
+// status USB_VHCI_STATUS_ERROR stands for any error (the host sees the errno which it
+// was translated to)
+static void reap(int fd, uint64_t handle, int32_t status, struct usb_vhci_urb *u)
+{
+	CHECK(!usb_vhci_sim_reap(fd, u, 1000));
+	CHECK(u->handle == handle);
+	if(status == USB_VHCI_STATUS_ERROR)
+		CHECK(u->status != USB_VHCI_STATUS_SUCCESS && u->status != USB_VHCI_STATUS_PENDING);
+	else
+		CHECK(u->status == status);
+}
+
+int main(void)
+{
+	struct usb_vhci_allocator allocator = { test_alloc, test_free, NULL };
+	struct usb_vhci_ctx_stats stats;
+	struct usb_vhci_ctx *ctx;
+	struct usb_vhci_work w;
+	struct usb_vhci_urb u;
+	struct usb_vhci_iso_packet iso[4];
+	static uint8_t out[5 << 20], in[3000];
+	int fd;
+
+	CHECK((fd = usb_vhci_sim_open(1, 0, NULL, NULL, NULL)) != -1);
+	CHECK((ctx = usb_vhci_ctx_attach(fd, &allocator)));
+	memset(out, 0x11, sizeof out);
+
+	// OUT data is fetched into a new block, which is cached when the urb is given back
+	submit(fd, 1, USB_VHCI_URB_TYPE_BULK, 0x02, out, 100, NULL, 0);
+	fetch_urb(ctx, &w);
+	CHECK(w.work.urb.buffer_length == 100 && w.work.urb.buffer[99] == 0x11 && !w.work.urb.iso_packets);
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_ctx_giveback(ctx, &w.work.urb));
+	CHECK(!w.work.urb.buffer);
+	reap(fd, 1, USB_VHCI_STATUS_SUCCESS, &u);
+
+	// same size class: the block is reused
+	submit(fd, 2, USB_VHCI_URB_TYPE_BULK, 0x02, out, 200, NULL, 0);
+	fetch_urb(ctx, &w);
+	CHECK(w.work.urb.buffer[199] == 0x11);
+	usb_vhci_ctx_release(ctx, &w.work.urb);
+	CHECK(!w.work.urb.buffer);
+	usb_vhci_ctx_get_stats(ctx, &stats);
+	CHECK(stats.urbs == 2 && stats.bytes_out == 300 && stats.buffer_allocs == 1 && stats.buffer_reuses == 1);
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_giveback(fd, &w.work.urb));
+	reap(fd, 2, USB_VHCI_STATUS_SUCCESS, &u);
+
+	// IN data is given back from the block
+	submit(fd, 3, USB_VHCI_URB_TYPE_BULK, 0x81, in, sizeof in, NULL, 0);
+	fetch_urb(ctx, &w);
+	CHECK(w.work.urb.buffer_length == sizeof in);
+	memset(w.work.urb.buffer, 0xab, sizeof in);
+	w.work.urb.buffer_actual = sizeof in;
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_ctx_giveback(ctx, &w.work.urb));
+	reap(fd, 3, USB_VHCI_STATUS_SUCCESS, &u);
+	CHECK(u.buffer_actual == sizeof in && in[0] == 0xab && in[sizeof in - 1] == 0xab);
+
+	// the iso packets share the block with the buffer
+	for(int i = 0; i < 4; i++)
+	{
+		iso[i].offset = i * 64;
+		iso[i].packet_length = 64;
+	}
+	submit(fd, 4, USB_VHCI_URB_TYPE_ISO, 0x83, in, 256, iso, 4);
+	fetch_urb(ctx, &w);
+	CHECK(w.work.urb.packet_count == 4 && w.work.urb.iso_packets && w.work.urb.buffer);
+	CHECK(w.work.urb.iso_packets[3].offset == 192 && w.work.urb.iso_packets[3].packet_length == 64);
+	for(int i = 0; i < 4; i++)
+	{
+		w.work.urb.iso_packets[i].packet_actual = 64;
+		w.work.urb.iso_packets[i].status = USB_VHCI_STATUS_SUCCESS;
+	}
+	w.work.urb.buffer_actual = 256;
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_ctx_giveback(ctx, &w.work.urb));
+	reap(fd, 4, USB_VHCI_STATUS_SUCCESS, &u);
+	CHECK(iso[2].packet_actual == 64 && iso[2].status == USB_VHCI_STATUS_SUCCESS);
+
+	// too big for the size classes: the block goes back to the allocator
+	usb_vhci_ctx_get_stats(ctx, &stats);
+	const size_t cached = allocated;
+	submit(fd, 5, USB_VHCI_URB_TYPE_BULK, 0x02, out, sizeof out, NULL, 0);
+	fetch_urb(ctx, &w);
+	CHECK(w.work.urb.buffer[sizeof out - 1] == 0x11 && allocated > cached);
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_ctx_giveback(ctx, &w.work.urb));
+	CHECK(allocated == cached);
+	reap(fd, 5, USB_VHCI_STATUS_SUCCESS, &u);
+
+	// no memory: the urb fails right away (an empty class would need an allocation)
+	out_of_memory = 1;
+	submit(fd, 6, USB_VHCI_URB_TYPE_BULK, 0x02, out, 1 << 20, NULL, 0);
+	errno = 0;
+	CHECK(usb_vhci_ctx_fetch_work(ctx, &w, 1000) == -1 && errno == ENOMEM);
+	reap(fd, 6, USB_VHCI_STATUS_ERROR, &u);
+	for(int i = 0; i < 4; i++)
+	{
+		iso[i].offset = i * 250;
+		iso[i].packet_length = 250;
+	}
+	submit(fd, 7, USB_VHCI_URB_TYPE_ISO, 0x83, in, 1000, iso, 4);
+	errno = 0;
+	CHECK(usb_vhci_ctx_fetch_work(ctx, &w, 1000) == -1 && errno == ENOMEM);
+	reap(fd, 7, USB_VHCI_STATUS_ERROR, &u);
+
+	// ... while cached blocks can still be used
+	submit(fd, 8, USB_VHCI_URB_TYPE_BULK, 0x02, out, 100, NULL, 0);
+	fetch_urb(ctx, &w);
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_ctx_giveback(ctx, &w.work.urb));
+	reap(fd, 8, USB_VHCI_STATUS_SUCCESS, &u);
+	out_of_memory = 0;
+
+	CHECK(!usb_vhci_ctx_close(ctx));
+	CHECK(!allocated);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Hand-over of a simulated controller with detach: an urb which the device has when
+ * detach is called holds it up (until the timeout, if there is one), a cancelation of it
+ * still reaches the device meanwhile, while the urbs which were not handed out yet stay
+ * in the inbox and go to the hcd which restores the state. A broken state or one of
+ * another version of the library is rejected. The (interrupt) urbs are tagged with their
+ * interval, because the device sees other handles than the host.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/libusb_vhci.h"
+#include "check.h"
+
+using namespace usb::vhci;
+
+static const int32_t held_tag(1);
+static const int32_t pending_tag(2);
+
+static sim_hcd* h;
+static process_urb_work* held;
+static volatile int stop_device;
+static volatile int got_cancel;
+static volatile int wrong_work;
+
+// returns the next process urb work and serves the port stat works before it
+static process_urb_work* take_urb(hcd& _h, unsigned int ms)
+{
+	const uint64_t end(check_now_ms() + ms);
+	while(check_now_ms() < end)
+	{
+		work* w;
+		_h.next_work(&w);
+		if(!w)
+		{
+			usleep(1000);
+			continue;
+		}
+		if(process_urb_work* u = dynamic_cast<process_urb_work*>(w)) return u;
+		if(port_stat_work* p = dynamic_cast<port_stat_work*>(w))
+		{
+			if(p->triggers_reset()) _h.port_reset_done(p->get_port());
+		}
+		_h.finish_work(w);
+	}
+	return NULL;
+}
+
+// the device while detach waits: it only may get the cancelation of the held urb,
+// which the host unlinks as soon as the pending urb is held back
+static void* device(void*)
+{
+	while(h->wait_for_work(0))
+		usleep(1000);
+	CHECK(h->unlink(static_cast<uint64_t>(held_tag)));
+	while(!__atomic_load_n(&stop_device, __ATOMIC_ACQUIRE))
+	{
+		work* w;
+		h->next_work(&w);
+		if(!w)
+		{
+			usleep(1000);
+			continue;
+		}
+		if(cancel_urb_work* c = dynamic_cast<cancel_urb_work*>(w))
+		{
+			if(held && c->get_handle() == held->get_urb()->get_handle())
+			{
+				held->get_urb()->set_status(USB_VHCI_STATUS_CANCELED);
+				h->finish_work(held);
+				held = NULL;
+				__atomic_store_n(&got_cancel, 1, __ATOMIC_RELEASE);
+			}
+		}
+		else
+			__atomic_store_n(&wrong_work, 1, __ATOMIC_RELEASE);
+		h->finish_work(w);
+	}
+	return NULL;
+}
+
+static void submit(int32_t tag, uint8_t epadr)
+{
+	static uint8_t buf[64];
+	usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = static_cast<uint64_t>(tag);
+	u.type = USB_VHCI_URB_TYPE_INT;
+	u.epadr = epadr;
+	u.interval = tag;
+	u.buffer = buf;
+	u.buffer_length = sizeof buf;
+	h->submit(u);
+}
+
+static void reap(int fd, int32_t tag, int32_t status)
+{
+	usb_vhci_urb u;
+	CHECK(!usb_vhci_sim_reap(fd, &u, 1000));
+	CHECK(u.handle == static_cast<uint64_t>(tag) && u.status == status);
+}
+
+static bool rejected(int fd, const std::vector<uint8_t>& state)
+{
+	try { local_hcd _h(fd, state); }
+	catch(std::invalid_argument&) { return true; }
+	return false;
+}
+
+int main()
+{
+	h = new sim_hcd(1);
+	h->port_connect(1, usb::data_rate_full);
+	const uint64_t end(check_now_ms() + 1000);
+	while(!h->get_port_stat(1).get_enable() && check_now_ms() < end)
+		take_urb(*h, 1);
+	CHECK(h->get_port_stat(1).get_enable());
+
+	submit(held_tag, 0x81);
+	held = take_urb(*h, 1000);
+	CHECK(held && held->get_urb()->get_interval() == held_tag);
+
+	// the device doesn't finish the urb in time: nothing is handed over
+	std::vector<uint8_t> state;
+	uint64_t start(check_now_ms());
+	bool timed_out(false);
+	try { h->detach(state, 50); }
+	catch(std::exception&) { timed_out = true; }
+	CHECK(timed_out && state.empty());
+	CHECK(check_now_ms() - start >= 50 && check_now_ms() - start < 1000);
+
+	// ... and the background thread fetches again
+	submit(pending_tag, 0x02);
+	const uint64_t end2(check_now_ms() + 1000);
+	while(h->get_statistics().inbox != 1 && check_now_ms() < end2)
+		usleep(1000);
+	CHECK(h->get_statistics().inbox == 1);
+
+	// the held urb gets unlinked while detach waits for it
+	pthread_t device_thread;
+	CHECK(!pthread_create(&device_thread, NULL, device, NULL));
+	const int fd(h->detach(state));
+	__atomic_store_n(&stop_device, 1, __ATOMIC_RELEASE);
+	CHECK(!pthread_join(device_thread, NULL));
+	CHECK(got_cancel && !held && !wrong_work);
+	CHECK(fd != -1 && !state.empty());
+	reap(fd, held_tag, USB_VHCI_STATUS_CANCELED);
+	// fd stays open
+	delete h;
+	h = NULL;
+
+	// broken or foreign states
+	std::vector<uint8_t> bad(state.begin(), state.begin() + state.size() / 2);
+	CHECK(rejected(fd, bad));
+	bad = state;
+	bad[8] ^= 1; // package version
+	CHECK(rejected(fd, bad));
+	bad = state;
+	bad[24]++; // sizeof(usb_vhci_urb)
+	CHECK(rejected(fd, bad));
+
+	// the pending urb goes to the new hcd
+	local_hcd* h2(new local_hcd(fd, state));
+	CHECK(h2->get_port_stat(1).get_enable());
+	process_urb_work* u(take_urb(*h2, 1000));
+	CHECK(u && u->get_urb()->get_interval() == pending_tag);
+	u->get_urb()->ack();
+	h2->finish_work(u);
+	reap(fd, pending_tag, USB_VHCI_STATUS_SUCCESS);
+	delete h2;
+	puts("OK");
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Strand executor on the simulated controller: the works of an endpoint are handled in
+ * order and never in parallel, endpoints 1-7 and 9-15 get different strands, a cancel
+ * work waits until its urb has been handled, and the destructor doesn't wait for a poll
+ * timeout of the dispatcher. The (interrupt) urbs are tagged with their interval,
+ * because the device sees other handles than the host.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/libusb_vhci.h"
+#include "check.h"
+
+using namespace usb::vhci;
+
+// index: endpoint number + (in ? 16 : 0)
+static int32_t last_tag[32];
+static int busy[32];
+static volatile int ep9_done;
+static volatile int cancel_handle_done;
+static volatile int processing_canceled_urb;
+static volatile int cancel_during_processing;
+static const int32_t canceled_tag(1000);
+static uint64_t canceled_handle; // as seen by the device
+
+static size_t ep_index(const usb::urb* urb)
+{
+	return (urb->get_endpoint_address() & 0x0f) + (urb->is_in() ? 16 : 0);
+}
+
+static void wait_for(volatile int* flag, unsigned int ms)
+{
+	const uint64_t end(check_now_ms() + ms);
+	while(!__atomic_load_n(flag, __ATOMIC_ACQUIRE) && check_now_ms() < end)
+		usleep(1000);
+}
+
+static void handler(void*, hcd& h, work* w)
+{
+	if(port_stat_work* p = dynamic_cast<port_stat_work*>(w))
+	{
+		if(p->triggers_reset()) h.port_reset_done(p->get_port());
+	}
+	else if(process_urb_work* u = dynamic_cast<process_urb_work*>(w))
+	{
+		usb::urb* urb(u->get_urb());
+		const size_t i(ep_index(urb));
+		CHECK(!__atomic_exchange_n(&busy[i], 1, __ATOMIC_ACQ_REL));
+		CHECK(urb->get_interval() > last_tag[i]);
+		last_tag[i] = urb->get_interval();
+		if(i == 1 && urb->get_interval() == 1)
+			// blocks the strand of endpoint 1 until endpoint 9 was handled
+			wait_for(&ep9_done, 2000);
+		else if(i == 9)
+			__atomic_store_n(&ep9_done, 1, __ATOMIC_RELEASE);
+		if(urb->get_interval() == canceled_tag)
+		{
+			canceled_handle = urb->get_handle();
+			__atomic_store_n(&processing_canceled_urb, 1, __ATOMIC_RELEASE);
+			wait_for(&cancel_handle_done, 200);
+			if(cancel_handle_done) cancel_during_processing = 1;
+		}
+		urb->ack();
+		__atomic_store_n(&busy[i], 0, __ATOMIC_RELEASE);
+	}
+	else if(cancel_urb_work* c = dynamic_cast<cancel_urb_work*>(w))
+	{
+		if(c->get_handle() == canceled_handle)
+			__atomic_store_n(&cancel_handle_done, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void submit(sim_hcd& h, int32_t tag, uint8_t epadr)
+{
+	usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = tag;
+	u.interval = tag;
+	u.type = USB_VHCI_URB_TYPE_INT;
+	u.epadr = epadr;
+	h.submit(u);
+}
+
+int main()
+{
+	sim_hcd h(1);
+	executor* e(new executor(h, handler, NULL, 4));
+	h.port_connect(1, usb::data_rate_full);
+	const uint64_t end(check_now_ms() + 2000);
+	while(!h.get_port_stat(1).get_enable() && check_now_ms() < end)
+		usleep(1000);
+	CHECK(h.get_port_stat(1).get_enable());
+
+	// endpoint 1 is blocked until endpoint 9 is done: both must have their own strand
+	submit(h, 1, 0x01);
+	submit(h, 2, 0x09);
+	usb_vhci_urb o;
+	CHECK(h.reap(o, 1000) && o.handle == 2);
+	CHECK(h.reap(o, 3000) && o.handle == 1);
+
+	// every endpoint number and direction, many urbs each
+	int32_t tag(10);
+	for(int k(0); k < 20; k++)
+	{
+		for(uint8_t ep(1); ep < 16; ep++)
+		{
+			submit(h, tag++, ep);
+			submit(h, tag++, ep | 0x80);
+		}
+	}
+	for(int32_t n(10); n < tag; n++)
+		CHECK(h.reap(o, 1000) && o.status == USB_VHCI_STATUS_SUCCESS);
+
+	// unlinked while the handler has it: the cancel work waits behind it
+	submit(h, canceled_tag, 0x82);
+	wait_for(&processing_canceled_urb, 1000);
+	CHECK(processing_canceled_urb);
+	h.unlink(canceled_tag);
+	CHECK(h.reap(o, 1000) && o.handle == static_cast<uint64_t>(canceled_tag));
+	wait_for(&cancel_handle_done, 1000);
+	CHECK(cancel_handle_done);
+	CHECK(!cancel_during_processing);
+
+	// the dispatcher is idle now; it must not take a poll timeout to stop it
+	usleep(50000);
+	const uint64_t start(check_now_ms());
+	delete e;
+	CHECK(check_now_ms() - start < 50);
+	puts("OK");
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * usb_vhci_giveback_iov on the simulated controller: the chunks end up one after the
+ * other in the transfer buffer, and an iov which holds more than buffer_length bytes
+ * fails with ENOBUFS, but still completes the urb (with an error and the bytes which
+ * fitted) instead of leaving it pending.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "../src/libusb_vhci.h"
+#include "check.h"
+
+// skips the port stat works
+static void fetch_urb(int fd, struct usb_vhci_work *w)
+{
+	const uint64_t end = check_now_ms() + 1000;
+	do
+	{
+		if(!usb_vhci_fetch_work_timeout(fd, w, 100) && w->type == USB_VHCI_WORK_TYPE_PROCESS_URB)
+			return;
+	} while(check_now_ms() < end);
+	CHECK(!"no urb");
+}
+
+static void submit_in(int fd, uint64_t handle, uint8_t *buf, int32_t len)
+{
+	struct usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = handle;
+	u.type = USB_VHCI_URB_TYPE_BULK;
+	u.epadr = 0x81;
+	u.buffer = buf;
+	u.buffer_length = len;
+	CHECK(!usb_vhci_sim_submit(fd, &u));
+}
+
+int main(void)
+{
+	struct usb_vhci_work w;
+	struct usb_vhci_urb u;
+	struct iovec iov[2];
+	static uint8_t a[64], b[64], in[128];
+	int fd;
+
+	CHECK((fd = usb_vhci_sim_open(1, 0, NULL, NULL, NULL)) != -1);
+	memset(a, 0xaa, sizeof a);
+	memset(b, 0xbb, sizeof b);
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof a;
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof b;
+
+	// two chunks which fit
+	submit_in(fd, 1, in, 128);
+	fetch_urb(fd, &w);
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	CHECK(!usb_vhci_giveback_iov(fd, &w.work.urb, iov, 2));
+	CHECK(!usb_vhci_sim_reap(fd, &u, 1000));
+	CHECK(u.handle == 1 && u.status == USB_VHCI_STATUS_SUCCESS && u.buffer_actual == 128);
+	CHECK(in[63] == 0xaa && in[64] == 0xbb && in[127] == 0xbb);
+
+	// the second chunk doesn't fit into the 64 byte buffer
+	memset(in, 0, sizeof in);
+	submit_in(fd, 2, in, 64);
+	fetch_urb(fd, &w);
+	w.work.urb.status = USB_VHCI_STATUS_SUCCESS;
+	errno = 0;
+	CHECK(usb_vhci_giveback_iov(fd, &w.work.urb, iov, 2) == -1 && errno == ENOBUFS);
+	CHECK(!usb_vhci_sim_reap(fd, &u, 1000));
+	CHECK(u.handle == 2 && u.status != USB_VHCI_STATUS_SUCCESS && u.status != USB_VHCI_STATUS_PENDING);
+	CHECK(u.buffer_actual == 64 && in[63] == 0xaa);
+
+	CHECK(!usb_vhci_close(fd));
+	return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reactor with three simulated controllers on one thread: the handlers are called on the
+ * thread which runs the reactor, the urbs of all controllers are served, a controller
+ * which is removed by its handler gets its background thread back, and stop wakes up
+ * run. The (interrupt) urbs are tagged with their interval, because the device sees
+ * other handles than the host.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/libusb_vhci.h"
+#include "check.h"
+
+using namespace usb::vhci;
+
+static const int hcd_count(3);
+static const int32_t remove_tag(1000);
+
+static reactor* r;
+static pthread_t reactor_thread;
+static volatile int wrong_thread;
+
+struct device
+{
+	sim_hcd* h;
+	int served;
+	bool removed;
+};
+
+static void serve(device& d)
+{
+	work* w;
+	bool more;
+	do
+	{
+		// returns whether more works are left; w is NULL if there was none
+		more = d.h->next_work(&w);
+		if(!w) continue;
+		if(port_stat_work* p = dynamic_cast<port_stat_work*>(w))
+		{
+			if(p->triggers_reset()) d.h->port_reset_done(p->get_port());
+		}
+		else if(process_urb_work* u = dynamic_cast<process_urb_work*>(w))
+		{
+			usb::urb* urb(u->get_urb());
+			if(urb->is_in())
+			{
+				memset(urb->get_buffer(), 0xab, urb->get_buffer_length());
+				urb->set_buffer_actual(urb->get_buffer_length());
+			}
+			if(urb->get_interval() == remove_tag)
+			{
+				CHECK(r->remove(*d.h));
+				d.removed = true;
+			}
+			urb->ack();
+			d.served++;
+		}
+		d.h->finish_work(w);
+	} while(more);
+}
+
+static void handler(void* arg, hcd& h)
+{
+	device& d(*static_cast<device*>(arg));
+	CHECK(&h == d.h);
+	if(!pthread_equal(pthread_self(), reactor_thread))
+		__atomic_store_n(&wrong_thread, 1, __ATOMIC_RELEASE);
+	serve(d);
+}
+
+static void* run_reactor(void*)
+{
+	r->run();
+	return NULL;
+}
+
+static void submit(sim_hcd& h, int32_t tag, uint8_t epadr)
+{
+	static uint8_t buf[64];
+	usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = static_cast<uint64_t>(tag);
+	u.type = USB_VHCI_URB_TYPE_INT;
+	u.epadr = epadr;
+	u.interval = tag;
+	u.buffer = buf;
+	u.buffer_length = sizeof buf;
+	h.submit(u);
+}
+
+static void reap(sim_hcd& h, int32_t tag, uint8_t epadr)
+{
+	usb_vhci_urb u;
+	CHECK(h.reap(u, 1000));
+	CHECK(u.handle == static_cast<uint64_t>(tag) && u.status == 0);
+	if(epadr & 0x80) CHECK(u.buffer_actual == 64 && u.buffer[63] == 0xab);
+}
+
+int main()
+{
+	r = new reactor();
+	reactor& re(*r);
+	sim_hcd* hcds[hcd_count];
+	device devs[hcd_count];
+	for(int i(0); i < hcd_count; i++)
+	{
+		hcds[i] = new sim_hcd(1);
+		devs[i].h = hcds[i];
+		devs[i].served = 0;
+		devs[i].removed = false;
+		re.add(*hcds[i], hcd::callback(handler, &devs[i]));
+	}
+	CHECK(re.get_controller_count() == hcd_count);
+	bool rejected(false);
+	try { re.add(*hcds[0], hcd::callback(handler, &devs[0])); }
+	catch(std::invalid_argument&) { rejected = true; }
+	CHECK(rejected && re.get_controller_count() == hcd_count);
+
+	CHECK(!pthread_create(&reactor_thread, NULL, run_reactor, NULL));
+	for(int i(0); i < hcd_count; i++)
+		hcds[i]->port_connect(1, usb::data_rate_high);
+	for(int i(0); i < hcd_count; i++)
+	{
+		const uint64_t end(check_now_ms() + 1000);
+		while(!hcds[i]->get_port_stat(1).get_enable() && check_now_ms() < end)
+			usleep(1000);
+		CHECK(hcds[i]->get_port_stat(1).get_enable());
+	}
+
+	// the urbs of all controllers are served by the one thread
+	for(int32_t tag(1); tag <= 300; tag++)
+	{
+		const uint8_t epadr((tag & 1) ? 0x81 : 0x02);
+		for(int i(0); i < hcd_count; i++)
+			submit(*hcds[i], tag, epadr);
+		for(int i(0); i < hcd_count; i++)
+			reap(*hcds[i], tag, epadr);
+	}
+	for(int i(0); i < hcd_count; i++)
+		CHECK(devs[i].served == 300);
+
+	// the handler removes the last controller
+	submit(*hcds[hcd_count - 1], remove_tag, 0x81);
+	reap(*hcds[hcd_count - 1], remove_tag, 0x81);
+	CHECK(devs[hcd_count - 1].removed);
+
+	// ... whose works are fetched by its background thread again
+	submit(*hcds[hcd_count - 1], remove_tag + 1, 0x02);
+	CHECK(hcds[hcd_count - 1]->wait_for_work(1000));
+	serve(devs[hcd_count - 1]);
+	reap(*hcds[hcd_count - 1], remove_tag + 1, 0x02);
+
+	// the others are still served by the reactor
+	submit(*hcds[0], remove_tag + 2, 0x81);
+	reap(*hcds[0], remove_tag + 2, 0x81);
+
+	const uint64_t start(check_now_ms());
+	re.stop();
+	CHECK(!pthread_join(reactor_thread, NULL));
+	CHECK(check_now_ms() - start < 500);
+	CHECK(!__atomic_load_n(&wrong_thread, __ATOMIC_ACQUIRE));
+	CHECK(re.get_controller_count() == hcd_count - 1);
+	CHECK(!re.remove(*hcds[hcd_count - 1]));
+	CHECK(re.remove(*hcds[0]));
+
+	// the destructor gives the remaining controller its background thread back
+	delete r;
+	for(int i(0); i < hcd_count; i++)
+		delete hcds[i];
+	return 0;
+}
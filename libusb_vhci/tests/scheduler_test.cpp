@@ -0,0 +1,168 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2009-2019 Michael Singer <michael@a-singer.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Coroutine scheduler of libusb_vhci.hpp on the simulated controller: a task per
+ * endpoint serves its urbs, urbs of endpoints without a task wait until they are
+ * unlinked, urbs of other addresses time out, an exception of a task is thrown by run(), and a moved-from task is rejected by
+ * spawn(). The program is skipped if it isn't built with C++20 coroutines.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+
+#if __cplusplus >= 201703L
+#include "../src/libusb_vhci.hpp"
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__cpp_lib_coroutine)
+
+#include <atomic>
+#include <thread>
+
+using namespace usb::vhci::v2;
+
+static const int urb_count(2000);
+static std::atomic<int> served(0);
+
+static task bulk_in(scheduler& s)
+{
+	for(;;)
+	{
+		urb u(co_await s.next_urb(1, 0x81));
+		for(auto& b : u.buffer()) b = 0xab;
+		u.set_buffer_actual(u.buffer().size());
+		u.ack();
+		co_await s.complete(std::move(u));
+		served++;
+	}
+}
+
+static task bulk_out(scheduler& s)
+{
+	for(int n(0);; n++)
+	{
+		urb u(co_await s.next_urb(1, 0x02));
+		CHECK(u.buffer()[0] == 0x11);
+		if(n == urb_count / 2) throw std::runtime_error("out");
+		u.ack();
+		s.complete(std::move(u));
+		served++;
+	}
+}
+
+static void submit(int fd, uint64_t handle, uint8_t devadr, uint8_t epadr, uint8_t* buf, int32_t status)
+{
+	usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = handle;
+	u.type = USB_VHCI_URB_TYPE_BULK;
+	u.devadr = devadr;
+	u.epadr = epadr;
+	u.buffer = buf;
+	u.buffer_length = 64;
+	CHECK(!usb_vhci_sim_submit(fd, &u));
+	if(status == -1) return;
+	CHECK(!usb_vhci_sim_reap(fd, &u, 1000));
+	CHECK(u.handle == handle && u.status == status);
+	if(!status && (epadr & 0x80)) CHECK(u.buffer_actual == 64 && buf[63] == 0xab);
+}
+
+int main()
+{
+	controller c(controller::simulated(1));
+	scheduler s(c);
+	task t(bulk_in(s));
+	s.spawn(std::move(t));
+	bool rejected(false);
+	try { s.spawn(std::move(t)); }
+	catch(std::invalid_argument&) { rejected = true; }
+	CHECK(rejected && s.task_count() == 1);
+	s.spawn(bulk_out(s));
+
+	std::atomic<bool> thrown(false);
+	std::thread dev([&] { try { s.run(); } catch(std::runtime_error&) { thrown = true; } });
+	c.port_connect(1, usb::data_rate_high);
+	usb_vhci_port_stat ps;
+	const uint64_t end(check_now_ms() + 1000);
+	do
+	{
+		usleep(1000);
+		CHECK(!usb_vhci_sim_get_port_stat(c.fd(), 1, &ps));
+	} while(!(ps.status & USB_VHCI_PORT_STAT_ENABLE) && check_now_ms() < end);
+	CHECK(ps.status & USB_VHCI_PORT_STAT_ENABLE);
+
+	// SET_ADDRESS is handled by the scheduler
+	usb_vhci_urb u;
+	memset(&u, 0, sizeof u);
+	u.handle = 1;
+	u.type = USB_VHCI_URB_TYPE_CONTROL;
+	u.bRequest = 5;
+	u.wValue = 7;
+	CHECK(!usb_vhci_sim_submit(c.fd(), &u));
+	CHECK(!usb_vhci_sim_reap(c.fd(), &u, 1000) && !u.status);
+
+	uint8_t out[64], in[64];
+	memset(out, 0x11, sizeof out);
+	for(int i(0); i < urb_count; i++)
+	{
+		memset(in, 0, sizeof in);
+		if(i & 1) submit(c.fd(), i + 2, 7, 0x81, in, 0);
+		else submit(c.fd(), i + 2, 7, 0x02, out, 0);
+	}
+
+	// no task waits for endpoint 3, so its urb stays there until it is unlinked
+	submit(c.fd(), urb_count + 2, 7, 0x83, in, -1);
+	CHECK(usb_vhci_sim_reap(c.fd(), &u, 100) == -1);
+	CHECK(usb_vhci_sim_unlink(c.fd(), urb_count + 2) == 1); // the scheduler has it
+	CHECK(!usb_vhci_sim_reap(c.fd(), &u, 1000));
+	CHECK(u.handle == urb_count + 2 && u.status == USB_VHCI_STATUS_CANCELED);
+
+	// address 3 isn't the address of the device
+	submit(c.fd(), urb_count + 3, 3, 0x81, in, USB_VHCI_STATUS_TIMEDOUT);
+
+	// bulk_out throws on its next urb; run() rethrows and the task is gone
+	submit(c.fd(), urb_count + 4, 7, 0x02, out, -1);
+	dev.join();
+	CHECK(thrown && served == urb_count && s.task_count() == 1);
+	return 0;
+}
+
+#else
+
+int main()
+{
+	// built without coroutines
+	return 77;
+}
+
+#endif
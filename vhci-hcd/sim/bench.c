@@ -0,0 +1,495 @@
+/*
+ * bench.c -- user space stress test and benchmark for the urb queues and the port state
+ *            machine of vhci-hcd (usb-vhci-core.h)
+ *
+ * Copyright (C) 2007-2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Host threads play the role of usbcore: they submit urbs (vhci_urb_enqueue) and unlink
+ * some of them again (vhci_urb_dequeue). Device threads play the role of a user space
+ * device server talking to usb-vhci-iocifc: they fetch work and give the urbs back. A port
+ * thread connects, resets and disconnects devices all the time.
+ *
+ * Every urb is owned by its host thread (like a real urb is owned by its driver), so the
+ * harness can check at the end that every submitted urb was given back exactly once.
+ *
+ * Run it under perf to profile changes of the queueing and locking:
+ *   make sim && perf record -g sim/bench -t 5
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "usb-vhci-hcd.h"
+
+struct sim_host
+{
+	pthread_t thread;
+	struct urb *urbs;      // depth urbs owned by this thread
+	volatile int *busy;    // non-zero while urbs[i] is submitted
+	unsigned int seed;
+	u64 submitted, unlinked, unlink_attempts;
+	volatile u64 completed;
+};
+
+struct sim_dev
+{
+	pthread_t thread;
+	u8 port_sched_offset;
+	const void **held;     // fetched urbs which are not given back yet (ring)
+	unsigned int held_head, held_count;
+	u64 fetched, canceled, port_stats, givebacks, enoent;
+};
+
+static struct
+{
+	struct usb_hcd hcd;
+	struct usb_vhci_hcd vhc; // has to follow hcd (hcd_priv)
+} sim;
+#define vhc (&sim.vhc)
+
+static unsigned int opt_seconds = 2, opt_hosts = 2, opt_devs = 1, opt_depth = 32, opt_cancel = 1, opt_ports = 4, opt_hold = 8;
+static int opt_nowakeup = 0;
+
+static volatile int stop;
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static u64 port_ops, port_rejected;
+
+// same as vdev->ifc->wakeup in the kernel (wakes up a device thread which waits for work)
+static void sim_wakeup(void)
+{
+	if(opt_nowakeup)
+		return;
+	pthread_mutex_lock(&work_mutex);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+}
+
+static int sim_has_work(void)
+{
+	unsigned long flags;
+	int y;
+	spin_lock_irqsave(&vhc->lock, flags);
+	y = usb_vhci_has_work_locked(vhc);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return y;
+}
+
+// same as usb_vhci_urb_giveback, but the urbp has to be removed from its list already
+static void sim_urb_giveback(struct usb_vhci_urb_priv *urbp)
+{
+	struct urb *urb = urbp->urb;
+	struct sim_host *host = urb->context;
+	urb->hcpriv = NULL;
+	kfree(urbp);
+	__sync_fetch_and_add(&host->completed, 1);
+	__atomic_store_n(&host->busy[urb - host->urbs], 0, __ATOMIC_RELEASE);
+}
+
+// vhci_urb_enqueue
+static void sim_urb_enqueue(struct urb *urb)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+
+	urbp = kzalloc(sizeof *urbp, GFP_ATOMIC);
+	if(unlikely(!urbp))
+		abort();
+	urbp->urb = urb;
+	urbp->enqueue_time = ktime_get();
+	atomic_set(&urbp->status, -EINPROGRESS);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urb->hcpriv = urbp;
+	usb_vhci_queue_urbp(vhc, urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	sim_wakeup();
+}
+
+// vhci_urb_dequeue; returns non-zero, if the urb was found
+static int sim_urb_dequeue(struct urb *urb)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	int cancel;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp = usb_vhci_unqueue_urb(vhc, urb, &cancel);
+	if(urbp)
+		list_del(&urbp->urbp_list);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	if(urbp)
+		sim_urb_giveback(urbp);
+	else if(cancel)
+		sim_wakeup();
+	return urbp || cancel;
+}
+
+static void *host_thread(void *arg)
+{
+	struct sim_host *host = arg;
+	unsigned int i;
+	int idle;
+
+	while(!stop)
+	{
+		idle = 1;
+		for(i = 0; i < opt_depth; i++)
+		{
+			if(__atomic_load_n(&host->busy[i], __ATOMIC_ACQUIRE))
+				continue;
+			host->busy[i] = 1;
+			host->submitted++;
+			sim_urb_enqueue(&host->urbs[i]);
+			idle = 0;
+		}
+
+		if(opt_cancel && (unsigned int)(rand_r(&host->seed) % 100) < opt_cancel)
+		{
+			i = rand_r(&host->seed) % opt_depth;
+			if(__atomic_load_n(&host->busy[i], __ATOMIC_ACQUIRE))
+			{
+				host->unlink_attempts++;
+				if(sim_urb_dequeue(&host->urbs[i]))
+					host->unlinked++;
+			}
+		}
+
+		if(idle)
+			sched_yield();
+	}
+	return NULL;
+}
+
+// ioc_giveback_common
+static void dev_giveback(struct sim_dev *dev, const void *handle)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	int canceled;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp = usb_vhci_find_fetched(vhc, handle, &canceled);
+	if(!urbp)
+	{
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		dev->enoent++;
+		return;
+	}
+	list_del(&urbp->urbp_list);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	urbp->urb->actual_length = urbp->urb->transfer_buffer_length;
+	urbp->urb->status = canceled ? -ECONNRESET : 0;
+	sim_urb_giveback(urbp);
+	dev->givebacks++;
+}
+
+// gives back the oldest urb which is held by the device thread
+static void dev_giveback_held(struct sim_dev *dev)
+{
+	const void *handle = dev->held[dev->held_head];
+	dev->held_head = (dev->held_head + 1) % opt_hold;
+	dev->held_count--;
+	dev_giveback(dev, handle);
+}
+
+// ioc_fetch_work followed by ioc_giveback; up to opt_hold urbs are kept in flight, so
+// that unlinks also hit urbs which are already fetched
+static void *dev_thread(void *arg)
+{
+	struct sim_dev *dev = arg;
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_port stat;
+	struct timespec ts;
+	unsigned long flags;
+	const void *handle;
+
+	while(!stop)
+	{
+		spin_lock_irqsave(&vhc->lock, flags);
+		if((urbp = usb_vhci_next_cancel(vhc)))
+		{
+			handle = urbp->urb;
+			spin_unlock_irqrestore(&vhc->lock, flags);
+			dev->canceled++;
+			dev_giveback(dev, handle);
+			continue;
+		}
+		if(usb_vhci_next_port_update(vhc, &dev->port_sched_offset, &stat))
+		{
+			spin_unlock_irqrestore(&vhc->lock, flags);
+			dev->port_stats++;
+			continue;
+		}
+		if((urbp = usb_vhci_peek_inbox(vhc)))
+		{
+			usb_vhci_mark_fetched(vhc, urbp);
+			handle = urbp->urb;
+			spin_unlock_irqrestore(&vhc->lock, flags);
+			dev->fetched++;
+			if(!opt_hold)
+			{
+				dev_giveback(dev, handle);
+				continue;
+			}
+			if(dev->held_count == opt_hold)
+				dev_giveback_held(dev);
+			dev->held[(dev->held_head + dev->held_count++) % opt_hold] = handle;
+			continue;
+		}
+		spin_unlock_irqrestore(&vhc->lock, flags);
+
+		if(dev->held_count)
+		{
+			while(dev->held_count)
+				dev_giveback_held(dev);
+			continue;
+		}
+		if(opt_nowakeup)
+		{
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock(&work_mutex);
+		if(!stop && !sim_has_work())
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 1000000;
+			if(ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&work_cond, &work_mutex, &ts);
+		}
+		pthread_mutex_unlock(&work_mutex);
+	}
+	while(dev->held_count)
+		dev_giveback_held(dev);
+	return NULL;
+}
+
+// replays what usbcore and a device server do when a device gets plugged in and out
+static void *port_thread(void *arg)
+{
+	static const struct { int feature; int set; u16 status, change; } seq[] = {
+		{ USB_PORT_FEAT_POWER,        1, 0, 0 },
+		{ -1, 0, USB_PORT_STAT_CONNECTION | USB_PORT_STAT_HIGH_SPEED, USB_PORT_STAT_C_CONNECTION },
+		{ USB_PORT_FEAT_C_CONNECTION, 0, 0, 0 },
+		{ USB_PORT_FEAT_RESET,        1, 0, 0 },
+		{ -1, 0, USB_PORT_STAT_ENABLE, USB_PORT_STAT_C_RESET },
+		{ USB_PORT_FEAT_C_RESET,      0, 0, 0 },
+		{ USB_PORT_FEAT_SUSPEND,      1, 0, 0 },
+		{ USB_PORT_FEAT_SUSPEND,      0, 0, 0 },
+		{ -1, 0, 0, USB_PORT_STAT_C_SUSPEND },
+		{ -1, 0, 0, USB_PORT_STAT_C_CONNECTION },
+		{ USB_PORT_FEAT_C_CONNECTION, 0, 0, 0 },
+		{ USB_PORT_FEAT_POWER,        0, 0, 0 }
+	};
+	unsigned int seed = 4711, step = 0;
+	unsigned long flags;
+	u8 port;
+	int ret;
+
+	(void)arg;
+	while(!stop)
+	{
+		port = rand_r(&seed) % opt_ports;
+		step = (step + 1) % (sizeof seq / sizeof *seq);
+
+		spin_lock_irqsave(&vhc->lock, flags);
+		if(seq[step].feature >= 0)
+			ret = usb_vhci_port_feature(&vhc->ports[port], seq[step].set, seq[step].feature);
+		else
+			ret = usb_vhci_port_stat_apply(&vhc->ports[port], seq[step].status, seq[step].change);
+		if(ret >= 0)
+			vhc->port_update |= 1 << (port + 1);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+
+		port_ops++;
+		if(ret < 0)
+			port_rejected++;
+		else
+			sim_wakeup();
+		usleep(50);
+	}
+	return NULL;
+}
+
+// gives back everything which is left after all threads have stopped
+static u64 drain(struct list_head *list)
+{
+	struct usb_vhci_urb_priv *urbp;
+	u64 n = 0;
+	while(!list_empty(list))
+	{
+		urbp = list_entry(list->next, struct usb_vhci_urb_priv, urbp_list);
+		list_del(&urbp->urbp_list);
+		sim_urb_giveback(urbp);
+		n++;
+	}
+	return n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t seconds] [-p host threads] [-c device threads] [-d queue depth per host thread]\n"
+	                "       [-x unlink percentage] [-l urbs held by each device thread] [-P ports]\n"
+	                "       [-n (no wakeups, device threads poll)]\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_host *hosts;
+	struct sim_dev *devs;
+	pthread_t port_tid;
+	u64 submitted = 0, completed = 0, unlinked = 0, unlink_attempts = 0, left;
+	u64 fetched = 0, canceled = 0, port_stats = 0, givebacks = 0, enoent = 0;
+	ktime_t start;
+	double secs;
+	unsigned int i, j;
+	int opt, errors = 0;
+
+	while((opt = getopt(argc, argv, "t:p:c:d:x:l:P:n")) != -1)
+	{
+		switch(opt)
+		{
+		case 't': opt_seconds = atoi(optarg); break;
+		case 'p': opt_hosts = atoi(optarg); break;
+		case 'c': opt_devs = atoi(optarg); break;
+		case 'd': opt_depth = atoi(optarg); break;
+		case 'x': opt_cancel = atoi(optarg); break;
+		case 'l': opt_hold = atoi(optarg); break;
+		case 'P': opt_ports = atoi(optarg); break;
+		case 'n': opt_nowakeup = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(!opt_hosts || !opt_devs || !opt_depth || opt_cancel > 100 || !opt_ports || opt_ports > 31)
+		usage(argv[0]);
+
+	// same as vhci_start
+	spin_lock_init(&vhc->lock);
+	vhc->ports = calloc(opt_ports, sizeof *vhc->ports);
+	vhc->port_count = opt_ports;
+	INIT_LIST_HEAD(&vhc->urbp_list_inbox);
+	INIT_LIST_HEAD(&vhc->urbp_list_fetched);
+	INIT_LIST_HEAD(&vhc->urbp_list_cancel);
+	INIT_LIST_HEAD(&vhc->urbp_list_canceling);
+	INIT_LIST_HEAD(&vhc->urbp_list_done);
+	INIT_LIST_HEAD(&vhc->urbp_list_shaped);
+	INIT_LIST_HEAD(&vhc->resp_rules);
+
+	hosts = calloc(opt_hosts, sizeof *hosts);
+	devs = calloc(opt_devs, sizeof *devs);
+	for(i = 0; i < opt_hosts; i++)
+	{
+		hosts[i].urbs = calloc(opt_depth, sizeof *hosts[i].urbs);
+		hosts[i].busy = calloc(opt_depth, sizeof *hosts[i].busy);
+		hosts[i].seed = i + 1;
+		for(j = 0; j < opt_depth; j++)
+		{
+			hosts[i].urbs[j].context = &hosts[i];
+			hosts[i].urbs[j].transfer_buffer_length = 64;
+		}
+	}
+
+	for(i = 0; i < opt_devs; i++)
+		devs[i].held = calloc(opt_hold ? opt_hold : 1, sizeof *devs[i].held);
+
+	start = ktime_get();
+	for(i = 0; i < opt_devs; i++)
+		pthread_create(&devs[i].thread, NULL, dev_thread, &devs[i]);
+	for(i = 0; i < opt_hosts; i++)
+		pthread_create(&hosts[i].thread, NULL, host_thread, &hosts[i]);
+	pthread_create(&port_tid, NULL, port_thread, NULL);
+
+	sleep(opt_seconds);
+	stop = 1;
+
+	pthread_join(port_tid, NULL);
+	for(i = 0; i < opt_hosts; i++)
+		pthread_join(hosts[i].thread, NULL);
+	pthread_mutex_lock(&work_mutex);
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+	for(i = 0; i < opt_devs; i++)
+		pthread_join(devs[i].thread, NULL);
+	secs = (double)(ktime_get() - start) / 1e9;
+
+	left = drain(&vhc->urbp_list_inbox) + drain(&vhc->urbp_list_fetched) +
+	       drain(&vhc->urbp_list_cancel) + drain(&vhc->urbp_list_canceling);
+
+	for(i = 0; i < opt_hosts; i++)
+	{
+		submitted += hosts[i].submitted;
+		completed += hosts[i].completed;
+		unlinked += hosts[i].unlinked;
+		unlink_attempts += hosts[i].unlink_attempts;
+		for(j = 0; j < opt_depth; j++)
+		{
+			if(hosts[i].busy[j] || hosts[i].urbs[j].hcpriv)
+			{
+				fprintf(stderr, "ERROR: urb %u of host thread %u was never given back\n", j, i);
+				errors++;
+			}
+		}
+	}
+	for(i = 0; i < opt_devs; i++)
+	{
+		fetched += devs[i].fetched;
+		canceled += devs[i].canceled;
+		port_stats += devs[i].port_stats;
+		givebacks += devs[i].givebacks;
+		enoent += devs[i].enoent;
+	}
+	if(submitted != completed)
+	{
+		fprintf(stderr, "ERROR: %llu urbs submitted, but %llu given back\n", (unsigned long long)submitted, (unsigned long long)completed);
+		errors++;
+	}
+
+	printf("threads:          %u host, %u device, depth %u, hold %u, %u ports, %u%% unlinks%s\n",
+	       opt_hosts, opt_devs, opt_depth, opt_hold, opt_ports, opt_cancel, opt_nowakeup ? ", polling" : "");
+	printf("elapsed:          %.3f s\n", secs);
+	printf("urbs submitted:   %llu (%.0f/s)\n", (unsigned long long)submitted, submitted / secs);
+	printf("urbs fetched:     %llu (%.0f/s)\n", (unsigned long long)fetched, fetched / secs);
+	printf("urbs given back:  %llu by device, %llu unknown handles\n", (unsigned long long)givebacks, (unsigned long long)enoent);
+	printf("unlinks:          %llu of %llu attempts, %llu reported as CANCEL_URB\n", (unsigned long long)unlinked, (unsigned long long)unlink_attempts, (unsigned long long)canceled);
+	printf("port changes:     %llu (%llu rejected), %llu reported as PORT_STAT\n", (unsigned long long)port_ops, (unsigned long long)port_rejected, (unsigned long long)port_stats);
+	printf("left in queues:   %llu\n", (unsigned long long)left);
+	printf("%s\n", errors ? "FAILED" : "OK");
+
+	for(i = 0; i < opt_hosts; i++)
+	{
+		free(hosts[i].urbs);
+		free((void *)hosts[i].busy);
+	}
+	for(i = 0; i < opt_devs; i++)
+		free(devs[i].held);
+	free(hosts);
+	free(devs);
+	free(vhc->ports);
+	return errors ? 1 : 0;
+}
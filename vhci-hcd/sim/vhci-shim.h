@@ -0,0 +1,203 @@
+/*
+ * vhci-shim.h -- minimal user space replacement of the kernel API which is used by
+ *                usb-vhci-hcd.h and usb-vhci-core.h
+ *
+ * Copyright (C) 2007-2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _VHCI_SHIM_H
+#define _VHCI_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+// the sim build doesn't know about scatter-gather lists
+#define NO_URB_SG
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef int64_t  s64;
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+// memory
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+static inline void *kzalloc(size_t size, int flags) { (void)flags; return calloc(1, size); }
+static inline void *kmalloc(size_t size, int flags) { (void)flags; return malloc(size); }
+static inline void kfree(const void *p) { free((void *)p); }
+
+// spinlocks (irq flags are meaningless in user space)
+typedef pthread_spinlock_t spinlock_t;
+#define spin_lock_init(l)              pthread_spin_init((l), PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(l)                   pthread_spin_lock(l)
+#define spin_unlock(l)                 pthread_spin_unlock(l)
+#define spin_lock_irqsave(l, f)        do { (f) = 0; pthread_spin_lock(l); } while(0)
+#define spin_unlock_irqrestore(l, f)   do { (void)(f); pthread_spin_unlock(l); } while(0)
+
+typedef struct { volatile int counter; } atomic_t;
+#define atomic_read(v)   ((v)->counter)
+#define atomic_set(v, i) ((v)->counter = (i))
+
+// time
+typedef s64 ktime_t;
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define ktime_to_ns(kt) ((s64)(kt))
+
+// these are never used by the core functions
+struct timer_list { int unused; };
+struct tasklet_struct { int unused; };
+struct module;
+
+// doubly linked lists (same semantics as <linux/list.h>)
+struct list_head
+{
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *entry, struct list_head *prev, struct list_head *next)
+{
+	next->prev = entry;
+	entry->next = next;
+	entry->prev = prev;
+	prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+	__list_add(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	__list_add(entry, head->prev, head);
+}
+
+static inline void __list_del(struct list_head *prev, struct list_head *next)
+{
+	next->prev = prev;
+	prev->next = next;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline void list_move_tail(struct list_head *entry, struct list_head *head)
+{
+	__list_del(entry->prev, entry->next);
+	list_add_tail(entry, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define list_for_each_entry(pos, head, member) \
+	for(pos = list_entry((head)->next, __typeof__(*pos), member); \
+	    &pos->member != (head); \
+	    pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for(pos = list_entry((head)->next, __typeof__(*pos), member), \
+	    n = list_entry(pos->member.next, __typeof__(*pos), member); \
+	    &pos->member != (head); \
+	    pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+// driver model and usbcore (only what the inline helpers of usb-vhci-hcd.h need)
+struct device
+{
+	void *platform_data;
+};
+
+struct platform_device
+{
+	int id;
+	struct device dev;
+};
+#define to_platform_device(x) container_of((x), struct platform_device, dev)
+
+struct usb_bus
+{
+	struct device *controller;
+	int busnum;
+};
+
+struct usb_hcd
+{
+	struct usb_bus self;
+	unsigned long hcd_priv[0] __attribute__((aligned(sizeof(s64))));
+};
+
+struct urb
+{
+	void *hcpriv;
+	unsigned int pipe;
+	void *transfer_buffer;
+	int transfer_buffer_length;
+	int actual_length;
+	int status;
+	void *context; // owner of the urb (used by the harness)
+};
+
+// wValue of Clear/SetPortFeature (see USB 2.0 spec table 11-17)
+#define USB_PORT_FEAT_CONNECTION     0
+#define USB_PORT_FEAT_ENABLE         1
+#define USB_PORT_FEAT_SUSPEND        2
+#define USB_PORT_FEAT_OVER_CURRENT   3
+#define USB_PORT_FEAT_RESET          4
+#define USB_PORT_FEAT_POWER          8
+#define USB_PORT_FEAT_LOWSPEED       9
+#define USB_PORT_FEAT_HIGHSPEED      10
+#define USB_PORT_FEAT_C_CONNECTION   16
+#define USB_PORT_FEAT_C_ENABLE       17
+#define USB_PORT_FEAT_C_SUSPEND      18
+#define USB_PORT_FEAT_C_OVER_CURRENT 19
+#define USB_PORT_FEAT_C_RESET        20
+#define USB_PORT_FEAT_TEST           21
+#define USB_PORT_FEAT_INDICATOR      22
+
+#endif
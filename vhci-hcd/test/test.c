@@ -68,6 +68,18 @@ static struct usb_hcd testhcd = {
 };
 #endif
 
+#ifdef TEST_URB_SG
+static struct usb_bus testbus = {
+	.sg_tablesize = ~0
+};
+#endif
+
+#ifdef TEST_SG_CONSTRAINT
+static struct usb_bus testbus2 = {
+	.no_sg_constraint = 1
+};
+#endif
+
 static int __init init(void)
 {
 	if(usb_disabled()) return -ENODEV;
@@ -81,6 +93,15 @@ static int __init init(void)
 	dev_set_name((struct device *)NULL, foo);
 #endif
 
+#ifdef TEST_URB_SG
+	{
+		struct urb *urb = (struct urb *)NULL;
+		struct sg_mapping_iter miter;
+		sg_miter_start(&miter, urb->sg, urb->num_sgs, SG_MITER_TO_SG);
+		sg_miter_stop(&miter);
+	}
+#endif
+
 	return 0;
 }
 module_init(init);
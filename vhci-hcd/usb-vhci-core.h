@@ -0,0 +1,380 @@
+/*
+ * usb-vhci-core.h -- VHCI USB host controller driver: urb queues and port state machine.
+ *
+ * Copyright (C) 2007-2008 Conemis AG Karlsruhe Germany
+ * Copyright (C) 2007-2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The functions in here only manipulate the urb lists and the port structures of a
+ * controller. They don't sleep, don't give back urbs and don't talk to usbcore, so they
+ * can be shared by usb-vhci-hcd and usb-vhci-iocifc, and they can be compiled in user
+ * space against sim/vhci-shim.h (see sim/bench.c).
+ *
+ * All of them have to be called with vhc->lock held.
+ */
+
+#ifndef _USB_VHCI_CORE_H
+#define _USB_VHCI_CORE_H
+
+// hands an urb to user space
+// caller has vhc->lock
+static inline void usb_vhci_queue_urbp(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	urbp->seq = ++vhc->urb_seq;
+	list_add_tail(&urbp->urbp_list, &vhc->urbp_list_inbox);
+}
+
+// Searches an urb which gets unlinked by its creator. Returns the urb, if it has to be given
+// back immediately by the caller (because user space doesn't know about it yet, or because
+// it is delayed by bus shaping only). If user space is processing the urb, then it is moved
+// into the cancel list and *cancel is set to a non-zero value.
+// caller has vhc->lock
+static inline struct usb_vhci_urb_priv *usb_vhci_unqueue_urb(struct usb_vhci_hcd *vhc, const struct urb *urb, int *cancel)
+{
+	struct usb_vhci_urb_priv *entry;
+
+	*cancel = 0;
+
+	// search the queue of unprocessed urbs (inbox)
+	list_for_each_entry(entry, &vhc->urbp_list_inbox, urbp_list)
+		if(entry->urb == urb)
+			return entry;
+
+	// search the urbs which are delayed by bus shaping
+	list_for_each_entry(entry, &vhc->urbp_list_shaped, urbp_list)
+		if(entry->urb == urb)
+			return entry;
+
+	// check if the urb is on a vacation through user space
+	list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
+	{
+		if(entry->urb == urb)
+		{
+			// move it into the cancel list
+			list_move_tail(&entry->urbp_list, &vhc->urbp_list_cancel);
+			*cancel = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+// returns non-zero, if there is something to report to user space
+// caller has vhc->lock
+static inline int usb_vhci_has_work_locked(const struct usb_vhci_hcd *vhc)
+{
+	return vhc->port_update ||
+	       !list_empty(&vhc->urbp_list_cancel) ||
+	       !list_empty(&vhc->urbp_list_inbox);
+}
+
+// Takes the next cancelation which has to be reported to user space and moves the urb into
+// the canceling list. Returns NULL, if there is none.
+// caller has vhc->lock
+static inline struct usb_vhci_urb_priv *usb_vhci_next_cancel(struct usb_vhci_hcd *vhc)
+{
+	struct usb_vhci_urb_priv *urbp;
+	if(list_empty(&vhc->urbp_list_cancel))
+		return NULL;
+	urbp = list_entry(vhc->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
+	list_move_tail(&urbp->urbp_list, &vhc->urbp_list_canceling);
+	return urbp;
+}
+
+// Takes the next port which has changes to be reported to user space and copies its state
+// into *stat. Returns the index of the port (first port is port# 1), or 0 if there is none.
+// The port which is checked first is rotated by *sched_offset, so that every port has its
+// chance to be reported to user space, even if the hcd is under heavy load.
+// caller has vhc->lock
+static inline u8 usb_vhci_next_port_update(struct usb_vhci_hcd *vhc, u8 *sched_offset, struct usb_vhci_port *stat)
+{
+	u8 _port, port;
+
+	if(!vhc->port_update)
+		return 0;
+	if(*sched_offset >= vhc->port_count)
+		*sched_offset = 0;
+	for(_port = 0; _port < vhc->port_count; _port++)
+	{
+		port = (_port + *sched_offset) % vhc->port_count;
+		if(vhc->port_update & (1 << (port + 1)))
+		{
+			vhc->port_update &= ~(1 << (port + 1));
+			*sched_offset = port + 1;
+			*stat = vhc->ports[port];
+			return port + 1;
+		}
+	}
+	return 0;
+}
+
+// returns the oldest urb which wasn't fetched by user space yet (or NULL)
+// caller has vhc->lock
+static inline struct usb_vhci_urb_priv *usb_vhci_peek_inbox(struct usb_vhci_hcd *vhc)
+{
+	if(list_empty(&vhc->urbp_list_inbox))
+		return NULL;
+	return list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
+}
+
+// marks an urb from the inbox as fetched by user space
+// caller has vhc->lock
+static inline void usb_vhci_mark_fetched(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	list_move_tail(&urbp->urbp_list, &vhc->urbp_list_fetched);
+}
+
+// Searches an urb which was fetched by user space. *canceled is set to a non-zero value, if
+// the urb was found in the cancel list or in the canceling list. Returns NULL, if the handle
+// is unknown.
+// caller has vhc->lock
+static inline struct usb_vhci_urb_priv *usb_vhci_find_fetched(struct usb_vhci_hcd *vhc, const void *handle, int *canceled)
+{
+	struct usb_vhci_urb_priv *entry;
+
+	*canceled = 0;
+	list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
+		if(entry->urb == handle)
+			return entry;
+
+	*canceled = 1;
+	list_for_each_entry(entry, &vhc->urbp_list_canceling, urbp_list)
+		if(entry->urb == handle)
+			return entry;
+	list_for_each_entry(entry, &vhc->urbp_list_cancel, urbp_list)
+		if(entry->urb == handle)
+			return entry;
+
+	*canceled = 0;
+	return NULL;
+}
+
+// Applies a port status change which was reported by the (virtual) device. Change is one of
+// USB_PORT_STAT_C_{CONNECTION,ENABLE,SUSPEND,OVERCURRENT,RESET} or
+// USB_PORT_STAT_C_RESET | USB_PORT_STAT_C_ENABLE. Returns -EPROTO, if the change isn't
+// allowed in the current state of the port.
+// caller has vhc->lock
+static inline int usb_vhci_port_stat_apply(struct usb_vhci_port *p, u16 status, u16 change)
+{
+	u16 overcurrent;
+
+	if(unlikely(!(p->port_status & USB_PORT_STAT_POWER)))
+		return -EPROTO;
+
+	switch(change)
+	{
+	case USB_PORT_STAT_C_CONNECTION:
+		overcurrent = p->port_status & USB_PORT_STAT_OVERCURRENT;
+		p->port_change |= USB_PORT_STAT_C_CONNECTION;
+		if(status & USB_PORT_STAT_CONNECTION)
+			p->port_status = USB_PORT_STAT_POWER | USB_PORT_STAT_CONNECTION |
+				((status & USB_PORT_STAT_LOW_SPEED) ? USB_PORT_STAT_LOW_SPEED :
+				((status & USB_PORT_STAT_HIGH_SPEED) ? USB_PORT_STAT_HIGH_SPEED : 0)) |
+				overcurrent;
+		else
+			p->port_status = USB_PORT_STAT_POWER | overcurrent;
+		p->port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+		break;
+
+	case USB_PORT_STAT_C_ENABLE:
+		if(unlikely(!(p->port_status & USB_PORT_STAT_CONNECTION) ||
+			(p->port_status & USB_PORT_STAT_RESET) ||
+			(status & USB_PORT_STAT_ENABLE)))
+			return -EPROTO;
+		p->port_change |= USB_PORT_STAT_C_ENABLE;
+		p->port_status &= ~USB_PORT_STAT_ENABLE;
+		p->port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+		p->port_status &= ~USB_PORT_STAT_SUSPEND;
+		break;
+
+	case USB_PORT_STAT_C_SUSPEND:
+		if(unlikely(!(p->port_status & USB_PORT_STAT_CONNECTION) ||
+			!(p->port_status & USB_PORT_STAT_ENABLE) ||
+			(p->port_status & USB_PORT_STAT_RESET) ||
+			(status & USB_PORT_STAT_SUSPEND)))
+			return -EPROTO;
+		p->port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+		p->port_change |= USB_PORT_STAT_C_SUSPEND;
+		p->port_status &= ~USB_PORT_STAT_SUSPEND;
+		break;
+
+	case USB_PORT_STAT_C_OVERCURRENT:
+		p->port_change |= USB_PORT_STAT_C_OVERCURRENT;
+		p->port_status &= ~USB_PORT_STAT_OVERCURRENT;
+		p->port_status |= status & USB_PORT_STAT_OVERCURRENT;
+		break;
+
+	default: // USB_PORT_STAT_C_RESET [| USB_PORT_STAT_C_ENABLE]
+		if(unlikely(!(p->port_status & USB_PORT_STAT_CONNECTION) ||
+			!(p->port_status & USB_PORT_STAT_RESET) ||
+			(status & USB_PORT_STAT_RESET)))
+			return -EPROTO;
+		if(change & USB_PORT_STAT_C_ENABLE)
+		{
+			if(status & USB_PORT_STAT_ENABLE)
+				return -EPROTO;
+			p->port_change |= USB_PORT_STAT_C_ENABLE;
+		}
+		else
+			p->port_status |= status & USB_PORT_STAT_ENABLE;
+		p->port_change |= USB_PORT_STAT_C_RESET;
+		p->port_status &= ~USB_PORT_STAT_RESET;
+		break;
+	}
+	return 0;
+}
+
+// Handles the ClearPortFeature (set == 0) and SetPortFeature (set != 0) requests of the
+// root hub. Returns 1, if the state of the port has changed, 0 if not, or -EPIPE if the
+// feature isn't supported.
+// caller has vhc->lock
+static inline int usb_vhci_port_feature(struct usb_vhci_port *p, int set, u16 wValue)
+{
+	u16 *const ps = &p->port_status;
+	u16 *const pc = &p->port_change;
+	u8 *const pf = &p->port_flags;
+
+	if(!set)
+	{
+		switch(wValue)
+		{
+		case USB_PORT_FEAT_SUSPEND:
+			// (see USB 2.0 spec section 11.5 and 11.24.2.7.1.3)
+			if(*ps & USB_PORT_STAT_SUSPEND)
+			{
+				*pf |= USB_VHCI_PORT_STAT_FLAG_RESUMING;
+				return 1;
+			}
+			return 0;
+		case USB_PORT_FEAT_POWER:
+			// (see USB 2.0 spec section 11.11 and 11.24.2.7.1.6)
+			if(*ps & USB_PORT_STAT_POWER)
+			{
+				// clear all status bits except overcurrent (see USB 2.0 spec section 11.24.2.7.1)
+				*ps &= USB_PORT_STAT_OVERCURRENT;
+				// clear all change bits except overcurrent (see USB 2.0 spec section 11.24.2.7.2)
+				*pc &= USB_PORT_STAT_C_OVERCURRENT;
+				// clear resuming flag
+				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+				return 1;
+			}
+			return 0;
+		case USB_PORT_FEAT_ENABLE:
+			// (see USB 2.0 spec section 11.5.1.4 and 11.24.2.7.{1,2}.2)
+			if(*ps & USB_PORT_STAT_ENABLE)
+			{
+				// clear enable and suspend bits (see section 11.24.2.7.1.{2,3})
+				*ps &= ~(USB_PORT_STAT_ENABLE | USB_PORT_STAT_SUSPEND);
+				// i'm not quite sure if the suspend change bit should be cleared too (see section 11.24.2.7.2.{2,3})
+				*pc &= ~(USB_PORT_STAT_C_ENABLE | USB_PORT_STAT_C_SUSPEND);
+				// clear resuming flag
+				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+				// TODO: maybe we should clear the low/high speed bits here (section 11.24.2.7.1.{7,8})
+				return 1;
+			}
+			return 0;
+		case USB_PORT_FEAT_CONNECTION:
+		case USB_PORT_FEAT_OVER_CURRENT:
+		case USB_PORT_FEAT_RESET:
+		case USB_PORT_FEAT_LOWSPEED:
+		case USB_PORT_FEAT_HIGHSPEED:
+		case USB_PORT_FEAT_INDICATOR:
+			return 0; // no-op
+		case USB_PORT_FEAT_C_CONNECTION:
+		case USB_PORT_FEAT_C_ENABLE:
+		case USB_PORT_FEAT_C_SUSPEND:
+		case USB_PORT_FEAT_C_OVER_CURRENT:
+		case USB_PORT_FEAT_C_RESET:
+			if(*pc & (1 << (wValue - 16)))
+			{
+				*pc &= ~(1 << (wValue - 16));
+				return 1;
+			}
+			return 0;
+		//case USB_PORT_FEAT_TEST:
+		default:
+			return -EPIPE;
+		}
+	}
+
+	switch(wValue)
+	{
+	case USB_PORT_FEAT_SUSPEND:
+		// USB 2.0 spec section 11.24.2.7.1.3:
+		//  "This bit can be set only if the port's PORT_ENABLE bit is set and the hub receives
+		//  a SetPortFeature(PORT_SUSPEND) request."
+		// The spec also says that the suspend bit has to be cleared whenever the enable bit is cleared.
+		// (see also section 11.5)
+		if((*ps & USB_PORT_STAT_ENABLE) && !(*ps & USB_PORT_STAT_SUSPEND))
+		{
+			*ps |= USB_PORT_STAT_SUSPEND;
+			return 1;
+		}
+		return 0;
+	case USB_PORT_FEAT_POWER:
+		// (see USB 2.0 spec section 11.11 and 11.24.2.7.1.6)
+		if(!(*ps & USB_PORT_STAT_POWER))
+		{
+			*ps |= USB_PORT_STAT_POWER;
+			return 1;
+		}
+		return 0;
+	case USB_PORT_FEAT_RESET:
+		// (see USB 2.0 spec section 11.24.2.7.1.5)
+		// initiate reset only if there is a device plugged into the port and if there isn't already a reset pending
+		if((*ps & USB_PORT_STAT_CONNECTION) && !(*ps & USB_PORT_STAT_RESET))
+		{
+			// keep the state of these bits and clear all others
+			*ps &= USB_PORT_STAT_POWER
+			     | USB_PORT_STAT_CONNECTION
+			     | USB_PORT_STAT_LOW_SPEED
+			     | USB_PORT_STAT_HIGH_SPEED
+			     | USB_PORT_STAT_OVERCURRENT;
+
+			*ps |= USB_PORT_STAT_RESET; // reset initiated
+
+			// clear resuming flag
+			*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+			return 1;
+		}
+		return 0;
+	case USB_PORT_FEAT_CONNECTION:
+	case USB_PORT_FEAT_OVER_CURRENT:
+	case USB_PORT_FEAT_LOWSPEED:
+	case USB_PORT_FEAT_HIGHSPEED:
+	case USB_PORT_FEAT_INDICATOR:
+		return 0; // no-op
+	case USB_PORT_FEAT_C_CONNECTION:
+	case USB_PORT_FEAT_C_ENABLE:
+	case USB_PORT_FEAT_C_SUSPEND:
+	case USB_PORT_FEAT_C_OVER_CURRENT:
+	case USB_PORT_FEAT_C_RESET:
+		if(!(*pc & (1 << (wValue - 16))))
+		{
+			*pc |= 1 << (wValue - 16);
+			return 1;
+		}
+		return 0;
+	//case USB_PORT_FEAT_ENABLE: // port can't be enabled without reseting (USB 2.0 spec section 11.24.2.7.1.2)
+	//case USB_PORT_FEAT_TEST:
+	default:
+		return -EPIPE;
+	}
+}
+
+#endif
@@ -39,6 +39,10 @@ static void dump_urb(struct urb *urb)
 	vhci_printk(KERN_DEBUG, "flags=0x%08x buflen=%d/%d\n", urb->transfer_flags, urb->actual_length, max);
 #endif
 	vhci_printk(KERN_DEBUG, "tbuf=0x%p tdma=0x%016llx sbuf=0x%p sdma=0x%016llx\n", urb->transfer_buffer, (u64)urb->transfer_dma, urb->setup_packet, (u64)urb->setup_dma);
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+		vhci_printk(KERN_DEBUG, "sg=0x%p num_sgs=%d\n", urb->sg, urb->num_sgs);
+#endif
 	if(usb_pipeint(urb->pipe))
 		vhci_printk(KERN_DEBUG, "interval=%d\n", urb->interval);
 	else if(usb_pipeisoc(urb->pipe))
@@ -109,7 +113,8 @@ static void dump_urb(struct urb *urb)
 		for(j = 0; j < urb->number_of_packets; j++)
 		{
 			vhci_printk(KERN_DEBUG, "PACKET%d: offset=%d pktlen=%d/%d status=%d(%s)\n", j, urb->iso_frame_desc[j].offset, urb->iso_frame_desc[j].actual_length, urb->iso_frame_desc[j].length, urb->iso_frame_desc[j].status, get_status_str(urb->iso_frame_desc[j].status));
-			if(debug_output >= 2)
+			// data stages of sg urbs aren't dumped
+			if(debug_output >= 2 && urb->transfer_buffer)
 			{
 				vhci_printk(KERN_DEBUG, "PACKET%d: data stage (%d/%d bytes %s):\n", j, urb->iso_frame_desc[j].actual_length, urb->iso_frame_desc[j].length, in ? "received" : "transmitted");
 				vhci_printk(KERN_DEBUG, "PACKET%d: ", j);
@@ -129,7 +134,7 @@ static void dump_urb(struct urb *urb)
 			}
 		}
 	}
-	else if(debug_output >= 2)
+	else if(debug_output >= 2 && urb->transfer_buffer)
 	{
 		vhci_printk(KERN_DEBUG, "data stage (%d/%d bytes %s):\n", urb->actual_length, max, in ? "received" : "transmitted");
 		vhci_printk(KERN_DEBUG, "");
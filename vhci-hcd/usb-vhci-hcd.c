@@ -36,9 +36,14 @@
 #include <linux/usb.h>
 #include <linux/fs.h>
 #include <linux/device.h>
+#include <linux/interrupt.h>
+#include <linux/scatterlist.h>
+
+#include <linux/jiffies.h>
 
 #include <asm/atomic.h>
 #include <asm/bitops.h>
+#include <asm/div64.h>
 #include <asm/uaccess.h>
 
 #include "usb-vhci-hcd.h"
@@ -189,6 +194,233 @@ void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *u
 }
 EXPORT_SYMBOL_GPL(usb_vhci_urb_giveback);
 
+// returns the index of the root hub port behind which the device of the urb is
+// (the device may be attached to a hub which is emulated by user space)
+static inline u8 urb_root_port(const struct urb *urb)
+{
+	const struct usb_device *udev = urb->dev;
+	while(udev->parent && udev->parent->parent)
+		udev = udev->parent;
+	return udev->portnum;
+}
+
+// copies len bytes from data into the data stage of urb
+static inline void urb_fill_buffer(struct urb *urb, const void *data, int len)
+{
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+	{
+		sg_copy_from_buffer(urb->sg, urb->num_sgs, (void *)data, len);
+		return;
+	}
+#endif
+	memcpy(urb->transfer_buffer, data, len);
+}
+
+// caller has vhc->lock
+static void responder_remove_rules(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_resp_rule *rule, *tmp;
+	list_for_each_entry_safe(rule, tmp, &vhc->resp_rules, list)
+	{
+		if(!index || rule->port == index)
+		{
+			list_del(&rule->list);
+			kfree(rule);
+			vhc->resp_rule_count--;
+		}
+	}
+}
+
+// Tries to complete a control urb with one of the responder rules of its port. Returns
+// non-zero, if a rule matched. The urb must be given back by the done tasklet then.
+// caller has vhc->lock
+static int vhci_respond(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct urb *const urb = urbp->urb;
+	const struct usb_ctrlrequest *cr = (const struct usb_ctrlrequest *)urb->setup_packet;
+	struct usb_vhci_resp_rule *rule;
+	int status, len = 0;
+	u8 port;
+
+	if(unlikely(!cr))
+		return 0;
+
+	port = urb_root_port(urb);
+	list_for_each_entry(rule, &vhc->resp_rules, list)
+	{
+		if(rule->port != port ||
+		   rule->bmRequestType != cr->bRequestType ||
+		   rule->bRequest != cr->bRequest ||
+		   rule->wValue != le16_to_cpu(cr->wValue) ||
+		   rule->wIndex != le16_to_cpu(cr->wIndex))
+			continue;
+
+		status = rule->status;
+		if(!status)
+		{
+			if(cr->bRequestType & USB_DIR_IN)
+			{
+				len = min_t(int, rule->data_length, urb->transfer_buffer_length);
+				if(len)
+					urb_fill_buffer(urb, rule->data, len);
+				if(len < urb->transfer_buffer_length && (urb->transfer_flags & URB_SHORT_NOT_OK))
+					status = -EREMOTEIO;
+			}
+			else
+				len = urb->transfer_buffer_length;
+		}
+		urb->actual_length = len;
+		usb_vhci_maybe_set_status(urbp, status);
+
+#ifdef DEBUG
+		if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "responder completed urb on port %d [req=0x%02x%02x, status=%d, len=%d]\n", (int)port, (int)cr->bRequestType, (int)cr->bRequest, status, len);
+#endif
+
+		if(rule->count && !--rule->count)
+		{
+			list_del(&rule->list);
+			kfree(rule);
+			vhc->resp_rule_count--;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// returns the current time in nanoseconds
+static inline s64 vhci_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+// returns the length of a (micro)frame in nanoseconds
+static inline u32 port_frame_ns(const struct usb_vhci_port *p)
+{
+	return (p->port_status & USB_PORT_STAT_HIGH_SPEED) ? 125 * NSEC_PER_USEC : NSEC_PER_MSEC;
+}
+
+// returns the number of payload bytes which fit into a (micro)frame
+// (max. bulk throughput; see USB 2.0 spec table 5-10)
+static inline u32 port_frame_bytes(const struct usb_vhci_port *p)
+{
+	if(p->port_status & USB_PORT_STAT_HIGH_SPEED)
+		return 13 * 512;
+	if(p->port_status & USB_PORT_STAT_LOW_SPEED)
+		return 187; // raw bit rate of 1.5 Mbit/s
+	return 19 * 64;
+}
+
+// rounds t up to the end of the (micro)frame in which it lies
+static inline s64 shape_frame_end(const struct usb_vhci_hcd *vhc, const struct usb_vhci_port *p, s64 t)
+{
+	u64 rel = t - vhc->clock_start;
+	u32 frame_ns = port_frame_ns(p);
+	u32 rem = do_div(rel, frame_ns);
+	return rem ? t + (frame_ns - rem) : t;
+}
+
+// returns the number of jiffies after which the timer has to fire if the next urb is due in ns
+static inline unsigned long shape_timeout(s64 ns)
+{
+	u64 us;
+	unsigned long j;
+	if(ns <= 0)
+		return 1;
+	us = ns;
+	do_div(us, NSEC_PER_USEC);
+	j = usecs_to_jiffies(us > UINT_MAX ? UINT_MAX : (unsigned int)us);
+	return j ? j : 1;
+}
+
+// Completes an urb which was processed successfully or not. If bus shaping is enabled
+// for the port of the urb, then the urb is delayed until its data would have passed a real
+// bus with the data rate of the port, plus the configured latency. Otherwise the urb is
+// given back immediately.
+// caller owns vhc->lock and has irq disabled.
+void usb_vhci_urb_complete(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct urb *const urb = urbp->urb;
+	struct usb_vhci_port *p;
+	unsigned long expires;
+	s64 now, start;
+	u64 xfer;
+	u8 port;
+
+	port = urb_root_port(urb);
+	if(likely(!port || port > vhc->port_count || !vhc->ports[port - 1].shaping))
+	{
+		usb_vhci_urb_giveback(vhc, urbp);
+		return;
+	}
+	p = &vhc->ports[port - 1];
+
+	// the bus transfers one urb after the other
+	now = vhci_now();
+	start = max(now, p->bus_free);
+	xfer = (u64)(urb->actual_length + (usb_pipecontrol(urb->pipe) ? 8 : 0)) * port_frame_ns(p);
+	do_div(xfer, port_frame_bytes(p));
+	p->bus_free = start + xfer;
+
+	// the host controller reports completions at the end of a frame
+	urbp->shape_due = shape_frame_end(vhc, p, p->bus_free) + (s64)p->latency_us * NSEC_PER_USEC;
+	list_move_tail(&urbp->urbp_list, &vhc->urbp_list_shaped);
+
+	expires = jiffies + shape_timeout(urbp->shape_due - now);
+	if(!timer_pending(&vhc->timer) || time_before(expires, vhc->timer.expires))
+		mod_timer(&vhc->timer, expires);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_complete);
+
+// frame clock: gives back the shaped urbs which are due (in order per port)
+static void vhci_timer(unsigned long _vhc)
+{
+	struct usb_vhci_hcd *vhc = (struct usb_vhci_hcd *)_vhc;
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	s64 now, next;
+	u32 blocked;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+repeat:
+	now = vhci_now();
+	next = 0;
+	blocked = 0;
+	list_for_each_entry(urbp, &vhc->urbp_list_shaped, urbp_list)
+	{
+		u32 bit = 1u << urb_root_port(urbp->urb);
+		if(!(blocked & bit) && urbp->shape_due <= now)
+		{
+			// the lock gets released while giving back, so we have to start all over
+			usb_vhci_urb_giveback(vhc, urbp);
+			goto repeat;
+		}
+		blocked |= bit;
+		if(!next || urbp->shape_due < next)
+			next = urbp->shape_due;
+	}
+	if(next)
+		mod_timer(&vhc->timer, jiffies + shape_timeout(next - now));
+	spin_unlock_irqrestore(&vhc->lock, flags);
+}
+
+// gives back the urbs which were completed by the responder
+// (usbcore doesn't like urbs which are given back from within urb_enqueue)
+static void vhci_done_tasklet(unsigned long _vhc)
+{
+	struct usb_vhci_hcd *vhc = (struct usb_vhci_hcd *)_vhc;
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	while(!list_empty(&vhc->urbp_list_done))
+	{
+		urbp = list_entry(vhc->urbp_list_done.next, struct usb_vhci_urb_priv, urbp_list);
+		usb_vhci_urb_complete(vhc, urbp);
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+}
+
 #ifdef OLD_GIVEBACK_MECH
 static int vhci_urb_enqueue(struct usb_hcd *hcd, struct usb_host_endpoint *ep, struct urb *urb, gfp_t mem_flags)
 #else
@@ -210,13 +442,14 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flag
 
 	trace_function(dev);
 
-	if(unlikely(!urb->transfer_buffer && urb->transfer_buffer_length))
+	if(unlikely(!usb_vhci_urb_has_buffer(urb) && urb->transfer_buffer_length))
 		return -EINVAL;
 
 	urbp = kzalloc(sizeof *urbp, mem_flags);
 	if(unlikely(!urbp))
 		return -ENOMEM;
 	urbp->urb = urb;
+	urbp->enqueue_time = ktime_get();
 	atomic_set(&urbp->status, urb->status);
 
 	vhci_dbg("vhci_urb_enqueue: urb->status = %d(%s)",urb->status,get_status_str(urb->status));
@@ -232,8 +465,16 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flag
 	}
 #endif
 	usb_get_dev(urb->dev);
-	list_add_tail(&urbp->urbp_list, &vhc->urbp_list_inbox);
 	urb->hcpriv = urbp;
+	if(vhc->resp_rule_count && usb_pipetype(urb->pipe) == PIPE_CONTROL && vhci_respond(vhc, urbp))
+	{
+		urbp->seq = ++vhc->urb_seq;
+		list_add_tail(&urbp->urbp_list, &vhc->urbp_list_done);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		tasklet_schedule(&vhc->done_tasklet);
+		return 0;
+	}
+	usb_vhci_queue_urbp(vhc, urbp);
 	spin_unlock_irqrestore(&vhc->lock, flags);
 	vdev->ifc->wakeup(vdev);
 	return 0;
@@ -249,7 +490,8 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 	struct device *dev;
 	struct usb_vhci_device *vdev;
 	unsigned long flags;
-	struct usb_vhci_urb_priv *entry, *urbp = NULL;
+	struct usb_vhci_urb_priv *urbp;
+	int cancel;
 #ifndef OLD_GIVEBACK_MECH
 	int retval;
 #endif
@@ -270,45 +512,16 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 	}
 #endif
 
-	// search the queue of unprocessed urbs (inbox)
-	list_for_each_entry(entry, &vhc->urbp_list_inbox, urbp_list)
-	{
-		if(entry->urb == urb)
-		{
-			urbp = entry;
-			break;
-		}
-	}
-
-	// if found in inbox
+	urbp = usb_vhci_unqueue_urb(vhc, urb, &cancel);
 	if(urbp)
 		usb_vhci_urb_giveback(vhc, urbp);
-	else // if not found...
-	{
-		// ...then check if the urb is on a vacation through user space
-		list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
-		{
-			if(entry->urb == urb)
-			{
-				// move it into the cancel list
-				list_move_tail(&entry->urbp_list, &vhc->urbp_list_cancel);
-				vdev->ifc->wakeup(vdev);
-				break;
-			}
-		}
-	}
+	else if(cancel)
+		vdev->ifc->wakeup(vdev);
 
 	spin_unlock_irqrestore(&vhc->lock, flags);
 	return 0;
 }
 
-/*
-static void vhci_timer(unsigned long _vhc)
-{
-	struct usb_vhci_hcd *vhc = (struct usb_vhci_hcd *)_vhc;
-}
-*/
-
 static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
 {
 	struct usb_vhci_hcd *vhc;
@@ -393,8 +606,6 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 	struct device *dev;
 	int retval = 0;
 	unsigned long flags;
-	u16 *ps, *pc;
-	u8 *pf;
 	u8 port, has_changes = 0;
 
 	vhc = usbhcd_to_vhcihcd(hcd);
@@ -418,82 +629,23 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 			goto err;
 		break;
 	case ClearPortFeature:
+	case SetPortFeature:
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "%s: ClearPortFeature [wValue=0x%04x, wIndex=%d]\n", __FUNCTION__, (int)wValue, (int)wIndex);
+		if(debug_output) dev_dbg(dev, "%s: %sPortFeature [wValue=0x%04x, wIndex=%d]\n", __FUNCTION__, (typeReq == ClearPortFeature) ? "Clear" : "Set", (int)wValue, (int)wIndex);
 #endif
 		if(unlikely(!wIndex || wIndex > vhc->port_count || wLength))
 			goto err;
-		ps = &vhc->ports[wIndex - 1].port_status;
-		pc = &vhc->ports[wIndex - 1].port_change;
-		pf = &vhc->ports[wIndex - 1].port_flags;
-		switch(wValue)
+		retval = usb_vhci_port_feature(&vhc->ports[wIndex - 1], typeReq == SetPortFeature, wValue);
+		if(unlikely(retval < 0))
+			goto err;
+		if(retval)
 		{
-		case USB_PORT_FEAT_SUSPEND:
-			// (see USB 2.0 spec section 11.5 and 11.24.2.7.1.3)
-			if(*ps & USB_PORT_STAT_SUSPEND)
-			{
 #ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d resuming\n", (int)wIndex);
+			if(debug_output) dev_dbg(dev, "Port %d: [port_status=0x%04x] [port_change=0x%04x]\n", (int)wIndex, (int)vhc->ports[wIndex - 1].port_status, (int)vhc->ports[wIndex - 1].port_change);
 #endif
-				*pf |= USB_VHCI_PORT_STAT_FLAG_RESUMING;
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		case USB_PORT_FEAT_POWER:
-			// (see USB 2.0 spec section 11.11 and 11.24.2.7.1.6)
-			if(*ps & USB_PORT_STAT_POWER)
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d power-off\n", (int)wIndex);
-#endif
-				// clear all status bits except overcurrent (see USB 2.0 spec section 11.24.2.7.1)
-				*ps &= USB_PORT_STAT_OVERCURRENT;
-				// clear all change bits except overcurrent (see USB 2.0 spec section 11.24.2.7.2)
-				*pc &= USB_PORT_STAT_C_OVERCURRENT;
-				// clear resuming flag
-				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		case USB_PORT_FEAT_ENABLE:
-			// (see USB 2.0 spec section 11.5.1.4 and 11.24.2.7.{1,2}.2)
-			if(*ps & USB_PORT_STAT_ENABLE)
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d disabled\n", (int)wIndex);
-#endif
-				// clear enable and suspend bits (see section 11.24.2.7.1.{2,3})
-				*ps &= ~(USB_PORT_STAT_ENABLE | USB_PORT_STAT_SUSPEND);
-				// i'm not quite sure if the suspend change bit should be cleared too (see section 11.24.2.7.2.{2,3})
-				*pc &= ~(USB_PORT_STAT_C_ENABLE | USB_PORT_STAT_C_SUSPEND);
-				// clear resuming flag
-				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-				// TODO: maybe we should clear the low/high speed bits here (section 11.24.2.7.1.{7,8})
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		case USB_PORT_FEAT_CONNECTION:
-		case USB_PORT_FEAT_OVER_CURRENT:
-		case USB_PORT_FEAT_RESET:
-		case USB_PORT_FEAT_LOWSPEED:
-		case USB_PORT_FEAT_HIGHSPEED:
-		case USB_PORT_FEAT_INDICATOR:
-			break; // no-op
-		case USB_PORT_FEAT_C_CONNECTION:
-		case USB_PORT_FEAT_C_ENABLE:
-		case USB_PORT_FEAT_C_SUSPEND:
-		case USB_PORT_FEAT_C_OVER_CURRENT:
-		case USB_PORT_FEAT_C_RESET:
-			if(*pc & (1 << (wValue - 16)))
-			{
-				*pc &= ~(1 << (wValue - 16));
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		//case USB_PORT_FEAT_TEST:
-		default:
-			goto err;
+			vhci_port_update(vhc, wIndex);
 		}
+		retval = 0;
 		break;
 	case GetHubDescriptor:
 #ifdef DEBUG
@@ -525,93 +677,6 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 		buf[2] = (u8)vhc->ports[wIndex - 1].port_change;
 		buf[3] = (u8)(vhc->ports[wIndex - 1].port_change >> 8);
 		break;
-	case SetPortFeature:
-#ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "%s: SetPortFeature [wValue=0x%04x, wIndex=%d]\n", __FUNCTION__, (int)wValue, (int)wIndex);
-#endif
-		if(unlikely(!wIndex || wIndex > vhc->port_count || wLength))
-			goto err;
-		ps = &vhc->ports[wIndex - 1].port_status;
-		pc = &vhc->ports[wIndex - 1].port_change;
-		pf = &vhc->ports[wIndex - 1].port_flags;
-		switch(wValue)
-		{
-		case USB_PORT_FEAT_SUSPEND:
-			// USB 2.0 spec section 11.24.2.7.1.3:
-			//  "This bit can be set only if the port’s PORT_ENABLE bit is set and the hub receives
-			//  a SetPortFeature(PORT_SUSPEND) request."
-			// The spec also says that the suspend bit has to be cleared whenever the enable bit is cleared.
-			// (see also section 11.5)
-			if((*ps & USB_PORT_STAT_ENABLE) && !(*ps & USB_PORT_STAT_SUSPEND))
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d suspended\n", (int)wIndex);
-#endif
-				*ps |= USB_PORT_STAT_SUSPEND;
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		case USB_PORT_FEAT_POWER:
-			// (see USB 2.0 spec section 11.11 and 11.24.2.7.1.6)
-			if(!(*ps & USB_PORT_STAT_POWER))
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d power-on\n", (int)wIndex);
-#endif
-				*ps |= USB_PORT_STAT_POWER;
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		case USB_PORT_FEAT_RESET:
-			// (see USB 2.0 spec section 11.24.2.7.1.5)
-			// initiate reset only if there is a device plugged into the port and if there isn't already a reset pending
-			if((*ps & USB_PORT_STAT_CONNECTION) && !(*ps & USB_PORT_STAT_RESET))
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d resetting\n", (int)wIndex);
-#endif
-
-				// keep the state of these bits and clear all others
-				*ps &= USB_PORT_STAT_POWER
-				     | USB_PORT_STAT_CONNECTION
-				     | USB_PORT_STAT_LOW_SPEED
-				     | USB_PORT_STAT_HIGH_SPEED
-				     | USB_PORT_STAT_OVERCURRENT;
-
-				*ps |= USB_PORT_STAT_RESET; // reset initiated
-
-				// clear resuming flag
-				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-
-				vhci_port_update(vhc, wIndex);
-			}
-#ifdef DEBUG
-			else if(debug_output) dev_dbg(dev, "Port %d reset not possible because of port_state=%04x\n", (int)wIndex, (int)*ps);
-#endif
-			break;
-		case USB_PORT_FEAT_CONNECTION:
-		case USB_PORT_FEAT_OVER_CURRENT:
-		case USB_PORT_FEAT_LOWSPEED:
-		case USB_PORT_FEAT_HIGHSPEED:
-		case USB_PORT_FEAT_INDICATOR:
-			break; // no-op
-		case USB_PORT_FEAT_C_CONNECTION:
-		case USB_PORT_FEAT_C_ENABLE:
-		case USB_PORT_FEAT_C_SUSPEND:
-		case USB_PORT_FEAT_C_OVER_CURRENT:
-		case USB_PORT_FEAT_C_RESET:
-			if(!(*pc & (1 << (wValue - 16))))
-			{
-				*pc |= 1 << (wValue - 16);
-				vhci_port_update(vhc, wIndex);
-			}
-			break;
-		//case USB_PORT_FEAT_ENABLE: // port can't be enabled without reseting (USB 2.0 spec section 11.24.2.7.1.2)
-		//case USB_PORT_FEAT_TEST:
-		default:
-			goto err;
-		}
-		break;
 	default:
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "%s: +++UNHANDLED_REQUEST+++ [req=0x%04x, v=0x%04x, i=0x%04x, l=%d]\n", __FUNCTION__, (int)typeReq, (int)wValue, (int)wIndex, (int)wLength);
@@ -785,6 +850,61 @@ static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char
 	return size;
 }
 
+// Shows the bus shaping configuration of all ports. Each line looks like
+// "<port> <0|1> <latency_us> <bytes per frame> <frame length in ns>".
+static ssize_t show_shaping(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_port *p;
+	size_t size = 0;
+	unsigned long flags;
+	u8 port;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
+
+	trace_function(dev);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(port = 0; port < vhc->port_count && size < PAGE_SIZE; port++)
+	{
+		p = &vhc->ports[port];
+		size += snprintf(buf + size, PAGE_SIZE - size, "%d %d %u %u %u\n",
+			(int)port + 1, (int)p->shaping, p->latency_us, port_frame_bytes(p), port_frame_ns(p));
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	return min_t(size_t, size, PAGE_SIZE);
+}
+
+// Configures bus shaping of a port: "<port> <0|1> [<latency_us>]". When enabled, urbs
+// aren't given back faster than the data rate of the port allows, and each urb is delayed
+// by the given latency.
+static ssize_t store_shaping(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	unsigned int port, on, latency = 0;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
+
+	trace_function(dev);
+
+	if(sscanf(buf, "%u %u %u", &port, &on, &latency) < 2)
+		return -EINVAL;
+	if(!port || port > vhc->port_count || on > 1 || latency > 10 * USEC_PER_SEC)
+		return -EINVAL;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	vhc->ports[port - 1].shaping = on;
+	vhc->ports[port - 1].latency_us = latency;
+	vhc->ports[port - 1].bus_free = 0;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	return count;
+}
+
+static DEVICE_ATTR(shaping, S_IRUSR | S_IWUSR, show_shaping, store_shaping);
+
 static int vhci_start(struct usb_hcd *hcd)
 {
 	struct usb_vhci_hcd *vhc;
@@ -804,17 +924,23 @@ static int vhci_start(struct usb_hcd *hcd)
 	if(unlikely(ports == NULL)) return -ENOMEM;
 
 	spin_lock_init(&vhc->lock);
-	//init_timer(&vhc->timer);
-	//vhc->timer.function = vhci_timer;
-	//vhc->timer.data = (unsigned long)vhc;
+	init_timer(&vhc->timer);
+	vhc->timer.function = vhci_timer;
+	vhc->timer.data = (unsigned long)vhc;
 	vhc->ports = ports;
 	vhc->port_count = vdev->port_count;
 	vhc->port_update = 0;
-	atomic_set(&vhc->frame_num, 0);
+	vhc->urb_seq = 0;
+	vhc->clock_start = vhci_now();
 	INIT_LIST_HEAD(&vhc->urbp_list_inbox);
 	INIT_LIST_HEAD(&vhc->urbp_list_fetched);
 	INIT_LIST_HEAD(&vhc->urbp_list_cancel);
 	INIT_LIST_HEAD(&vhc->urbp_list_canceling);
+	INIT_LIST_HEAD(&vhc->urbp_list_done);
+	INIT_LIST_HEAD(&vhc->urbp_list_shaped);
+	tasklet_init(&vhc->done_tasklet, vhci_done_tasklet, (unsigned long)vhc);
+	INIT_LIST_HEAD(&vhc->resp_rules);
+	vhc->resp_rule_count = 0;
 	vhc->rh_state = USB_VHCI_RH_RUNNING;
 
 	hcd->power_budget = 500; // NOTE: practically we have unlimited power because this is a virtual device with... err... virtual power!
@@ -822,6 +948,14 @@ static int vhci_start(struct usb_hcd *hcd)
 	hcd->uses_new_polling = 1;
 #ifndef NO_HAS_TT_FLAG
 	hcd->has_tt = 1;
+#endif
+#ifndef NO_URB_SG
+	// we never do dma, so we accept sg lists of any length (usbcore won't linearize them for us)
+	hcd->self.sg_tablesize = ~0;
+#ifndef NO_SG_CONSTRAINT
+	// the data is copied element by element, so the elements may have any length
+	hcd->self.no_sg_constraint = 1;
+#endif
 #endif
 
 	retval = device_create_file(dev, &dev_attr_urbs_inbox);
@@ -832,9 +966,14 @@ static int vhci_start(struct usb_hcd *hcd)
 	if(unlikely(retval != 0)) goto rem_file_fetched;
 	retval = device_create_file(dev, &dev_attr_urbs_canceling);
 	if(unlikely(retval != 0)) goto rem_file_cancel;
+	retval = device_create_file(dev, &dev_attr_shaping);
+	if(unlikely(retval != 0)) goto rem_file_canceling;
 
 	return 0;
 
+rem_file_canceling:
+	device_remove_file(dev, &dev_attr_urbs_canceling);
+
 rem_file_cancel:
 	device_remove_file(dev, &dev_attr_urbs_cancel);
 
@@ -855,6 +994,7 @@ static void vhci_stop(struct usb_hcd *hcd)
 {
 	struct usb_vhci_hcd *vhc;
 	struct device *dev;
+	unsigned long flags;
 
 	dev = usbhcd_to_dev(hcd);
 
@@ -862,11 +1002,18 @@ static void vhci_stop(struct usb_hcd *hcd)
 
 	vhc = usbhcd_to_vhcihcd(hcd);
 
+	device_remove_file(dev, &dev_attr_shaping);
 	device_remove_file(dev, &dev_attr_urbs_canceling);
 	device_remove_file(dev, &dev_attr_urbs_cancel);
 	device_remove_file(dev, &dev_attr_urbs_fetched);
 	device_remove_file(dev, &dev_attr_urbs_inbox);
 
+	del_timer_sync(&vhc->timer);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	responder_remove_rules(vhc, 0);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
 	if(likely(vhc->ports))
 	{
 		kfree(vhc->ports);
@@ -881,9 +1028,12 @@ static void vhci_stop(struct usb_hcd *hcd)
 static int vhci_get_frame(struct usb_hcd *hcd)
 {
 	struct usb_vhci_hcd *vhc;
+	u64 ms;
 	vhc = usbhcd_to_vhcihcd(hcd);
 	trace_function(usbhcd_to_dev(hcd));
-	return atomic_read(&vhc->frame_num);
+	ms = vhci_now() - vhc->clock_start;
+	do_div(ms, NSEC_PER_MSEC);
+	return (int)(ms & 0x7ff); // 11 bit frame number (like in SOF packets)
 }
 
 static const struct hc_driver vhci_hcd = {
@@ -945,7 +1095,20 @@ static int vhci_hcd_remove(struct platform_device *pdev)
 
 	trace_function(vhcihcd_to_dev(vhc));
 
+	tasklet_kill(&vhc->done_tasklet);
+	del_timer_sync(&vhc->timer);
+
 	spin_lock_irqsave(&vhc->lock, flags);
+	while(!list_empty(&vhc->urbp_list_shaped))
+	{
+		urbp = list_entry(vhc->urbp_list_shaped.next, struct usb_vhci_urb_priv, urbp_list);
+		usb_vhci_urb_giveback(vhc, urbp);
+	}
+	while(!list_empty(&vhc->urbp_list_done))
+	{
+		urbp = list_entry(vhc->urbp_list_done.next, struct usb_vhci_urb_priv, urbp_list);
+		usb_vhci_urb_giveback(vhc, urbp);
+	}
 	while(!list_empty(&vhc->urbp_list_inbox))
 	{
 		urbp = list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
@@ -1160,10 +1323,7 @@ int usb_vhci_hcd_has_work(struct usb_vhci_hcd *vhc)
 	unsigned long flags;
 	int y = 0;
 	spin_lock_irqsave(&vhc->lock, flags);
-	if(vhc->port_update ||
-	   !list_empty(&vhc->urbp_list_cancel) ||
-	   !list_empty(&vhc->urbp_list_inbox))
-		y = 1;
+	y = usb_vhci_has_work_locked(vhc);
 	spin_unlock_irqrestore(&vhc->lock, flags);
 	return y;
 }
@@ -1173,7 +1333,7 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 {
 	struct device *dev;
 	unsigned long flags;
-	u16 overcurrent;
+	int retval;
 
 	dev = vhcihcd_to_dev(vhc);
 
@@ -1188,88 +1348,23 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 	            change != (USB_PORT_STAT_C_RESET | USB_PORT_STAT_C_ENABLE)))
 		return -EINVAL;
 
-	spin_lock_irqsave(&vhc->lock, flags);
-	if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_POWER)))
-	{
-		spin_unlock_irqrestore(&vhc->lock, flags);
-		return -EPROTO;
-	}
-
 #ifdef DEBUG
 	if(debug_output) dev_dbg(dev, "performing PORT_STAT [port=%d ~status=0x%04x ~change=0x%04x]\n", (int)index, (int)status, (int)change);
 #endif
 
-	switch(change)
+	spin_lock_irqsave(&vhc->lock, flags);
+	retval = usb_vhci_port_stat_apply(&vhc->ports[index - 1], status, change);
+	if(unlikely(retval))
 	{
-	case USB_PORT_STAT_C_CONNECTION:
-		overcurrent = vhc->ports[index - 1].port_status & USB_PORT_STAT_OVERCURRENT;
-		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_CONNECTION;
-		if(status & USB_PORT_STAT_CONNECTION)
-			vhc->ports[index - 1].port_status = USB_PORT_STAT_POWER | USB_PORT_STAT_CONNECTION |
-				((status & USB_PORT_STAT_LOW_SPEED) ? USB_PORT_STAT_LOW_SPEED :
-				((status & USB_PORT_STAT_HIGH_SPEED) ? USB_PORT_STAT_HIGH_SPEED : 0)) |
-				overcurrent;
-		else
-			vhc->ports[index - 1].port_status = USB_PORT_STAT_POWER | overcurrent;
-		vhc->ports[index - 1].port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-		break;
-
-	case USB_PORT_STAT_C_ENABLE:
-		if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_CONNECTION) ||
-			(vhc->ports[index - 1].port_status & USB_PORT_STAT_RESET) ||
-			(status & USB_PORT_STAT_ENABLE)))
-		{
-			spin_unlock_irqrestore(&vhc->lock, flags);
-			return -EPROTO;
-		}
-		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_ENABLE;
-		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_ENABLE;
-		vhc->ports[index - 1].port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_SUSPEND;
-		break;
-
-	case USB_PORT_STAT_C_SUSPEND:
-		if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_CONNECTION) ||
-			!(vhc->ports[index - 1].port_status & USB_PORT_STAT_ENABLE) ||
-			(vhc->ports[index - 1].port_status & USB_PORT_STAT_RESET) ||
-			(status & USB_PORT_STAT_SUSPEND)))
-		{
-			spin_unlock_irqrestore(&vhc->lock, flags);
-			return -EPROTO;
-		}
-		vhc->ports[index - 1].port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_SUSPEND;
-		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_SUSPEND;
-		break;
-
-	case USB_PORT_STAT_C_OVERCURRENT:
-		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_OVERCURRENT;
-		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_OVERCURRENT;
-		vhc->ports[index - 1].port_status |= status & USB_PORT_STAT_OVERCURRENT;
-		break;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return retval;
+	}
 
-	default: // USB_PORT_STAT_C_RESET [| USB_PORT_STAT_C_ENABLE]
-		if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_CONNECTION) ||
-			!(vhc->ports[index - 1].port_status & USB_PORT_STAT_RESET) ||
-			(status & USB_PORT_STAT_RESET)))
-		{
-			spin_unlock_irqrestore(&vhc->lock, flags);
-			return -EPROTO;
-		}
-		if(change & USB_PORT_STAT_C_ENABLE)
-		{
-			if(status & USB_PORT_STAT_ENABLE)
-			{
-				spin_unlock_irqrestore(&vhc->lock, flags);
-				return -EPROTO;
-			}
-			vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_ENABLE;
-		}
-		else
-			vhc->ports[index - 1].port_status |= status & USB_PORT_STAT_ENABLE;
-		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_RESET;
-		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_RESET;
-		break;
+	if(change == USB_PORT_STAT_C_CONNECTION)
+	{
+		// the rules were made for the device which was plugged in before
+		responder_remove_rules(vhc, index);
+		vhc->ports[index - 1].bus_free = 0;
 	}
 
 	vhci_port_update(vhc, index);
@@ -1280,6 +1375,60 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 }
 EXPORT_SYMBOL_GPL(usb_vhci_apply_port_stat);
 
+// Appends rule to the responder rules of port rule->port. On success the controller
+// takes the ownership of rule, which has to be allocated with kmalloc.
+int usb_vhci_responder_add(struct usb_vhci_hcd *vhc, struct usb_vhci_resp_rule *rule)
+{
+	unsigned long flags;
+
+	if(unlikely(!rule->port || rule->port > vhc->port_count))
+		return -EINVAL;
+
+	if(unlikely(rule->status != 0 && rule->status != -EPIPE))
+		return -EINVAL;
+
+	// data stage only for successful IN requests
+	if(unlikely(rule->data_length > USB_VHCI_RESPONDER_MAX_DATA ||
+	            (rule->data_length && (rule->status || !(rule->bmRequestType & USB_DIR_IN)))))
+		return -EINVAL;
+
+	// user space has to see SET_ADDRESS, otherwise it doesn't know the address of its device
+	if(unlikely(rule->bmRequestType == (USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE) &&
+	            rule->bRequest == USB_REQ_SET_ADDRESS))
+		return -EPERM;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(unlikely(vhc->resp_rule_count >= USB_VHCI_RESPONDER_MAX_RULES))
+	{
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return -ENOSPC;
+	}
+	list_add_tail(&rule->list, &vhc->resp_rules);
+	vhc->resp_rule_count++;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "responder rule added [port=%d, req=0x%02x%02x, wValue=0x%04x, wIndex=0x%04x, status=%d, len=%d]\n", (int)rule->port, (int)rule->bmRequestType, (int)rule->bRequest, (int)rule->wValue, (int)rule->wIndex, rule->status, (int)rule->data_length);
+#endif
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_responder_add);
+
+// removes all responder rules of port index (or of all ports, if index is 0)
+int usb_vhci_responder_clear(struct usb_vhci_hcd *vhc, u8 index)
+{
+	unsigned long flags;
+
+	if(unlikely(index > vhc->port_count))
+		return -EINVAL;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	responder_remove_rules(vhc, index);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_responder_clear);
+
 #ifdef DEBUG
 static ssize_t show_debug_output(struct device_driver *drv, char *buf)
 {
@@ -22,11 +22,18 @@
 #ifndef _USB_VHCI_HCD_H
 #define _USB_VHCI_HCD_H
 
+#ifdef USB_VHCI_SIM
+// user space build (see sim/)
+#	include "sim/vhci-shim.h"
+#	include "usb-vhci.h"
+#else
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
 #include <linux/wait.h>
 #include <linux/list.h>
+#include <linux/interrupt.h>
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/device.h>
@@ -51,12 +58,19 @@
 #	include <linux/usb-vhci.h>
 #	include "usb-vhci.config.h"
 #endif
+#endif
 
 struct usb_vhci_port
 {
 	u16 port_status;
 	u16 port_change;
 	u8 port_flags;
+
+	// bus shaping (see sysfs attribute "shaping")
+	u8 shaping;
+	u32 latency_us;
+	// time (ns) at which the emulated bus of the port becomes idle
+	s64 bus_free;
 };
 
 enum usb_vhci_rh_state
@@ -97,6 +111,37 @@ struct usb_vhci_urb_priv
 	struct urb *urb;
 	struct list_head urbp_list;
 	atomic_t status;
+
+	// number of ioctls which are copying data from or into the urb without holding vhc->lock;
+	// the urb must not be given back while it is pinned (protected by vhc->lock)
+	int pinned;
+	// the urb was canceled while it was pinned and has to be given back as soon as it gets unpinned
+	u8 giveback_on_unpin;
+	// number of bytes of IN data (from the start of the data stage, without holes) which were
+	// already transfered by USB_VHCI_HCD_IOCGIVEBACKPART
+	int in_streamed;
+
+	// time of vhci_urb_enqueue and per-controller sequence number (for latency profiling)
+	ktime_t enqueue_time;
+	u64 seq;
+
+	// time (ns) at which a shaped urb gets given back
+	s64 shape_due;
+};
+
+// rule of the in-kernel responder (see USB_VHCI_HCD_IOCRESPONDER)
+struct usb_vhci_resp_rule
+{
+	struct list_head list;
+	u8 port;
+	u8 bmRequestType;
+	u8 bRequest;
+	u16 wValue;
+	u16 wIndex;
+	int status;
+	u32 count;
+	u16 data_length;
+	u8 data[0];
 };
 
 struct usb_vhci_hcd
@@ -106,11 +151,15 @@ struct usb_vhci_hcd
 
 	spinlock_t lock;
 
-	atomic_t frame_num;
+	// time (ns) of frame 0; the frame number is derived from it
+	s64 clock_start;
 	enum usb_vhci_rh_state rh_state;
 
-	// TODO: implement timer for incrementing frame_num every millisecond
-	//struct timer_list timer;
+	// sequence number of the last enqueued urb
+	u64 urb_seq;
+
+	// releases shaped urbs when their frame has passed
+	struct timer_list timer;
 
 	// urbs which are waiting to get fetched by user space are in this list
 	struct list_head urbp_list_inbox;
@@ -126,9 +175,32 @@ struct usb_vhci_hcd
 	// user space already knows about the cancelation state are in this list
 	struct list_head urbp_list_canceling;
 
+	// urbs which were completed by the responder and which are waiting for the tasklet to
+	// give them back are in this list
+	struct list_head urbp_list_done;
+	struct tasklet_struct done_tasklet;
+
+	// urbs which were completed, but which are delayed by bus shaping are in this list
+	struct list_head urbp_list_shaped;
+
+	// responder rules of all ports (in the order they were added)
+	struct list_head resp_rules;
+	unsigned int resp_rule_count;
+
 	u8 port_count;
 };
 
+// Returns non-zero, if the data stage of urb is backed by memory. This is either the linear
+// transfer_buffer or, for hosts which submit scatter-gather urbs, the sg list.
+static inline int usb_vhci_urb_has_buffer(const struct urb *urb)
+{
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+		return 1;
+#endif
+	return urb->transfer_buffer != NULL;
+}
+
 static inline struct usb_vhci_device *pdev_to_vhcidev(struct platform_device *pdev)
 {
 	return pdev->dev.platform_data;
@@ -204,14 +276,22 @@ static inline struct usb_hcd *pdev_to_usbhcd(struct platform_device *pdev)
 	return vhcidev_to_usbhcd(pdev_to_vhcidev(pdev));
 }
 
+#ifndef USB_VHCI_SIM
+// (the user space build only uses the inline functions)
 const char *usb_vhci_dev_name(struct usb_vhci_device *vdev);
 int usb_vhci_dev_id(struct usb_vhci_device *vdev);
 int usb_vhci_dev_busnum(struct usb_vhci_device *vdev);
 void usb_vhci_maybe_set_status(struct usb_vhci_urb_priv *urbp, int status);
 void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
+void usb_vhci_urb_complete(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
 int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port_count, struct usb_vhci_device **vdev_ret);
 int usb_vhci_hcd_unregister(struct usb_vhci_device *vdev);
 int usb_vhci_hcd_has_work(struct usb_vhci_hcd *vhc);
 int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u8 index);
+int usb_vhci_responder_add(struct usb_vhci_hcd *vhc, struct usb_vhci_resp_rule *rule);
+int usb_vhci_responder_clear(struct usb_vhci_hcd *vhc, u8 index);
+#endif
+
+#include "usb-vhci-core.h"
 
 #endif
@@ -34,6 +34,8 @@
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
 
 #include "usb-vhci-hcd.h"
 
@@ -41,6 +43,10 @@
 #include <asm/bitops.h>
 #include <asm/uaccess.h>
 
+// number of iso packet descriptors which are copied from/to user space at once (the
+// chunk lives on the stack)
+#define USB_VHCI_ISO_CHUNK 16
+
 #define DRIVER_NAME "usb_vhci_iocifc"
 #define DRIVER_DESC "User-mode IOCTL-interface for USB VHCI"
 #define DRIVER_VERSION USB_VHCI_IOCIFC_VERSION " (" USB_VHCI_IOCIFC_DATE ")"
@@ -85,6 +91,7 @@ struct vhci_ifc_priv
 {
 	struct file *file;
 	wait_queue_head_t work_event;
+	atomic_t kicked; // set by USB_VHCI_HCD_IOCKICK
 	u8 port_sched_offset;
 
 #ifdef DEBUG
@@ -130,6 +137,7 @@ static int init_ifc_priv(void *context, void *ifc_priv)
 
 	ifcp->file = context;
 	init_waitqueue_head(&ifcp->work_event);
+	atomic_set(&ifcp->kicked, 0);
 	ifcp->port_sched_offset = 0;
 
 #ifdef DEBUG
@@ -280,6 +288,54 @@ static int ioc_port_stat(struct usb_vhci_device *vdev, struct usb_vhci_ioc_port_
 	return usb_vhci_apply_port_stat(vhcidev_to_vhcihcd(vdev), status, change, index);
 }
 
+// called in device_ioctl only
+static int ioc_responder(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_responder __user *arg)
+{
+	struct usb_vhci_resp_rule *rule;
+	u16 len;
+	u8 op, index;
+	int retval;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCRESPONDER\n");
+#endif
+
+	__get_user(op, &arg->op);
+	__get_user(index, &arg->index);
+
+	if(op == USB_VHCI_RESPONDER_OP_CLEAR)
+		return usb_vhci_responder_clear(vhc, index);
+	if(unlikely(op != USB_VHCI_RESPONDER_OP_ADD))
+		return -EINVAL;
+
+	__get_user(len, &arg->data_length);
+	if(unlikely(len > USB_VHCI_RESPONDER_MAX_DATA))
+		return -EINVAL;
+
+	rule = kmalloc(sizeof *rule + len, GFP_KERNEL);
+	if(unlikely(!rule))
+		return -ENOMEM;
+
+	rule->port = index;
+	rule->data_length = len;
+	__get_user(rule->bmRequestType, &arg->setup_packet.bmRequestType);
+	__get_user(rule->bRequest, &arg->setup_packet.bRequest);
+	__get_user(rule->wValue, &arg->setup_packet.wValue);
+	__get_user(rule->wIndex, &arg->setup_packet.wIndex);
+	__get_user(rule->status, &arg->status);
+	__get_user(rule->count, &arg->count);
+	if(len && unlikely(copy_from_user(rule->data, arg->data, len)))
+	{
+		kfree(rule);
+		return -EFAULT;
+	}
+
+	retval = usb_vhci_responder_add(vhc, rule);
+	if(unlikely(retval))
+		kfree(rule);
+	return retval;
+}
+
 static inline u8 conv_urb_type(u8 type)
 {
 	switch(type & 0x3)
@@ -304,8 +360,17 @@ static inline u16 conv_urb_flags(unsigned int flags)
 static inline void dump_urb(struct urb *urb) {/* do nothing */}
 #endif
 
+// called in ioc_fetch_work only
+static inline void put_work_ts(struct usb_vhci_ioc_work_ts __user *ts, u64 enqueue_time, u64 seq)
+{
+	__put_user(enqueue_time, &ts->enqueue_time);
+	__put_user(seq, &ts->seq);
+}
+
 // called in device_ioctl only
-static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg, s16 timeout)
+// ts is NULL, if the caller isn't interested in the time stamp and the sequence number of the urb
+// (otherwise it points to the same memory as arg)
+static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg, struct usb_vhci_ioc_work_ts __user *ts, s16 timeout)
 {
 #ifdef DEBUG
 	struct device *dev = vhcihcd_to_dev(vhc);
@@ -314,10 +379,10 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 	struct vhci_ifc_priv *ifcp;
 	struct usb_vhci_port port_stat;
 	struct usb_vhci_ioc_urb urb;
-	u64 handle;
+	u64 handle, enqueue_time, seq;
 	unsigned long flags;
 	long wret;
-	u8 _port, port;
+	u8 port;
 
 #ifdef DEBUG
 	// Floods the logs
@@ -331,9 +396,9 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 		if(timeout > 1000)
 			timeout = 1000;
 		if(timeout > 0)
-			wret = wait_event_interruptible_timeout(ifcp->work_event, usb_vhci_hcd_has_work(vhc), msecs_to_jiffies(timeout));
+			wret = wait_event_interruptible_timeout(ifcp->work_event, usb_vhci_hcd_has_work(vhc) || atomic_read(&ifcp->kicked), msecs_to_jiffies(timeout));
 		else
-			wret = wait_event_interruptible(ifcp->work_event, usb_vhci_hcd_has_work(vhc));
+			wret = wait_event_interruptible(ifcp->work_event, usb_vhci_hcd_has_work(vhc) || atomic_read(&ifcp->kicked));
 		if(unlikely(wret < 0))
 		{
 			if(likely(wret == -ERESTARTSYS))
@@ -342,6 +407,9 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 		}
 		else if(!wret)
 			return -ETIMEDOUT;
+		// a kick is consumed only if there is no work to return instead
+		if(!usb_vhci_hcd_has_work(vhc) && atomic_xchg(&ifcp->kicked, 0))
+			return -EINTR;
 	}
 	else
 	{
@@ -350,52 +418,44 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 	}
 
 	spin_lock_irqsave(&vhc->lock, flags);
-	if(!list_empty(&vhc->urbp_list_cancel))
+	urbp = usb_vhci_next_cancel(vhc);
+	if(urbp)
 	{
-		urbp = list_entry(vhc->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=CANCEL_URB handle=0x%016llx]\n", (u64)(unsigned long)urbp->urb);
 #endif
 		handle = (u64)(unsigned long)urbp->urb;
-		list_move_tail(&urbp->urbp_list, &vhc->urbp_list_canceling);
+		enqueue_time = ktime_to_ns(urbp->enqueue_time);
+		seq = urbp->seq;
 		spin_unlock_irqrestore(&vhc->lock, flags);
 		__put_user(USB_VHCI_WORK_TYPE_CANCEL_URB, &arg->type);
 		__put_user(handle, &arg->handle);
+		if(ts)
+			put_work_ts(ts, enqueue_time, seq);
 		return 0;
 	}
 
-	if(vhc->port_update)
+	port = usb_vhci_next_port_update(vhc, &ifcp->port_sched_offset, &port_stat);
+	if(port)
 	{
-		if(ifcp->port_sched_offset >= vhc->port_count)
-			ifcp->port_sched_offset = 0;
-		for(_port = 0; _port < vhc->port_count; _port++)
-		{
-			// The port which will be checked first, is rotated by port_sched_offset, so that every port
-			// has its chance to be reported to user space, even if the hcd is under heavy load.
-			port = (_port + ifcp->port_sched_offset) % vhc->port_count;
-			if(vhc->port_update & (1 << (port + 1)))
-			{
-				vhc->port_update &= ~(1 << (port + 1));
-				ifcp->port_sched_offset = port + 1;
-				port_stat = vhc->ports[port];
-				spin_unlock_irqrestore(&vhc->lock, flags);
+		spin_unlock_irqrestore(&vhc->lock, flags);
 #ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PORT_STAT port=%d status=0x%04x change=0x%04x]\n", (int)(port + 1), (int)port_stat.port_status, (int)port_stat.port_change);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PORT_STAT port=%d status=0x%04x change=0x%04x]\n", (int)port, (int)port_stat.port_status, (int)port_stat.port_change);
 #endif
-				__put_user(USB_VHCI_WORK_TYPE_PORT_STAT, &arg->type);
-				__put_user(port + 1, &arg->work.port.index);
-				__put_user(port_stat.port_status, &arg->work.port.status);
-				__put_user(port_stat.port_change, &arg->work.port.change);
-				__put_user(port_stat.port_flags, &arg->work.port.flags);
-				return 0;
-			}
-		}
+		__put_user(USB_VHCI_WORK_TYPE_PORT_STAT, &arg->type);
+		__put_user(port, &arg->work.port.index);
+		__put_user(port_stat.port_status, &arg->work.port.status);
+		__put_user(port_stat.port_change, &arg->work.port.change);
+		__put_user(port_stat.port_flags, &arg->work.port.flags);
+		if(ts)
+			put_work_ts(ts, 0, 0);
+		return 0;
 	}
 
 repeat:
-	if(!list_empty(&vhc->urbp_list_inbox))
+	urbp = usb_vhci_peek_inbox(vhc);
+	if(urbp)
 	{
-		urbp = list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
 		handle = (u64)(unsigned long)urbp->urb;
 		memset(&urb, 0, sizeof urb);
 		urb.address = usb_pipedevice(urbp->urb->pipe);
@@ -416,12 +476,12 @@ repeat:
 				goto invalid_urb;
 			if(cmd->bRequestType & 0x80)
 			{
-				if(unlikely(!wLength || !urbp->urb->transfer_buffer))
+				if(unlikely(!wLength || !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
 			else
 			{
-				if(unlikely(wLength && !urbp->urb->transfer_buffer))
+				if(unlikely(wLength && !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
 			urb.buffer_length = wLength;
@@ -435,12 +495,12 @@ repeat:
 		{
 			if(usb_pipein(urbp->urb->pipe))
 			{
-				if(unlikely(!urbp->urb->transfer_buffer_length || !urbp->urb->transfer_buffer))
+				if(unlikely(!urbp->urb->transfer_buffer_length || !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
 			else
 			{
-				if(unlikely(urbp->urb->transfer_buffer_length && !urbp->urb->transfer_buffer))
+				if(unlikely(urbp->urb->transfer_buffer_length && !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
 			urb.buffer_length = urbp->urb->transfer_buffer_length;
@@ -452,13 +512,17 @@ repeat:
 		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PROCESS_URB handle=0x%016llx]\n", handle);
 #endif
 		dump_urb(urbp->urb);
-		list_move_tail(&urbp->urbp_list, &vhc->urbp_list_fetched);
+		enqueue_time = ktime_to_ns(urbp->enqueue_time);
+		seq = urbp->seq;
+		usb_vhci_mark_fetched(vhc, urbp);
 		spin_unlock_irqrestore(&vhc->lock, flags);
 
 		__put_user(USB_VHCI_WORK_TYPE_PROCESS_URB, &arg->type);
 		__put_user(handle, &arg->handle);
 		if(unlikely(__copy_to_user(&arg->work.urb, &urb, sizeof urb)))
 			return -EFAULT;
+		if(ts)
+			put_work_ts(ts, enqueue_time, seq);
 		return 0;
 
 	invalid_urb:
@@ -476,57 +540,129 @@ repeat:
 }
 
 // caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle(struct usb_vhci_hcd *vhc, const void *handle)
+static inline int is_urb_dir_in(const struct urb *urb)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+	if(unlikely(usb_pipecontrol(urb->pipe)))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+		return cmd->bRequestType & 0x80;
+	}
+	else
+		return usb_pipein(urb->pipe);
 }
 
 // caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle_in_cancel(struct usb_vhci_hcd *vhc, const void *handle)
+static inline int urb_data_stage_length(const struct urb *urb)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_cancel, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+	if(unlikely(usb_pipecontrol(urb->pipe)))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+		return le16_to_cpu(cmd->wLength);
+	}
+	return urb->transfer_buffer_length;
 }
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle_in_canceling(struct usb_vhci_hcd *vhc, const void *handle)
+// Copies len bytes of the data stage of urb, starting at offset, to user space.
+// This might sleep, so the urb has to be pinned.
+static int urb_copy_to_user(struct urb *urb, void __user *buf, int offset, int len)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_canceling, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+	{
+		struct sg_mapping_iter miter;
+		int n, retval = 0;
+
+		// no SG_MITER_ATOMIC here, because copy_to_user might sleep
+		sg_miter_start(&miter, urb->sg, urb->num_sgs, SG_MITER_FROM_SG);
+		while(len && sg_miter_next(&miter))
+		{
+			if((size_t)offset >= miter.length)
+			{
+				offset -= miter.length;
+				continue;
+			}
+			n = min_t(int, miter.length - offset, len);
+			if(unlikely(copy_to_user(buf, miter.addr + offset, n)))
+			{
+				retval = -EFAULT;
+				break;
+			}
+			buf += n;
+			len -= n;
+			offset = 0;
+		}
+		sg_miter_stop(&miter);
+		return retval;
+	}
+#endif
+	return copy_to_user(buf, urb->transfer_buffer + offset, len) ? -EFAULT : 0;
 }
 
-// caller has lock
-static inline int is_urb_dir_in(const struct urb *urb)
+// Copies len bytes from user space into the data stage of urb, starting at offset.
+// This might sleep, so the urb has to be pinned or removed from all lists.
+static int urb_copy_from_user(struct urb *urb, const void __user *buf, int offset, int len)
 {
-	if(unlikely(usb_pipecontrol(urb->pipe)))
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
 	{
-		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
-		return cmd->bRequestType & 0x80;
+		struct sg_mapping_iter miter;
+		int n, retval = 0;
+
+		// no SG_MITER_ATOMIC here, because copy_from_user might sleep
+		sg_miter_start(&miter, urb->sg, urb->num_sgs, SG_MITER_TO_SG);
+		while(len && sg_miter_next(&miter))
+		{
+			if((size_t)offset >= miter.length)
+			{
+				offset -= miter.length;
+				continue;
+			}
+			n = min_t(int, miter.length - offset, len);
+			if(unlikely(copy_from_user(miter.addr + offset, buf, n)))
+			{
+				retval = -EFAULT;
+				break;
+			}
+			buf += n;
+			len -= n;
+			offset = 0;
+		}
+		sg_miter_stop(&miter);
+		return retval;
 	}
+#endif
+	return copy_from_user(urb->transfer_buffer + offset, buf, len) ? -EFAULT : 0;
+}
+
+// Gives back an urb for which the user space already knows about its cancelation.
+// If the urb is pinned, then this is deferred until unpin_urbp gets called for the last time.
+// caller has lock
+static inline void giveback_canceled_urbp(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	if(unlikely(urbp->pinned))
+		urbp->giveback_on_unpin = 1;
 	else
-		return usb_pipein(urb->pipe);
+		usb_vhci_urb_giveback(vhc, urbp);
+}
+
+// caller has lock
+static inline void unpin_urbp(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	if(!--urbp->pinned && unlikely(urbp->giveback_on_unpin))
+		usb_vhci_urb_giveback(vhc, urbp);
 }
 
 // -ECANCELED doesn't report an error, but it indicates that the urb was in the "cancel"
 // list or in the "canceling" list.
-// If this function reports an error (other than -ENOENT), then the urb will be given back to its creator anyway,
-// if its handle was found. (If its handle wasn't found, then -ENOENT is returned.)
+// If this function reports an error (other than -ENOENT or -EBUSY), then the urb will be given back to its creator
+// anyway, if its handle was found. (If its handle wasn't found, then -ENOENT is returned. If the urb is in use by
+// another ioctl, which transfers a part of its data, then -EBUSY is returned.)
 // called in ioc_giveback{,32} only
 static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int status, int act, int iso_count, int err_count, const void __user *buf, const struct usb_vhci_ioc_iso_packet_giveback __user *iso)
 {
 	struct usb_vhci_urb_priv *urbp;
 	unsigned long flags;
-	int retval = 0, is_in, is_iso, i;
+	int retval = 0, is_in, is_iso, i, canceled;
 #ifdef DEBUG
 	struct device *dev = vhcihcd_to_dev(vhc);
 #endif
@@ -534,11 +670,11 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 	// TODO: do we really need to disable interrupts for accessing the urb lists?
 	spin_lock_irqsave(&vhc->lock, flags);
 
-	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
+	urbp = usb_vhci_find_fetched(vhc, handle, &canceled);
+	if(unlikely(!urbp || canceled))
 	{
 		// if not found, check the cancel{,ing} list
-		if(likely((urbp = urbp_from_handle_in_canceling(vhc, handle)) ||
-			(urbp = urbp_from_handle_in_cancel(vhc, handle))))
+		if(likely(urbp))
 		{
 #ifdef DEBUG
 			if(debug_output) dev_dbg(dev, "GIVEBACK: urb was canceled\n");
@@ -555,6 +691,21 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 		}
 	}
 
+	if(unlikely(urbp->pinned))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: urb is in use\n");
+#endif
+		// the user space knows about the cancelation now, so the urb has to go back to its
+		// creator when the other ioctl is done with it
+		if(retval == -ECANCELED)
+			giveback_canceled_urbp(vhc, urbp);
+		else
+			retval = -EBUSY;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return retval;
+	}
+
 	// remove urb from list before we release the spinlock
 	list_del(&urbp->urbp_list);
 
@@ -614,13 +765,16 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 	{
 		if(unlikely(act && !buf))
 		{
+			// the data might have been transfered by USB_VHCI_HCD_IOCGIVEBACKPART already
+			if(likely(act <= urbp->in_streamed))
+				goto data_done;
 #ifdef DEBUG
 			if(debug_output) dev_dbg(dev, "GIVEBACK: buf must not be zero\n");
 #endif
 			retval = -EINVAL;
 			goto done_with_errors;
 		}
-		if(unlikely(copy_from_user(urbp->urb->transfer_buffer, buf, act)))
+		if(unlikely(urb_copy_from_user(urbp->urb, buf, 0, act)))
 		{
 #ifdef DEBUG
 			if(debug_output) dev_dbg(dev, "GIVEBACK: copy_from_user(buf) failed\n");
@@ -638,21 +792,35 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 		retval = -EINVAL;
 		goto done_with_errors;
 	}
+data_done:
 	if(likely(is_iso && iso_count))
 	{
-		for(i = 0; i < iso_count; i++)
+		// one copy per chunk instead of one __get_user per field
+		struct usb_vhci_ioc_iso_packet_giveback iso_tmp[USB_VHCI_ISO_CHUNK];
+		int j, n;
+		for(i = 0; i < iso_count; i += n)
 		{
-			__get_user(urbp->urb->iso_frame_desc[i].status, &iso[i].status);
-			__get_user(urbp->urb->iso_frame_desc[i].actual_length, &iso[i].packet_actual);
+			n = min(iso_count - i, USB_VHCI_ISO_CHUNK);
+			if(unlikely(__copy_from_user(iso_tmp, iso + i, n * sizeof *iso_tmp)))
+			{
+				retval = -EFAULT;
+				goto done_with_errors;
+			}
+			for(j = 0; j < n; j++)
+			{
+				urbp->urb->iso_frame_desc[i + j].status = iso_tmp[j].status;
+				urbp->urb->iso_frame_desc[i + j].actual_length = iso_tmp[j].packet_actual;
+			}
 		}
 	}
 	urbp->urb->actual_length = act;
 	urbp->urb->error_count = err_count;
 
 	// now we are done with this urb and it can return to its creator
+	// (possibly delayed by bus shaping)
 	usb_vhci_maybe_set_status(urbp, status);
 	spin_lock_irqsave(&vhc->lock, flags);
-	usb_vhci_urb_giveback(vhc, urbp);
+	usb_vhci_urb_complete(vhc, urbp);
 	spin_unlock_irqrestore(&vhc->lock, flags);
 #ifdef DEBUG
 	if(debug_output) dev_dbg(dev, "GIVEBACK: done\n");
@@ -711,34 +879,19 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 {
 	struct usb_vhci_urb_priv *urbp;
 	unsigned long flags;
-	int tb_len, is_in, is_iso, i, ret = -ENOMEM;
-	void *user_buf_tmp = NULL;
-	struct usb_vhci_ioc_iso_packet_data *iso_tmp = NULL;
-
-	if(likely(user_len))
-	{
-		user_buf_tmp = kmalloc(user_len, GFP_KERNEL);
-		if(unlikely(!user_buf_tmp))
-			goto end;
-	}
-	if(likely(iso_count))
-	{
-		iso_tmp = kmalloc(iso_count * sizeof *iso_tmp, GFP_KERNEL);
-		if(unlikely(!iso_tmp))
-			goto end;
-	}
-	ret = 0;
+	int tb_len, is_in, is_iso, i, j, n, canceled, pin, ret = 0;
+	struct usb_vhci_ioc_iso_packet_data iso_tmp[USB_VHCI_ISO_CHUNK];
 
 	spin_lock_irqsave(&vhc->lock, flags);
-	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
+	urbp = usb_vhci_find_fetched(vhc, handle, &canceled);
+	if(unlikely(!urbp || canceled))
 	{
 		// if not found, check the cancel{,ing} list
-		if(likely((urbp = urbp_from_handle_in_cancel(vhc, handle)) ||
-			(urbp = urbp_from_handle_in_canceling(vhc, handle))))
+		if(likely(urbp))
 		{
 			// we can give the urb back to its creator now, because the user space is informed about
 			// its cancelation
-			usb_vhci_urb_giveback(vhc, urbp);
+			giveback_canceled_urbp(vhc, urbp);
 			ret = -ECANCELED;
 			goto end_unlock;
 		}
@@ -746,13 +899,7 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 		goto end_unlock;
 	}
 
-	tb_len = urbp->urb->transfer_buffer_length;
-	if(unlikely(usb_pipecontrol(urbp->urb->pipe)))
-	{
-		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urbp->urb->setup_packet;
-		tb_len = le16_to_cpu(cmd->wLength);
-	}
-
+	tb_len = urb_data_stage_length(urbp->urb);
 	is_in = is_urb_dir_in(urbp->urb);
 	is_iso = usb_pipeisoc(urbp->urb->pipe);
 
@@ -770,14 +917,9 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 				ret = -EINVAL;
 				goto end_unlock;
 			}
-			for(i = 0; i < iso_count; i++)
-			{
-				iso_tmp[i].offset = urbp->urb->iso_frame_desc[i].offset;
-				iso_tmp[i].packet_length = urbp->urb->iso_frame_desc[i].length;
-			}
 		}
 	}
-	else if(unlikely(is_in || !tb_len || !urbp->urb->transfer_buffer))
+	else if(unlikely(is_in || !tb_len || !usb_vhci_urb_has_buffer(urbp->urb)))
 	{
 		ret = -ENODATA;
 		goto end_unlock;
@@ -790,38 +932,145 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 			ret = -EINVAL;
 			goto end_unlock;
 		}
-		memcpy(user_buf_tmp, urbp->urb->transfer_buffer, tb_len);
 	}
 
-	// we have copied all data into our private buffers, so we can release the spinlock
+	// the urb can't be given back while it is pinned, so we can copy the data straight from its
+	// buffer into the user-mode buffer without holding the spinlock (and without a bounce buffer);
+	// the same goes for the iso packet descriptors
+	pin = (!is_in && tb_len) || (is_iso && iso_count);
+	if(pin)
+		urbp->pinned++;
+
 	spin_unlock_irqrestore(&vhc->lock, flags);
 
-	// since we do not hold the spinlock any longer, we can now safely write the user-mode buffers
+	if(!pin)
+		return 0;
 
-	if(likely(is_iso && iso_count))
+	if(likely(!is_in && tb_len))
+		ret = urb_copy_to_user(urbp->urb, user_buf, 0, tb_len);
+
+	if(likely(!ret && is_iso && iso_count))
 	{
-		if(unlikely(copy_to_user(iso, iso_tmp, iso_count * sizeof *iso_tmp)))
+		// one copy per chunk of descriptors (without allocating a buffer for all of them)
+		for(i = 0; i < iso_count; i += n)
 		{
-			ret = -EFAULT;
-			goto end;
+			n = min(iso_count - i, USB_VHCI_ISO_CHUNK);
+			for(j = 0; j < n; j++)
+			{
+				iso_tmp[j].offset = urbp->urb->iso_frame_desc[i + j].offset;
+				iso_tmp[j].packet_length = urbp->urb->iso_frame_desc[i + j].length;
+			}
+			if(unlikely(copy_to_user(iso + i, iso_tmp, n * sizeof *iso_tmp)))
+			{
+				ret = -EFAULT;
+				break;
+			}
 		}
 	}
 
-	if(likely(!is_in && tb_len))
+	spin_lock_irqsave(&vhc->lock, flags);
+	unpin_urbp(vhc, urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return ret;
+
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return ret;
+}
+
+// called in ioc_fetch_data_part{,32} only
+static int ioc_fetch_data_part_common(struct usb_vhci_hcd *vhc, const void *handle, void __user *buf, int offset, int len)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	int tb_len, canceled, ret = 0;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp = usb_vhci_find_fetched(vhc, handle, &canceled);
+	if(unlikely(!urbp || canceled))
 	{
-		if(unlikely(copy_to_user(user_buf, user_buf_tmp, tb_len)))
+		// same as in ioc_fetch_data_common
+		if(likely(urbp))
 		{
-			ret = -EFAULT;
-			goto end;
+			giveback_canceled_urbp(vhc, urbp);
+			ret = -ECANCELED;
+			goto end_unlock;
 		}
+		ret = -ENOENT;
+		goto end_unlock;
+	}
+
+	tb_len = urb_data_stage_length(urbp->urb);
+	if(unlikely(is_urb_dir_in(urbp->urb) || !tb_len || !usb_vhci_urb_has_buffer(urbp->urb)))
+	{
+		ret = -ENODATA;
+		goto end_unlock;
+	}
+	if(unlikely(offset < 0 || len < 0 || offset > tb_len || len > tb_len - offset || (len && !buf)))
+	{
+		ret = -EINVAL;
+		goto end_unlock;
+	}
+	urbp->pinned++;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	ret = urb_copy_to_user(urbp->urb, buf, offset, len);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	unpin_urbp(vhc, urbp);
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return ret;
+}
+
+// called in ioc_giveback_part{,32} only
+static int ioc_giveback_part_common(struct usb_vhci_hcd *vhc, const void *handle, const void __user *buf, int offset, int len)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	int tb_len, canceled, ret = 0;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp = usb_vhci_find_fetched(vhc, handle, &canceled);
+	if(unlikely(!urbp || canceled))
+	{
+		// canceled urbs have to be completed by USB_VHCI_HCD_IOCGIVEBACK (or USB_VHCI_HCD_IOCFETCHDATA)
+		if(likely(urbp))
+			ret = -ECANCELED;
+		else
+			ret = -ENOENT;
+		goto end_unlock;
+	}
+
+	tb_len = urb_data_stage_length(urbp->urb);
+	if(unlikely(!is_urb_dir_in(urbp->urb) || !usb_vhci_urb_has_buffer(urbp->urb)))
+	{
+		ret = -EINVAL;
+		goto end_unlock;
 	}
+	if(unlikely(offset < 0 || len < 0 || offset > tb_len || len > tb_len - offset || (len && !buf)))
+	{
+		ret = -ENOBUFS;
+		goto end_unlock;
+	}
+	// in_streamed only counts data without holes, so a chunk has to start within it
+	if(unlikely(offset > urbp->in_streamed))
+	{
+		ret = -EINVAL;
+		goto end_unlock;
+	}
+	urbp->pinned++;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	ret = urb_copy_from_user(urbp->urb, buf, offset, len);
 
-	goto end;
+	spin_lock_irqsave(&vhc->lock, flags);
+	// in_streamed only grows, so the chunk still starts within it
+	if(likely(!ret) && offset + len > urbp->in_streamed)
+		urbp->in_streamed = offset + len;
+	unpin_urbp(vhc, urbp);
 end_unlock:
 	spin_unlock_irqrestore(&vhc->lock, flags);
-end:
-	kfree(user_buf_tmp);
-	kfree(iso_tmp);
 	return ret;
 }
 
@@ -860,6 +1109,43 @@ static int ioc_fetch_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_data
 	return ioc_fetch_data_common(vhc, handle, user_buf, user_len, iso, iso_count);
 }
 
+// called in device_ioctl only
+static int ioc_data_part(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_data_part __user *arg, int giveback)
+{
+	const void *handle;
+	void __user *buf;
+	u64 handle64;
+	int offset, len;
+	u32 reserved;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOC%sPART\n", giveback ? "GIVEBACK" : "FETCHDATA");
+#endif
+
+	if(sizeof(void *) > 4)
+		__get_user(handle64, &arg->handle);
+	else
+	{
+		u32 handle1, handle2;
+		__get_user(handle1, (u32 __user *)&arg->handle);
+		__get_user(handle2, (u32 __user *)&arg->handle + 1);
+		*((u32 *)&handle64) = handle1;
+		*((u32 *)&handle64 + 1) = handle2;
+		if(handle64 >> 32)
+			return -EINVAL;
+	}
+	__get_user(buf, &arg->buffer);
+	__get_user(offset, &arg->offset);
+	__get_user(len, &arg->length);
+	__get_user(reserved, &arg->reserved);
+	handle = (const void *)(unsigned long)handle64;
+	if(unlikely(!handle || reserved))
+		return -EINVAL;
+	if(giveback)
+		return ioc_giveback_part_common(vhc, handle, buf, offset, len);
+	return ioc_fetch_data_part_common(vhc, handle, buf, offset, len);
+}
+
 #ifdef CONFIG_COMPAT
 // called in device_ioctl only
 static int ioc_giveback32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback32 __user *arg)
@@ -916,6 +1202,33 @@ static int ioc_fetch_data32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_da
 	iso = compat_ptr(iso32);
 	return ioc_fetch_data_common(vhc, handle, user_buf, user_len, iso, iso_count);
 }
+
+// called in device_ioctl only
+static int ioc_data_part32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_data_part32 __user *arg, int giveback)
+{
+	const void *handle;
+	void __user *buf;
+	u64 handle64;
+	int offset, len;
+	u32 buf32, reserved;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOC%sPART32\n", giveback ? "GIVEBACK" : "FETCHDATA");
+#endif
+
+	__get_user(handle64, &arg->handle);
+	__get_user(buf32, &arg->buffer);
+	__get_user(offset, &arg->offset);
+	__get_user(len, &arg->length);
+	__get_user(reserved, &arg->reserved);
+	handle = (const void *)(unsigned long)handle64;
+	if(unlikely(!handle || reserved))
+		return -EINVAL;
+	buf = compat_ptr(buf32);
+	if(giveback)
+		return ioc_giveback_part_common(vhc, handle, buf, offset, len);
+	return ioc_fetch_data_part_common(vhc, handle, buf, offset, len);
+}
 #endif
 
 static long device_do_ioctl(struct file *file,
@@ -955,12 +1268,17 @@ static long device_do_ioctl(struct file *file,
 		break;
 
 	case USB_VHCI_HCD_IOCFETCHWORK_RO:
-		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, 100);
+		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, NULL, 100);
 		break;
 
 	case USB_VHCI_HCD_IOCFETCHWORK:
 		__get_user(timeout, &((struct usb_vhci_ioc_work __user *)arg)->timeout);
-		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, timeout);
+		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, NULL, timeout);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORKTS:
+		__get_user(timeout, &((struct usb_vhci_ioc_work_ts __user *)arg)->work.timeout);
+		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, (struct usb_vhci_ioc_work_ts __user *)arg, timeout);
 		break;
 
 	case USB_VHCI_HCD_IOCGIVEBACK:
@@ -971,6 +1289,23 @@ static long device_do_ioctl(struct file *file,
 		ret = ioc_fetch_data(vhc, (struct usb_vhci_ioc_urb_data __user *)arg);
 		break;
 
+	case USB_VHCI_HCD_IOCFETCHDATAPART:
+		ret = ioc_data_part(vhc, (struct usb_vhci_ioc_data_part __user *)arg, 0);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACKPART:
+		ret = ioc_data_part(vhc, (struct usb_vhci_ioc_data_part __user *)arg, 1);
+		break;
+
+	case USB_VHCI_HCD_IOCRESPONDER:
+		ret = ioc_responder(vhc, (struct usb_vhci_ioc_responder __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCKICK:
+		atomic_set(&vhcidev_to_ifcp(vdev)->kicked, 1);
+		wake_up_interruptible(&vhcidev_to_ifcp(vdev)->work_event);
+		break;
+
 #ifdef CONFIG_COMPAT
 	case USB_VHCI_HCD_IOCGIVEBACK32:
 		ret = ioc_giveback32(vhc, (struct usb_vhci_ioc_giveback32 __user *)arg);
@@ -979,6 +1314,14 @@ static long device_do_ioctl(struct file *file,
 	case USB_VHCI_HCD_IOCFETCHDATA32:
 		ret = ioc_fetch_data32(vhc, (struct usb_vhci_ioc_urb_data32 __user *)arg);
 		break;
+
+	case USB_VHCI_HCD_IOCFETCHDATAPART32:
+		ret = ioc_data_part32(vhc, (struct usb_vhci_ioc_data_part32 __user *)arg, 0);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACKPART32:
+		ret = ioc_data_part32(vhc, (struct usb_vhci_ioc_data_part32 __user *)arg, 1);
+		break;
 #endif
 
 	default:
@@ -1004,6 +1347,25 @@ static long device_ioctl32(struct file *file,
 }
 #endif
 
+// readable while FETCHWORK would not block, so that many controllers can be waited for
+// with one poll/epoll
+static unsigned int device_poll(struct file *file, poll_table *wait)
+{
+	struct usb_vhci_device *vdev;
+	struct usb_vhci_hcd *vhc;
+
+	vdev = file->private_data;
+
+	if(unlikely(!vdev))
+		return POLLERR;
+
+	vhc = vhcidev_to_vhcihcd(vdev);
+	poll_wait(file, &vhcidev_to_ifcp(vdev)->work_event, wait);
+	if(usb_vhci_hcd_has_work(vhc))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
 static loff_t device_llseek(struct file *file, loff_t offset, int origin)
 {
 	vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
@@ -1015,6 +1377,7 @@ static struct file_operations fops = {
 	.llseek         = device_llseek,
 	.read           = device_read,
 	.write          = device_write,
+	.poll           = device_poll,
 	.unlocked_ioctl = device_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl   = device_ioctl32,
@@ -1150,8 +1513,13 @@ static int __init init(void)
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCPORTSTAT     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCPORTSTAT);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK_RO = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK_RO);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORKTS  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORKTS);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHDATA    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHDATA);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHDATAPART = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHDATAPART);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACKPART = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACKPART);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCRESPONDER    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCRESPONDER);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCKICK         = %08x\n", (unsigned int)USB_VHCI_HCD_IOCKICK);
 #endif
 
 	return 0;
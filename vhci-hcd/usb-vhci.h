@@ -141,6 +141,16 @@ struct usb_vhci_ioc_work
                                          // already
 };
 
+// structure for the USB_VHCI_HCD_IOCFETCHWORKTS ioctl
+struct usb_vhci_ioc_work_ts
+{
+	struct usb_vhci_ioc_work work;
+	__u64 enqueue_time;  // [out] for PROCESS_URB and CANCEL_URB: time (CLOCK_MONOTONIC,
+	                     //       in nanoseconds) at which the urb was enqueued
+	__u64 seq;           // [out] for PROCESS_URB and CANCEL_URB: sequence number of
+	                     //       the urb (counts up per controller, starting at 1)
+};
+
 struct usb_vhci_ioc_iso_packet_data
 {
 	__u32 offset;
@@ -178,6 +188,39 @@ struct usb_vhci_ioc_giveback
 	__s32 error_count;   // for ISO
 };
 
+// structure for the USB_VHCI_HCD_IOCFETCHDATAPART and USB_VHCI_HCD_IOCGIVEBACKPART ioctls
+// (for transfering the data stage of large urbs in chunks)
+struct usb_vhci_ioc_data_part
+{
+	__u64 handle;        // handle which identifies the urb
+	void *buffer;        // FETCHDATAPART: receives the OUT data of the chunk
+	                     // GIVEBACKPART:  contains the IN data of the chunk
+	__s32 offset;        // offset of the chunk within the data stage
+	__s32 length;        // length of the chunk in bytes
+	__u32 reserved;      // must be zero (keeps the 32 bit layout free of padding)
+};
+
+// structure for the USB_VHCI_HCD_IOCRESPONDER ioctl
+// (a responder rule completes matching control urbs within the kernel, without
+// passing them to user space)
+#define USB_VHCI_RESPONDER_MAX_DATA  1024 // max. length of the data stage of a rule
+#define USB_VHCI_RESPONDER_MAX_RULES 256  // max. number of rules per controller
+struct usb_vhci_ioc_responder
+{
+	struct usb_vhci_ioc_setup_packet setup_packet; // bmRequestType, bRequest, wValue
+	                                               // and wIndex have to match
+	                                               // (wLength is ignored)
+	__s32 status;        // status of the completed urb (0 or -EPIPE)
+	__u32 count;         // number of times the rule applies before it gets removed
+	                     // (0 means: never remove it)
+	__u16 data_length;   // number of valid bytes in data (only for IN requests)
+	__u8 index;          // index of port (0 means all ports for OP_CLEAR)
+	__u8 op;
+#define USB_VHCI_RESPONDER_OP_ADD   0 // append a rule to the rules of the port
+#define USB_VHCI_RESPONDER_OP_CLEAR 1 // remove all rules of the port
+	__u8 data[USB_VHCI_RESPONDER_MAX_DATA]; // data stage of IN requests
+};
+
 #ifdef __KERNEL__
 #ifdef CONFIG_COMPAT
 #include <linux/compat.h>
@@ -200,6 +243,15 @@ struct usb_vhci_ioc_giveback32
 	__s32 packet_count;
 	__s32 error_count;
 };
+
+struct usb_vhci_ioc_data_part32
+{
+	__u64 handle;
+	compat_caddr_t buffer;
+	__s32 offset;
+	__s32 length;
+	__u32 reserved;
+};
 #endif
 #endif
 
@@ -221,7 +273,33 @@ struct usb_vhci_ioc_giveback32
                                        struct usb_vhci_ioc_urb_data)
 #define USB_VHCI_HCD_IOCFETCHDATA32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 4, \
                                        struct usb_vhci_ioc_urb_data32)
-#define USB_VHCI_HCD_IOC_MAXNR       4
+// USB_VHCI_HCD_IOCFETCHDATAPART: copies a chunk of the data stage of an OUT urb.
+// USB_VHCI_HCD_IOCGIVEBACKPART:  copies a chunk of the data stage of an IN urb into
+//                                the urb, without giving it back. A chunk has to
+//                                start within the data which was transfered before
+//                                (EINVAL otherwise). If the whole data stage was
+//                                transfered this way, the urb can be completed by
+//                                USB_VHCI_HCD_IOCGIVEBACK with a null buffer.
+#define USB_VHCI_HCD_IOCFETCHDATAPART   _IOW (USB_VHCI_HCD_IOC_MAGIC, 5, \
+                                          struct usb_vhci_ioc_data_part)
+#define USB_VHCI_HCD_IOCFETCHDATAPART32 _IOW (USB_VHCI_HCD_IOC_MAGIC, 5, \
+                                          struct usb_vhci_ioc_data_part32)
+#define USB_VHCI_HCD_IOCGIVEBACKPART    _IOW (USB_VHCI_HCD_IOC_MAGIC, 6, \
+                                          struct usb_vhci_ioc_data_part)
+#define USB_VHCI_HCD_IOCGIVEBACKPART32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 6, \
+                                          struct usb_vhci_ioc_data_part32)
+// same as USB_VHCI_HCD_IOCFETCHWORK, but additionally returns the time of enqueuing
+// and the sequence number of the urb
+#define USB_VHCI_HCD_IOCFETCHWORKTS     _IOWR(USB_VHCI_HCD_IOC_MAGIC, 7, \
+                                          struct usb_vhci_ioc_work_ts)
+// adds or removes in-kernel responder rules; rules of a port are removed
+// automatically when the connection state of the port changes
+#define USB_VHCI_HCD_IOCRESPONDER       _IOW (USB_VHCI_HCD_IOC_MAGIC, 8, \
+                                          struct usb_vhci_ioc_responder)
+// wakes up a thread which waits in USB_VHCI_HCD_IOCFETCHWORK{,TS} (which fails with
+// EINTR then); if no thread waits, the next waiting fetch returns immediately
+#define USB_VHCI_HCD_IOCKICK            _IO  (USB_VHCI_HCD_IOC_MAGIC, 9)
+#define USB_VHCI_HCD_IOC_MAXNR       9
 
 #endif
 